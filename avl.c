@@ -11,275 +11,801 @@
  *	This code works, needs no changes
  */
 
+#define _GNU_SOURCE
 #include "avl.h"
 
-static void destroy_right(avl_tree_t *tree, bitree_node_t *node);
+typedef key_probe_t probe_t;
 
-static void rotate_left(bitree_node_t **node) {
+static inline void probe_init(avl_tree_t *tree, probe_t *probe,
+                              const void *data) {
+    key_probe_init(&tree->key, probe, data);
+}
+
+static inline int probe_cmp(avl_tree_t *tree, const probe_t *probe,
+                            const avl_node_t *node) {
+    return key_probe_cmp(&tree->key, tree->compare, probe, node->key,
+                         avl_data(node));
+}
+
+static inline size_t data_bytes(avl_tree_t *tree, const void *data) {
+    return tree->data_size != NULL ? tree->data_size(data) : 0;
+}
+
+static inline int snapshots(avl_tree_t *tree) {
+    return tree->versions != NULL && tree->versions->snapshots != NULL;
+}
+
+static inline int shared(avl_tree_t *tree, const avl_node_t *node) {
+    return tree->versions != NULL && node->epoch < tree->versions->shared;
+}
+
+static void retire(avl_tree_t *tree, void *ptr, int node) {
+    avl_versions_t *versions = tree->versions;
+    avl_retired_t *retired;
+    long size;
+    if (versions->retired_count == versions->retired_size) {
+        size = versions->retired_size ? versions->retired_size * 2
+                                      : AVL_SPARE_NODES;
+        if ((retired = realloc(versions->retired,
+                               size * sizeof(avl_retired_t))) == NULL) {
+            // leaking beats freeing memory a snapshot may still read
+            error("Failed to retire %s", node ? "node" : "data");
+            return;
+        }
+        versions->retired = retired;
+        versions->retired_size = size;
+    }
+    retired = &versions->retired[versions->retired_count++];
+    retired->ptr = ptr;
+    retired->epoch = versions->epoch;
+    retired->node = node;
+    return;
+}
+
+static void release(avl_tree_t *tree, avl_node_t *node) {
+    tree->bytes -= data_bytes(tree, avl_data(node));
+    if (tree->destroy == NULL)
+        return;
+    // the node this one was copied from may still be read in a snapshot
+    if ((node->flags & AVL_NODE_COPIED) && snapshots(tree))
+        retire(tree, avl_data(node), 0);
+    else
+        tree->destroy(avl_data(node));
+    return;
+}
+
+static inline void tally(avl_tree_t *tree, int counter, unsigned long n) {
+    if (tree->stats != NULL && n != 0)
+        stats_add(tree->stats, counter, n);
+}
+
+static inline unsigned long start_op(avl_tree_t *tree) {
+    return tree->stats != NULL && stats_sample() ? stats_now() : 0;
+}
+
+static void end_op(avl_tree_t *tree, int hist, unsigned long start,
+                   int counter) {
+    if (tree->stats == NULL)
+        return;
+    if (counter >= 0)
+        stats_add(tree->stats, counter, 1);
+    if (start != 0)
+        stats_record(tree->stats, hist, stats_now() - start);
+    return;
+}
+
+static inline int insert_counter(int retval) {
+    return retval == 0 ? AVL_STAT_INSERT
+                       : retval == 1 ? AVL_STAT_DUPLICATE : -1;
+}
+
+static inline void touch(avl_tree_t *tree, avl_node_t *node) {
+    // readers share the lock, so the bit is atomic and only written when
+    // it changes to keep hot nodes from bouncing between caches
+    if (tree->budget != 0 && !__atomic_load_n(&node->ref, __ATOMIC_RELAXED))
+        __atomic_store_n(&node->ref, 1, __ATOMIC_RELAXED);
+}
+
+static inline uint32_t subtree_count(const avl_node_t *node) {
+    return avl_is_eob(node) ? 0 : node->count;
+}
+
+static inline void recount(avl_tree_t *tree, avl_node_t *node) {
+    if (tree->counted && !avl_is_eob(node))
+        node->count = subtree_count(avl_left(node)) +
+                      subtree_count(avl_right(node)) + !avl_is_hidden(node);
+}
+
+static avl_node_t *node_alloc(avl_tree_t *tree, const probe_t *probe) {
+    avl_node_t *node;
+    if ((node = slab_alloc(tree->nodes)) == NULL) {
+        error("Failed to allocate data");
+        return NULL;
+    }
+    node->data = (void *)probe->data;
+    node->key = probe->key;
+    node->left = NULL;
+    node->right = NULL;
+    node->factor = AVL_BALANCED;
+    node->flags = 0;
+    node->ref = 1;
+    node->timer = 0;
+    node->epoch = tree->versions != NULL ? tree->versions->epoch : 0;
+    node->count = 1;
+    tree->bytes += sizeof(avl_node_t) + data_bytes(tree, node->data);
+    return node;
+}
+
+static int spare_reserve(avl_tree_t *tree) {
+    avl_versions_t *versions = tree->versions;
+    avl_node_t *node;
+    if (!snapshots(tree))
+        return 0;
+    // a change then copies nodes without a way to fail half way through
+    while (versions->spares < AVL_SPARE_NODES) {
+        if ((node = slab_alloc(tree->nodes)) == NULL) {
+            error("Failed to allocate spare nodes");
+            return -1;
+        }
+        node->flags = AVL_NODE_FREE;
+        versions->spare[versions->spares++] = node;
+    }
+    return 0;
+}
+
+static avl_node_t *own(avl_tree_t *tree, avl_node_t **node) {
+    avl_versions_t *versions = tree->versions;
+    avl_node_t *copy;
+    if (!shared(tree, *node))
+        return *node;
+    if (versions->spares > 0) {
+        copy = versions->spare[--versions->spares];
+    } else if ((copy = slab_alloc(tree->nodes)) == NULL) {
+        error("Failed to copy node");
+        return NULL;
+    }
+    *copy = **node;
+    copy->epoch = versions->epoch;
+    copy->flags |= AVL_NODE_COPIED;
+    if (avl_expires(copy))
+        tree->wheel->timers[copy->timer].node = copy;
+    retire(tree, *node, 1);
+    *node = copy;
+    return copy;
+}
+
+static int own_tree(avl_tree_t *tree, avl_node_t **node) {
+    // without snapshots nothing is shared, skip the walk over every node
+    if (avl_is_eob(*node) || !snapshots(tree))
+        return 0;
+    if (own(tree, node) == NULL || own_tree(tree, &avl_left(*node)) != 0)
+        return -1;
+    return own_tree(tree, &avl_right(*node));
+}
+
+static inline void read_lock(avl_tree_t *tree) {
+    if (tree->lock != NULL)
+        pthread_rwlock_rdlock(tree->lock);
+}
+
+static inline void write_lock(avl_tree_t *tree) {
+    if (tree->lock != NULL)
+        pthread_rwlock_wrlock(tree->lock);
+}
+
+static inline void unlock(avl_tree_t *tree) {
+    if (tree->lock != NULL)
+        pthread_rwlock_unlock(tree->lock);
+}
+
+static uint64_t clock_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static inline int expired(avl_tree_t *tree, const avl_node_t *node) {
+    // only nodes with a time to live pay for reading the clock
+    return avl_expires(node) &&
+           tree->wheel->timers[node->timer].expires <= clock_ms();
+}
+
+static inline int visible(avl_tree_t *tree, const avl_node_t *node) {
+    return !avl_is_hidden(node) && !expired(tree, node);
+}
+
+static int timer_reserve(avl_tree_t *tree) {
+    avl_wheel_t *wheel = tree->wheel;
+    avl_timer_t *timers;
+    uint32_t id, size;
+    if (wheel == NULL) {
+        if ((wheel = calloc(1, sizeof(avl_wheel_t))) == NULL) {
+            error("Failed to allocate timer wheel");
+            return -1;
+        }
+        // timer 0 is never handed out, it means no timer
+        wheel->size = 1;
+        wheel->tick = clock_ms();
+        tree->wheel = wheel;
+    }
+    if (wheel->free != 0)
+        return 0;
+    if (wheel->size > UINT32_MAX / 2) {
+        error("Too many timers");
+        return -1;
+    }
+    size = wheel->size < AVL_WHEEL_TIMERS ? AVL_WHEEL_TIMERS : wheel->size * 2;
+    if ((timers = realloc(wheel->timers, size * sizeof(avl_timer_t))) == NULL) {
+        error("Failed to allocate timers");
+        return -1;
+    }
+    for (id = size - 1; id >= wheel->size; id--) {
+        timers[id].node = NULL;
+        timers[id].next = wheel->free;
+        wheel->free = id;
+    }
+    wheel->timers = timers;
+    wheel->size = size;
+    return 0;
+}
+
+static void timer_link(avl_wheel_t *wheel, uint32_t id) {
+    avl_timer_t *timer = &wheel->timers[id];
+    uint64_t expires = timer->expires, delta;
+    int level = 0;
+    if (expires < wheel->tick)
+        expires = wheel->tick;
+    delta = expires - wheel->tick;
+    while (level < AVL_WHEEL_LEVELS - 1 &&
+           delta >> (AVL_WHEEL_BITS * (level + 1)) != 0)
+        level++;
+    // park timers beyond the wheel span in the last slot it reaches, they
+    // are placed again when that slot is cascaded
+    if (delta >> (AVL_WHEEL_BITS * AVL_WHEEL_LEVELS) != 0)
+        expires = wheel->tick +
+                  ((uint64_t)1 << (AVL_WHEEL_BITS * AVL_WHEEL_LEVELS)) - 1;
+    timer->slot = level * AVL_WHEEL_SLOTS +
+                  ((expires >> (AVL_WHEEL_BITS * level)) &
+                   (AVL_WHEEL_SLOTS - 1));
+    timer->prev = 0;
+    timer->next = wheel->slots[timer->slot];
+    if (timer->next != 0)
+        wheel->timers[timer->next].prev = id;
+    wheel->slots[timer->slot] = id;
+    wheel->used[level] |= (uint64_t)1 << (timer->slot % AVL_WHEEL_SLOTS);
+    return;
+}
+
+static void timer_unlink(avl_wheel_t *wheel, uint32_t id) {
+    avl_timer_t *timer = &wheel->timers[id];
+    if (timer->prev != 0)
+        wheel->timers[timer->prev].next = timer->next;
+    else
+        wheel->slots[timer->slot] = timer->next;
+    if (timer->next != 0)
+        wheel->timers[timer->next].prev = timer->prev;
+    if (wheel->slots[timer->slot] == 0)
+        wheel->used[timer->slot / AVL_WHEEL_SLOTS] &=
+            ~((uint64_t)1 << (timer->slot % AVL_WHEEL_SLOTS));
+    return;
+}
+
+static void timer_start(avl_tree_t *tree, avl_node_t *node, uint64_t expires) {
+    avl_wheel_t *wheel = tree->wheel;
+    uint32_t id = wheel->free;
+    wheel->free = wheel->timers[id].next;
+    wheel->timers[id].node = node;
+    wheel->timers[id].expires = expires;
+    timer_link(wheel, id);
+    wheel->count++;
+    node->timer = id;
+    return;
+}
+
+static void timer_stop(avl_tree_t *tree, avl_node_t *node) {
+    avl_wheel_t *wheel = tree->wheel;
+    uint32_t id = node->timer;
+    timer_unlink(wheel, id);
+    wheel->timers[id].node = NULL;
+    wheel->timers[id].next = wheel->free;
+    wheel->free = id;
+    wheel->count--;
+    node->timer = 0;
+    return;
+}
+
+static void cascade(avl_wheel_t *wheel, int level, uint64_t tick) {
+    uint32_t slot = level * AVL_WHEEL_SLOTS +
+                    ((tick >> (AVL_WHEEL_BITS * level)) &
+                     (AVL_WHEEL_SLOTS - 1));
+    uint32_t id;
+    // every timer of the slot is due within the span of the lower levels
+    while ((id = wheel->slots[slot]) != 0) {
+        timer_unlink(wheel, id);
+        timer_link(wheel, id);
+    }
+    return;
+}
+
+// a lower bound of the earliest expiry time on the wheel, read from the
+// occupied slots without walking any timer
+static uint64_t wheel_next(const avl_wheel_t *wheel) {
+    uint64_t next = UINT64_MAX, start, rest;
+    uint32_t pos, offset;
+    int level, shift;
+    for (level = 0; level < AVL_WHEEL_LEVELS; level++) {
+        if (wheel->used[level] == 0)
+            continue;
+        shift = AVL_WHEEL_BITS * level;
+        pos = (wheel->tick >> shift) & (AVL_WHEEL_SLOTS - 1);
+        rest = wheel->used[level] >> pos;
+        offset = rest != 0 ? (uint32_t)__builtin_ctzll(rest)
+                           : AVL_WHEEL_SLOTS - pos +
+                                 __builtin_ctzll(wheel->used[level]);
+        // a slot on an upper level holds timers from its first tick on
+        start = ((wheel->tick >> shift) + offset) << shift;
+        if (start < wheel->tick)
+            start = wheel->tick;
+        if (start < next)
+            next = start;
+    }
+    return next;
+}
+
+static void rotate_left(avl_tree_t *tree, avl_node_t **node) {
     debug(D_AVLTREE, "Rotating right");
-    bitree_node_t *left, *grandchild;
-    left = bitree_left(*node);
-    if (((avl_node_t *)bitree_data(*node))->factor == AVL_LFT_HEAVY) {
-        bitree_left(*node) = bitree_right(left);
-        bitree_right(left) = *node;
-        ((avl_node_t *)bitree_data(*node))->factor = AVL_BALANCED;
-        ((avl_node_t *)bitree_data(left))->factor = AVL_BALANCED;
+    avl_node_t *left, *grandchild;
+    tally(tree, AVL_STAT_ROTATE, 1);
+    // the caller owns the node and set spare nodes aside for the rest
+    left = own(tree, &avl_left(*node));
+    if (left->factor != AVL_RGT_HEAVY) {
+        avl_left(*node) = avl_right(left);
+        avl_right(left) = *node;
+        if (left->factor == AVL_LFT_HEAVY) {
+            (*node)->factor = AVL_BALANCED;
+            left->factor = AVL_BALANCED;
+        } else {
+            /* Only on removal and joins, the subtree keeps its height */
+            (*node)->factor = AVL_LFT_HEAVY;
+            left->factor = AVL_RGT_HEAVY;
+        }
+        recount(tree, *node);
+        recount(tree, left);
         *node = left;
     } else {
-        grandchild = bitree_right(left);
-        bitree_right(left) = bitree_left(grandchild);
-        bitree_left(grandchild) = left;
-        bitree_left(*node) = bitree_right(grandchild);
-        bitree_right(grandchild) = *node;
+        grandchild = own(tree, &avl_right(left));
+        avl_right(left) = avl_left(grandchild);
+        avl_left(grandchild) = left;
+        avl_left(*node) = avl_right(grandchild);
+        avl_right(grandchild) = *node;
 
-        switch (((avl_node_t *)bitree_data(grandchild))->factor) {
+        switch (grandchild->factor) {
         case AVL_LFT_HEAVY:
-            ((avl_node_t *)bitree_data(*node))->factor = AVL_RGT_HEAVY;
-            ((avl_node_t *)bitree_data(left))->factor = AVL_BALANCED;
+            (*node)->factor = AVL_RGT_HEAVY;
+            left->factor = AVL_BALANCED;
             break;
         case AVL_BALANCED:
-            ((avl_node_t *)bitree_data(*node))->factor = AVL_BALANCED;
-            ((avl_node_t *)bitree_data(left))->factor = AVL_BALANCED;
+            (*node)->factor = AVL_BALANCED;
+            left->factor = AVL_BALANCED;
             break;
         case AVL_RGT_HEAVY:
-            ((avl_node_t *)bitree_data(*node))->factor = AVL_BALANCED;
-            ((avl_node_t *)bitree_data(left))->factor = AVL_LFT_HEAVY;
+            (*node)->factor = AVL_BALANCED;
+            left->factor = AVL_LFT_HEAVY;
             break;
         }
-        ((avl_node_t *)bitree_data(grandchild))->factor = AVL_BALANCED;
+        grandchild->factor = AVL_BALANCED;
+        recount(tree, *node);
+        recount(tree, left);
+        recount(tree, grandchild);
         *node = grandchild;
     }
     return;
 }
 
-static void rotate_right(bitree_node_t **node) {
+static void rotate_right(avl_tree_t *tree, avl_node_t **node) {
     debug(D_AVLTREE, "Rotating left");
-    bitree_node_t *right, *grandchild;
-    right = bitree_right(*node);
-    if (((avl_node_t *)bitree_data(*node))->factor == AVL_RGT_HEAVY) {
-        bitree_right(*node) = bitree_left(right);
-        bitree_left(right) = *node;
-        ((avl_node_t *)bitree_data(*node))->factor = AVL_BALANCED;
-        ((avl_node_t *)bitree_data(right))->factor = AVL_BALANCED;
+    avl_node_t *right, *grandchild;
+    tally(tree, AVL_STAT_ROTATE, 1);
+    right = own(tree, &avl_right(*node));
+    if (right->factor != AVL_LFT_HEAVY) {
+        avl_right(*node) = avl_left(right);
+        avl_left(right) = *node;
+        if (right->factor == AVL_RGT_HEAVY) {
+            (*node)->factor = AVL_BALANCED;
+            right->factor = AVL_BALANCED;
+        } else {
+            /* Only on removal and joins, the subtree keeps its height */
+            (*node)->factor = AVL_RGT_HEAVY;
+            right->factor = AVL_LFT_HEAVY;
+        }
+        recount(tree, *node);
+        recount(tree, right);
+        *node = right;
     } else {
-        grandchild = bitree_left(right);
-        bitree_left(right) = bitree_right(grandchild);
-        bitree_right(grandchild) = right;
-        bitree_right(*node) = bitree_left(grandchild);
-        bitree_left(grandchild) = *node;
+        grandchild = own(tree, &avl_left(right));
+        avl_left(right) = avl_right(grandchild);
+        avl_right(grandchild) = right;
+        avl_right(*node) = avl_left(grandchild);
+        avl_left(grandchild) = *node;
 
-        switch (((avl_node_t *)bitree_data(grandchild))->factor) {
+        switch (grandchild->factor) {
         case AVL_LFT_HEAVY:
-            ((avl_node_t *)bitree_data(*node))->factor = AVL_BALANCED;
-            ((avl_node_t *)bitree_data(right))->factor = AVL_RGT_HEAVY;
+            (*node)->factor = AVL_BALANCED;
+            right->factor = AVL_RGT_HEAVY;
             break;
         case AVL_BALANCED:
-            ((avl_node_t *)bitree_data(*node))->factor = AVL_BALANCED;
-            ((avl_node_t *)bitree_data(right))->factor = AVL_BALANCED;
+            (*node)->factor = AVL_BALANCED;
+            right->factor = AVL_BALANCED;
             break;
         case AVL_RGT_HEAVY:
-            ((avl_node_t *)bitree_data(*node))->factor = AVL_LFT_HEAVY;
-            ((avl_node_t *)bitree_data(right))->factor = AVL_BALANCED;
+            (*node)->factor = AVL_LFT_HEAVY;
+            right->factor = AVL_BALANCED;
         }
-        ((avl_node_t *)bitree_data(grandchild))->factor = AVL_BALANCED;
+        grandchild->factor = AVL_BALANCED;
+        recount(tree, *node);
+        recount(tree, right);
+        recount(tree, grandchild);
         *node = grandchild;
     }
     return;
 }
 
-static void destroy_left(avl_tree_t *tree, bitree_node_t *node) {
-    debug(D_AVLTREE, "Destroying left branch");
-    bitree_node_t **position;
-    if (bitree_size(tree) == 0)
-        return;
-    if (node == NULL)
-        position = &tree->root;
-    else
-        position = &node->left;
-
-    if (*position != NULL) {
-        destroy_left(tree, *position);
-        destroy_right(tree, *position);
-        if (tree->destroy != NULL) {
-            tree->destroy(((avl_node_t *)(*position)->data)->data);
-        }
-        free((*position)->data);
-        free(*position);
-        *position = NULL;
-        tree->size--;
-    }
+static void node_free(avl_tree_t *tree, avl_node_t *node) {
+    if (avl_expires(node))
+        timer_stop(tree, node);
+    if (avl_is_hidden(node))
+        tree->hidden--;
+    node->flags = AVL_NODE_FREE;
+    tree->bytes -= sizeof(avl_node_t);
+    slab_free(tree->nodes, node);
+    tree->size--;
     return;
 }
 
-static void destroy_right(avl_tree_t *tree, bitree_node_t *node) {
-    debug(D_AVLTREE, "Destroying right branch");
-    bitree_node_t **position;
-    if (bitree_size(tree) == 0)
-        return;
-    if (node == NULL)
-        position = &tree->root;
-    else
-        position = &node->right;
-
-    if (*position != NULL) {
-        destroy_left(tree, *position);
-        destroy_right(tree, *position);
-        if (tree->destroy != NULL) {
-            tree->destroy(((avl_node_t *)(*position)->data)->data);
-        }
-        free((*position)->data);
-        free(*position);
-        *position = NULL;
-        tree->size--;
-    }
+static void destroy_node(void *obj, void *arg) {
+    avl_node_t *node = obj;
+    avl_tree_t *tree = arg;
+    if (!(node->flags & AVL_NODE_FREE))
+        tree->destroy(avl_data(node));
     return;
 }
 
-static int insert(avl_tree_t *tree, bitree_node_t **node, const void *data,
-                  int *balanced) {
-    avl_node_t *avl_data;
-    int cmpval, retval = 2;
-    if (bitree_is_eob(*node)) {
-        if ((avl_data = malloc(sizeof(avl_node_t))) == NULL) {
-            error("Failed to allocate data");
+static int insert(avl_tree_t *tree, avl_node_t **node, const probe_t *probe,
+                  int *balanced, uint64_t expires) {
+    const void *data = probe->data;
+    int cmpval, retval;
+    // entries with a time to live are kept out of the hash index
+    int indexed = tree->index != NULL && expires == 0;
+    if (avl_is_eob(*node)) {
+        if (indexed && hashtable_insert(tree->index, data) < 0)
+            return -1;
+        if ((*node = node_alloc(tree, probe)) == NULL) {
+            if (indexed)
+                hashtable_remove(tree->index, data);
             return -1;
         }
-        avl_data->factor = AVL_BALANCED;
-        avl_data->hidden = 0;
-        avl_data->data = (void *)data;
-        debug(D_AVLTREE,"End of branch");
-        return bitree_ins_left(tree, *node, avl_data);
-    } else {
-        cmpval = tree->compare(data, ((avl_node_t *)bitree_data(*node))->data);
-        if (cmpval < 0) {
-            if (bitree_is_eob(bitree_left(*node))) {
-                if ((avl_data = malloc(sizeof(avl_node_t))) == NULL) {
-                    error("Failed to allocate data");
-                    return -1;
-                }
-                avl_data->factor = AVL_BALANCED;
-                avl_data->hidden = 0;
-                avl_data->data = (void *)data;
-
-                if (bitree_ins_left(tree, *node, avl_data) != 0) {
-                    error("Failed to insert left");
-                    return -1;
-                }
-                *balanced = 0;
-            } else {
-                if ((retval = insert(tree, &bitree_left(*node), data,
-                                     balanced)) != 0) {
-                    error("%d : Failed to insert data into left branch", retval);
-                    return retval;
-                } else
-                    debug(D_AVLTREE, "Data inserted");
-            }
+        if (expires != 0)
+            timer_start(tree, *node, expires);
+        tree->size++;
+        debug(D_AVLTREE, "End of branch");
+        *balanced = 0;
+        return 0;
+    }
 
-            if (!(*balanced)) {
-                debug(D_AVLTREE, "Balancing tree");
-                switch (((avl_node_t *)bitree_data(*node))->factor) {
-                case AVL_LFT_HEAVY:
-                    rotate_left(node);
-                    *balanced = 1;
-                    break;
-                case AVL_BALANCED:
-                    ((avl_node_t *)bitree_data(*node))->factor = AVL_LFT_HEAVY;
-                    break;
-                case AVL_RGT_HEAVY:
-                    ((avl_node_t *)bitree_data(*node))->factor = AVL_BALANCED;
-                    *balanced = 1;
-                }
-            }
-        } else if (cmpval > 0) {
-            if (bitree_is_eob(bitree_right(*node))) {
-                if ((avl_data = malloc(sizeof(avl_node_t))) == NULL){
-                    error("Failed to allocate data");
-                    return -1;
-                }
-                avl_data->factor = AVL_BALANCED;
-                avl_data->hidden = 0;
-                avl_data->data = (void *)data;
+    // copy the path down from the root if a snapshot shares it
+    if (own(tree, node) == NULL)
+        return -1;
+    cmpval = probe_cmp(tree, probe, *node);
+    if (cmpval < 0) {
+        if ((retval = insert(tree, &avl_left(*node), probe, balanced,
+                             expires)) != 0) {
+            error("%d : Failed to insert data into left branch", retval);
+            return retval;
+        }
+        debug(D_AVLTREE, "Data inserted");
 
-                if (bitree_ins_right(tree, *node, avl_data) != 0) {
-                    error("Failed to insert right");
-                    return -1;
-                }
-                debug(D_AVLTREE,"Inserted right");
-                *balanced = 0;
-            } else {
-                if ((retval = insert(tree, &bitree_right(*node), data,
-                                     balanced)) != 0) {
-                    error("%d : Failed to insert data into right branch", retval);
-                    return retval;
-                } else
-                    debug(D_AVLTREE, "Data inserted");
+        if (!(*balanced)) {
+            debug(D_AVLTREE, "Balancing tree");
+            switch ((*node)->factor) {
+            case AVL_LFT_HEAVY:
+                rotate_left(tree, node);
+                *balanced = 1;
+                break;
+            case AVL_BALANCED:
+                (*node)->factor = AVL_LFT_HEAVY;
+                break;
+            case AVL_RGT_HEAVY:
+                (*node)->factor = AVL_BALANCED;
+                *balanced = 1;
             }
+        }
+    } else if (cmpval > 0) {
+        if ((retval = insert(tree, &avl_right(*node), probe, balanced,
+                             expires)) != 0) {
+            error("%d : Failed to insert data into right branch", retval);
+            return retval;
+        }
+        debug(D_AVLTREE, "Data inserted");
 
-            if (!(*balanced)) {
-                debug(D_AVLTREE, "Balancing tree");
-                switch (((avl_node_t *)bitree_data(*node))->factor) {
-                case AVL_LFT_HEAVY:
-                    ((avl_node_t *)bitree_data(*node))->factor = AVL_BALANCED;
-                    *balanced = 1;
-                    break;
-                case AVL_BALANCED:
-                    ((avl_node_t *)bitree_data(*node))->factor = AVL_RGT_HEAVY;
-                    break;
-                case AVL_RGT_HEAVY:
-                    rotate_right(node);
-                    *balanced = 1;
-                }
-            }
-        } else {
-            if (!((avl_node_t *)bitree_data(*node))->hidden) {
-                error("Data already exists");
-                return 1;
-            } else {
-                debug(D_AVLTREE, "Unhiding data");
-                if (tree->destroy != NULL) {
-                    tree->destroy(((avl_node_t *)bitree_data(*node))->data);
-                }
-                ((avl_node_t *)bitree_data(*node))->data = (void *)data;
-                ((avl_node_t *)bitree_data(*node))->hidden = 0;
+        if (!(*balanced)) {
+            debug(D_AVLTREE, "Balancing tree");
+            switch ((*node)->factor) {
+            case AVL_LFT_HEAVY:
+                (*node)->factor = AVL_BALANCED;
+                *balanced = 1;
+                break;
+            case AVL_BALANCED:
+                (*node)->factor = AVL_RGT_HEAVY;
+                break;
+            case AVL_RGT_HEAVY:
+                rotate_right(tree, node);
                 *balanced = 1;
-                return 1;
             }
         }
+    } else {
+        if (visible(tree, *node)) {
+            error("Data already exists");
+            return 1;
+        }
+        debug(D_AVLTREE, "Unhiding data");
+        if (indexed && hashtable_insert(tree->index, data) < 0)
+            return -1;
+        release(tree, *node);
+        avl_data(*node) = (void *)data;
+        tree->bytes += data_bytes(tree, data);
+        if (avl_is_hidden(*node))
+            tree->hidden--;
+        (*node)->flags &= ~(AVL_NODE_HIDDEN | AVL_NODE_COPIED);
+        (*node)->ref = 1;
+        if (avl_expires(*node))
+            timer_stop(tree, *node);
+        if (expires != 0)
+            timer_start(tree, *node, expires);
+        *balanced = 1;
     }
-    return retval;
+    recount(tree, *node);
+    return 0;
 }
 
-static int hide(avl_tree_t *tree, bitree_node_t *node, const void *data) {
+static int hide(avl_tree_t *tree, avl_node_t **node, const probe_t *probe) {
     debug(D_AVLTREE, "Hiding data");
     int cmpval, retval;
-    if (bitree_is_eob(node))
+    if (avl_is_eob(*node) || own(tree, node) == NULL)
         return -1;
-    cmpval = tree->compare(data, ((avl_node_t *)bitree_data(node))->data);
+    cmpval = probe_cmp(tree, probe, *node);
     if (cmpval < 0) {
-        retval = hide(tree, bitree_left(node), data);
+        retval = hide(tree, &avl_left(*node), probe);
     } else if (cmpval > 0) {
-        retval = hide(tree, bitree_right(node), data);
+        retval = hide(tree, &avl_right(*node), probe);
     } else {
-        ((avl_node_t *)bitree_data(node))->hidden = 1;
+        if (!avl_is_hidden(*node)) {
+            if (tree->index != NULL)
+                hashtable_remove(tree->index, avl_data(*node));
+            tree->hidden++;
+        }
+        (*node)->flags |= AVL_NODE_HIDDEN;
         retval = 0;
     }
+    recount(tree, *node);
     return retval;
 }
 
-static int lookup(avl_tree_t *tree, bitree_node_t *node, void **data) {
+static int replace(avl_tree_t *tree, avl_node_t **node, const probe_t *probe) {
+    int cmpval;
+    if (avl_is_eob(*node) || own(tree, node) == NULL)
+        return -1;
+    cmpval = probe_cmp(tree, probe, *node);
+    if (cmpval < 0)
+        return replace(tree, &avl_left(*node), probe);
+    if (cmpval > 0)
+        return replace(tree, &avl_right(*node), probe);
+    if (!visible(tree, *node))
+        return -1;
+    debug(D_AVLTREE, "Replacing data");
+    // the table keeps its size, so the insert cannot fail
+    if (tree->index != NULL && !avl_expires(*node)) {
+        hashtable_remove(tree->index, avl_data(*node));
+        hashtable_insert(tree->index, probe->data);
+    }
+    release(tree, *node);
+    avl_data(*node) = (void *)probe->data;
+    tree->bytes += data_bytes(tree, probe->data);
+    (*node)->flags &= ~AVL_NODE_COPIED;
+    (*node)->ref = 1;
+    return 0;
+}
+
+static void shrunk_left(avl_tree_t *tree, avl_node_t **node, int *shrunk) {
+    debug(D_AVLTREE, "Balancing tree");
+    switch ((*node)->factor) {
+    case AVL_LFT_HEAVY:
+        (*node)->factor = AVL_BALANCED;
+        break;
+    case AVL_BALANCED:
+        (*node)->factor = AVL_RGT_HEAVY;
+        *shrunk = 0;
+        break;
+    case AVL_RGT_HEAVY:
+        if (avl_right(*node)->factor == AVL_BALANCED)
+            *shrunk = 0;
+        rotate_right(tree, node);
+    }
+    return;
+}
+
+static void shrunk_right(avl_tree_t *tree, avl_node_t **node, int *shrunk) {
+    debug(D_AVLTREE, "Balancing tree");
+    switch ((*node)->factor) {
+    case AVL_RGT_HEAVY:
+        (*node)->factor = AVL_BALANCED;
+        break;
+    case AVL_BALANCED:
+        (*node)->factor = AVL_LFT_HEAVY;
+        *shrunk = 0;
+        break;
+    case AVL_LFT_HEAVY:
+        if (avl_left(*node)->factor == AVL_BALANCED)
+            *shrunk = 0;
+        rotate_left(tree, node);
+    }
+    return;
+}
+
+static avl_node_t *unlink_min(avl_tree_t *tree, avl_node_t **node,
+                              int *shrunk) {
+    avl_node_t *min;
+    own(tree, node);
+    if (avl_is_eob(avl_left(*node))) {
+        min = *node;
+        *node = avl_right(min);
+        *shrunk = 1;
+        return min;
+    }
+    min = unlink_min(tree, &avl_left(*node), shrunk);
+    if (*shrunk)
+        shrunk_left(tree, node, shrunk);
+    recount(tree, *node);
+    return min;
+}
+
+static int delete(avl_tree_t *tree, avl_node_t **node, const probe_t *probe,
+                  int *shrunk, int any) {
+    avl_node_t *old, *succ;
+    int cmpval, retval;
+    if (avl_is_eob(*node) || own(tree, node) == NULL)
+        return -1;
+
+    cmpval = probe_cmp(tree, probe, *node);
+    if (cmpval < 0) {
+        if ((retval = delete(tree, &avl_left(*node), probe, shrunk, any)) != 0)
+            return retval;
+        if (*shrunk)
+            shrunk_left(tree, node, shrunk);
+    } else if (cmpval > 0) {
+        if ((retval = delete(tree, &avl_right(*node), probe, shrunk, any)) != 0)
+            return retval;
+        if (*shrunk)
+            shrunk_right(tree, node, shrunk);
+    } else {
+        if (!any && !visible(tree, *node))
+            return -1;
+        old = *node;
+        if (tree->index != NULL)
+            hashtable_remove(tree->index, avl_data(old));
+        release(tree, old);
+        if (avl_is_eob(avl_left(old))) {
+            *node = avl_right(old);
+            *shrunk = 1;
+        } else if (avl_is_eob(avl_right(old))) {
+            *node = avl_left(old);
+            *shrunk = 1;
+        } else {
+            succ = unlink_min(tree, &avl_right(old), shrunk);
+            avl_left(succ) = avl_left(old);
+            avl_right(succ) = avl_right(old);
+            succ->factor = old->factor;
+            *node = succ;
+            if (*shrunk)
+                shrunk_right(tree, node, shrunk);
+        }
+        debug(D_AVLTREE, "Data removed");
+        node_free(tree, old);
+    }
+    recount(tree, *node);
+    return 0;
+}
+
+static avl_node_t *tree_to_vine(avl_node_t *root) {
+    avl_node_t head, *tail = &head, *rest = root, *tmp;
+    avl_right(&head) = root;
+    while (!avl_is_eob(rest)) {
+        if (avl_is_eob(avl_left(rest))) {
+            tail = rest;
+            rest = avl_right(rest);
+        } else {
+            tmp = avl_left(rest);
+            avl_left(rest) = avl_right(tmp);
+            avl_right(tmp) = rest;
+            rest = tmp;
+            avl_right(tail) = tmp;
+        }
+    }
+    return avl_right(&head);
+}
+
+static int count_height(long count) {
+    int height = 0;
+    while (count > 0) {
+        height++;
+        count >>= 1;
+    }
+    return height;
+}
+
+static avl_node_t *vine_to_tree(avl_tree_t *tree, avl_node_t **vine,
+                                long count) {
+    avl_node_t *left, *root;
+    long nleft;
+    if (count == 0)
+        return NULL;
+    nleft = count / 2;
+    left = vine_to_tree(tree, vine, nleft);
+    root = *vine;
+    *vine = avl_right(root);
+    avl_left(root) = left;
+    avl_right(root) = vine_to_tree(tree, vine, count - nleft - 1);
+    root->factor = count_height(nleft) - count_height(count - nleft - 1);
+    recount(tree, root);
+    return root;
+}
+
+static int compare_items(const void *item1, const void *item2, void *arg) {
+    avl_tree_t *tree = arg;
+    return tree->compare(*(void *const *)item1, *(void *const *)item2);
+}
+
+static int sort_items(avl_tree_t *tree, void **items, long count) {
+    int cmpval, sorted = 1;
+    long i;
+    for (i = 1; i < count; i++) {
+        cmpval = tree->compare(items[i - 1], items[i]);
+        if (cmpval == 0) {
+            error("Data already exists");
+            return 1;
+        }
+        if (cmpval > 0)
+            sorted = 0;
+    }
+    if (sorted)
+        return 0;
+
+    debug(D_AVLTREE, "Sorting %ld items", count);
+    qsort_r(items, count, sizeof(void *), compare_items, tree);
+    for (i = 1; i < count; i++) {
+        if (tree->compare(items[i - 1], items[i]) == 0) {
+            error("Data already exists");
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int lookup(avl_tree_t *tree, avl_node_t *node, const probe_t *probe,
+                  void **data) {
     debug(D_AVLTREE, "Performing lookup");
     int cmpval, retval;
-    if (bitree_is_eob(node)) {
+    if (avl_is_eob(node)) {
         return -1;
     }
-    cmpval = tree->compare(*data, ((avl_node_t *)bitree_data(node))->data);
+    cmpval = probe_cmp(tree, probe, node);
     if (cmpval < 0) {
-        retval = lookup(tree, bitree_left(node), data);
+        retval = lookup(tree, avl_left(node), probe, data);
     } else if (cmpval > 0) {
-        retval = lookup(tree, bitree_right(node), data);
+        retval = lookup(tree, avl_right(node), probe, data);
     } else {
-        if (!((avl_node_t *)bitree_data(node))->hidden) {
-            *data = ((avl_node_t *)bitree_data(node))->data;
+        if (visible(tree, node)) {
+            touch(tree, node);
+            *data = avl_data(node);
             retval = 0;
         } else {
             return -1;
@@ -288,15 +814,195 @@ static int lookup(avl_tree_t *tree, bitree_node_t *node, void **data) {
     return retval;
 }
 
+static int live(avl_tree_t *tree, const avl_node_t *node) {
+    avl_node_t *n = avl_root(tree);
+    int cmpval;
+    probe_t probe;
+    probe_init(tree, &probe, avl_data(node));
+    while (!avl_is_eob(n) && n != node) {
+        if ((cmpval = probe_cmp(tree, &probe, n)) == 0)
+            return 0;
+        n = cmpval < 0 ? avl_left(n) : avl_right(n);
+    }
+    return n == node;
+}
+
+static int evict(avl_tree_t *tree, const void *keep, int hidden) {
+    avl_node_t *node;
+    long scanned, limit;
+    int shrunk;
+    probe_t probe;
+    // one sweep passes every hidden or expired entry, two sweeps clear every
+    // reference bit, so a victim turns up before
+    limit = (hidden ? 1 : 2) * slab_capacity(tree->nodes) + 1;
+    for (scanned = 0; scanned < limit; scanned++) {
+        if ((node = slab_next(tree->nodes, &tree->hand)) == NULL)
+            break;
+        if ((node->flags & AVL_NODE_FREE) || avl_data(node) == keep)
+            continue;
+        // the slab also holds versions only snapshots still read
+        if (snapshots(tree) && !live(tree, node))
+            continue;
+        if (hidden) {
+            if (visible(tree, node))
+                continue;
+        } else if (visible(tree, node)) {
+            if (node->ref) {
+                node->ref = 0;
+                continue;
+            }
+            tree->evicted++;
+        }
+        if (spare_reserve(tree) != 0)
+            return -1;
+        debug(D_AVLTREE, "Evicting data");
+        probe_init(tree, &probe, avl_data(node));
+        shrunk = 0;
+        delete(tree, &avl_root(tree), &probe, &shrunk, 1);
+        return 0;
+    }
+    return -1;
+}
+
+static inline int over_budget(avl_tree_t *tree) {
+    return tree->budget != 0 && tree->bytes > tree->budget;
+}
+
+static long expire(avl_tree_t *tree, uint64_t now, long budget);
+
+static void enforce(avl_tree_t *tree, const void *keep) {
+    if (!over_budget(tree))
+        return;
+    // entries nobody can look up any more go before any CLOCK victim, a few
+    // due ones from the wheel and the rest as the hand passes them
+    if (tree->wheel != NULL)
+        expire(tree, clock_ms(), AVL_EXPIRE_BUDGET);
+    while (over_budget(tree) && tree->hidden > 0 && evict(tree, keep, 1) == 0)
+        ;
+    while (over_budget(tree) && evict(tree, keep, 0) == 0)
+        ;
+    return;
+}
+
+static inline int fits(avl_tree_t *tree, const void *data) {
+    if (tree->budget == 0 ||
+        sizeof(avl_node_t) + data_bytes(tree, data) <= tree->budget)
+        return 1;
+    error("Data does not fit in the memory budget");
+    return 0;
+}
+
+static inline int countable(avl_tree_t *tree, long more) {
+    if (!tree->counted || avl_size(tree) + more <= AVL_COUNT_MAX)
+        return 1;
+    error("Tree cannot count more than %lu entries",
+          (unsigned long)AVL_COUNT_MAX);
+    return 0;
+}
+
+static size_t count_bytes(avl_tree_t *tree, avl_node_t *node) {
+    if (avl_is_eob(node))
+        return 0;
+    return sizeof(avl_node_t) + data_bytes(tree, avl_data(node)) +
+           count_bytes(tree, avl_left(node)) +
+           count_bytes(tree, avl_right(node));
+}
+
+static void reclaim(avl_tree_t *tree) {
+    avl_versions_t *versions = tree->versions;
+    avl_retired_t *retired;
+    avl_node_t *node;
+    uint32_t oldest;
+    long i;
+    // a snapshot reads what was retired after its epoch was closed
+    oldest = snapshots(tree) ? versions->snapshots->epoch : UINT32_MAX;
+    for (i = 0; i < versions->retired_count; i++) {
+        retired = &versions->retired[i];
+        if (retired->epoch > oldest)
+            break;
+        if (retired->node) {
+            node = retired->ptr;
+            node->flags = AVL_NODE_FREE;
+            slab_free(tree->nodes, node);
+        } else {
+            tree->destroy(retired->ptr);
+        }
+    }
+    versions->retired_count -= i;
+    if (i > 0)
+        memmove(versions->retired, versions->retired + i,
+                versions->retired_count * sizeof(avl_retired_t));
+    if (!snapshots(tree)) {
+        while (versions->spares > 0)
+            slab_free(tree->nodes, versions->spare[--versions->spares]);
+    }
+    debug(D_AVLTREE, "Reclaimed %ld retired entries", i);
+    return;
+}
+
+static void snapshot_drop(avl_tree_t *tree, avl_snapshot_t *snap) {
+    avl_versions_t *versions = tree->versions;
+    avl_snapshot_t **prev;
+    for (prev = &versions->snapshots; *prev != snap; prev = &(*prev)->next)
+        ;
+    *prev = snap->next;
+    free(snap);
+    // the newest snapshot left decides which nodes are still shared
+    versions->shared = 0;
+    for (snap = versions->snapshots; snap != NULL; snap = snap->next)
+        versions->shared = snap->epoch + 1;
+    reclaim(tree);
+    return;
+}
+
 avl_tree_t *avl_init(int (*compare)(const void *key1, const void *key2),
                      void (*destroy)(void *data)) {
     avl_tree_t *tree;
-    tree = bitree_init(destroy);
+    if ((tree = malloc(sizeof(avl_tree_t))) == NULL) {
+        error("Failed to allocate tree");
+        return NULL;
+    }
+    if ((tree->nodes = slab_init(sizeof(avl_node_t), AVL_SLAB_NODES)) ==
+        NULL) {
+        free(tree);
+        return NULL;
+    }
+    tree->size = 0;
     tree->compare = compare;
+    tree->destroy = destroy;
+    tree->root = NULL;
+    tree->key.mode = AVL_KEY_GENERIC;
+    tree->index = NULL;
+    tree->lock = NULL;
+    tree->wheel = NULL;
+    tree->data_size = NULL;
+    tree->bytes = 0;
+    tree->budget = 0;
+    tree->hand.chunk = NULL;
+    tree->hand.index = 0;
+    tree->evicted = 0;
+    tree->hidden = 0;
+    tree->stats = NULL;
+    tree->versions = NULL;
+    tree->counted = 0;
     debug(D_AVLTREE, "Initialised AVL Tree");
     return tree;
 }
 
+avl_tree_t *avl_init_key(int (*compare)(const void *key1, const void *key2),
+                         const avl_key_t *key, void (*destroy)(void *data)) {
+    avl_tree_t *tree;
+    if (key_mode_check(key) != 0) {
+        error("Invalid key mode");
+        return NULL;
+    }
+    if ((tree = avl_init(compare, destroy)) == NULL)
+        return NULL;
+    tree->key = *key;
+    debug(D_AVLTREE, "Using key mode %d", key->mode);
+    return tree;
+}
+
 void avl_destroy(avl_tree_t *tree) {
     debug(D_AVLTREE, "Destroying Binary search tree");
     if (!tree) {
@@ -304,7 +1010,28 @@ void avl_destroy(avl_tree_t *tree) {
         debug(D_AVLTREE, "Allocate tree first");
         return;
     }
-    destroy_left(tree, NULL);
+    if (tree->versions != NULL) {
+        // free what snapshots held first so data is destroyed only once
+        while (tree->versions->snapshots != NULL)
+            snapshot_drop(tree, tree->versions->snapshots);
+        free(tree->versions->retired);
+        free(tree->versions);
+    }
+    if (tree->destroy != NULL)
+        slab_walk(tree->nodes, destroy_node, tree);
+    slab_destroy(tree->nodes);
+    if (tree->index != NULL)
+        hashtable_destroy(tree->index);
+    if (tree->wheel != NULL) {
+        free(tree->wheel->timers);
+        free(tree->wheel);
+    }
+    if (tree->stats != NULL)
+        stats_destroy(tree->stats);
+    if (tree->lock != NULL) {
+        pthread_rwlock_destroy(tree->lock);
+        free(tree->lock);
+    }
     memset(tree, 0, sizeof(avl_tree_t));
     free(tree);
     tree = NULL;
@@ -318,27 +1045,1646 @@ int avl_insert(avl_tree_t *tree, const void *data) {
         debug(D_AVLTREE, "Allocate tree first");
         return -1;
     }
-    int balanced = 0;
-    return insert(tree, &bitree_root(tree), data, &balanced);
+    unsigned long start = start_op(tree);
+    int balanced = 0, retval;
+    probe_t probe;
+    probe_init(tree, &probe, data);
+    write_lock(tree);
+    if (!fits(tree, data) || !countable(tree, 1))
+        retval = -1;
+    else if ((retval = spare_reserve(tree)) == 0)
+        retval = insert(tree, &avl_root(tree), &probe, &balanced, 0);
+    enforce(tree, data);
+    unlock(tree);
+    end_op(tree, AVL_HIST_INSERT, start, insert_counter(retval));
+    return retval;
 }
 
-int avl_remove(avl_tree_t *tree, const void *data) {
-    debug(D_AVLTREE, "Removing data");
+int avl_insert_ttl(avl_tree_t *tree, const void *data, long ttl) {
+    debug(D_AVLTREE, "Inserting data with a time to live of %ld ms", ttl);
     if (!tree) {
         debug(D_AVLTREE, "Tree pointer cannot be NULL");
         debug(D_AVLTREE, "Allocate tree first");
         return -1;
     }
-    // TODO: Change to remove instead of hide
-    return hide(tree, bitree_root(tree), data);
+    if (ttl < 0) {
+        error("Invalid time to live %ld", ttl);
+        return -1;
+    }
+    if (ttl == 0)
+        return avl_insert(tree, data);
+    unsigned long start = start_op(tree);
+    int balanced = 0, retval;
+    probe_t probe;
+    probe_init(tree, &probe, data);
+    write_lock(tree);
+    // with a timer at hand the insert cannot fail half way
+    if (!fits(tree, data) || !countable(tree, 1))
+        retval = -1;
+    else if ((retval = timer_reserve(tree)) == 0 &&
+             (retval = spare_reserve(tree)) == 0)
+        retval = insert(tree, &avl_root(tree), &probe, &balanced,
+                        clock_ms() + ttl);
+    enforce(tree, data);
+    unlock(tree);
+    end_op(tree, AVL_HIST_INSERT, start, insert_counter(retval));
+    return retval;
 }
 
-int avl_lookup(avl_tree_t *tree, void **data) {
+static int bulk_load(avl_tree_t *tree, void **items, long count) {
+    avl_node_t head, *tail, *vine, *node;
+    probe_t probe;
+    int cmpval, retval;
+    long i;
+    if ((retval = sort_items(tree, items, count)) != 0)
+        return retval;
+    // index inserts below cannot fail once there is room for all items
+    if (tree->index != NULL &&
+        hashtable_reserve(tree->index, hashtable_size(tree->index) + count) !=
+            0)
+        return -1;
+    // every node gets relinked, copy all of them a snapshot shares
+    if (own_tree(tree, &avl_root(tree)) != 0)
+        return -1;
+
+    vine = tree_to_vine(avl_root(tree));
+
+    // check for visible duplicates before touching anything
+    for (node = vine, i = 0; node != NULL && i < count;) {
+        cmpval = tree->compare(items[i], avl_data(node));
+        if (cmpval < 0) {
+            i++;
+        } else if (cmpval > 0) {
+            node = avl_right(node);
+        } else if (visible(tree, node)) {
+            error("Data already exists");
+            avl_root(tree) = vine_to_tree(tree, &vine, avl_size(tree));
+            return 1;
+        } else {
+            node = avl_right(node);
+            i++;
+        }
+    }
+
+    tail = &head;
+    for (i = 0; vine != NULL || i < count;) {
+        cmpval = 1;
+        if (vine != NULL && i < count)
+            cmpval = tree->compare(items[i], avl_data(vine));
+        if (vine != NULL && (i == count || cmpval > 0)) {
+            node = vine;
+            vine = avl_right(vine);
+        } else if (cmpval == 0) {
+            debug(D_AVLTREE, "Unhiding data");
+            node = vine;
+            vine = avl_right(vine);
+            release(tree, node);
+            avl_data(node) = items[i++];
+            tree->bytes += data_bytes(tree, avl_data(node));
+            if (avl_is_hidden(node))
+                tree->hidden--;
+            node->flags &= ~(AVL_NODE_HIDDEN | AVL_NODE_COPIED);
+            node->ref = 1;
+            if (avl_expires(node))
+                timer_stop(tree, node);
+            if (tree->index != NULL)
+                hashtable_insert(tree->index, avl_data(node));
+        } else {
+            probe_init(tree, &probe, items[i]);
+            if ((node = node_alloc(tree, &probe)) == NULL) {
+                // keep what was loaded so far and the rest of the tree
+                avl_right(tail) = vine;
+                node = avl_right(&head);
+                avl_root(tree) = vine_to_tree(tree, &node, avl_size(tree));
+                return -1;
+            }
+            tree->size++;
+            if (tree->index != NULL)
+                hashtable_insert(tree->index, items[i]);
+            i++;
+        }
+        avl_right(tail) = node;
+        tail = node;
+    }
+    avl_right(tail) = NULL;
+    node = avl_right(&head);
+    avl_root(tree) = vine_to_tree(tree, &node, avl_size(tree));
+    return 0;
+}
+
+int avl_bulk_load(avl_tree_t *tree, void **items, long count) {
+    int retval;
+    debug(D_AVLTREE, "Bulk loading %ld items", count);
+    if (!tree) {
+        debug(D_AVLTREE, "Tree pointer cannot be NULL");
+        debug(D_AVLTREE, "Allocate tree first");
+        return -1;
+    }
+    write_lock(tree);
+    retval = countable(tree, count) ? bulk_load(tree, items, count) : -1;
+    enforce(tree, NULL);
+    unlock(tree);
+    if (retval == 0)
+        tally(tree, AVL_STAT_INSERT, count);
+    return retval;
+}
+
+int avl_remove(avl_tree_t *tree, const void *data) {
+    debug(D_AVLTREE, "Removing data");
+    if (!tree) {
+        debug(D_AVLTREE, "Tree pointer cannot be NULL");
+        debug(D_AVLTREE, "Allocate tree first");
+        return -1;
+    }
+    unsigned long start = start_op(tree);
+    int shrunk = 0, retval;
+    probe_t probe;
+    probe_init(tree, &probe, data);
+    write_lock(tree);
+    if ((retval = spare_reserve(tree)) == 0)
+        retval = delete(tree, &avl_root(tree), &probe, &shrunk, 0);
+    unlock(tree);
+    end_op(tree, AVL_HIST_REMOVE, start, retval == 0 ? AVL_STAT_REMOVE : -1);
+    return retval;
+}
+
+int avl_hide(avl_tree_t *tree, const void *data) {
+    debug(D_AVLTREE, "Hiding data");
+    if (!tree) {
+        debug(D_AVLTREE, "Tree pointer cannot be NULL");
+        debug(D_AVLTREE, "Allocate tree first");
+        return -1;
+    }
+    int retval;
+    probe_t probe;
+    probe_init(tree, &probe, data);
+    write_lock(tree);
+    if ((retval = spare_reserve(tree)) == 0)
+        retval = hide(tree, &avl_root(tree), &probe);
+    unlock(tree);
+    return retval;
+}
+
+int avl_replace(avl_tree_t *tree, const void *data) {
+    debug(D_AVLTREE, "Replacing data");
+    if (!tree) {
+        debug(D_AVLTREE, "Tree pointer cannot be NULL");
+        debug(D_AVLTREE, "Allocate tree first");
+        return -1;
+    }
+    int retval;
+    probe_t probe;
+    probe_init(tree, &probe, data);
+    write_lock(tree);
+    if (!fits(tree, data))
+        retval = -1;
+    else if ((retval = spare_reserve(tree)) == 0)
+        retval = replace(tree, &avl_root(tree), &probe);
+    enforce(tree, data);
+    unlock(tree);
+    return retval;
+}
+
+long avl_compact(avl_tree_t *tree) {
+    avl_node_t head, *tail, *node, *next;
+    long purged = 0;
+    debug(D_AVLTREE, "Compacting tree");
+    if (!tree) {
+        debug(D_AVLTREE, "Tree pointer cannot be NULL");
+        debug(D_AVLTREE, "Allocate tree first");
+        return -1;
+    }
+    write_lock(tree);
+    if (own_tree(tree, &avl_root(tree)) != 0) {
+        unlock(tree);
+        return -1;
+    }
+    tail = &head;
+    for (node = tree_to_vine(avl_root(tree)); node != NULL; node = next) {
+        next = avl_right(node);
+        if (!visible(tree, node)) {
+            release(tree, node);
+            node_free(tree, node);
+            purged++;
+        } else {
+            avl_right(tail) = node;
+            tail = node;
+        }
+    }
+    avl_right(tail) = NULL;
+    node = avl_right(&head);
+    avl_root(tree) = vine_to_tree(tree, &node, avl_size(tree));
+    unlock(tree);
+    debug(D_AVLTREE, "Purged %ld hidden nodes", purged);
+    return purged;
+}
+
+static long expire(avl_tree_t *tree, uint64_t now, long budget) {
+    avl_wheel_t *wheel = tree->wheel;
+    avl_timer_t *timer;
+    avl_node_t *node;
+    uint64_t tick, rest;
+    uint32_t id, slot;
+    long removed = 0;
+    int level, shrunk;
+    probe_t probe;
+    if (wheel->count == 0) {
+        wheel->tick = now + 1;
+        return 0;
+    }
+    while (wheel->tick <= now) {
+        tick = wheel->tick;
+        for (level = 1;
+             level < AVL_WHEEL_LEVELS &&
+             (tick & (((uint64_t)1 << (AVL_WHEEL_BITS * level)) - 1)) == 0;
+             level++)
+            cascade(wheel, level, tick);
+        slot = tick & (AVL_WHEEL_SLOTS - 1);
+        while ((id = wheel->slots[slot]) != 0) {
+            // stop on the tick, the next call picks up where this one left
+            if (removed == budget || spare_reserve(tree) != 0)
+                return removed;
+            timer = &wheel->timers[id];
+            if (timer->expires > tick) {
+                timer_unlink(wheel, id);
+                timer_link(wheel, id);
+                continue;
+            }
+            node = timer->node;
+            timer_stop(tree, node);
+            probe_init(tree, &probe, avl_data(node));
+            shrunk = 0;
+            delete(tree, &avl_root(tree), &probe, &shrunk, 1);
+            removed++;
+        }
+        // skip the empty slots up to the next cascade, or up to now
+        rest = wheel->used[0] & ~((2ULL << slot) - 1);
+        if (rest != 0)
+            wheel->tick = (tick & ~(uint64_t)(AVL_WHEEL_SLOTS - 1)) +
+                          __builtin_ctzll(rest);
+        else
+            wheel->tick = (tick | (AVL_WHEEL_SLOTS - 1)) + 1;
+        if (wheel->tick > now + 1)
+            wheel->tick = now + 1;
+    }
+    return removed;
+}
+
+long avl_expire(avl_tree_t *tree, long budget) {
+    long removed = 0;
+    int idle;
+    if (!tree) {
+        debug(D_AVLTREE, "Tree pointer cannot be NULL");
+        debug(D_AVLTREE, "Allocate tree first");
+        return -1;
+    }
+    // do not stall readers on the write lock when nothing can expire
+    read_lock(tree);
+    idle = avl_timers(tree) == 0;
+    unlock(tree);
+    if (idle)
+        return 0;
+    write_lock(tree);
+    if (tree->wheel != NULL)
+        removed = expire(tree, clock_ms(), budget);
+    unlock(tree);
+    debug(D_AVLTREE, "Removed %ld expired entries", removed);
+    return removed;
+}
+
+int avl_lookup(avl_tree_t *tree, void **data) {
     if (!tree) {
         debug(D_AVLTREE, "Tree pointer cannot be NULL");
         debug(D_AVLTREE, "Allocate tree first");
         return -1;
     }
     debug(D_AVLTREE, "Performing lookup");
-    return lookup(tree, bitree_root(tree), data);
+    unsigned long start = start_op(tree);
+    int retval;
+    probe_t probe;
+    read_lock(tree);
+    if (tree->index != NULL)
+        retval = hashtable_lookup(tree->index, data);
+    // entries with a time to live are only found in the tree
+    if (tree->index == NULL || (retval != 0 && avl_timers(tree) > 0)) {
+        probe_init(tree, &probe, *data);
+        retval = lookup(tree, avl_root(tree), &probe, data);
+    }
+    unlock(tree);
+    end_op(tree, AVL_HIST_LOOKUP, start,
+           retval == 0 ? AVL_STAT_HIT : AVL_STAT_MISS);
+    return retval;
+}
+
+static long lookup_batch(avl_tree_t *tree, void **data, long count,
+                         int *status) {
+    probe_t probe[AVL_BATCH_WIDTH];
+    avl_node_t *node[AVL_BATCH_WIDTH], *n;
+    long slot[AVL_BATCH_WIDTH], next, found = 0;
+    int active, i, cmpval, done;
+    for (active = 0, next = 0; active < AVL_BATCH_WIDTH && next < count;
+         active++, next++) {
+        slot[active] = next;
+        probe_init(tree, &probe[active], data[next]);
+        node[active] = avl_root(tree);
+    }
+    while (active > 0) {
+        for (i = 0; i < active;) {
+            done = 1;
+            if (avl_is_eob(n = node[i])) {
+                status[slot[i]] = -1;
+            } else if ((cmpval = probe_cmp(tree, &probe[i], n)) == 0) {
+                if (visible(tree, n)) {
+                    touch(tree, n);
+                    data[slot[i]] = avl_data(n);
+                    status[slot[i]] = 0;
+                    found++;
+                } else {
+                    status[slot[i]] = -1;
+                }
+            } else {
+                // start loading the next node while the other lanes work
+                node[i] = cmpval < 0 ? avl_left(n) : avl_right(n);
+                if (!avl_is_eob(node[i]))
+                    __builtin_prefetch(node[i]);
+                done = 0;
+            }
+            if (!done) {
+                i++;
+            } else if (next < count) {
+                slot[i] = next;
+                probe_init(tree, &probe[i], data[next++]);
+                node[i] = avl_root(tree);
+                i++;
+            } else {
+                active--;
+                slot[i] = slot[active];
+                probe[i] = probe[active];
+                node[i] = node[active];
+            }
+        }
+    }
+    return found;
+}
+
+long avl_lookup_batch(avl_tree_t *tree, void **data, long count,
+                      int *status) {
+    long i, found = 0;
+    probe_t probe;
+    if (!tree) {
+        debug(D_AVLTREE, "Tree pointer cannot be NULL");
+        debug(D_AVLTREE, "Allocate tree first");
+        return -1;
+    }
+    debug(D_AVLTREE, "Performing batch lookup of %ld items", count);
+    read_lock(tree);
+    if (tree->index != NULL) {
+        for (i = 0; i < count; i++) {
+            status[i] = hashtable_lookup(tree->index, &data[i]);
+            if (status[i] != 0 && avl_timers(tree) > 0) {
+                probe_init(tree, &probe, data[i]);
+                status[i] = lookup(tree, avl_root(tree), &probe, &data[i]);
+            }
+            found += status[i] == 0;
+        }
+    } else {
+        found = lookup_batch(tree, data, count, status);
+    }
+    unlock(tree);
+    tally(tree, AVL_STAT_HIT, found);
+    tally(tree, AVL_STAT_MISS, count - found);
+    return found;
+}
+
+static int compare_slots(const void *item1, const void *item2, void *arg) {
+    avl_tree_t *tree = arg;
+    return tree->compare(**(void **const *)item1, **(void **const *)item2);
+}
+
+long avl_insert_batch(avl_tree_t *tree, void **data, long count,
+                      int *status) {
+    void ***slots;
+    long i, inserted = 0;
+    int balanced;
+    probe_t probe;
+    if (!tree) {
+        debug(D_AVLTREE, "Tree pointer cannot be NULL");
+        debug(D_AVLTREE, "Allocate tree first");
+        return -1;
+    }
+    debug(D_AVLTREE, "Inserting batch of %ld items", count);
+    // malloc(0) may return NULL, which is not a failure here
+    if (count == 0)
+        return 0;
+    if ((slots = malloc(count * sizeof(void **))) == NULL) {
+        error("Failed to allocate batch slots");
+        return -1;
+    }
+    // sort the slots and not the data so status keeps the caller's order
+    for (i = 0; i < count; i++)
+        slots[i] = &data[i];
+    qsort_r(slots, count, sizeof(void **), compare_slots, tree);
+    write_lock(tree);
+    for (i = 0; i < count; i++) {
+        balanced = 0;
+        probe_init(tree, &probe, *slots[i]);
+        status[slots[i] - data] =
+            !fits(tree, *slots[i]) || !countable(tree, 1) ||
+                    spare_reserve(tree) != 0
+                ? -1
+                : insert(tree, &avl_root(tree), &probe, &balanced, 0);
+        inserted += status[slots[i] - data] == 0;
+        // the budget holds after every entry, which keeps each new one
+        enforce(tree, *slots[i]);
+    }
+    unlock(tree);
+    free(slots);
+    if (tree->stats != NULL) {
+        for (i = 0; i < count; i++)
+            if (status[i] == 1)
+                tally(tree, AVL_STAT_DUPLICATE, 1);
+        tally(tree, AVL_STAT_INSERT, inserted);
+    }
+    return inserted;
+}
+
+int avl_budget(avl_tree_t *tree, size_t budget,
+               size_t (*size)(const void *data)) {
+    debug(D_AVLTREE, "Setting memory budget of %zu bytes", budget);
+    if (!tree) {
+        debug(D_AVLTREE, "Tree pointer cannot be NULL");
+        debug(D_AVLTREE, "Allocate tree first");
+        return -1;
+    }
+    write_lock(tree);
+    if (size != tree->data_size) {
+        tree->data_size = size;
+        // not the slab, it also holds nodes only snapshots still read
+        tree->bytes = count_bytes(tree, avl_root(tree));
+    }
+    tree->budget = budget;
+    enforce(tree, NULL);
+    unlock(tree);
+    return 0;
+}
+
+int avl_stats_enable(avl_tree_t *tree) {
+    debug(D_AVLTREE, "Enabling statistics");
+    if (!tree) {
+        debug(D_AVLTREE, "Tree pointer cannot be NULL");
+        debug(D_AVLTREE, "Allocate tree first");
+        return -1;
+    }
+    if (tree->stats != NULL)
+        return 0;
+    if ((tree->stats = stats_init(AVL_STAT_COUNTERS, AVL_HIST_COUNT)) == NULL)
+        return -1;
+    return 0;
+}
+
+static void measure(avl_tree_t *tree, avl_stats_t *stats) {
+    avl_node_t *stack[AVL_MAX_HEIGHT + 1], *node;
+    int depths[AVL_MAX_HEIGHT + 1], top = 0, depth;
+    long visible = 0, total = 0;
+    if (!avl_is_eob(avl_root(tree))) {
+        stack[top] = avl_root(tree);
+        depths[top++] = 1;
+    }
+    // preorder, the stack holds at most one pending branch per level
+    while (top > 0) {
+        node = stack[--top];
+        depth = depths[top];
+        if (depth > stats->height)
+            stats->height = depth;
+        if (avl_is_hidden(node)) {
+            stats->hidden++;
+        } else if (expired(tree, node)) {
+            stats->expired++;
+        } else {
+            visible++;
+            total += depth;
+        }
+        if (!avl_is_eob(avl_right(node))) {
+            stack[top] = avl_right(node);
+            depths[top++] = depth + 1;
+        }
+        if (!avl_is_eob(avl_left(node))) {
+            stack[top] = avl_left(node);
+            depths[top++] = depth + 1;
+        }
+    }
+    stats->depth = visible > 0 ? (double)total / visible : 0;
+    return;
+}
+
+int avl_stats(avl_tree_t *tree, avl_stats_t *stats) {
+    if (!tree) {
+        debug(D_AVLTREE, "Tree pointer cannot be NULL");
+        debug(D_AVLTREE, "Allocate tree first");
+        return -1;
+    }
+    memset(stats, 0, sizeof(avl_stats_t));
+    if (tree->stats != NULL) {
+        stats->inserts = stats_counter(tree->stats, AVL_STAT_INSERT);
+        stats->duplicates = stats_counter(tree->stats, AVL_STAT_DUPLICATE);
+        stats->hits = stats_counter(tree->stats, AVL_STAT_HIT);
+        stats->misses = stats_counter(tree->stats, AVL_STAT_MISS);
+        stats->removes = stats_counter(tree->stats, AVL_STAT_REMOVE);
+        stats->rotations = stats_counter(tree->stats, AVL_STAT_ROTATE);
+        stats_summary(tree->stats, AVL_HIST_INSERT, &stats->insert);
+        stats_summary(tree->stats, AVL_HIST_LOOKUP, &stats->lookup);
+        stats_summary(tree->stats, AVL_HIST_REMOVE, &stats->remove);
+    }
+    read_lock(tree);
+    stats->size = avl_size(tree);
+    stats->bytes = avl_bytes(tree);
+    stats->evicted = avl_evicted(tree);
+    measure(tree, stats);
+    unlock(tree);
+    return 0;
+}
+
+static void dump_summary(FILE *out, const char *name,
+                         const stats_summary_t *sum, int json) {
+    if (json)
+        fprintf(out,
+                ",\"%s\":{\"count\":%lu,\"mean_ns\":%lu,\"p50_ns\":%lu,"
+                "\"p90_ns\":%lu,\"p99_ns\":%lu,\"p999_ns\":%lu,"
+                "\"max_ns\":%lu}",
+                name, sum->count, sum->mean, sum->p50, sum->p90, sum->p99,
+                sum->p999, sum->max);
+    else
+        fprintf(out,
+                "%s_count %lu\n%s_mean_ns %lu\n%s_p50_ns %lu\n"
+                "%s_p90_ns %lu\n%s_p99_ns %lu\n%s_p999_ns %lu\n"
+                "%s_max_ns %lu\n",
+                name, sum->count, name, sum->mean, name, sum->p50, name,
+                sum->p90, name, sum->p99, name, sum->p999, name, sum->max);
+    return;
+}
+
+int avl_stats_dump(avl_tree_t *tree, FILE *out, int json) {
+    avl_stats_t stats;
+    if (avl_stats(tree, &stats) != 0)
+        return -1;
+    if (json)
+        fprintf(out,
+                "{\"size\":%ld,\"hidden\":%ld,\"expired\":%ld,"
+                "\"height\":%d,\"depth_avg\":%.2f,\"bytes\":%zu,"
+                "\"inserts\":%lu,\"duplicates\":%lu,\"hits\":%lu,"
+                "\"misses\":%lu,\"removes\":%lu,\"rotations\":%lu,"
+                "\"evicted\":%lu",
+                stats.size, stats.hidden, stats.expired, stats.height,
+                stats.depth, stats.bytes, stats.inserts, stats.duplicates,
+                stats.hits, stats.misses, stats.removes, stats.rotations,
+                stats.evicted);
+    else
+        fprintf(out,
+                "size %ld\nhidden %ld\nexpired %ld\nheight %d\n"
+                "depth_avg %.2f\nbytes %zu\ninserts %lu\nduplicates %lu\n"
+                "hits %lu\nmisses %lu\nremoves %lu\nrotations %lu\n"
+                "evicted %lu\n",
+                stats.size, stats.hidden, stats.expired, stats.height,
+                stats.depth, stats.bytes, stats.inserts, stats.duplicates,
+                stats.hits, stats.misses, stats.removes, stats.rotations,
+                stats.evicted);
+    dump_summary(out, "insert", &stats.insert, json);
+    dump_summary(out, "lookup", &stats.lookup, json);
+    dump_summary(out, "remove", &stats.remove, json);
+    if (json)
+        fprintf(out, "}\n");
+    return ferror(out) ? -1 : 0;
+}
+
+static int build_index(avl_tree_t *tree,
+                       unsigned long (*hash)(const void *data)) {
+    avl_cursor_t cursor;
+    hashtable_t *index;
+    int retval;
+    if (tree->index != NULL) {
+        hashtable_destroy(tree->index);
+        tree->index = NULL;
+    }
+    if (hash == NULL)
+        return 0;
+    if ((index = hashtable_init(hash, tree->compare)) == NULL)
+        return -1;
+    if (hashtable_reserve(index, avl_size(tree)) != 0) {
+        hashtable_destroy(index);
+        return -1;
+    }
+    avl_cursor_init(&cursor, tree);
+    for (retval = avl_cursor_first(&cursor); retval == 0;
+         retval = avl_cursor_next(&cursor))
+        if (!avl_expires(cursor.path[cursor.depth - 1]))
+            hashtable_insert(index, avl_cursor_data(&cursor));
+    tree->index = index;
+    return 0;
+}
+
+int avl_index(avl_tree_t *tree, unsigned long (*hash)(const void *data)) {
+    int retval;
+    debug(D_AVLTREE, "Building hash index");
+    if (!tree) {
+        debug(D_AVLTREE, "Tree pointer cannot be NULL");
+        debug(D_AVLTREE, "Allocate tree first");
+        return -1;
+    }
+    write_lock(tree);
+    retval = build_index(tree, hash);
+    unlock(tree);
+    return retval;
+}
+
+int avl_concurrent(avl_tree_t *tree) {
+    pthread_rwlockattr_t attr;
+    debug(D_AVLTREE, "Enabling concurrent mode");
+    if (!tree) {
+        debug(D_AVLTREE, "Tree pointer cannot be NULL");
+        debug(D_AVLTREE, "Allocate tree first");
+        return -1;
+    }
+    if (tree->lock != NULL)
+        return 0;
+    if ((tree->lock = malloc(sizeof(pthread_rwlock_t))) == NULL) {
+        error("Failed to allocate lock");
+        return -1;
+    }
+    // do not let a steady stream of lookups starve the writer
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr,
+                                  PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(tree->lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    return 0;
+}
+
+static uint32_t count_tree(avl_tree_t *tree, avl_node_t *node) {
+    if (avl_is_eob(node))
+        return 0;
+    count_tree(tree, avl_left(node));
+    count_tree(tree, avl_right(node));
+    recount(tree, node);
+    return node->count;
+}
+
+int avl_order(avl_tree_t *tree) {
+    debug(D_AVLTREE, "Counting subtrees");
+    if (!tree) {
+        debug(D_AVLTREE, "Tree pointer cannot be NULL");
+        debug(D_AVLTREE, "Allocate tree first");
+        return -1;
+    }
+    write_lock(tree);
+    if (tree->counted) {
+        unlock(tree);
+        return 0;
+    }
+    if (avl_size(tree) > AVL_COUNT_MAX) {
+        unlock(tree);
+        error("Cannot count more than %lu entries",
+              (unsigned long)AVL_COUNT_MAX);
+        return -1;
+    }
+    // the counts are written into every node, copy the ones a snapshot shares
+    if (own_tree(tree, &avl_root(tree)) != 0) {
+        unlock(tree);
+        return -1;
+    }
+    tree->counted = 1;
+    count_tree(tree, avl_root(tree));
+    unlock(tree);
+    return 0;
+}
+
+void avl_read_lock(avl_tree_t *tree) {
+    read_lock(tree);
+    return;
+}
+
+void avl_read_unlock(avl_tree_t *tree) {
+    unlock(tree);
+    return;
+}
+
+static inline avl_node_t *cursor_root(avl_cursor_t *cursor) {
+    return cursor->snapshot != NULL ? cursor->snapshot->root
+                                    : avl_root(cursor->tree);
+}
+
+static inline int cursor_visible(avl_cursor_t *cursor,
+                                 const avl_node_t *node) {
+    // a snapshot never reads the timer wheel, writers change it
+    if (cursor->snapshot != NULL)
+        return !avl_is_hidden(node);
+    return visible(cursor->tree, node);
+}
+
+static int cursor_push_left(avl_cursor_t *cursor, avl_node_t *node) {
+    while (!avl_is_eob(node)) {
+        cursor->path[cursor->depth++] = node;
+        node = avl_left(node);
+    }
+    return avl_cursor_valid(cursor) ? 0 : -1;
+}
+
+static int cursor_push_right(avl_cursor_t *cursor, avl_node_t *node) {
+    while (!avl_is_eob(node)) {
+        cursor->path[cursor->depth++] = node;
+        node = avl_right(node);
+    }
+    return avl_cursor_valid(cursor) ? 0 : -1;
+}
+
+static int cursor_step_next(avl_cursor_t *cursor) {
+    avl_node_t *node = cursor->path[cursor->depth - 1];
+    if (!avl_is_eob(avl_right(node)))
+        return cursor_push_left(cursor, avl_right(node));
+    while (--cursor->depth > 0 &&
+           avl_right(cursor->path[cursor->depth - 1]) == node)
+        node = cursor->path[cursor->depth - 1];
+    return avl_cursor_valid(cursor) ? 0 : -1;
+}
+
+static int cursor_step_prev(avl_cursor_t *cursor) {
+    avl_node_t *node = cursor->path[cursor->depth - 1];
+    if (!avl_is_eob(avl_left(node)))
+        return cursor_push_right(cursor, avl_left(node));
+    while (--cursor->depth > 0 &&
+           avl_left(cursor->path[cursor->depth - 1]) == node)
+        node = cursor->path[cursor->depth - 1];
+    return avl_cursor_valid(cursor) ? 0 : -1;
+}
+
+static int cursor_skip_next(avl_cursor_t *cursor) {
+    while (avl_cursor_valid(cursor) &&
+           !cursor_visible(cursor, cursor->path[cursor->depth - 1]))
+        cursor_step_next(cursor);
+    return avl_cursor_valid(cursor) ? 0 : -1;
+}
+
+static int cursor_skip_prev(avl_cursor_t *cursor) {
+    while (avl_cursor_valid(cursor) &&
+           !cursor_visible(cursor, cursor->path[cursor->depth - 1]))
+        cursor_step_prev(cursor);
+    return avl_cursor_valid(cursor) ? 0 : -1;
+}
+
+void avl_cursor_init(avl_cursor_t *cursor, avl_tree_t *tree) {
+    cursor->tree = tree;
+    cursor->snapshot = NULL;
+    cursor->depth = 0;
+    return;
+}
+
+void avl_snapshot_cursor_init(avl_cursor_t *cursor, avl_snapshot_t *snap) {
+    cursor->tree = snap->tree;
+    cursor->snapshot = snap;
+    cursor->depth = 0;
+    return;
+}
+
+int avl_cursor_first(avl_cursor_t *cursor) {
+    cursor->depth = 0;
+    cursor_push_left(cursor, cursor_root(cursor));
+    return cursor_skip_next(cursor);
+}
+
+int avl_cursor_last(avl_cursor_t *cursor) {
+    cursor->depth = 0;
+    cursor_push_right(cursor, cursor_root(cursor));
+    return cursor_skip_prev(cursor);
+}
+
+int avl_cursor_seek(avl_cursor_t *cursor, const void *data) {
+    avl_tree_t *tree = cursor->tree;
+    avl_node_t *node = cursor_root(cursor);
+    int cmpval, found = 0;
+    probe_t probe;
+    probe_init(tree, &probe, data);
+    cursor->depth = 0;
+    while (!avl_is_eob(node)) {
+        cursor->path[cursor->depth++] = node;
+        cmpval = probe_cmp(tree, &probe, node);
+        if (cmpval == 0) {
+            found = cursor->depth;
+            break;
+        } else if (cmpval < 0) {
+            found = cursor->depth;
+            node = avl_left(node);
+        } else {
+            node = avl_right(node);
+        }
+    }
+    cursor->depth = found;
+    return cursor_skip_next(cursor);
+}
+
+int avl_cursor_next(avl_cursor_t *cursor) {
+    if (!avl_cursor_valid(cursor))
+        return -1;
+    cursor_step_next(cursor);
+    return cursor_skip_next(cursor);
+}
+
+int avl_cursor_prev(avl_cursor_t *cursor) {
+    if (!avl_cursor_valid(cursor))
+        return -1;
+    cursor_step_prev(cursor);
+    return cursor_skip_prev(cursor);
+}
+
+static long range(avl_cursor_t *cursor, const void *lo, const void *hi,
+                  int (*callback)(void *data, void *arg), void *arg) {
+    long count = 0;
+    int retval;
+    if (lo != NULL)
+        retval = avl_cursor_seek(cursor, lo);
+    else
+        retval = avl_cursor_first(cursor);
+    for (; retval == 0; retval = avl_cursor_next(cursor)) {
+        if (hi != NULL &&
+            cursor->tree->compare(avl_cursor_data(cursor), hi) > 0)
+            break;
+        count++;
+        if (callback(avl_cursor_data(cursor), arg) != 0)
+            break;
+    }
+    return count;
+}
+
+long avl_range(avl_tree_t *tree, const void *lo, const void *hi,
+               int (*callback)(void *data, void *arg), void *arg) {
+    avl_cursor_t cursor;
+    long count;
+    debug(D_AVLTREE, "Performing range scan");
+    if (!tree) {
+        debug(D_AVLTREE, "Tree pointer cannot be NULL");
+        debug(D_AVLTREE, "Allocate tree first");
+        return -1;
+    }
+    read_lock(tree);
+    avl_cursor_init(&cursor, tree);
+    count = range(&cursor, lo, hi, callback, arg);
+    unlock(tree);
+    return count;
+}
+
+long avl_prefix(avl_tree_t *tree, const void *prefix,
+                int (*match)(const void *prefix, const void *data),
+                int (*callback)(void *data, void *arg), void *arg) {
+    avl_cursor_t cursor;
+    long count = 0;
+    int retval;
+    debug(D_AVLTREE, "Performing prefix scan");
+    if (!tree) {
+        debug(D_AVLTREE, "Tree pointer cannot be NULL");
+        debug(D_AVLTREE, "Allocate tree first");
+        return -1;
+    }
+    read_lock(tree);
+    avl_cursor_init(&cursor, tree);
+    for (retval = avl_cursor_seek(&cursor, prefix); retval == 0;
+         retval = avl_cursor_next(&cursor)) {
+        if (!match(prefix, avl_cursor_data(&cursor)))
+            break;
+        count++;
+        if (callback(avl_cursor_data(&cursor), arg) != 0)
+            break;
+    }
+    unlock(tree);
+    return count;
+}
+
+static int order_check(avl_tree_t *tree) {
+    if (!tree) {
+        debug(D_AVLTREE, "Tree pointer cannot be NULL");
+        debug(D_AVLTREE, "Allocate tree first");
+        return -1;
+    }
+    if (!tree->counted) {
+        error("Tree does not keep subtree counts");
+        return -1;
+    }
+    return 0;
+}
+
+static void order_lock(avl_tree_t *tree) {
+    read_lock(tree);
+    if (avl_timers(tree) == 0 || wheel_next(tree->wheel) > clock_ms())
+        return;
+    // the counts take in entries past their time to live until they are
+    // removed, remove a few of them first as avl_expire would
+    unlock(tree);
+    write_lock(tree);
+    if (tree->wheel != NULL)
+        expire(tree, clock_ms(), AVL_EXPIRE_BUDGET);
+    return;
+}
+
+static long before(avl_tree_t *tree, const void *data, int inclusive) {
+    avl_node_t *node = avl_root(tree);
+    long count = 0;
+    int cmpval;
+    probe_t probe;
+    probe_init(tree, &probe, data);
+    while (!avl_is_eob(node)) {
+        cmpval = probe_cmp(tree, &probe, node);
+        if (cmpval < 0 || (cmpval == 0 && !inclusive)) {
+            node = avl_left(node);
+            continue;
+        }
+        count += subtree_count(avl_left(node)) + !avl_is_hidden(node);
+        if (cmpval == 0)
+            break;
+        node = avl_right(node);
+    }
+    return count;
+}
+
+long avl_rank(avl_tree_t *tree, const void *data) {
+    long rank;
+    debug(D_AVLTREE, "Ranking data");
+    if (order_check(tree) != 0)
+        return -1;
+    order_lock(tree);
+    rank = before(tree, data, 0);
+    unlock(tree);
+    return rank;
+}
+
+int avl_select(avl_tree_t *tree, long index, void **data) {
+    avl_node_t *node;
+    long left;
+    int retval = -1;
+    debug(D_AVLTREE, "Selecting entry %ld", index);
+    if (order_check(tree) != 0 || index < 0)
+        return -1;
+    order_lock(tree);
+    for (node = avl_root(tree); !avl_is_eob(node);) {
+        left = subtree_count(avl_left(node));
+        if (index < left) {
+            node = avl_left(node);
+            continue;
+        }
+        index -= left;
+        if (!avl_is_hidden(node) && index-- == 0) {
+            // counted but past its time to live, not removed yet
+            if (expired(tree, node))
+                break;
+            touch(tree, node);
+            *data = avl_data(node);
+            retval = 0;
+            break;
+        }
+        node = avl_right(node);
+    }
+    unlock(tree);
+    return retval;
+}
+
+long avl_count_range(avl_tree_t *tree, const void *lo, const void *hi) {
+    long count;
+    debug(D_AVLTREE, "Counting range");
+    if (order_check(tree) != 0)
+        return -1;
+    order_lock(tree);
+    count = hi != NULL ? before(tree, hi, 1) : subtree_count(avl_root(tree));
+    if (lo != NULL)
+        count -= before(tree, lo, 0);
+    unlock(tree);
+    return count > 0 ? count : 0;
+}
+
+avl_snapshot_t *avl_snapshot(avl_tree_t *tree) {
+    avl_snapshot_t *snap, **last;
+    debug(D_AVLTREE, "Taking snapshot");
+    if (!tree) {
+        debug(D_AVLTREE, "Tree pointer cannot be NULL");
+        debug(D_AVLTREE, "Allocate tree first");
+        return NULL;
+    }
+    if ((snap = malloc(sizeof(avl_snapshot_t))) == NULL) {
+        error("Failed to allocate snapshot");
+        return NULL;
+    }
+    write_lock(tree);
+    if (tree->versions == NULL) {
+        if ((tree->versions = calloc(1, sizeof(avl_versions_t))) == NULL) {
+            unlock(tree);
+            error("Failed to allocate snapshot bookkeeping");
+            free(snap);
+            return NULL;
+        }
+        // nodes from before the first snapshot are in epoch 0
+        tree->versions->epoch = 1;
+    }
+    // readers of the snapshot never look at the clock, the due entries left
+    // over stay in it
+    if (tree->wheel != NULL)
+        expire(tree, clock_ms(), AVL_EXPIRE_BUDGET);
+    snap->tree = tree;
+    snap->root = avl_root(tree);
+    snap->size = avl_size(tree);
+    snap->epoch = tree->versions->epoch++;
+    snap->next = NULL;
+    for (last = &tree->versions->snapshots; *last != NULL;
+         last = &(*last)->next)
+        ;
+    *last = snap;
+    tree->versions->shared = snap->epoch + 1;
+    unlock(tree);
+    debug(D_AVLTREE, "Took snapshot at epoch %u", snap->epoch);
+    return snap;
+}
+
+void avl_snapshot_release(avl_snapshot_t *snap) {
+    avl_tree_t *tree;
+    debug(D_AVLTREE, "Releasing snapshot");
+    if (!snap) {
+        debug(D_AVLTREE, "Snapshot pointer cannot be NULL");
+        return;
+    }
+    tree = snap->tree;
+    write_lock(tree);
+    snapshot_drop(tree, snap);
+    unlock(tree);
+    return;
+}
+
+int avl_snapshot_lookup(avl_snapshot_t *snap, void **data) {
+    avl_node_t *node;
+    avl_tree_t *tree;
+    int cmpval;
+    probe_t probe;
+    if (!snap) {
+        debug(D_AVLTREE, "Snapshot pointer cannot be NULL");
+        return -1;
+    }
+    tree = snap->tree;
+    probe_init(tree, &probe, *data);
+    for (node = snap->root; !avl_is_eob(node);) {
+        cmpval = probe_cmp(tree, &probe, node);
+        if (cmpval == 0) {
+            if (avl_is_hidden(node))
+                return -1;
+            *data = avl_data(node);
+            return 0;
+        }
+        node = cmpval < 0 ? avl_left(node) : avl_right(node);
+    }
+    return -1;
+}
+
+long avl_snapshot_range(avl_snapshot_t *snap, const void *lo, const void *hi,
+                        int (*callback)(void *data, void *arg), void *arg) {
+    avl_cursor_t cursor;
+    debug(D_AVLTREE, "Performing snapshot range scan");
+    if (!snap) {
+        debug(D_AVLTREE, "Snapshot pointer cannot be NULL");
+        return -1;
+    }
+    avl_snapshot_cursor_init(&cursor, snap);
+    return range(&cursor, lo, hi, callback, arg);
+}
+
+typedef struct avl_setop_ avl_setop_t;
+
+// a subtree pair of a set operation, the leaves run as worker tasks and
+// the inner frames are joined once all leaves are done
+typedef struct {
+    avl_setop_t *op;
+    avl_node_t *a, *b, *found, *result, *dropped;
+    int ha, hb, height, left, right, claimed;
+} avl_frame_t;
+
+struct avl_setop_ {
+    avl_tree_t *tree, *other;
+    int type, count, leaves, done, refs;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    avl_frame_t frames[(2 << AVL_SET_DEPTH) - 1];
+};
+
+// the nodes only keep balance factors, heights are passed along
+static inline int left_height(const avl_node_t *node, int height) {
+    return node->factor == AVL_RGT_HEAVY ? height - 2 : height - 1;
+}
+
+static inline int right_height(const avl_node_t *node, int height) {
+    return node->factor == AVL_LFT_HEAVY ? height - 2 : height - 1;
+}
+
+static int height(const avl_node_t *node) {
+    int h = 0;
+    for (; !avl_is_eob(node); h++)
+        node = node->factor == AVL_RGT_HEAVY ? avl_right(node)
+                                             : avl_left(node);
+    return h;
+}
+
+static avl_node_t *join(avl_tree_t *tree, avl_node_t *l, int hl,
+                        avl_node_t *k, avl_node_t *r, int hr, int *h);
+
+static avl_node_t *join_right(avl_tree_t *tree, avl_node_t *l, int hl,
+                              avl_node_t *k, avl_node_t *r, int hr,
+                              int *h) {
+    int hll = left_height(l, hl), hlr = right_height(l, hl), hk;
+    // walk down the right spine to a subtree as high as r
+    if (hlr <= hr + 1) {
+        avl_left(k) = avl_right(l);
+        avl_right(k) = r;
+        k->factor = hlr - hr;
+        recount(tree, k);
+        hk = hlr + 1;
+        avl_right(l) = k;
+    } else {
+        avl_right(l) = join_right(tree, avl_right(l), hlr, k, r, hr, &hk);
+    }
+    if (hk - hll <= 1) {
+        l->factor = hll - hk;
+        recount(tree, l);
+        *h = (hll > hk ? hll : hk) + 1;
+        return l;
+    }
+    l->factor = AVL_RGT_HEAVY;
+    rotate_right(tree, &l);
+    *h = l->factor == AVL_BALANCED ? hll + 2 : hll + 3;
+    return l;
+}
+
+static avl_node_t *join_left(avl_tree_t *tree, avl_node_t *l, int hl,
+                             avl_node_t *k, avl_node_t *r, int hr, int *h) {
+    int hrl = left_height(r, hr), hrr = right_height(r, hr), hk;
+    if (hrl <= hl + 1) {
+        avl_left(k) = l;
+        avl_right(k) = avl_left(r);
+        k->factor = hl - hrl;
+        recount(tree, k);
+        hk = hrl + 1;
+        avl_left(r) = k;
+    } else {
+        avl_left(r) = join_left(tree, l, hl, k, avl_left(r), hrl, &hk);
+    }
+    if (hk - hrr <= 1) {
+        r->factor = hk - hrr;
+        recount(tree, r);
+        *h = (hrr > hk ? hrr : hk) + 1;
+        return r;
+    }
+    r->factor = AVL_LFT_HEAVY;
+    rotate_left(tree, &r);
+    *h = r->factor == AVL_BALANCED ? hrr + 2 : hrr + 3;
+    return r;
+}
+
+static avl_node_t *join(avl_tree_t *tree, avl_node_t *l, int hl,
+                        avl_node_t *k, avl_node_t *r, int hr, int *h) {
+    if (hl > hr + 1)
+        return join_right(tree, l, hl, k, r, hr, h);
+    if (hr > hl + 1)
+        return join_left(tree, l, hl, k, r, hr, h);
+    avl_left(k) = l;
+    avl_right(k) = r;
+    k->factor = hl - hr;
+    recount(tree, k);
+    *h = (hl > hr ? hl : hr) + 1;
+    return k;
+}
+
+static avl_node_t *split_last(avl_tree_t *tree, avl_node_t *node, int height,
+                              avl_node_t **last, int *h) {
+    avl_node_t *rest;
+    int hr;
+    if (avl_is_eob(avl_right(node))) {
+        *last = node;
+        *h = height - 1;
+        return avl_left(node);
+    }
+    rest = split_last(tree, avl_right(node), right_height(node, height), last,
+                      &hr);
+    return join(tree, avl_left(node), left_height(node, height), node, rest,
+                hr, h);
+}
+
+static avl_node_t *join2(avl_tree_t *tree, avl_node_t *l, int hl,
+                         avl_node_t *r, int hr, int *h) {
+    avl_node_t *k;
+    if (avl_is_eob(l)) {
+        *h = hr;
+        return r;
+    }
+    l = split_last(tree, l, hl, &k, &hl);
+    return join(tree, l, hl, k, r, hr, h);
+}
+
+static avl_node_t *split(avl_tree_t *tree, avl_node_t *node, int height,
+                         const probe_t *probe, avl_node_t **l, int *hl,
+                         avl_node_t **r, int *hr) {
+    avl_node_t *found;
+    int cmpval, h;
+    if (avl_is_eob(node)) {
+        *l = *r = NULL;
+        *hl = *hr = 0;
+        return NULL;
+    }
+    cmpval = probe_cmp(tree, probe, node);
+    if (cmpval == 0) {
+        *l = avl_left(node);
+        *hl = left_height(node, height);
+        *r = avl_right(node);
+        *hr = right_height(node, height);
+        return node;
+    }
+    if (cmpval < 0) {
+        found = split(tree, avl_left(node), left_height(node, height), probe,
+                      l, hl, r, &h);
+        *r = join(tree, *r, h, node, avl_right(node),
+                  right_height(node, height), hr);
+    } else {
+        found = split(tree, avl_right(node), right_height(node, height),
+                      probe, l, &h, r, hr);
+        *l = join(tree, avl_left(node), left_height(node, height), node, *l,
+                  h, hl);
+    }
+    return found;
+}
+
+static void drop(avl_node_t *node, avl_node_t **dropped) {
+    avl_right(node) = *dropped;
+    *dropped = node;
+    return;
+}
+
+static void drop_tree(avl_node_t *node, avl_node_t **dropped) {
+    avl_node_t *right;
+    if (avl_is_eob(node))
+        return;
+    drop_tree(avl_left(node), dropped);
+    right = avl_right(node);
+    drop(node, dropped);
+    drop_tree(right, dropped);
+    return;
+}
+
+// pick the node that stays between the two halves, b is the node of the
+// other tree and found the equal node of the tree, if any
+static avl_node_t *pick(avl_tree_t *other, int type, avl_node_t *found,
+                        avl_node_t *b, avl_node_t **dropped) {
+    avl_node_t *keep;
+    if (type == AVL_SET_UNION)
+        keep = b;
+    else if (type == AVL_SET_INTERSECT)
+        keep = visible(other, b) ? found : NULL;
+    else
+        keep = visible(other, b) ? NULL : found;
+    if (found != NULL && found != keep)
+        drop(found, dropped);
+    return keep;
+}
+
+static avl_node_t *combine(avl_tree_t *tree, avl_tree_t *other, int type,
+                           avl_node_t *a, int ha, avl_node_t *b, int hb,
+                           avl_node_t **dropped, int *h) {
+    avl_node_t *l, *r, *bl, *br, *found, *keep;
+    int hl, hr, hbl, hbr;
+    probe_t probe;
+    if (avl_is_eob(b)) {
+        if (type == AVL_SET_INTERSECT) {
+            drop_tree(a, dropped);
+            a = NULL;
+            ha = 0;
+        }
+        *h = ha;
+        return a;
+    }
+    if (avl_is_eob(a)) {
+        *h = type == AVL_SET_UNION ? hb : 0;
+        return type == AVL_SET_UNION ? b : NULL;
+    }
+    bl = avl_left(b);
+    br = avl_right(b);
+    hbl = left_height(b, hb);
+    hbr = right_height(b, hb);
+    probe_init(tree, &probe, avl_data(b));
+    found = split(tree, a, ha, &probe, &l, &hl, &r, &hr);
+    l = combine(tree, other, type, l, hl, bl, hbl, dropped, &hl);
+    r = combine(tree, other, type, r, hr, br, hbr, dropped, &hr);
+    if ((keep = pick(other, type, found, b, dropped)) != NULL)
+        return join(tree, l, hl, keep, r, hr, h);
+    return join2(tree, l, hl, r, hr, h);
+}
+
+static void frame_run(avl_frame_t *frame) {
+    avl_setop_t *op = frame->op;
+    frame->result = combine(op->tree, op->other, op->type, frame->a,
+                            frame->ha, frame->b, frame->hb, &frame->dropped,
+                            &frame->height);
+    pthread_mutex_lock(&op->mutex);
+    if (++op->done == op->leaves)
+        pthread_cond_signal(&op->cond);
+    pthread_mutex_unlock(&op->mutex);
+    return;
+}
+
+static void setop_put(avl_setop_t *op) {
+    if (__atomic_sub_fetch(&op->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        pthread_mutex_destroy(&op->mutex);
+        pthread_cond_destroy(&op->cond);
+        free(op);
+    }
+    return;
+}
+
+static void frame_job(void *arg) {
+    avl_frame_t *frame = arg;
+    avl_setop_t *op = frame->op;
+    // the caller runs the leaves no worker got to yet
+    if (!__atomic_exchange_n(&frame->claimed, 1, __ATOMIC_ACQ_REL))
+        frame_run(frame);
+    setop_put(op);
+    return;
+}
+
+static int frame_split(avl_setop_t *op, avl_node_t *a, int ha, avl_node_t *b,
+                       int hb, int depth) {
+    int i = op->count++, hl, hr;
+    avl_frame_t *frame = &op->frames[i];
+    avl_node_t *l, *r;
+    probe_t probe;
+    memset(frame, 0, sizeof(avl_frame_t));
+    frame->op = op;
+    frame->a = a;
+    frame->ha = ha;
+    frame->b = b;
+    frame->hb = hb;
+    frame->left = frame->right = -1;
+    if (depth == 0 || hb < AVL_SET_HEIGHT || avl_is_eob(a)) {
+        op->leaves++;
+        return i;
+    }
+    probe_init(op->tree, &probe, avl_data(b));
+    frame->found = split(op->tree, a, ha, &probe, &l, &hl, &r, &hr);
+    frame->left = frame_split(op, l, hl, avl_left(b), left_height(b, hb),
+                              depth - 1);
+    frame->right = frame_split(op, r, hr, avl_right(b), right_height(b, hb),
+                               depth - 1);
+    return i;
+}
+
+static avl_node_t *frame_join(avl_setop_t *op, int i, avl_node_t **dropped,
+                              int *h) {
+    avl_frame_t *frame = &op->frames[i];
+    avl_node_t *l, *r, *keep, *last;
+    int hl, hr;
+    if (frame->left < 0) {
+        if (frame->dropped != NULL) {
+            for (last = frame->dropped; avl_right(last) != NULL;
+                 last = avl_right(last))
+                ;
+            avl_right(last) = *dropped;
+            *dropped = frame->dropped;
+        }
+        *h = frame->height;
+        return frame->result;
+    }
+    l = frame_join(op, frame->left, dropped, &hl);
+    r = frame_join(op, frame->right, dropped, &hr);
+    if ((keep = pick(op->other, op->type, frame->found, frame->b, dropped)) !=
+        NULL)
+        return join(op->tree, l, hl, keep, r, hr, h);
+    return join2(op->tree, l, hl, r, hr, h);
+}
+
+static int set_depth(workqueue_t *wq) {
+    int depth = 0;
+    // a few tasks per worker evens out subtrees of different sizes
+    while (depth < AVL_SET_DEPTH && (1 << depth) < 4 * workqueue_workers(wq))
+        depth++;
+    return depth;
+}
+
+static avl_node_t *combine_parallel(avl_tree_t *tree, avl_tree_t *other,
+                                    int type, avl_node_t *b, int hb,
+                                    workqueue_t *wq, avl_node_t **dropped) {
+    avl_setop_t *op;
+    avl_node_t *root;
+    int i, h;
+    if (wq == NULL || workqueue_workers(wq) == 0 || hb < AVL_SET_HEIGHT ||
+        (op = calloc(1, sizeof(avl_setop_t))) == NULL)
+        return combine(tree, other, type, avl_root(tree),
+                       height(avl_root(tree)), b, hb, dropped, &h);
+    op->tree = tree;
+    op->other = other;
+    op->type = type;
+    op->refs = 1;
+    pthread_mutex_init(&op->mutex, NULL);
+    pthread_cond_init(&op->cond, NULL);
+    frame_split(op, avl_root(tree), height(avl_root(tree)), b, hb,
+                set_depth(wq));
+
+    for (i = 0; i < op->count; i++) {
+        if (op->frames[i].left >= 0)
+            continue;
+        __atomic_fetch_add(&op->refs, 1, __ATOMIC_RELAXED);
+        if (workqueue_submit(wq, frame_job, &op->frames[i]) != 0)
+            __atomic_fetch_sub(&op->refs, 1, __ATOMIC_RELAXED);
+    }
+    // help out instead of blocking, the caller may be a worker itself
+    for (i = 0; i < op->count; i++)
+        if (op->frames[i].left < 0 &&
+            !__atomic_exchange_n(&op->frames[i].claimed, 1, __ATOMIC_ACQ_REL))
+            frame_run(&op->frames[i]);
+    pthread_mutex_lock(&op->mutex);
+    while (op->done < op->leaves)
+        pthread_cond_wait(&op->cond, &op->mutex);
+    pthread_mutex_unlock(&op->mutex);
+
+    root = frame_join(op, 0, dropped, &h);
+    debug(D_AVLTREE, "Ran set operation in %d tasks", op->leaves);
+    setop_put(op);
+    return root;
+}
+
+static long purge(avl_tree_t *tree, avl_node_t *dropped) {
+    avl_node_t *next;
+    long count = 0;
+    for (; dropped != NULL; dropped = next, count++) {
+        next = avl_right(dropped);
+        if (tree->index != NULL)
+            hashtable_remove(tree->index, avl_data(dropped));
+        release(tree, dropped);
+        node_free(tree, dropped);
+    }
+    return count;
+}
+
+static void lock_pair(avl_tree_t *tree, avl_tree_t *other, int write) {
+    // a fixed order keeps two calls with swapped trees from deadlocking
+    if (tree < other)
+        write_lock(tree);
+    if (write)
+        write_lock(other);
+    else
+        read_lock(other);
+    if (tree > other)
+        write_lock(tree);
+    return;
+}
+
+static void unlock_pair(avl_tree_t *tree, avl_tree_t *other) {
+    unlock(other);
+    unlock(tree);
+    return;
+}
+
+static int set_check(avl_tree_t *tree, avl_tree_t *other) {
+    if (!tree || !other) {
+        debug(D_AVLTREE, "Tree pointer cannot be NULL");
+        debug(D_AVLTREE, "Allocate tree first");
+        return -1;
+    }
+    if (tree == other) {
+        error("Cannot combine a tree with itself");
+        return -1;
+    }
+    if (tree->compare != other->compare) {
+        error("Cannot combine trees with different compare callbacks");
+        return -1;
+    }
+    return 0;
+}
+
+static long set_remove(avl_tree_t *tree, avl_tree_t *other, int type,
+                       workqueue_t *wq) {
+    avl_node_t *dropped = NULL;
+    long removed;
+    if (set_check(tree, other) != 0)
+        return -1;
+    lock_pair(tree, other, 0);
+    if (own_tree(tree, &avl_root(tree)) != 0) {
+        unlock_pair(tree, other);
+        return -1;
+    }
+    avl_root(tree) = combine_parallel(tree, other, type, avl_root(other),
+                                      height(avl_root(other)), wq, &dropped);
+    removed = purge(tree, dropped);
+    unlock_pair(tree, other);
+    tally(tree, AVL_STAT_REMOVE, removed);
+    debug(D_AVLTREE, "Removed %ld entries", removed);
+    return removed;
+}
+
+long avl_intersect(avl_tree_t *tree, avl_tree_t *other, workqueue_t *wq) {
+    debug(D_AVLTREE, "Intersecting trees");
+    return set_remove(tree, other, AVL_SET_INTERSECT, wq);
+}
+
+long avl_difference(avl_tree_t *tree, avl_tree_t *other, workqueue_t *wq) {
+    debug(D_AVLTREE, "Subtracting trees");
+    return set_remove(tree, other, AVL_SET_DIFFERENCE, wq);
+}
+
+static void adopt_undo(avl_tree_t *tree, avl_node_t **nodes, long count) {
+    while (count > 0) {
+        tree->bytes -= data_bytes(tree, avl_data(nodes[--count]));
+        node_free(tree, nodes[count]);
+    }
+    return;
+}
+
+// give the visible entries of other nodes of the tree, as a balanced tree
+static avl_node_t *adopt(avl_tree_t *tree, avl_tree_t *other,
+                         avl_node_t *vine, avl_node_t **nodes, long *count) {
+    avl_node_t head, *tail = &head, *node;
+    uint64_t expires;
+    probe_t probe;
+    for (*count = 0; vine != NULL; vine = avl_right(vine)) {
+        if (!visible(other, vine))
+            continue;
+        expires = avl_expires(vine) ? other->wheel->timers[vine->timer].expires
+                                    : 0;
+        probe_init(tree, &probe, avl_data(vine));
+        if ((expires != 0 && timer_reserve(tree) != 0) ||
+            (node = node_alloc(tree, &probe)) == NULL) {
+            adopt_undo(tree, nodes, *count);
+            return NULL;
+        }
+        if (expires != 0)
+            timer_start(tree, node, expires);
+        tree->size++;
+        nodes[(*count)++] = node;
+        avl_right(tail) = node;
+        tail = node;
+    }
+    avl_right(tail) = NULL;
+    node = avl_right(&head);
+    return vine_to_tree(tree, &node, *count);
+}
+
+long avl_union(avl_tree_t *tree, avl_tree_t *other, workqueue_t *wq) {
+    avl_node_t **nodes, *vine, *b, *dropped = NULL, *next;
+    long count, i;
+    debug(D_AVLTREE, "Merging trees");
+    if (set_check(tree, other) != 0)
+        return -1;
+    lock_pair(tree, other, 1);
+    if (snapshots(other)) {
+        unlock_pair(tree, other);
+        error("Cannot move entries out of a tree with snapshots");
+        return -1;
+    }
+    if (!countable(tree, avl_size(other))) {
+        unlock_pair(tree, other);
+        return -1;
+    }
+    // sized under the lock, other may grow until then
+    if ((nodes = malloc((avl_size(other) + 1) * sizeof(avl_node_t *))) ==
+        NULL) {
+        unlock_pair(tree, other);
+        error("Failed to allocate merge nodes");
+        return -1;
+    }
+    vine = tree_to_vine(avl_root(other));
+    // every insert below has room in the index once this succeeds
+    if ((tree->index != NULL &&
+         hashtable_reserve(tree->index,
+                           hashtable_size(tree->index) + avl_size(other)) !=
+             0) ||
+        own_tree(tree, &avl_root(tree)) != 0 ||
+        (b = adopt(tree, other, vine, nodes, &count)) == NULL) {
+        avl_root(other) = vine_to_tree(other, &vine, avl_size(other));
+        unlock_pair(tree, other);
+        free(nodes);
+        return -1;
+    }
+
+    avl_root(tree) = combine_parallel(tree, other, AVL_SET_UNION, b,
+                                      count_height(count), wq, &dropped);
+    purge(tree, dropped);
+    if (tree->index != NULL)
+        for (i = 0; i < count; i++)
+            if (!avl_expires(nodes[i]))
+                hashtable_insert(tree->index, avl_data(nodes[i]));
+
+    // other keeps nothing, the moved data now belongs to the tree
+    for (i = 0; vine != NULL; vine = next) {
+        next = avl_right(vine);
+        if (i < count && avl_data(vine) == avl_data(nodes[i])) {
+            if (other->index != NULL && !avl_expires(vine))
+                hashtable_remove(other->index, avl_data(vine));
+            other->bytes -= data_bytes(other, avl_data(vine));
+            i++;
+        } else {
+            release(other, vine);
+        }
+        node_free(other, vine);
+    }
+    avl_root(other) = NULL;
+    enforce(tree, NULL);
+    unlock_pair(tree, other);
+    free(nodes);
+    tally(tree, AVL_STAT_INSERT, count);
+    debug(D_AVLTREE, "Moved %ld entries", count);
+    return count;
 }
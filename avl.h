@@ -13,29 +13,332 @@
 #ifndef _BINARYTREE_BISTREE_H_
 #define _BINARYTREE_BISTREE_H_
 
-#include "bitree.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hashtable.h"
+#include "key.h"
 #include "log.h"
+#include "slab.h"
+#include "stats.h"
+#include "workqueue.h"
 
 #define AVL_LFT_HEAVY 1
 #define AVL_BALANCED 0
 #define AVL_RGT_HEAVY -1
 
+#define AVL_NODE_HIDDEN 0x01
+#define AVL_NODE_FREE 0x02
+#define AVL_NODE_COPIED 0x04
+
+/**< Number of nodes allocated at once by the node slab */
+#define AVL_SLAB_NODES 1024
+
+/**< Maximum tree height, enough for more than 2^40 nodes */
+#define AVL_MAX_HEIGHT 64
+
+/**< Spare nodes kept for path copying, enough for any single removal */
+#define AVL_SPARE_NODES (3 * AVL_MAX_HEIGHT)
+
+/**< Most entries a tree keeping subtree counts holds, hidden ones included */
+#define AVL_COUNT_MAX UINT32_MAX
+
+/**< Number of searches a batch lookup runs in lockstep */
+#define AVL_BATCH_WIDTH 8
+
+/**< Levels of a set operation split up front, at most 2^n worker tasks */
+#define AVL_SET_DEPTH 6
+
+/**< Smallest height of the other tree worth a worker task */
+#define AVL_SET_HEIGHT 10
+
+/**< Set operations */
+#define AVL_SET_UNION 0
+#define AVL_SET_INTERSECT 1
+#define AVL_SET_DIFFERENCE 2
+
+/**< Number of slots on every level of the expiry timer wheel, log2 */
+#define AVL_WHEEL_BITS 6
+#define AVL_WHEEL_SLOTS (1 << AVL_WHEEL_BITS)
+
+/**< Number of timer wheel levels, with millisecond ticks the wheel spans
+ * 2^30 ms, about 12 days. Later expiry times are parked on the top level. */
+#define AVL_WHEEL_LEVELS 5
+
+/**< Number of timers allocated when the wheel is created */
+#define AVL_WHEEL_TIMERS 64
+
+/**< Expired entries removed on the side of a single call, keeps the request
+ * path short when many entries expire at once */
+#define AVL_EXPIRE_BUDGET 32
+
+/**< Operation counters of the tree statistics */
+#define AVL_STAT_INSERT 0
+#define AVL_STAT_DUPLICATE 1
+#define AVL_STAT_HIT 2
+#define AVL_STAT_MISS 3
+#define AVL_STAT_REMOVE 4
+#define AVL_STAT_ROTATE 5
+#define AVL_STAT_COUNTERS 6
+
+/**< Latency histograms of the tree statistics */
+#define AVL_HIST_INSERT 0
+#define AVL_HIST_LOOKUP 1
+#define AVL_HIST_REMOVE 2
+#define AVL_HIST_COUNT 3
+
 /** @brief Definition of the avl node
  *
- *  This structure defines the avl tree node
+ *  This structure defines the avl tree node. Child pointers, balance factor
+ *  and flags live in the same allocation as the user data pointer, so a
+ *  lookup touches a single cache line per tree level. Nodes are carved out
+ *  of a per tree slab. With a built-in key mode the node caches the key, or
+ *  its first bytes, so most comparisons never touch the data. The epoch
+ *  tells whether a snapshot shares the node, shared nodes are never written.
+ *  The subtree count fills what used to be padding at the end of the node.
  *
  */
-typedef struct {
+typedef struct avl_node_ {
     /**< Node data */
     void *data;
-    /**< Set data hidden */
-    int hidden;
+    /**< Left node pointer */
+    struct avl_node_ *left;
+    /**< Right node pointer */
+    struct avl_node_ *right;
+    /**< Cached key, or big endian key prefix */
+    uint64_t key;
     /**< AVL Factor */
-    int factor;
+    signed char factor;
+    /**< Node flags (hidden, free, copied) */
+    unsigned char flags;
+    /**< Set by lookups, cleared by the eviction clock hand */
+    unsigned char ref;
+    /**< Expiry timer, 0 if the node does not expire */
+    uint32_t timer;
+    /**< Write epoch the node was created in */
+    uint32_t epoch;
+    /**< Entries in the subtree that are not hidden, kept once counted */
+    uint32_t count;
 } avl_node_t;
 
-/**< Macro to define avl_tree_t */
-#define avl_tree_t bitree_t
+/** @brief Definition of an expiry timer
+ *
+ *  This structure links a node with a time to live into a timer wheel slot.
+ *  Timers live in an array and are referenced by index, so the node only
+ *  needs 32 bits for it and stays the same size.
+ *
+ */
+typedef struct {
+    /**< Node that expires, NULL if the timer is free */
+    avl_node_t *node;
+    /**< Expiry time in milliseconds on the monotonic clock */
+    uint64_t expires;
+    /**< Next timer in the slot or on the free list, 0 for none */
+    uint32_t next;
+    /**< Previous timer in the slot, 0 for none */
+    uint32_t prev;
+    /**< Wheel slot holding the timer */
+    uint32_t slot;
+} avl_timer_t;
+
+/** @brief Definition of the expiry timer wheel
+ *
+ *  This structure contains a hierarchical timer wheel with millisecond
+ *  ticks. Level 0 holds the timers due within AVL_WHEEL_SLOTS ticks, every
+ *  next level covers AVL_WHEEL_SLOTS times as many ticks per slot and is
+ *  cascaded into the lower levels as time passes.
+ *
+ */
+typedef struct {
+    /**< Timers, entry 0 is unused so index 0 means none */
+    avl_timer_t *timers;
+    /**< Number of allocated timers */
+    uint32_t size;
+    /**< First free timer, 0 if none */
+    uint32_t free;
+    /**< Number of running timers */
+    long count;
+    /**< Next tick to process */
+    uint64_t tick;
+    /**< Occupied slots of every level, one bit per slot */
+    uint64_t used[AVL_WHEEL_LEVELS];
+    /**< First timer of every slot */
+    uint32_t slots[AVL_WHEEL_LEVELS * AVL_WHEEL_SLOTS];
+} avl_wheel_t;
+
+/** @brief Definition of a retired node or data
+ *
+ *  This structure holds memory the tree no longer uses but that snapshots
+ *  taken before it was retired may still read
+ *
+ */
+typedef struct {
+    /**< Retired node or data */
+    void *ptr;
+    /**< Write epoch it was retired in */
+    uint32_t epoch;
+    /**< Non zero for a node, zero for data */
+    int node;
+} avl_retired_t;
+
+/** @brief Definition of the snapshot bookkeeping
+ *
+ *  This structure tracks the snapshots of a tree. Every snapshot closes a
+ *  write epoch, nodes created in an epoch up to the newest snapshot are
+ *  shared and get copied before a writer changes them. What the copies
+ *  replace is retired and freed once the snapshots that could reach it are
+ *  released.
+ *
+ */
+typedef struct {
+    /**< Epoch of the nodes written now */
+    uint32_t epoch;
+    /**< Nodes with a lower epoch are shared, 0 if there are no snapshots */
+    uint32_t shared;
+    /**< Live snapshots, oldest first */
+    struct avl_snapshot_ *snapshots;
+    /**< Retired nodes and data, oldest first */
+    avl_retired_t *retired;
+    /**< Number of retired entries */
+    long retired_count;
+    /**< Number of allocated retired entries */
+    long retired_size;
+    /**< Nodes set aside so copying cannot fail half way through a change */
+    avl_node_t *spare[AVL_SPARE_NODES];
+    /**< Number of spare nodes */
+    int spares;
+} avl_versions_t;
+
+/** @brief Definition of the avl tree
+ *
+ *  This structure contains all avl tree data
+ *
+ */
+typedef struct {
+    /**< This avl tree size */
+    long size;
+    /**< Compare callback function */
+    int (*compare)(const void *key1, const void *key2);
+    /**< Destroy data callback function */
+    void (*destroy)(void *data);
+    /**< Tree root node pointer */
+    avl_node_t *root;
+    /**< Key mode */
+    avl_key_t key;
+    /**< Node allocator */
+    slab_t *nodes;
+    /**< Optional hash index on the visible entries */
+    hashtable_t *index;
+    /**< Reader-writer lock, NULL unless in concurrent mode */
+    pthread_rwlock_t *lock;
+    /**< Expiry timer wheel, NULL until data with a time to live is inserted */
+    avl_wheel_t *wheel;
+    /**< Data size callback, NULL to only account nodes */
+    size_t (*data_size)(const void *data);
+    /**< Bytes used by the nodes and their data */
+    size_t bytes;
+    /**< Memory budget in bytes, 0 for no limit */
+    size_t budget;
+    /**< Eviction clock hand */
+    slab_hand_t hand;
+    /**< Number of evicted entries */
+    unsigned long evicted;
+    /**< Number of hidden nodes in the tree */
+    long hidden;
+    /**< Operation counters and latency histograms, NULL if not enabled */
+    stats_t *stats;
+    /**< Snapshot bookkeeping, NULL until the first snapshot */
+    avl_versions_t *versions;
+    /**< Non zero once the nodes keep subtree counts */
+    int counted;
+} avl_tree_t;
+
+/** @brief Definition of an avl snapshot
+ *
+ *  This structure holds a read-only version of the tree. It shares its
+ *  nodes with the live tree, writers copy the nodes they change instead.
+ *  Reading a snapshot takes no lock, entries with a time to live are seen
+ *  as they were when it was taken.
+ *
+ */
+typedef struct avl_snapshot_ {
+    /**< Tree the snapshot was taken of */
+    avl_tree_t *tree;
+    /**< Root node of this version */
+    avl_node_t *root;
+    /**< Number of nodes in this version */
+    long size;
+    /**< Last write epoch this version contains */
+    uint32_t epoch;
+    /**< Next newer snapshot */
+    struct avl_snapshot_ *next;
+} avl_snapshot_t;
+
+/** @brief Definition of the avl tree statistics
+ *
+ *  This structure contains the operation counters, the latency summaries
+ *  and the shape of the tree at the time it was filled
+ *
+ */
+typedef struct {
+    /**< Number of inserted entries */
+    unsigned long inserts;
+    /**< Number of inserts refused because the key exists */
+    unsigned long duplicates;
+    /**< Number of lookups that found an entry */
+    unsigned long hits;
+    /**< Number of lookups that found nothing */
+    unsigned long misses;
+    /**< Number of removed entries */
+    unsigned long removes;
+    /**< Number of single and double rotations */
+    unsigned long rotations;
+    /**< Number of evicted entries */
+    unsigned long evicted;
+    /**< Insert latency in nanoseconds, one in STATS_SAMPLE inserts */
+    stats_summary_t insert;
+    /**< Lookup latency in nanoseconds, one in STATS_SAMPLE lookups */
+    stats_summary_t lookup;
+    /**< Remove latency in nanoseconds, one in STATS_SAMPLE removes */
+    stats_summary_t remove;
+    /**< Number of nodes */
+    long size;
+    /**< Number of hidden nodes */
+    long hidden;
+    /**< Number of expired nodes not yet reclaimed */
+    long expired;
+    /**< Height of the tree */
+    int height;
+    /**< Average depth of the visible entries, the root being at depth 1 */
+    double depth;
+    /**< Bytes used by the nodes and their data */
+    size_t bytes;
+} avl_stats_t;
+
+/** @brief Definition of the avl cursor
+ *
+ *  This structure holds a position in the tree for in-order traversal. The
+ *  path from the root to the current node is kept on an explicit stack, so
+ *  stepping in both directions needs no parent pointers or recursion. A
+ *  cursor is invalidated by any change to the tree, in concurrent mode the
+ *  cursor user has to hold the read lock. A cursor on a snapshot stays
+ *  valid until the snapshot is released and needs no lock.
+ *
+ */
+typedef struct {
+    /**< Tree the cursor walks */
+    avl_tree_t *tree;
+    /**< Snapshot the cursor walks, NULL for the live tree */
+    avl_snapshot_t *snapshot;
+    /**< Path from the root to the current node */
+    avl_node_t *path[AVL_MAX_HEIGHT];
+    /**< Number of nodes on the path, 0 if the cursor is not positioned */
+    int depth;
+} avl_cursor_t;
 
 /** @brief Initialise the avl tree
  *
@@ -48,6 +351,31 @@ typedef struct {
 avl_tree_t *avl_init(int (*compare)(const void *key1, const void *key2),
               void (*destroy)(void *data));
 
+/** @brief Initialise the avl tree with a built-in key mode
+ *
+ *  This function initialises an avl tree that compares keys inline instead
+ *  of through the compare callback on the search path. The compare callback
+ *  is still used for scans and sorting and has to order data the same way
+ *  as the key mode.
+ *
+ *  @param compare Data compare callback
+ *  @param key Key mode description
+ *  @param destroy Destroy data callback
+ *
+ *  @return Pointer to the tree, NULL if failed
+ */
+avl_tree_t *avl_init_key(int (*compare)(const void *key1, const void *key2),
+                         const avl_key_t *key, void (*destroy)(void *data));
+
+/** @brief Destroy the avl tree
+ *
+ *  This function calls the destroy callback on the stored data, releases
+ *  the node slabs at once and frees the tree itself
+ *
+ *  @param tree Pointer to an avl tree
+ */
+void avl_destroy(avl_tree_t *tree);
+
 /** @brief Insert data into avl tree
  *
  *  This function inserts data into an avl tree
@@ -59,9 +387,59 @@ avl_tree_t *avl_init(int (*compare)(const void *key1, const void *key2),
  */
 int avl_insert(avl_tree_t *tree, const void *data);
 
+/** @brief Insert data with a time to live into the avl tree
+ *
+ *  This function inserts data like avl_insert does and lets it expire after
+ *  ttl milliseconds. An expired entry is skipped by lookups and scans right
+ *  away and can be replaced by a later insert of the same key. Its node is
+ *  reclaimed by avl_expire. Entries with a time to live are kept out of the
+ *  hash index, index lookups that miss fall back to the tree while any are
+ *  in the tree.
+ *
+ *  @param tree Pointer to the tree in which it will insert data
+ *  @param data Void pointer to the data that will be inserted
+ *  @param ttl Time to live in milliseconds, 0 to never expire
+ *
+ *  @return 0 if successful, 1 if the data already exists, -1 if failed
+ */
+int avl_insert_ttl(avl_tree_t *tree, const void *data, long ttl);
+
+/** @brief Reclaim expired entries
+ *
+ *  Advance the expiry timer wheel to the current time and remove up to
+ *  budget expired entries, calling the destroy callback on their data.
+ *  Only the timers that are due are touched, so the cost is proportional
+ *  to the number of expired entries and not to the tree size. Call it
+ *  from a background job with a small budget, the write lock is held for
+ *  one call.
+ *
+ *  @param tree Pointer to the avl tree
+ *  @param budget Maximum number of entries to remove
+ *
+ *  @return Number of removed entries, -1 if failed. Less than budget means
+ *  the wheel caught up with the clock.
+ */
+long avl_expire(avl_tree_t *tree, long budget);
+
+/** @brief Insert an array of data into the avl tree
+ *
+ *  This function builds a perfectly balanced tree out of an array of data
+ *  in linear time. An unsorted array is sorted in place first. Entries
+ *  already in the tree are merged in the same pass, hidden entries with a
+ *  matching key are replaced.
+ *
+ *  @param tree Pointer to the tree in which it will insert data
+ *  @param items Array of pointers to the data that will be inserted
+ *  @param count Number of entries in the array
+ *
+ *  @return 0 if successful, 1 if a key is duplicated, -1 if failed
+ */
+int avl_bulk_load(avl_tree_t *tree, void **items, long count);
+
 /** @brief Remove data from tree
  *
- *  Remove a node containing given data from the tree
+ *  Remove a node containing given data from the tree, rebalance the tree
+ *  and call the destroy callback on the stored data
  *
  *  @param tree Pointer to the avl tree
  *  @param data Reference data that has to be removed
@@ -70,9 +448,49 @@ int avl_insert(avl_tree_t *tree, const void *data);
  */
 int avl_remove(avl_tree_t *tree, const void *data);
 
+/** @brief Hide data in the tree
+ *
+ *  Mark the node containing given data as hidden without removing it. A
+ *  hidden node is skipped by lookups and reused by a later insert of the
+ *  same key. Hidden nodes are purged by avl_compact.
+ *
+ *  @param tree Pointer to the avl tree
+ *  @param data Reference data that has to be hidden
+ *
+ *  @return 0 if successful, -1 if failed
+ */
+int avl_hide(avl_tree_t *tree, const void *data);
+
+/** @brief Replace data in the tree
+ *
+ *  Swap the data of the visible entry equal to given data for it and call
+ *  the destroy callback on the old data. The entry keeps its place and time
+ *  to live. Snapshots taken before still read the old data: with a destroy
+ *  callback it is destroyed once they are released, without one the caller
+ *  has to keep it until then.
+ *
+ *  @param tree Pointer to the avl tree
+ *  @param data Data that replaces the equal entry
+ *
+ *  @return 0 if successful, -1 if failed or not found
+ */
+int avl_replace(avl_tree_t *tree, const void *data);
+
+/** @brief Purge all hidden nodes
+ *
+ *  Remove all hidden nodes from the tree and rebuild it as a perfectly
+ *  balanced tree in a single linear pass
+ *
+ *  @param tree Pointer to the avl tree
+ *
+ *  @return Number of purged nodes, -1 if failed
+ */
+long avl_compact(avl_tree_t *tree);
+
 /** @brief Lookup data in the tree
  *
- *  This functions looks for a node with data that matches given reference data
+ *  This functions looks for a node with data that matches given reference data.
+ *  The lookup is served from the hash index when one is enabled.
  *
  *  @param tree Pointer to the avl tree
  *  @param data Pointer to a data reference
@@ -81,7 +499,435 @@ int avl_remove(avl_tree_t *tree, const void *data);
  */
 int avl_lookup(avl_tree_t *tree, void **data);
 
+/** @brief Lookup a batch of data in the tree
+ *
+ *  This function looks up every reference data of the batch like
+ *  avl_lookup does. Up to AVL_BATCH_WIDTH searches descend the tree in
+ *  lockstep and each one prefetches its next node, so the cache misses of
+ *  different searches overlap instead of following each other.
+ *
+ *  @param tree Pointer to the avl tree
+ *  @param data Array of data references, found entries are replaced by the
+ *  stored data
+ *  @param count Number of data references
+ *  @param status Set to 0 for every found entry and -1 for every miss
+ *
+ *  @return Number of entries found, -1 if failed
+ */
+long avl_lookup_batch(avl_tree_t *tree, void **data, long count, int *status);
+
+/** @brief Insert a batch of data in the tree
+ *
+ *  This function inserts every data of the batch like avl_insert does. The
+ *  batch is inserted in key order under a single lock so consecutive
+ *  inserts descend through the same, cache hot, upper levels.
+ *
+ *  @param tree Pointer to the avl tree
+ *  @param data Array of data to insert
+ *  @param count Number of data
+ *  @param status Set to the avl_insert return value of every data
+ *
+ *  @return Number of entries inserted, -1 if failed
+ */
+long avl_insert_batch(avl_tree_t *tree, void **data, long count, int *status);
+
+/** @brief Cap the memory used by the tree
+ *
+ *  Account the bytes of every node and of the data it holds, and evict
+ *  entries once a change pushes the total over the budget. Eviction follows
+ *  the CLOCK policy: a hand sweeps the nodes in memory order, skips the
+ *  ones looked up since it last passed and evicts the first one that was
+ *  not, calling the destroy callback on its data. Expired and then hidden
+ *  entries go before any visible one: up to AVL_EXPIRE_BUDGET due entries
+ *  are taken off the timer wheel, the hand removes the other expired ones
+ *  it passes. An insert never evicts the entry it adds, inserting data
+ *  that alone exceeds the budget fails instead.
+ *  Lookups served by the hash index do not mark the entries they hit. The
+ *  size callback has to return the same size for as long as data is in the
+ *  tree.
+ *
+ *  @param tree Pointer to the avl tree
+ *  @param budget Memory budget in bytes, 0 for no limit
+ *  @param size Data size callback, NULL to only account nodes
+ *
+ *  @return 0 if successful, -1 if failed
+ */
+int avl_budget(avl_tree_t *tree, size_t budget,
+               size_t (*size)(const void *data));
+
+/** @brief Enable the tree statistics
+ *
+ *  Count operations and record the latency of a sample of them. Every
+ *  thread counts into its own stripe, so the counters add no contention.
+ *  Like avl_concurrent, enable the statistics before the tree is shared
+ *  between threads.
+ *
+ *  @param tree Pointer to the avl tree
+ *
+ *  @return 0 if successful, -1 if failed
+ */
+int avl_stats_enable(avl_tree_t *tree);
+
+/** @brief Retrieve the tree statistics
+ *
+ *  Aggregate the counters and walk the tree for its shape under the read
+ *  lock. The walk visits every node, so the cost grows with the tree. The
+ *  counters are zero unless the statistics are enabled.
+ *
+ *  @param tree Pointer to the avl tree
+ *  @param stats Filled with the statistics
+ *
+ *  @return 0 if successful, -1 if failed
+ */
+int avl_stats(avl_tree_t *tree, avl_stats_t *stats);
+
+/** @brief Write the tree statistics
+ *
+ *  Write the statistics as one JSON object on a single line, or as one
+ *  name and value per line
+ *
+ *  @param tree Pointer to the avl tree
+ *  @param out Stream to write to
+ *  @param json Non zero for JSON, zero for text
+ *
+ *  @return 0 if successful, -1 if failed
+ */
+int avl_stats_dump(avl_tree_t *tree, FILE *out, int json);
+
+/** @brief Maintain a hash index next to the tree
+ *
+ *  Build a hash index on all visible entries and keep it up to date on
+ *  every change to the tree. Once enabled, avl_lookup is served from the
+ *  index in constant time, ordered operations keep using the tree. Data
+ *  that compares equal has to hash to the same value.
+ *
+ *  @param tree Pointer to the avl tree
+ *  @param hash Data hash callback, NULL to drop the index
+ *
+ *  @return 0 if successful, -1 if failed
+ */
+int avl_index(avl_tree_t *tree, unsigned long (*hash)(const void *data));
+
+/** @brief Enable concurrent mode
+ *
+ *  Protect the tree with a reader-writer lock. Lookups and scans then run
+ *  in parallel from any number of threads, while changes to the tree are
+ *  serialised against them. Concurrent mode cannot be disabled again.
+ *
+ *  @param tree Pointer to the avl tree
+ *
+ *  @return 0 if successful, -1 if failed
+ */
+int avl_concurrent(avl_tree_t *tree);
+
+/** @brief Keep subtree counts for order statistics
+ *
+ *  Count the entries below every node and keep the counts up to date on
+ *  every change to the tree, so avl_rank, avl_select and avl_count_range
+ *  run in logarithmic time. Counting costs every change a few extra node
+ *  reads on the path it walks and cannot be disabled again. The counts are
+ *  32 bits wide, so a counted tree holds at most AVL_COUNT_MAX entries and
+ *  inserts past that fail.
+ *
+ *  @param tree Pointer to the avl tree
+ *
+ *  @return 0 if successful, -1 if failed
+ */
+int avl_order(avl_tree_t *tree);
+
+/** @brief Take the tree read lock
+ *
+ *  Take the read lock around cursor use in concurrent mode. Does nothing
+ *  if the tree is not in concurrent mode.
+ *
+ *  @param tree Pointer to the avl tree
+ */
+void avl_read_lock(avl_tree_t *tree);
+
+/** @brief Release the tree read lock
+ *
+ *  @param tree Pointer to the avl tree
+ */
+void avl_read_unlock(avl_tree_t *tree);
+
+/** @brief Initialise a cursor
+ *
+ *  This function initialises an unpositioned cursor on a tree
+ *
+ *  @param cursor Pointer to the cursor
+ *  @param tree Pointer to the avl tree
+ */
+void avl_cursor_init(avl_cursor_t *cursor, avl_tree_t *tree);
+
+/** @brief Move the cursor to the first entry
+ *
+ *  @param cursor Pointer to the cursor
+ *
+ *  @return 0 if successful, -1 if the tree holds no visible entries
+ */
+int avl_cursor_first(avl_cursor_t *cursor);
+
+/** @brief Move the cursor to the last entry
+ *
+ *  @param cursor Pointer to the cursor
+ *
+ *  @return 0 if successful, -1 if the tree holds no visible entries
+ */
+int avl_cursor_last(avl_cursor_t *cursor);
+
+/** @brief Move the cursor to the first entry greater or equal to data
+ *
+ *  @param cursor Pointer to the cursor
+ *  @param data Reference data to seek to
+ *
+ *  @return 0 if successful, -1 if there is no such entry
+ */
+int avl_cursor_seek(avl_cursor_t *cursor, const void *data);
+
+/** @brief Move the cursor to the next entry
+ *
+ *  @param cursor Pointer to the cursor
+ *
+ *  @return 0 if successful, -1 if the cursor moved past the last entry
+ */
+int avl_cursor_next(avl_cursor_t *cursor);
+
+/** @brief Move the cursor to the previous entry
+ *
+ *  @param cursor Pointer to the cursor
+ *
+ *  @return 0 if successful, -1 if the cursor moved before the first entry
+ */
+int avl_cursor_prev(avl_cursor_t *cursor);
+
+/** @brief Call a callback for every entry in a range
+ *
+ *  Walk all visible entries between lo and hi (both inclusive) in order.
+ *  The walk stops early when the callback returns non zero.
+ *
+ *  @param tree Pointer to the avl tree
+ *  @param lo Lower bound reference data, NULL for no lower bound
+ *  @param hi Upper bound reference data, NULL for no upper bound
+ *  @param callback Callback called for every entry
+ *  @param arg Argument passed to the callback
+ *
+ *  @return Number of visited entries, -1 if failed
+ */
+long avl_range(avl_tree_t *tree, const void *lo, const void *hi,
+               int (*callback)(void *data, void *arg), void *arg);
+
+/** @brief Call a callback for every entry matching a prefix
+ *
+ *  Walk all visible entries starting at the first entry greater or equal
+ *  to prefix for as long as match returns non zero. The prefix reference
+ *  data has to sort before all entries it matches, which holds for string
+ *  keys compared with strcmp.
+ *
+ *  @param tree Pointer to the avl tree
+ *  @param prefix Reference data holding the prefix
+ *  @param match Callback returning non zero if data matches the prefix
+ *  @param callback Callback called for every entry
+ *  @param arg Argument passed to the callback
+ *
+ *  @return Number of visited entries, -1 if failed
+ */
+long avl_prefix(avl_tree_t *tree, const void *prefix,
+                int (*match)(const void *prefix, const void *data),
+                int (*callback)(void *data, void *arg), void *arg);
+
+/** @brief Count the entries ordered before reference data
+ *
+ *  Hidden entries are not counted. Entries whose time to live elapsed are
+ *  counted until they are removed: when any are due, the call first takes
+ *  the write lock and removes up to AVL_EXPIRE_BUDGET of them, so the
+ *  count only disagrees with avl_lookup while more are due at once.
+ *  Needs avl_order.
+ *
+ *  @param tree Pointer to the avl tree
+ *  @param data Reference data, it does not have to be in the tree
+ *
+ *  @return Rank of the reference data, -1 if failed
+ */
+long avl_rank(avl_tree_t *tree, const void *data);
+
+/** @brief Find the entry at a position
+ *
+ *  Find the entry with the given number of entries ordered before it, so
+ *  avl_select of avl_rank returns the entry itself. Hidden entries are
+ *  skipped and expired ones counted as in avl_rank, an expired entry at the
+ *  position is not returned. Needs avl_order.
+ *
+ *  @param tree Pointer to the avl tree
+ *  @param index Position of the entry, starting at 0
+ *  @param data Pointer that receives the data of the entry
+ *
+ *  @return 0 if successful, -1 if failed, out of range or expired
+ */
+int avl_select(avl_tree_t *tree, long index, void **data);
+
+/** @brief Count the entries in a range
+ *
+ *  Count the entries between lo and hi (both inclusive) without walking
+ *  them, with the same bounds as avl_range. Hidden entries are not counted
+ *  and expired ones are counted as in avl_rank. Needs avl_order.
+ *
+ *  @param tree Pointer to the avl tree
+ *  @param lo Lower bound reference data, NULL for no lower bound
+ *  @param hi Upper bound reference data, NULL for no upper bound
+ *
+ *  @return Number of entries in the range, -1 if failed
+ */
+long avl_count_range(avl_tree_t *tree, const void *lo, const void *hi);
+
+/** @brief Take a snapshot of the avl tree
+ *
+ *  This function returns a read-only version of the tree as it is now,
+ *  without copying it. Up to AVL_EXPIRE_BUDGET entries past their time to
+ *  live are removed first, readers of the snapshot do not look at the
+ *  clock, so expired entries left over are still visible in it. Call
+ *  avl_expire beforehand for a snapshot without them. Writers then copy
+ *  the path to every node they change, so the snapshot costs memory in
+ *  proportion to the writes made while it is held. The snapshot has to be
+ *  released before the tree is destroyed.
+ *
+ *  @param tree Pointer to the avl tree
+ *
+ *  @return Pointer to the snapshot, NULL if failed
+ */
+avl_snapshot_t *avl_snapshot(avl_tree_t *tree);
+
+/** @brief Release an avl snapshot
+ *
+ *  This function releases a snapshot and frees the nodes and data that
+ *  only it still shared
+ *
+ *  @param snap Pointer to the snapshot
+ */
+void avl_snapshot_release(avl_snapshot_t *snap);
+
+/** @brief Lookup data in an avl snapshot
+ *
+ *  @param snap Pointer to the snapshot
+ *  @param data Pointer to the reference data, replaced by the found data
+ *
+ *  @return 0 if found, -1 if not
+ */
+int avl_snapshot_lookup(avl_snapshot_t *snap, void **data);
+
+/** @brief Initialise a cursor on a snapshot
+ *
+ *  This function initialises an unpositioned cursor on a snapshot, it is
+ *  moved with the same functions as a cursor on the tree
+ *
+ *  @param cursor Pointer to the cursor
+ *  @param snap Pointer to the snapshot
+ */
+void avl_snapshot_cursor_init(avl_cursor_t *cursor, avl_snapshot_t *snap);
+
+/** @brief Call a callback for every entry in a range of a snapshot
+ *
+ *  Same as avl_range, but walks the version held by the snapshot and
+ *  takes no lock
+ *
+ *  @param snap Pointer to the snapshot
+ *  @param lo Lower bound reference data, NULL for no lower bound
+ *  @param hi Upper bound reference data, NULL for no upper bound
+ *  @param callback Callback called for every entry
+ *  @param arg Argument passed to the callback
+ *
+ *  @return Number of visited entries, -1 if failed
+ */
+long avl_snapshot_range(avl_snapshot_t *snap, const void *lo, const void *hi,
+                        int (*callback)(void *data, void *arg), void *arg);
+
+/** @brief Move all entries of another tree into the avl tree
+ *
+ *  Adds every visible entry of other to the tree, an entry of other
+ *  replaces an equal one in the tree. Other is left empty, its hidden and
+ *  expired entries are destroyed. Both trees need the same compare
+ *  callback and other cannot have snapshots. Runs in O(m log(n/m + 1))
+ *  for m entries in other and n in the tree, with split and join on
+ *  independent subtrees. While the tree has snapshots its nodes are copied
+ *  first, which takes O(n).
+ *
+ *  @param tree Pointer to the avl tree
+ *  @param other Pointer to the avl tree to move the entries from
+ *  @param wq Worker queue that runs independent subtrees, NULL to run on
+ *  the calling thread
+ *
+ *  @return Number of entries moved, -1 if failed
+ */
+long avl_union(avl_tree_t *tree, avl_tree_t *other, workqueue_t *wq);
+
+/** @brief Keep only the entries another tree holds as well
+ *
+ *  Removes every entry of the tree without a visible equal entry in
+ *  other. Other is not changed. Runs in the time of avl_union.
+ *
+ *  @param tree Pointer to the avl tree
+ *  @param other Pointer to the avl tree to compare with
+ *  @param wq Worker queue that runs independent subtrees, NULL to run on
+ *  the calling thread
+ *
+ *  @return Number of entries removed, -1 if failed
+ */
+long avl_intersect(avl_tree_t *tree, avl_tree_t *other, workqueue_t *wq);
+
+/** @brief Remove the entries another tree holds as well
+ *
+ *  Removes every entry of the tree with a visible equal entry in other.
+ *  Other is not changed. Runs in the time of avl_union.
+ *
+ *  @param tree Pointer to the avl tree
+ *  @param other Pointer to the avl tree to compare with
+ *  @param wq Worker queue that runs independent subtrees, NULL to run on
+ *  the calling thread
+ *
+ *  @return Number of entries removed, -1 if failed
+ */
+long avl_difference(avl_tree_t *tree, avl_tree_t *other, workqueue_t *wq);
+
 /**< Macro for accessing tree size */
 #define avl_size(tree) ((tree)->size)
 
+/**< Macro to retrieve the root of a tree */
+#define avl_root(tree) ((tree)->root)
+
+/**< Macro to check if node is the end of a branch */
+#define avl_is_eob(node) ((node) == NULL)
+
+/**< Macro to check if the node is hidden */
+#define avl_is_hidden(node) ((node)->flags & AVL_NODE_HIDDEN)
+
+/**< Macro to retrieve the bytes used by the nodes and their data */
+#define avl_bytes(tree) ((tree)->bytes)
+
+/**< Macro to retrieve the number of evicted entries */
+#define avl_evicted(tree) ((tree)->evicted)
+
+/**< Macro to check if the node has a time to live */
+#define avl_expires(node) ((node)->timer != 0)
+
+/**< Macro to retrieve the number of entries with a time to live */
+#define avl_timers(tree) ((tree)->wheel != NULL ? (tree)->wheel->count : 0)
+
+/**< Macro to retrieve the number of nodes in a snapshot */
+#define avl_snapshot_size(snap) ((snap)->size)
+
+/**< Macro to retrieve data from a node */
+#define avl_data(node) ((node)->data)
+
+/**< Macro to retrieve the left branch */
+#define avl_left(node) ((node)->left)
+
+/**< Macro to retrieve the right branch */
+#define avl_right(node) ((node)->right)
+
+/**< Macro to check if a cursor points at an entry */
+#define avl_cursor_valid(cursor) ((cursor)->depth > 0)
+
+/**< Macro to retrieve the data a cursor points at */
+#define avl_cursor_data(cursor)                                                \
+    (avl_data((cursor)->path[(cursor)->depth - 1]))
+
 #endif
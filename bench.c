@@ -0,0 +1,726 @@
+/** @file bench.c
+ *  @brief Throughput and latency benchmarks for the database.
+ *
+ *  This file contains the memdb-bench program. It runs insert, lookup,
+ *  remove and mixed workloads against an avl tree or a B+tree and prints one
+ *  JSON object per workload, so results can be compared between builds.
+ *
+ *  @author Bram Vlerick (bram.vlerick@ucast.be)
+ *  @bug
+ *  * None at the moment
+ */
+
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "avl.h"
+#include "bptree.h"
+#include "log.h"
+#include "memdb.h"
+#include "record.h"
+
+/**< Fixed size record with 200 byte key and value arrays */
+struct key_value_t {
+    char key[200];
+    char val[200];
+};
+
+enum { DIST_UNIFORM, DIST_ZIPF, DIST_SEQ };
+enum { RECORD_INT, RECORD_KV, RECORD_REC };
+enum { ENGINE_AVL, ENGINE_BPTREE };
+
+typedef struct {
+    long keys;
+    long ops;
+    int dist;
+    int record;
+    int engine;
+    double theta;
+    int read_pct;
+    int index;
+    int key;
+    unsigned long seed;
+    const char *workloads;
+    const char *wal;
+    long wal_delay;
+    int threads;
+    long batch;
+} bench_opts_t;
+
+typedef struct {
+    /**< Stored records, slot i holds key 2 * i */
+    void **data;
+    /**< Probe records for hits, slot i matches data[i] */
+    void **hit;
+    /**< Probe records for misses, slot i holds key 2 * i + 1 */
+    void **miss;
+    /**< Order in which records are inserted and removed */
+    long *order;
+    /**< Latency samples in nanoseconds */
+    unsigned long *lat;
+} bench_data_t;
+
+/**< Tree under test, exactly one engine is set */
+typedef struct {
+    avl_tree_t *avl;
+    bptree_t *bptree;
+} bench_tree_t;
+
+typedef struct {
+    const bench_opts_t *opts;
+    bench_data_t *bd;
+    memdb_t *db;
+    int id;
+    long failed;
+} durable_arg_t;
+
+typedef struct {
+    double alpha, zetan, eta, theta;
+    long n;
+} zipf_t;
+
+static unsigned long rng_state;
+static record_arena_t *arena;
+
+static unsigned long rng_next(void) {
+    // splitmix64, so runs are reproducible for a given seed
+    unsigned long z = (rng_state += 0x9e3779b97f4a7c15UL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9UL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebUL;
+    return z ^ (z >> 31);
+}
+
+static double rng_double(void) {
+    return (rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void zipf_init(zipf_t *zipf, long n, double theta) {
+    double zeta2 = 0;
+    long i;
+    zipf->n = n;
+    zipf->theta = theta;
+    zipf->zetan = 0;
+    for (i = 1; i <= n; i++)
+        zipf->zetan += 1.0 / pow((double)i, theta);
+    for (i = 1; i <= 2 && i <= n; i++)
+        zeta2 += 1.0 / pow((double)i, theta);
+    zipf->alpha = 1.0 / (1.0 - theta);
+    zipf->eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / zipf->zetan);
+}
+
+static long zipf_next(zipf_t *zipf) {
+    double u = rng_double(), uz = u * zipf->zetan;
+    long rank;
+    if (uz < 1.0)
+        rank = 0;
+    else if (uz < 1.0 + pow(0.5, zipf->theta))
+        rank = 1;
+    else
+        rank = (long)(zipf->n * pow(zipf->eta * u - zipf->eta + 1.0,
+                                    zipf->alpha));
+    if (rank >= zipf->n)
+        rank = zipf->n - 1;
+    // scatter the hot ranks over the key space
+    return (long)((rank * 0x9e3779b97f4a7c15UL) % (unsigned long)zipf->n);
+}
+
+static long pick(const bench_opts_t *opts, zipf_t *zipf, long i) {
+    switch (opts->dist) {
+    case DIST_SEQ:
+        return i % opts->keys;
+    case DIST_ZIPF:
+        return zipf_next(zipf);
+    default:
+        return rng_next() % opts->keys;
+    }
+}
+
+static int compare_int(const void *k1, const void *k2) {
+    long x1 = (long)(intptr_t)k1, x2 = (long)(intptr_t)k2;
+    return x1 < x2 ? -1 : x1 > x2;
+}
+
+static unsigned long hash_int(const void *k) {
+    return (unsigned long)(intptr_t)k;
+}
+
+static int compare_kv(const void *k1, const void *k2) {
+    return strcmp(((const struct key_value_t *)k1)->key,
+                  ((const struct key_value_t *)k2)->key);
+}
+
+static unsigned long hash_kv(const void *k) {
+    const char *key = ((const struct key_value_t *)k)->key;
+    return hashtable_hash_bytes(key, strlen(key));
+}
+
+static const char *key_kv(const void *k, size_t *len) {
+    const char *key = ((const struct key_value_t *)k)->key;
+    *len = strlen(key);
+    return key;
+}
+
+static void *make_record(const bench_opts_t *opts, long key) {
+    struct key_value_t *kv;
+    char kbuf[32], vbuf[32];
+    int klen, vlen;
+    void *rec;
+    switch (opts->record) {
+    case RECORD_INT:
+        return (void *)(intptr_t)key;
+    case RECORD_REC:
+        klen = snprintf(kbuf, sizeof(kbuf), "key%016ld", key);
+        vlen = snprintf(vbuf, sizeof(vbuf), "value of key %ld", key);
+        if ((rec = record_new(arena, kbuf, klen, vbuf, vlen)) == NULL)
+            fatal("Failed to allocate record");
+        return rec;
+    }
+    if ((kv = malloc(sizeof(struct key_value_t))) == NULL)
+        fatal("Failed to allocate record");
+    snprintf(kv->key, sizeof(kv->key), "key%016ld", key);
+    snprintf(kv->val, sizeof(kv->val), "value of key %ld", key);
+    return kv;
+}
+
+static void free_records(const bench_opts_t *opts, void **records) {
+    long i;
+    if (opts->record == RECORD_KV) {
+        for (i = 0; i < opts->keys; i++)
+            free(records[i]);
+    }
+    free(records);
+}
+
+static void bench_data_init(const bench_opts_t *opts, bench_data_t *bd) {
+    long i, j, tmp;
+    bd->data = malloc(opts->keys * sizeof(void *));
+    bd->hit = malloc(opts->keys * sizeof(void *));
+    bd->miss = malloc(opts->keys * sizeof(void *));
+    bd->order = malloc(opts->keys * sizeof(long));
+    bd->lat = malloc((opts->ops > opts->keys ? opts->ops : opts->keys) *
+                     sizeof(unsigned long));
+    if (!bd->data || !bd->hit || !bd->miss || !bd->order || !bd->lat)
+        fatal("Failed to allocate benchmark data");
+    for (i = 0; i < opts->keys; i++) {
+        bd->data[i] = make_record(opts, 2 * i);
+        bd->hit[i] = make_record(opts, 2 * i);
+        bd->miss[i] = make_record(opts, 2 * i + 1);
+        bd->order[i] = i;
+    }
+    if (opts->dist != DIST_SEQ) {
+        for (i = opts->keys - 1; i > 0; i--) {
+            j = rng_next() % (i + 1);
+            tmp = bd->order[i];
+            bd->order[i] = bd->order[j];
+            bd->order[j] = tmp;
+        }
+    }
+}
+
+static void bench_data_free(const bench_opts_t *opts, bench_data_t *bd) {
+    free_records(opts, bd->data);
+    free_records(opts, bd->hit);
+    free_records(opts, bd->miss);
+    free(bd->order);
+    free(bd->lat);
+}
+
+static bench_tree_t new_tree(const bench_opts_t *opts) {
+    bench_tree_t tree = {NULL, NULL};
+    static int (*compare[])(const void *, const void *) = {
+        compare_int, compare_kv, record_compare};
+    static unsigned long (*hash[])(const void *) = {hash_int, hash_kv,
+                                                    record_hash};
+    static const char *(*bytes[])(const void *, size_t *) = {NULL, key_kv,
+                                                             record_key};
+    avl_key_t key = {.mode = AVL_KEY_GENERIC};
+    if (opts->key && bytes[opts->record] != NULL) {
+        key.mode = AVL_KEY_STRING;
+        key.bytes = bytes[opts->record];
+    }
+    if (opts->engine == ENGINE_BPTREE) {
+        if ((tree.bptree = bptree_init_key(compare[opts->record], &key,
+                                           NULL)) == NULL)
+            fatal("Failed to allocate tree");
+        return tree;
+    }
+    if ((tree.avl = avl_init_key(compare[opts->record], &key, NULL)) == NULL)
+        fatal("Failed to allocate tree");
+    if (opts->index)
+        avl_index(tree.avl, hash[opts->record]);
+    return tree;
+}
+
+static inline int tree_insert(bench_tree_t *tree, const void *data) {
+    if (tree->bptree != NULL)
+        return bptree_insert(tree->bptree, data);
+    return avl_insert(tree->avl, data);
+}
+
+static inline int tree_remove(bench_tree_t *tree, const void *data) {
+    if (tree->bptree != NULL)
+        return bptree_remove(tree->bptree, data);
+    return avl_remove(tree->avl, data);
+}
+
+static inline int tree_lookup(bench_tree_t *tree, void **data) {
+    if (tree->bptree != NULL)
+        return bptree_lookup(tree->bptree, data);
+    return avl_lookup(tree->avl, data);
+}
+
+static long tree_insert_batch(bench_tree_t *tree, void **data, long count,
+                              int *status) {
+    long i, inserted = 0;
+    if (tree->avl != NULL)
+        return avl_insert_batch(tree->avl, data, count, status);
+    for (i = 0; i < count; i++)
+        inserted += (status[i] = bptree_insert(tree->bptree, data[i])) == 0;
+    return inserted;
+}
+
+static long tree_lookup_batch(bench_tree_t *tree, void **data, long count,
+                              int *status) {
+    long i, found = 0;
+    if (tree->avl != NULL)
+        return avl_lookup_batch(tree->avl, data, count, status);
+    for (i = 0; i < count; i++)
+        found += (status[i] = bptree_lookup(tree->bptree, &data[i])) == 0;
+    return found;
+}
+
+static void tree_destroy(bench_tree_t *tree) {
+    if (tree->bptree != NULL)
+        bptree_destroy(tree->bptree);
+    else
+        avl_destroy(tree->avl);
+}
+
+static void populate(const bench_opts_t *opts, bench_data_t *bd,
+                     bench_tree_t *tree) {
+    long i;
+    for (i = 0; i < opts->keys; i++)
+        tree_insert(tree, bd->data[bd->order[i]]);
+}
+
+static inline unsigned long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static int compare_lat(const void *l1, const void *l2) {
+    unsigned long x1 = *(const unsigned long *)l1;
+    unsigned long x2 = *(const unsigned long *)l2;
+    return x1 < x2 ? -1 : x1 > x2;
+}
+
+static void report(const bench_opts_t *opts, const char *workload,
+                   unsigned long *lat, long ops, unsigned long total_ns,
+                   long misses) {
+    static const char *dists[] = {"uniform", "zipf", "seq"};
+    static const char *records[] = {"int", "kv", "rec"};
+    static const char *engines[] = {"avl", "bptree"};
+    double secs = total_ns / 1e9;
+    qsort(lat, ops, sizeof(unsigned long), compare_lat);
+    printf("{\"workload\":\"%s\",\"engine\":\"%s\",\"record\":\"%s\","
+           "\"dist\":\"%s\",\"keys\":%ld,\"ops\":%ld,\"index\":%d,\"key\":%d,"
+           "\"batch\":%ld,\"seed\":%lu,\"secs\":%.6f,\"ops_per_sec\":%.0f,\"misses\":%ld,"
+           "\"p50_ns\":%lu,\"p99_ns\":%lu,\"p999_ns\":%lu}\n",
+           workload, engines[opts->engine], records[opts->record],
+           dists[opts->dist], opts->keys, ops, opts->index,
+           opts->key && opts->record != RECORD_INT, opts->batch, opts->seed,
+           secs,
+           secs > 0 ? ops / secs : 0.0, misses, ops ? lat[ops / 2] : 0,
+           ops ? lat[ops * 99 / 100] : 0, ops ? lat[ops * 999 / 1000] : 0);
+    fflush(stdout);
+}
+
+/**< Split the time of a batch evenly over its latency samples */
+static void batch_lat(unsigned long *lat, long count, unsigned long t) {
+    long i;
+    for (i = 0; i < count; i++)
+        lat[i] = t / count;
+}
+
+static void run_insert_batch(const bench_opts_t *opts, bench_data_t *bd) {
+    bench_tree_t tree = new_tree(opts);
+    unsigned long start, t, total = 0;
+    void **batch;
+    int *status;
+    long i, j, n, failed = 0;
+    if ((batch = malloc(opts->batch * sizeof(void *))) == NULL ||
+        (status = malloc(opts->batch * sizeof(int))) == NULL)
+        fatal("Failed to allocate batch");
+    for (i = 0; i < opts->keys; i += n) {
+        n = opts->keys - i < opts->batch ? opts->keys - i : opts->batch;
+        for (j = 0; j < n; j++)
+            batch[j] = bd->data[bd->order[i + j]];
+        start = now_ns();
+        failed += n - tree_insert_batch(&tree, batch, n, status);
+        t = now_ns() - start;
+        batch_lat(bd->lat + i, n, t);
+        total += t;
+    }
+    report(opts, "insert", bd->lat, opts->keys, total, failed);
+    free(status);
+    free(batch);
+    tree_destroy(&tree);
+}
+
+static void run_insert(const bench_opts_t *opts, bench_data_t *bd) {
+    bench_tree_t tree;
+    unsigned long start, t, total = 0;
+    long i, failed = 0;
+    if (opts->batch > 0) {
+        run_insert_batch(opts, bd);
+        return;
+    }
+    tree = new_tree(opts);
+    for (i = 0; i < opts->keys; i++) {
+        start = now_ns();
+        failed += tree_insert(&tree, bd->data[bd->order[i]]) != 0;
+        t = now_ns() - start;
+        bd->lat[i] = t;
+        total += t;
+    }
+    report(opts, "insert", bd->lat, opts->keys, total, failed);
+    tree_destroy(&tree);
+}
+
+static void run_lookup_batch(const bench_opts_t *opts, bench_data_t *bd,
+                             const char *workload, void **probes) {
+    bench_tree_t tree = new_tree(opts);
+    unsigned long start, t, total = 0;
+    void **batch;
+    int *status;
+    long i, j, n, misses = 0;
+    zipf_t zipf;
+    if ((batch = malloc(opts->batch * sizeof(void *))) == NULL ||
+        (status = malloc(opts->batch * sizeof(int))) == NULL)
+        fatal("Failed to allocate batch");
+    populate(opts, bd, &tree);
+    if (opts->dist == DIST_ZIPF)
+        zipf_init(&zipf, opts->keys, opts->theta);
+    for (i = 0; i < opts->ops; i += n) {
+        n = opts->ops - i < opts->batch ? opts->ops - i : opts->batch;
+        for (j = 0; j < n; j++)
+            batch[j] = probes[pick(opts, &zipf, i + j)];
+        start = now_ns();
+        misses += n - tree_lookup_batch(&tree, batch, n, status);
+        t = now_ns() - start;
+        batch_lat(bd->lat + i, n, t);
+        total += t;
+    }
+    report(opts, workload, bd->lat, opts->ops, total, misses);
+    free(status);
+    free(batch);
+    tree_destroy(&tree);
+}
+
+static void run_lookup(const bench_opts_t *opts, bench_data_t *bd,
+                       const char *workload, void **probes) {
+    bench_tree_t tree;
+    unsigned long start, t, total = 0;
+    long i, misses = 0;
+    void *data;
+    zipf_t zipf;
+    if (opts->batch > 0) {
+        run_lookup_batch(opts, bd, workload, probes);
+        return;
+    }
+    tree = new_tree(opts);
+    populate(opts, bd, &tree);
+    if (opts->dist == DIST_ZIPF)
+        zipf_init(&zipf, opts->keys, opts->theta);
+    for (i = 0; i < opts->ops; i++) {
+        data = probes[pick(opts, &zipf, i)];
+        start = now_ns();
+        misses += tree_lookup(&tree, &data) != 0;
+        t = now_ns() - start;
+        bd->lat[i] = t;
+        total += t;
+    }
+    report(opts, workload, bd->lat, opts->ops, total, misses);
+    tree_destroy(&tree);
+}
+
+static void run_remove(const bench_opts_t *opts, bench_data_t *bd) {
+    bench_tree_t tree = new_tree(opts);
+    unsigned long start, t, total = 0;
+    long i, failed = 0;
+    populate(opts, bd, &tree);
+    for (i = 0; i < opts->keys; i++) {
+        start = now_ns();
+        failed += tree_remove(&tree, bd->hit[bd->order[i]]) != 0;
+        t = now_ns() - start;
+        bd->lat[i] = t;
+        total += t;
+    }
+    report(opts, "remove", bd->lat, opts->keys, total, failed);
+    tree_destroy(&tree);
+}
+
+static void run_mixed(const bench_opts_t *opts, bench_data_t *bd) {
+    bench_tree_t tree = new_tree(opts);
+    unsigned long start, t, total = 0;
+    long i, key, misses = 0;
+    char *present;
+    void *data;
+    zipf_t zipf;
+    if ((present = malloc(opts->keys)) == NULL)
+        fatal("Failed to allocate benchmark data");
+    memset(present, 1, opts->keys);
+    populate(opts, bd, &tree);
+    if (opts->dist == DIST_ZIPF)
+        zipf_init(&zipf, opts->keys, opts->theta);
+    for (i = 0; i < opts->ops; i++) {
+        key = pick(opts, &zipf, i);
+        data = bd->hit[key];
+        start = now_ns();
+        if ((int)(rng_next() % 100) < opts->read_pct) {
+            misses += tree_lookup(&tree, &data) != 0;
+        } else if (present[key]) {
+            tree_remove(&tree, data);
+            present[key] = 0;
+        } else {
+            tree_insert(&tree, bd->data[key]);
+            present[key] = 1;
+        }
+        t = now_ns() - start;
+        bd->lat[i] = t;
+        total += t;
+    }
+    report(opts, "mixed", bd->lat, opts->ops, total, misses);
+    free(present);
+    tree_destroy(&tree);
+}
+
+static void *durable_thread(void *arg) {
+    durable_arg_t *da = arg;
+    const bench_opts_t *opts = da->opts;
+    unsigned long start;
+    char kbuf[32], vbuf[32];
+    int klen, vlen;
+    long i;
+    for (i = da->id; i < opts->ops; i += opts->threads) {
+        klen = snprintf(kbuf, sizeof(kbuf), "key%016ld", i % opts->keys);
+        vlen = snprintf(vbuf, sizeof(vbuf), "value %ld", i);
+        start = now_ns();
+        da->failed += memdb_set(da->db, kbuf, klen, vbuf, vlen) != 0;
+        da->bd->lat[i] = now_ns() - start;
+    }
+    return NULL;
+}
+
+static void run_durable(const bench_opts_t *opts, bench_data_t *bd) {
+    memdb_config_t config = {.wal = opts->wal, .wal_delay = opts->wal_delay};
+    durable_arg_t *args;
+    pthread_t *threads;
+    unsigned long start;
+    long failed = 0;
+    memdb_t *db;
+    int i;
+    if (opts->wal == NULL) {
+        error("The durable workload needs a log path (-l)");
+        return;
+    }
+    unlink(opts->wal);
+    if ((db = memdb_init(&config)) == NULL)
+        fatal("Failed to open database");
+    args = calloc(opts->threads, sizeof(durable_arg_t));
+    threads = calloc(opts->threads, sizeof(pthread_t));
+    if (!args || !threads)
+        fatal("Failed to allocate threads");
+    start = now_ns();
+    for (i = 0; i < opts->threads; i++) {
+        args[i] = (durable_arg_t){.opts = opts, .bd = bd, .db = db, .id = i};
+        pthread_create(&threads[i], NULL, durable_thread, &args[i]);
+    }
+    for (i = 0; i < opts->threads; i++) {
+        pthread_join(threads[i], NULL);
+        failed += args[i].failed;
+    }
+    // throughput over wall clock time, the writers run in parallel
+    report(opts, "durable", bd->lat, opts->ops, now_ns() - start, failed);
+    memdb_destroy(db);
+    unlink(opts->wal);
+    free(threads);
+    free(args);
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -n KEYS      number of keys (default 1000000)\n"
+            "  -o OPS       number of lookup/mixed operations (default KEYS)\n"
+            "  -d DIST      uniform, zipf or seq (default uniform)\n"
+            "  -t THETA     zipf skew (default 0.99)\n"
+            "  -r RECORD    int, kv (400 byte struct) or rec (record_t)\n"
+            "               (default int)\n"
+            "  -m PERCENT   read percentage of the mixed workload (default "
+            "90)\n"
+            "  -w LIST      comma separated workloads: insert, hit, miss,\n"
+            "               remove, mixed, durable (default all but "
+            "durable)\n"
+            "  -e ENGINE    avl or bptree (default avl)\n"
+            "  -x           maintain a hash index next to the avl tree\n"
+            "  -k           compare kv and rec keys with the string key mode\n"
+            "  -b BATCH     insert and look up keys in batches of BATCH\n"
+            "               (default 0, one at a time)\n"
+            "  -s SEED      random seed (default 1)\n"
+            "  -l PATH      write-ahead log of the durable workload, "
+            "recreated\n"
+            "  -g USEC      group commit window of the log (default 0)\n"
+            "  -j THREADS   writer threads of the durable workload "
+            "(default 1)\n",
+            name);
+}
+
+int main(int argc, char **argv) {
+    bench_opts_t opts = {
+        .keys = 1000000,
+        .ops = -1,
+        .dist = DIST_UNIFORM,
+        .record = RECORD_INT,
+        .engine = ENGINE_AVL,
+        .theta = 0.99,
+        .read_pct = 90,
+        .index = 0,
+        .key = 0,
+        .seed = 1,
+        .workloads = "insert,hit,miss,remove,mixed",
+        .wal = NULL,
+        .wal_delay = 0,
+        .threads = 1,
+        .batch = 0,
+    };
+    bench_data_t bd;
+    char *list, *name, *save;
+    int opt;
+
+    program_name = "memdb-bench";
+    debug_flags = 0;
+
+    while ((opt = getopt(argc, argv, "n:o:d:t:r:e:m:w:xkb:s:l:g:j:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            opts.keys = atol(optarg);
+            break;
+        case 'o':
+            opts.ops = atol(optarg);
+            break;
+        case 'd':
+            if (!strcmp(optarg, "zipf"))
+                opts.dist = DIST_ZIPF;
+            else if (!strcmp(optarg, "seq"))
+                opts.dist = DIST_SEQ;
+            else if (!strcmp(optarg, "uniform"))
+                opts.dist = DIST_UNIFORM;
+            else {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 't':
+            opts.theta = atof(optarg);
+            break;
+        case 'r':
+            if (!strcmp(optarg, "kv"))
+                opts.record = RECORD_KV;
+            else if (!strcmp(optarg, "rec"))
+                opts.record = RECORD_REC;
+            else if (!strcmp(optarg, "int"))
+                opts.record = RECORD_INT;
+            else {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'e':
+            if (!strcmp(optarg, "bptree"))
+                opts.engine = ENGINE_BPTREE;
+            else if (!strcmp(optarg, "avl"))
+                opts.engine = ENGINE_AVL;
+            else {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'm':
+            opts.read_pct = atoi(optarg);
+            break;
+        case 'w':
+            opts.workloads = optarg;
+            break;
+        case 'x':
+            opts.index = 1;
+            break;
+        case 'k':
+            opts.key = 1;
+            break;
+        case 'b':
+            opts.batch = atol(optarg);
+            break;
+        case 's':
+            opts.seed = strtoul(optarg, NULL, 0);
+            break;
+        case 'l':
+            opts.wal = optarg;
+            break;
+        case 'g':
+            opts.wal_delay = atol(optarg);
+            break;
+        case 'j':
+            opts.threads = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return opt != 'h';
+        }
+    }
+    if (opts.keys <= 0 || opts.theta <= 0 || opts.theta >= 1 ||
+        opts.threads <= 0 || opts.batch < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (opts.ops < 0)
+        opts.ops = opts.keys;
+
+    rng_state = opts.seed;
+    if ((arena = record_arena_init()) == NULL)
+        fatal("Failed to allocate record arena");
+    bench_data_init(&opts, &bd);
+
+    if ((list = strdup(opts.workloads)) == NULL)
+        fatal("Failed to allocate workload list");
+    for (name = strtok_r(list, ",", &save); name != NULL;
+         name = strtok_r(NULL, ",", &save)) {
+        if (!strcmp(name, "insert"))
+            run_insert(&opts, &bd);
+        else if (!strcmp(name, "hit"))
+            run_lookup(&opts, &bd, "lookup_hit", bd.hit);
+        else if (!strcmp(name, "miss"))
+            run_lookup(&opts, &bd, "lookup_miss", bd.miss);
+        else if (!strcmp(name, "remove"))
+            run_remove(&opts, &bd);
+        else if (!strcmp(name, "mixed"))
+            run_mixed(&opts, &bd);
+        else if (!strcmp(name, "durable"))
+            run_durable(&opts, &bd);
+        else
+            error("Unknown workload '%s'", name);
+    }
+    free(list);
+
+    bench_data_free(&opts, &bd);
+    record_arena_destroy(arena);
+    return 0;
+}
@@ -162,18 +162,18 @@ void bitree_rem_right(bitree_t *tree, bitree_node_t *node) {
 
 int bitree_merge(bitree_t *merge, bitree_t *left, bitree_t *right,
                  const void *data) {
-    if (!left || !right) {
-        return -1;
-    }
-    merge = bitree_init(left->destroy);
     if (!merge || !left || !right) {
         debug(D_BITREE, "Tree pointer cannot be NULL");
         debug(D_BITREE, "Allocate tree first");
         return -1;
     }
+    // the result goes into the caller's tree, so it has to start empty
+    if (bitree_size(merge) != 0) {
+        error("Merge tree is not empty");
+        return -1;
+    }
     debug(D_BITREE, "Trying to merge trees");
     if (bitree_ins_left(merge, NULL, data) != 0) {
-        bitree_destroy(merge);
         debug(D_BITREE, "Merge failed");
         return -1;
     }
@@ -105,9 +105,11 @@ void bitree_rem_right(bitree_t *tree, bitree_node_t *node);
 
 /** @brief Merge two trees
  *
- * This function will merge two trees with given data as the root node
+ * This function will merge two trees with given data as the root node.
+ * The result is not ordered or balanced, use avl_union for ordered sets.
+ * Both trees are emptied and their nodes moved into merge.
  *
- * @param merge The merged tree result
+ * @param merge Empty tree from bitree_init that receives the result
  * @param left The left branch of the root node
  * @param right the right branch of the root node
  * @param data The data that will be used to create the root node
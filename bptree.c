@@ -0,0 +1,534 @@
+/** @file bptree.c
+ *  @brief Functions for the B+tree.
+ *
+ *  This file contains the functions to control a B+tree with wide nodes
+ *  and linked leaves
+ *
+ *  @author Bram Vlerick (bram.vlerick@ucast.be)
+ *  @bug
+ *  * Hidden entries and the hash index of the avl tree are not supported
+ */
+
+#include "bptree.h"
+
+static bptree_node_t *node_alloc(bptree_t *tree, int leaf) {
+    bptree_node_t *node;
+    if ((node = slab_alloc(tree->nodes)) == NULL) {
+        error("Failed to allocate node");
+        return NULL;
+    }
+    node->count = 0;
+    node->leaf = leaf;
+    if (leaf) {
+        node->prev = NULL;
+        node->next = NULL;
+    }
+    return node;
+}
+
+static int node_search(bptree_t *tree, const bptree_node_t *node,
+                       const key_probe_t *probe, int *found) {
+    int lo = 0, hi = node->count, mid, cmpval;
+    *found = 0;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        cmpval = key_probe_cmp(&tree->key, tree->compare, probe,
+                               node->keys[mid], node->data[mid]);
+        if (cmpval == 0) {
+            *found = 1;
+            return mid;
+        }
+        if (cmpval < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return lo;
+}
+
+static int descend(bptree_t *tree, const key_probe_t *probe,
+                   bptree_node_t **path, int *idx, int *found) {
+    bptree_node_t *node = tree->root;
+    int depth, pos;
+    for (depth = 0;; depth++) {
+        path[depth] = node;
+        pos = node_search(tree, node, probe, found);
+        if (node->leaf) {
+            idx[depth] = pos;
+            return depth;
+        }
+        // entries equal to the key are the first data of the next child
+        idx[depth] = *found ? pos + 1 : pos;
+        node = node->child[idx[depth]];
+    }
+}
+
+static void node_insert(bptree_node_t *node, int pos, uint64_t key,
+                        void *data, bptree_node_t *right) {
+    memmove(node->keys + pos + 1, node->keys + pos,
+            (node->count - pos) * sizeof(uint64_t));
+    memmove(node->data + pos + 1, node->data + pos,
+            (node->count - pos) * sizeof(void *));
+    if (!node->leaf) {
+        memmove(node->child + pos + 2, node->child + pos + 1,
+                (node->count - pos) * sizeof(bptree_node_t *));
+        node->child[pos + 1] = right;
+    }
+    node->keys[pos] = key;
+    node->data[pos] = data;
+    node->count++;
+    return;
+}
+
+static void node_split(bptree_t *tree, bptree_node_t *node,
+                       bptree_node_t *sibling, int pos, uint64_t *key,
+                       void **data, bptree_node_t *right) {
+    uint64_t keys[BPTREE_ORDER + 1];
+    void *datas[BPTREE_ORDER + 1];
+    bptree_node_t *child[BPTREE_ORDER + 2];
+    int half = BPTREE_ORDER / 2, i;
+    // lay out the full node plus the new entry, then cut it in two
+    memcpy(keys, node->keys, pos * sizeof(uint64_t));
+    memcpy(datas, node->data, pos * sizeof(void *));
+    keys[pos] = *key;
+    datas[pos] = *data;
+    memcpy(keys + pos + 1, node->keys + pos,
+           (BPTREE_ORDER - pos) * sizeof(uint64_t));
+    memcpy(datas + pos + 1, node->data + pos,
+           (BPTREE_ORDER - pos) * sizeof(void *));
+    if (node->leaf) {
+        memcpy(node->keys, keys, half * sizeof(uint64_t));
+        memcpy(node->data, datas, half * sizeof(void *));
+        node->count = half;
+        for (i = half; i <= BPTREE_ORDER; i++) {
+            sibling->keys[i - half] = keys[i];
+            sibling->data[i - half] = datas[i];
+        }
+        sibling->count = BPTREE_ORDER + 1 - half;
+        sibling->prev = node;
+        sibling->next = node->next;
+        if (node->next != NULL)
+            node->next->prev = sibling;
+        else
+            tree->last = sibling;
+        node->next = sibling;
+        *key = sibling->keys[0];
+        *data = sibling->data[0];
+        return;
+    }
+    memcpy(child, node->child, (pos + 1) * sizeof(bptree_node_t *));
+    child[pos + 1] = right;
+    memcpy(child + pos + 2, node->child + pos + 1,
+           (BPTREE_ORDER - pos) * sizeof(bptree_node_t *));
+    memcpy(node->keys, keys, half * sizeof(uint64_t));
+    memcpy(node->data, datas, half * sizeof(void *));
+    memcpy(node->child, child, (half + 1) * sizeof(bptree_node_t *));
+    node->count = half;
+    // the middle entry moves up, it is the first data of the sibling
+    for (i = half + 1; i <= BPTREE_ORDER; i++) {
+        sibling->keys[i - half - 1] = keys[i];
+        sibling->data[i - half - 1] = datas[i];
+    }
+    memcpy(sibling->child, child + half + 1,
+           (BPTREE_ORDER - half + 1) * sizeof(bptree_node_t *));
+    sibling->count = BPTREE_ORDER - half;
+    *key = keys[half];
+    *data = datas[half];
+    return;
+}
+
+static int insert_entry(bptree_t *tree, bptree_node_t **path, int *idx,
+                        int depth, uint64_t key, void *data) {
+    bptree_node_t *spare[BPTREE_MAX_HEIGHT + 1], *right = NULL, *node;
+    int needed = 0, d, i;
+    // allocate every node the splits need up front, so a failed allocation
+    // leaves the tree untouched
+    for (d = depth; d >= 0 && path[d]->count == BPTREE_ORDER; d--)
+        needed++;
+    if (d < 0)
+        needed++;
+    for (i = 0; i < needed; i++) {
+        if ((spare[i] = node_alloc(tree, i == 0)) == NULL) {
+            while (i-- > 0)
+                slab_free(tree->nodes, spare[i]);
+            return -1;
+        }
+    }
+
+    for (i = 0, d = depth; d >= 0; d--) {
+        node = path[d];
+        if (node->count < BPTREE_ORDER) {
+            node_insert(node, idx[d], key, data, right);
+            return 0;
+        }
+        node_split(tree, node, spare[i], idx[d], &key, &data, right);
+        right = spare[i++];
+    }
+    // the root was split as well, grow a level
+    node = spare[i];
+    node->keys[0] = key;
+    node->data[0] = data;
+    node->child[0] = tree->root;
+    node->child[1] = right;
+    node->count = 1;
+    tree->root = node;
+    tree->height++;
+    debug(D_BPTREE, "Tree grew to %d levels", tree->height);
+    return 0;
+}
+
+static void node_remove(bptree_node_t *node, int pos) {
+    memmove(node->keys + pos, node->keys + pos + 1,
+            (node->count - pos - 1) * sizeof(uint64_t));
+    memmove(node->data + pos, node->data + pos + 1,
+            (node->count - pos - 1) * sizeof(void *));
+    if (!node->leaf)
+        memmove(node->child + pos + 1, node->child + pos + 2,
+                (node->count - pos - 1) * sizeof(bptree_node_t *));
+    node->count--;
+    return;
+}
+
+static void borrow_left(bptree_node_t *parent, int i, bptree_node_t *left,
+                        bptree_node_t *node) {
+    memmove(node->keys + 1, node->keys, node->count * sizeof(uint64_t));
+    memmove(node->data + 1, node->data, node->count * sizeof(void *));
+    if (node->leaf) {
+        node->keys[0] = left->keys[left->count - 1];
+        node->data[0] = left->data[left->count - 1];
+        parent->keys[i - 1] = node->keys[0];
+        parent->data[i - 1] = node->data[0];
+    } else {
+        // rotate through the parent
+        memmove(node->child + 1, node->child,
+                (node->count + 1) * sizeof(bptree_node_t *));
+        node->keys[0] = parent->keys[i - 1];
+        node->data[0] = parent->data[i - 1];
+        node->child[0] = left->child[left->count];
+        parent->keys[i - 1] = left->keys[left->count - 1];
+        parent->data[i - 1] = left->data[left->count - 1];
+    }
+    left->count--;
+    node->count++;
+    return;
+}
+
+static void borrow_right(bptree_node_t *parent, int i, bptree_node_t *node,
+                         bptree_node_t *right) {
+    if (node->leaf) {
+        node->keys[node->count] = right->keys[0];
+        node->data[node->count] = right->data[0];
+        node->count++;
+        node_remove(right, 0);
+        parent->keys[i] = right->keys[0];
+        parent->data[i] = right->data[0];
+        return;
+    }
+    // rotate through the parent
+    node->keys[node->count] = parent->keys[i];
+    node->data[node->count] = parent->data[i];
+    node->child[node->count + 1] = right->child[0];
+    node->count++;
+    parent->keys[i] = right->keys[0];
+    parent->data[i] = right->data[0];
+    memmove(right->keys, right->keys + 1,
+            (right->count - 1) * sizeof(uint64_t));
+    memmove(right->data, right->data + 1, (right->count - 1) * sizeof(void *));
+    memmove(right->child, right->child + 1,
+            right->count * sizeof(bptree_node_t *));
+    right->count--;
+    return;
+}
+
+static void merge(bptree_t *tree, bptree_node_t *parent, int i,
+                  bptree_node_t *left, bptree_node_t *right) {
+    if (left->leaf) {
+        left->next = right->next;
+        if (right->next != NULL)
+            right->next->prev = left;
+        else
+            tree->last = left;
+    } else {
+        // the separator comes down between the two halves
+        left->keys[left->count] = parent->keys[i];
+        left->data[left->count] = parent->data[i];
+        left->count++;
+        memcpy(left->child + left->count, right->child,
+               (right->count + 1) * sizeof(bptree_node_t *));
+    }
+    memcpy(left->keys + left->count, right->keys,
+           right->count * sizeof(uint64_t));
+    memcpy(left->data + left->count, right->data,
+           right->count * sizeof(void *));
+    left->count += right->count;
+    node_remove(parent, i);
+    slab_free(tree->nodes, right);
+    return;
+}
+
+static void rebalance(bptree_t *tree, bptree_node_t **path, int *idx,
+                      int depth) {
+    bptree_node_t *node, *parent, *left, *right;
+    int half = BPTREE_ORDER / 2, i;
+    for (; depth > 0; depth--) {
+        node = path[depth];
+        if (node->count >= half)
+            return;
+        parent = path[depth - 1];
+        i = idx[depth - 1];
+        left = i > 0 ? parent->child[i - 1] : NULL;
+        right = i < parent->count ? parent->child[i + 1] : NULL;
+        if (left != NULL && left->count > half) {
+            borrow_left(parent, i, left, node);
+            return;
+        }
+        if (right != NULL && right->count > half) {
+            borrow_right(parent, i, node, right);
+            return;
+        }
+        if (left != NULL)
+            merge(tree, parent, i - 1, left, node);
+        else
+            merge(tree, parent, i, node, right);
+    }
+    node = tree->root;
+    if (node->count > 0)
+        return;
+    // shrink a level, or drop the last leaf
+    if (node->leaf) {
+        tree->root = tree->first = tree->last = NULL;
+    } else {
+        tree->root = node->child[0];
+    }
+    tree->height--;
+    slab_free(tree->nodes, node);
+    debug(D_BPTREE, "Tree shrunk to %d levels", tree->height);
+    return;
+}
+
+static bptree_t *tree_alloc(int (*compare)(const void *key1,
+                                           const void *key2),
+                            const avl_key_t *key, void (*destroy)(void *data)) {
+    bptree_t *tree;
+    if ((tree = calloc(1, sizeof(bptree_t))) == NULL) {
+        error("Failed to allocate tree");
+        return NULL;
+    }
+    if ((tree->nodes = slab_init(sizeof(bptree_node_t), BPTREE_SLAB_NODES)) ==
+        NULL) {
+        free(tree);
+        return NULL;
+    }
+    tree->compare = compare;
+    tree->destroy = destroy;
+    tree->key = *key;
+    debug(D_BPTREE, "Initialised B+tree");
+    return tree;
+}
+
+bptree_t *bptree_init(int (*compare)(const void *key1, const void *key2),
+                      void (*destroy)(void *data)) {
+    avl_key_t key = {.mode = AVL_KEY_GENERIC};
+    return tree_alloc(compare, &key, destroy);
+}
+
+bptree_t *bptree_init_key(int (*compare)(const void *key1, const void *key2),
+                          const avl_key_t *key, void (*destroy)(void *data)) {
+    if (key_mode_check(key) != 0) {
+        error("Invalid key mode");
+        return NULL;
+    }
+    return tree_alloc(compare, key, destroy);
+}
+
+void bptree_destroy(bptree_t *tree) {
+    bptree_node_t *leaf;
+    int i;
+    if (!tree) {
+        debug(D_BPTREE, "Tree pointer cannot be NULL");
+        return;
+    }
+    debug(D_BPTREE, "Destroying B+tree");
+    if (tree->destroy != NULL) {
+        for (leaf = tree->first; leaf != NULL; leaf = leaf->next)
+            for (i = 0; i < leaf->count; i++)
+                tree->destroy(leaf->data[i]);
+    }
+    slab_destroy(tree->nodes);
+    memset(tree, 0, sizeof(bptree_t));
+    free(tree);
+    return;
+}
+
+int bptree_insert(bptree_t *tree, const void *data) {
+    bptree_node_t *path[BPTREE_MAX_HEIGHT];
+    int idx[BPTREE_MAX_HEIGHT], depth, found;
+    key_probe_t probe;
+    if (!tree) {
+        debug(D_BPTREE, "Tree pointer cannot be NULL");
+        debug(D_BPTREE, "Allocate tree first");
+        return -1;
+    }
+    if (tree->root == NULL) {
+        if ((tree->root = node_alloc(tree, 1)) == NULL)
+            return -1;
+        tree->first = tree->last = tree->root;
+        tree->height = 1;
+    }
+    key_probe_init(&tree->key, &probe, data);
+    depth = descend(tree, &probe, path, idx, &found);
+    if (found) {
+        debug(D_BPTREE, "Data already exists");
+        return 1;
+    }
+    if (insert_entry(tree, path, idx, depth, probe.key, (void *)data) != 0)
+        return -1;
+    tree->size++;
+    return 0;
+}
+
+int bptree_remove(bptree_t *tree, const void *data) {
+    bptree_node_t *path[BPTREE_MAX_HEIGHT], *leaf;
+    int idx[BPTREE_MAX_HEIGHT], depth, found, d;
+    key_probe_t probe;
+    void *old;
+    if (!tree) {
+        debug(D_BPTREE, "Tree pointer cannot be NULL");
+        debug(D_BPTREE, "Allocate tree first");
+        return -1;
+    }
+    if (tree->root == NULL)
+        return -1;
+    key_probe_init(&tree->key, &probe, data);
+    depth = descend(tree, &probe, path, idx, &found);
+    if (!found)
+        return -1;
+    leaf = path[depth];
+    old = leaf->data[idx[depth]];
+    node_remove(leaf, idx[depth]);
+    tree->size--;
+    // the first data of a leaf is the separator in the deepest ancestor
+    // that was entered through anything but its first child
+    if (idx[depth] == 0 && leaf->count > 0) {
+        for (d = depth - 1; d >= 0; d--) {
+            if (idx[d] > 0) {
+                path[d]->keys[idx[d] - 1] = leaf->keys[0];
+                path[d]->data[idx[d] - 1] = leaf->data[0];
+                break;
+            }
+        }
+    }
+    rebalance(tree, path, idx, depth);
+    if (tree->destroy != NULL)
+        tree->destroy(old);
+    return 0;
+}
+
+int bptree_lookup(bptree_t *tree, void **data) {
+    bptree_node_t *node;
+    key_probe_t probe;
+    int pos, found = 0;
+    if (!tree) {
+        debug(D_BPTREE, "Tree pointer cannot be NULL");
+        debug(D_BPTREE, "Allocate tree first");
+        return -1;
+    }
+    if ((node = tree->root) == NULL)
+        return -1;
+    key_probe_init(&tree->key, &probe, *data);
+    for (;;) {
+        pos = node_search(tree, node, &probe, &found);
+        if (node->leaf)
+            break;
+        node = node->child[found ? pos + 1 : pos];
+    }
+    if (!found)
+        return -1;
+    *data = node->data[pos];
+    return 0;
+}
+
+void bptree_cursor_init(bptree_cursor_t *cursor, bptree_t *tree) {
+    cursor->tree = tree;
+    cursor->leaf = NULL;
+    cursor->pos = 0;
+    return;
+}
+
+int bptree_cursor_first(bptree_cursor_t *cursor) {
+    cursor->leaf = cursor->tree->first;
+    cursor->pos = 0;
+    return cursor->leaf != NULL ? 0 : -1;
+}
+
+int bptree_cursor_last(bptree_cursor_t *cursor) {
+    cursor->leaf = cursor->tree->last;
+    cursor->pos = cursor->leaf != NULL ? cursor->leaf->count - 1 : 0;
+    return cursor->leaf != NULL ? 0 : -1;
+}
+
+int bptree_cursor_seek(bptree_cursor_t *cursor, const void *data) {
+    bptree_t *tree = cursor->tree;
+    bptree_node_t *path[BPTREE_MAX_HEIGHT];
+    int idx[BPTREE_MAX_HEIGHT], depth, found;
+    key_probe_t probe;
+    cursor->leaf = NULL;
+    if (tree->root == NULL)
+        return -1;
+    key_probe_init(&tree->key, &probe, data);
+    depth = descend(tree, &probe, path, idx, &found);
+    cursor->leaf = path[depth];
+    cursor->pos = idx[depth];
+    if (cursor->pos < cursor->leaf->count)
+        return 0;
+    // everything in this leaf is below data, continue in the next one
+    cursor->leaf = cursor->leaf->next;
+    cursor->pos = 0;
+    return cursor->leaf != NULL ? 0 : -1;
+}
+
+int bptree_cursor_next(bptree_cursor_t *cursor) {
+    if (cursor->leaf == NULL)
+        return -1;
+    if (++cursor->pos < cursor->leaf->count)
+        return 0;
+    cursor->leaf = cursor->leaf->next;
+    cursor->pos = 0;
+    return cursor->leaf != NULL ? 0 : -1;
+}
+
+int bptree_cursor_prev(bptree_cursor_t *cursor) {
+    if (cursor->leaf == NULL)
+        return -1;
+    if (--cursor->pos >= 0)
+        return 0;
+    cursor->leaf = cursor->leaf->prev;
+    cursor->pos = cursor->leaf != NULL ? cursor->leaf->count - 1 : 0;
+    return cursor->leaf != NULL ? 0 : -1;
+}
+
+long bptree_range(bptree_t *tree, const void *lo, const void *hi,
+                  int (*callback)(void *data, void *arg), void *arg) {
+    bptree_cursor_t cursor;
+    long visited = 0;
+    int retval;
+    if (!tree) {
+        debug(D_BPTREE, "Tree pointer cannot be NULL");
+        debug(D_BPTREE, "Allocate tree first");
+        return -1;
+    }
+    debug(D_BPTREE, "Performing range scan");
+    bptree_cursor_init(&cursor, tree);
+    if (lo != NULL)
+        retval = bptree_cursor_seek(&cursor, lo);
+    else
+        retval = bptree_cursor_first(&cursor);
+    for (; retval == 0; retval = bptree_cursor_next(&cursor)) {
+        if (hi != NULL && tree->compare(bptree_cursor_data(&cursor), hi) > 0)
+            break;
+        visited++;
+        if (callback(bptree_cursor_data(&cursor), arg) != 0)
+            break;
+    }
+    return visited;
+}
@@ -0,0 +1,235 @@
+/** @file bptree.h
+ *  @brief Functions prototypes for the B+tree.
+ *
+ *  This file contains the prototypes and macros to control a B+tree. Nodes
+ *  hold up to BPTREE_ORDER entries with their cached keys stored next to
+ *  each other, so a search reads a few cache lines per node instead of one
+ *  cache miss per key. All data lives in the leaves, which are linked in
+ *  key order for scans. Inner nodes reference the smallest data of each
+ *  child but the first as separator.
+ *
+ *  @author Bram Vlerick (bram.vlerick@ucast.be)
+ *  @bug
+ *  * Hidden entries and the hash index of the avl tree are not supported
+ */
+
+#ifndef _BPTREE_H_
+#define _BPTREE_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "key.h"
+#include "log.h"
+#include "slab.h"
+
+/**< Maximum number of entries in a node, has to be even */
+#define BPTREE_ORDER 32
+
+/**< Number of nodes allocated at once by the node slab */
+#define BPTREE_SLAB_NODES 256
+
+/**< Maximum tree height */
+#define BPTREE_MAX_HEIGHT 32
+
+/** @brief Definition of the B+tree node
+ *
+ *  This structure defines both leaf and inner nodes. Entry i of an inner
+ *  node separates child i from child i + 1 and is the smallest data of
+ *  child i + 1.
+ *
+ */
+typedef struct bptree_node_ {
+    /**< Number of entries */
+    int count;
+    /**< Non zero for leaves */
+    int leaf;
+    /**< Cached keys, or big endian key prefixes */
+    uint64_t keys[BPTREE_ORDER];
+    /**< Entry data */
+    void *data[BPTREE_ORDER];
+    union {
+        /**< Children of an inner node */
+        struct bptree_node_ *child[BPTREE_ORDER + 1];
+        struct {
+            /**< Previous leaf */
+            struct bptree_node_ *prev;
+            /**< Next leaf */
+            struct bptree_node_ *next;
+        };
+    };
+} bptree_node_t;
+
+/** @brief Definition of the B+tree
+ *
+ *  This structure contains all B+tree data
+ *
+ */
+typedef struct {
+    /**< Number of entries */
+    long size;
+    /**< Number of levels */
+    int height;
+    /**< Compare callback function */
+    int (*compare)(const void *key1, const void *key2);
+    /**< Destroy data callback function */
+    void (*destroy)(void *data);
+    /**< Key mode */
+    avl_key_t key;
+    /**< Root node */
+    bptree_node_t *root;
+    /**< First leaf */
+    bptree_node_t *first;
+    /**< Last leaf */
+    bptree_node_t *last;
+    /**< Node allocator */
+    slab_t *nodes;
+} bptree_t;
+
+/** @brief Definition of a B+tree cursor
+ *
+ *  A cursor is a leaf and a position in it
+ *
+ */
+typedef struct {
+    /**< Tree the cursor walks */
+    bptree_t *tree;
+    /**< Current leaf, NULL if the cursor is not positioned */
+    bptree_node_t *leaf;
+    /**< Position in the leaf */
+    int pos;
+} bptree_cursor_t;
+
+/** @brief Initialise the B+tree
+ *
+ *  @param compare Data compare callback
+ *  @param destroy Destroy data callback
+ *
+ *  @return Pointer to the tree, NULL if failed
+ */
+bptree_t *bptree_init(int (*compare)(const void *key1, const void *key2),
+                      void (*destroy)(void *data));
+
+/** @brief Initialise the B+tree with a built-in key mode
+ *
+ *  The compare callback has to order data the same way as the key mode
+ *
+ *  @param compare Data compare callback
+ *  @param key Key mode description
+ *  @param destroy Destroy data callback
+ *
+ *  @return Pointer to the tree, NULL if failed
+ */
+bptree_t *bptree_init_key(int (*compare)(const void *key1, const void *key2),
+                          const avl_key_t *key, void (*destroy)(void *data));
+
+/** @brief Destroy the B+tree
+ *
+ *  @param tree Pointer to the tree
+ */
+void bptree_destroy(bptree_t *tree);
+
+/** @brief Insert data in the B+tree
+ *
+ *  @param tree Pointer to the tree
+ *  @param data Pointer to the data
+ *
+ *  @return 0 if successful, 1 if the data already exists, -1 if failed
+ */
+int bptree_insert(bptree_t *tree, const void *data);
+
+/** @brief Remove data from the B+tree
+ *
+ *  The stored data is released with the destroy callback
+ *
+ *  @param tree Pointer to the tree
+ *  @param data Reference data
+ *
+ *  @return 0 if successful, -1 if not found
+ */
+int bptree_remove(bptree_t *tree, const void *data);
+
+/** @brief Look up data in the B+tree
+ *
+ *  @param tree Pointer to the tree
+ *  @param data Reference data, replaced by the stored data if found
+ *
+ *  @return 0 if successful, -1 if not found
+ */
+int bptree_lookup(bptree_t *tree, void **data);
+
+/** @brief Initialise a cursor
+ *
+ *  @param cursor Pointer to the cursor
+ *  @param tree Pointer to the tree
+ */
+void bptree_cursor_init(bptree_cursor_t *cursor, bptree_t *tree);
+
+/** @brief Move the cursor to the first entry
+ *
+ *  @param cursor Pointer to the cursor
+ *
+ *  @return 0 if successful, -1 if the tree is empty
+ */
+int bptree_cursor_first(bptree_cursor_t *cursor);
+
+/** @brief Move the cursor to the last entry
+ *
+ *  @param cursor Pointer to the cursor
+ *
+ *  @return 0 if successful, -1 if the tree is empty
+ */
+int bptree_cursor_last(bptree_cursor_t *cursor);
+
+/** @brief Move the cursor to the first entry not below data
+ *
+ *  @param cursor Pointer to the cursor
+ *  @param data Reference data
+ *
+ *  @return 0 if successful, -1 if all entries are below data
+ */
+int bptree_cursor_seek(bptree_cursor_t *cursor, const void *data);
+
+/** @brief Move the cursor to the next entry
+ *
+ *  @param cursor Pointer to the cursor
+ *
+ *  @return 0 if successful, -1 if there is no next entry
+ */
+int bptree_cursor_next(bptree_cursor_t *cursor);
+
+/** @brief Move the cursor to the previous entry
+ *
+ *  @param cursor Pointer to the cursor
+ *
+ *  @return 0 if successful, -1 if there is no previous entry
+ */
+int bptree_cursor_prev(bptree_cursor_t *cursor);
+
+/** @brief Scan a range of entries
+ *
+ *  This function calls callback in key order for every entry between lo
+ *  and hi inclusive, until the callback returns non zero
+ *
+ *  @param tree Pointer to the tree
+ *  @param lo Lower bound, NULL for the first entry
+ *  @param hi Upper bound, NULL for the last entry
+ *  @param callback Callback function
+ *  @param arg Argument passed to the callback
+ *
+ *  @return Number of entries visited, -1 if failed
+ */
+long bptree_range(bptree_t *tree, const void *lo, const void *hi,
+                  int (*callback)(void *data, void *arg), void *arg);
+
+/**< Macro to retrieve the number of entries */
+#define bptree_size(tree) ((tree)->size)
+
+/**< Macro to check if a cursor points at an entry */
+#define bptree_cursor_valid(cursor) ((cursor)->leaf != NULL)
+
+/**< Macro to retrieve the data a cursor points at */
+#define bptree_cursor_data(cursor) ((cursor)->leaf->data[(cursor)->pos])
+
+#endif
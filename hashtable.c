@@ -0,0 +1,164 @@
+/** @file hashtable.c
+ *  @brief Functions for the hash table.
+ *
+ *  This file contains the functions to control an open addressing hash
+ *  table with Robin Hood probing
+ *
+ *  @author Bram Vlerick (bram.vlerick@ucast.be)
+ *  @bug
+ *  * None at the moment
+ */
+
+#include "hashtable.h"
+
+static unsigned long mix(unsigned long hash) {
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdUL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+static void place(hashtable_t *table, hashtable_slot_t entry) {
+    hashtable_slot_t tmp;
+    unsigned long pos = entry.hash & table->mask;
+    entry.dist = 1;
+    for (;; pos = (pos + 1) & table->mask, entry.dist++) {
+        if (table->slots[pos].dist == 0) {
+            table->slots[pos] = entry;
+            return;
+        }
+        if (table->slots[pos].dist < entry.dist) {
+            tmp = table->slots[pos];
+            table->slots[pos] = entry;
+            entry = tmp;
+        }
+    }
+}
+
+static int grow(hashtable_t *table) {
+    hashtable_slot_t *old = table->slots;
+    unsigned long i, nslots = table->mask + 1;
+    debug(D_HASHTABLE, "Growing hash table to %lu slots", nslots * 2);
+    if ((table->slots = calloc(nslots * 2, sizeof(hashtable_slot_t))) ==
+        NULL) {
+        error("Failed to allocate slots");
+        table->slots = old;
+        return -1;
+    }
+    table->mask = nslots * 2 - 1;
+    for (i = 0; i < nslots; i++) {
+        if (old[i].dist != 0)
+            place(table, old[i]);
+    }
+    free(old);
+    return 0;
+}
+
+static long find(hashtable_t *table, const void *data) {
+    unsigned int hash = (unsigned int)mix(table->hash(data));
+    unsigned long pos = hash & table->mask;
+    unsigned int dist;
+    for (dist = 1;; pos = (pos + 1) & table->mask, dist++) {
+        if (table->slots[pos].dist < dist)
+            return -1;
+        if (table->slots[pos].hash == hash &&
+            table->compare(data, table->slots[pos].data) == 0)
+            return pos;
+    }
+}
+
+hashtable_t *hashtable_init(unsigned long (*hash)(const void *data),
+                            int (*compare)(const void *key1,
+                                           const void *key2)) {
+    hashtable_t *table;
+    if ((table = malloc(sizeof(hashtable_t))) == NULL) {
+        error("Failed to allocate hash table");
+        return NULL;
+    }
+    if ((table->slots = calloc(HASHTABLE_INIT_SLOTS,
+                               sizeof(hashtable_slot_t))) == NULL) {
+        error("Failed to allocate slots");
+        free(table);
+        return NULL;
+    }
+    table->size = 0;
+    table->mask = HASHTABLE_INIT_SLOTS - 1;
+    table->hash = hash;
+    table->compare = compare;
+    debug(D_HASHTABLE, "Hash table initialised");
+    return table;
+}
+
+void hashtable_destroy(hashtable_t *table) {
+    if (!table) {
+        debug(D_HASHTABLE, "Table pointer cannot be NULL");
+        return;
+    }
+    debug(D_HASHTABLE, "Destroying hash table");
+    free(table->slots);
+    memset(table, 0, sizeof(hashtable_t));
+    free(table);
+    return;
+}
+
+int hashtable_insert(hashtable_t *table, const void *data) {
+    hashtable_slot_t entry;
+    debug(D_HASHTABLE, "Inserting data");
+    if (find(table, data) >= 0) {
+        debug(D_HASHTABLE, "Data already exists");
+        return 1;
+    }
+    if (hashtable_reserve(table, table->size + 1) != 0)
+        return -1;
+    entry.data = (void *)data;
+    entry.hash = (unsigned int)mix(table->hash(data));
+    place(table, entry);
+    table->size++;
+    return 0;
+}
+
+int hashtable_reserve(hashtable_t *table, long size) {
+    // keep the load factor below 7/8
+    while ((unsigned long)size * 8 > (table->mask + 1) * 7) {
+        if (grow(table) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+int hashtable_remove(hashtable_t *table, const void *data) {
+    unsigned long next;
+    long pos;
+    debug(D_HASHTABLE, "Removing data");
+    if ((pos = find(table, data)) < 0)
+        return -1;
+    // shift the following entries back instead of leaving a tombstone
+    for (next = (pos + 1) & table->mask; table->slots[next].dist > 1;
+         pos = next, next = (next + 1) & table->mask) {
+        table->slots[pos] = table->slots[next];
+        table->slots[pos].dist--;
+    }
+    table->slots[pos].dist = 0;
+    table->size--;
+    return 0;
+}
+
+int hashtable_lookup(hashtable_t *table, void **data) {
+    long pos;
+    debug(D_HASHTABLE, "Performing lookup");
+    if ((pos = find(table, *data)) < 0)
+        return -1;
+    *data = table->slots[pos].data;
+    return 0;
+}
+
+unsigned long hashtable_hash_bytes(const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    unsigned long hash = 0xcbf29ce484222325UL;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 0x100000001b3UL;
+    }
+    return hash;
+}
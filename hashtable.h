@@ -0,0 +1,134 @@
+/** @file hashtable.h
+ *  @brief Functions prototypes for the hash table.
+ *
+ *  This file contains the prototypes and macros to control an open
+ *  addressing hash table with Robin Hood probing. The table stores data
+ *  pointers only, it never owns or frees the data.
+ *
+ *  @author Bram Vlerick (bram.vlerick@ucast.be)
+ *  @bug
+ *  * None at the moment
+ */
+
+#ifndef _HASHTABLE_H_
+#define _HASHTABLE_H_
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+
+/**< Initial number of slots, has to be a power of two */
+#define HASHTABLE_INIT_SLOTS 16
+
+/** @brief Definition of a hash table slot
+ *
+ *  This structure contains a single hash table entry
+ *
+ */
+typedef struct {
+    /**< Slot data */
+    void *data;
+    /**< Low bits of the data hash */
+    unsigned int hash;
+    /**< Probe distance plus one, 0 if the slot is empty */
+    unsigned int dist;
+} hashtable_slot_t;
+
+/** @brief Definition of the hash table
+ *
+ *  This structure contains all hash table data
+ *
+ */
+typedef struct {
+    /**< Number of entries */
+    long size;
+    /**< Number of slots minus one */
+    unsigned long mask;
+    /**< Hash callback function */
+    unsigned long (*hash)(const void *data);
+    /**< Compare callback function */
+    int (*compare)(const void *key1, const void *key2);
+    /**< Slot array */
+    hashtable_slot_t *slots;
+} hashtable_t;
+
+/** @brief Initialise the hash table
+ *
+ *  This function initialises a hash table. Data that compares equal has to
+ *  hash to the same value.
+ *
+ *  @param hash Data hash callback
+ *  @param compare Data compare callback, 0 means equal
+ *
+ *  @return Pointer to the hash table, NULL if failed
+ */
+hashtable_t *hashtable_init(unsigned long (*hash)(const void *data),
+                            int (*compare)(const void *key1,
+                                           const void *key2));
+
+/** @brief Destroy the hash table
+ *
+ *  Free the hash table, the stored data is left untouched
+ *
+ *  @param table Pointer to the hash table
+ */
+void hashtable_destroy(hashtable_t *table);
+
+/** @brief Insert data into the hash table
+ *
+ *  @param table Pointer to the hash table
+ *  @param data Pointer to the data that will be inserted
+ *
+ *  @return 0 if successful, 1 if the data already exists, -1 if failed
+ */
+int hashtable_insert(hashtable_t *table, const void *data);
+
+/** @brief Reserve room in the hash table
+ *
+ *  Grow the hash table so that it holds the given number of entries
+ *  without growing again. Inserts up to that size cannot fail.
+ *
+ *  @param table Pointer to the hash table
+ *  @param size Number of entries to make room for
+ *
+ *  @return 0 if successful, -1 if failed
+ */
+int hashtable_reserve(hashtable_t *table, long size);
+
+/** @brief Remove data from the hash table
+ *
+ *  @param table Pointer to the hash table
+ *  @param data Reference data that has to be removed
+ *
+ *  @return 0 if successful, -1 if failed
+ */
+int hashtable_remove(hashtable_t *table, const void *data);
+
+/** @brief Lookup data in the hash table
+ *
+ *  This function looks for data that matches given reference data
+ *
+ *  @param table Pointer to the hash table
+ *  @param data Pointer to a data reference, set to the found data
+ *
+ *  @return 0 if successful, -1 if failed
+ */
+int hashtable_lookup(hashtable_t *table, void **data);
+
+/** @brief Hash a byte buffer
+ *
+ *  Helper to build hash callbacks on top of, hashes the key bytes of the
+ *  data with 64 bit FNV-1a
+ *
+ *  @param buf Pointer to the buffer
+ *  @param len Length of the buffer
+ *
+ *  @return The hash value
+ */
+unsigned long hashtable_hash_bytes(const void *buf, size_t len);
+
+/**< Macro to retrieve the hash table size */
+#define hashtable_size(table) ((table)->size)
+
+#endif
@@ -0,0 +1,157 @@
+/** @file key.h
+ *  @brief Key modes shared by the tree engines.
+ *
+ *  This file contains the key mode description and the inline helpers the
+ *  trees use to compare a search key against stored data. A search key is
+ *  extracted once per operation, stored data is represented by its cached
+ *  key, or key prefix, and is only touched when the cached keys are equal.
+ *
+ *  @author Bram Vlerick (bram.vlerick@ucast.be)
+ *  @bug
+ *  * None at the moment
+ */
+
+#ifndef _KEY_H_
+#define _KEY_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define AVL_KEY_GENERIC 0
+#define AVL_KEY_U64 1
+#define AVL_KEY_BINARY 2
+#define AVL_KEY_STRING 3
+
+/** @brief Definition of the avl key mode
+ *
+ *  This structure describes where a built-in key mode finds the key in the
+ *  data. u64 keys are compared as unsigned integers, binary and string keys
+ *  bytewise with shorter strings first.
+ *
+ */
+typedef struct {
+    /**< Key mode */
+    int mode;
+    /**< Offset of the key in the data, u64 and binary keys */
+    size_t offset;
+    /**< Key size, binary keys */
+    size_t size;
+    /**< Key accessor, string keys */
+    const char *(*bytes)(const void *data, size_t *len);
+} avl_key_t;
+
+/** @brief Definition of a search key
+ *
+ *  Reference data with its key extracted once per operation
+ *
+ */
+typedef struct {
+    /**< Reference data */
+    const void *data;
+    /**< Key bytes, binary and string keys */
+    const char *bytes;
+    /**< Key length, binary and string keys */
+    size_t len;
+    /**< Key, or big endian key prefix */
+    uint64_t key;
+} key_probe_t;
+
+/** @brief Compute the cached prefix of a key
+ *
+ *  @param bytes Key bytes
+ *  @param len Key length
+ *
+ *  @return The first 8 key bytes, big endian and zero padded
+ */
+static inline uint64_t key_prefix(const char *bytes, size_t len) {
+    uint64_t prefix = 0;
+    size_t i;
+    for (i = 0; i < sizeof(prefix); i++)
+        prefix = (prefix << 8) | (i < len ? (unsigned char)bytes[i] : 0);
+    return prefix;
+}
+
+/** @brief Extract the search key of data
+ *
+ *  @param mode Key mode
+ *  @param probe Pointer to the search key
+ *  @param data Reference data
+ */
+static inline void key_probe_init(const avl_key_t *mode, key_probe_t *probe,
+                                  const void *data) {
+    probe->data = data;
+    switch (mode->mode) {
+    case AVL_KEY_U64:
+        memcpy(&probe->key, (const char *)data + mode->offset,
+               sizeof(probe->key));
+        break;
+    case AVL_KEY_BINARY:
+        probe->bytes = (const char *)data + mode->offset;
+        probe->len = mode->size;
+        probe->key = key_prefix(probe->bytes, probe->len);
+        break;
+    case AVL_KEY_STRING:
+        probe->bytes = mode->bytes(data, &probe->len);
+        probe->key = key_prefix(probe->bytes, probe->len);
+        break;
+    default:
+        probe->key = 0;
+    }
+}
+
+/** @brief Compare a search key against stored data
+ *
+ *  @param mode Key mode
+ *  @param compare Data compare callback, used by the generic mode
+ *  @param probe Pointer to the search key
+ *  @param key Cached key of the stored data
+ *  @param data Stored data
+ *
+ *  @return <0, 0 or >0 like compare
+ */
+static inline int key_probe_cmp(const avl_key_t *mode,
+                                int (*compare)(const void *key1,
+                                               const void *key2),
+                                const key_probe_t *probe, uint64_t key,
+                                const void *data) {
+    const char *bytes;
+    size_t len;
+    int cmpval;
+    if (mode->mode == AVL_KEY_GENERIC)
+        return compare(probe->data, data);
+    // the cached key settles the comparison unless the prefixes are equal
+    if (probe->key != key)
+        return probe->key < key ? -1 : 1;
+    switch (mode->mode) {
+    case AVL_KEY_BINARY:
+        if (probe->len <= sizeof(probe->key))
+            return 0;
+        return memcmp(probe->bytes, (const char *)data + mode->offset,
+                      probe->len);
+    case AVL_KEY_STRING:
+        bytes = mode->bytes(data, &len);
+        cmpval = memcmp(probe->bytes, bytes, probe->len < len ? probe->len : len);
+        if (cmpval != 0)
+            return cmpval;
+        return (probe->len > len) - (probe->len < len);
+    default:
+        return 0;
+    }
+}
+
+/** @brief Check a key mode
+ *
+ *  @param mode Key mode
+ *
+ *  @return 0 if valid, -1 if not
+ */
+static inline int key_mode_check(const avl_key_t *mode) {
+    if ((mode->mode == AVL_KEY_STRING && mode->bytes == NULL) ||
+        (mode->mode == AVL_KEY_BINARY && mode->size == 0) ||
+        mode->mode < AVL_KEY_GENERIC || mode->mode > AVL_KEY_STRING)
+        return -1;
+    return 0;
+}
+
+#endif
@@ -0,0 +1,438 @@
+/** @file loadgen.c
+ *  @brief Load generator for the memdb server.
+ *
+ *  This file contains a load generator that opens a number of connections
+ *  to a memdb server, preloads a key space and then drives a pipelined
+ *  GET/SET/SCAN mix. Every value returned is checked against the value the
+ *  key was written with. It prints one JSON object per run.
+ *
+ *  @author Bram Vlerick (bram.vlerick@ucast.be)
+ *  @bug
+ *  * None at the moment
+ */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "server.h"
+
+/**< Length of a generated key */
+#define KEY_LEN 13
+
+/**< Records requested by a single scan */
+#define SCAN_RECORDS 16
+
+typedef struct {
+    const char *host;
+    const char *port;
+    const char *unix_path;
+    int conns;
+    long ops;
+    int depth;
+    long keys;
+    int read_pct;
+    int scan_pct;
+    size_t vsize;
+    unsigned long seed;
+    int preload;
+} loadgen_opts_t;
+
+typedef struct {
+    const loadgen_opts_t *opts;
+    pthread_barrier_t *barrier;
+    int id;
+    int fd;
+    unsigned long rng;
+    char *out;
+    size_t outlen;
+    char *in;
+    /**< Round trip time of every pipelined batch in nanoseconds */
+    unsigned long *lat;
+    long batches;
+    long done;
+    long misses;
+    long errors;
+} loadgen_conn_t;
+
+static unsigned long rng_next(unsigned long *state) {
+    // splitmix64, so runs are reproducible for a given seed
+    unsigned long z = (*state += 0x9e3779b97f4a7c15UL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9UL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebUL;
+    return z ^ (z >> 31);
+}
+
+static inline unsigned long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static int compare_lat(const void *l1, const void *l2) {
+    unsigned long x1 = *(const unsigned long *)l1;
+    unsigned long x2 = *(const unsigned long *)l2;
+    return x1 < x2 ? -1 : x1 > x2;
+}
+
+static void make_key(char *buf, long key) {
+    char tmp[KEY_LEN + 1];
+    snprintf(tmp, sizeof(tmp), "key%010ld", key);
+    memcpy(buf, tmp, KEY_LEN);
+}
+
+static void make_val(char *buf, long key, size_t vsize) {
+    size_t i;
+    for (i = 0; i < vsize; i++)
+        buf[i] = 'a' + (key + i) % 26;
+}
+
+static int check_val(const char *buf, long key, size_t vlen, size_t vsize) {
+    size_t i;
+    if (vlen != vsize)
+        return -1;
+    for (i = 0; i < vlen; i++)
+        if (buf[i] != (char)('a' + (key + i) % 26))
+            return -1;
+    return 0;
+}
+
+static int connect_server(const loadgen_opts_t *opts) {
+    struct addrinfo hints, *res, *ai;
+    struct sockaddr_un addr;
+    int fd = -1, one = 1, retval;
+    if (opts->unix_path != NULL) {
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, opts->unix_path, sizeof(addr.sun_path) - 1);
+        if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+            connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+            fatal("Failed to connect to %s", opts->unix_path);
+        return fd;
+    }
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((retval = getaddrinfo(opts->host, opts->port, &hints, &res)) != 0)
+        fatal("Failed to resolve %s: %s", opts->host, gai_strerror(retval));
+    for (ai = res; ai != NULL; ai = ai->ai_next) {
+        if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+            continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0)
+        fatal("Failed to connect to %s:%s", opts->host, opts->port);
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static void write_all(int fd, const char *buf, size_t len) {
+    ssize_t n;
+    while (len > 0) {
+        if ((n = write(fd, buf, len)) < 0) {
+            if (errno == EINTR)
+                continue;
+            fatal("Failed to send requests: %s", strerror(errno));
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+static void read_all(int fd, char *buf, size_t len) {
+    ssize_t n;
+    while (len > 0) {
+        if ((n = read(fd, buf, len)) <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            fatal("Connection lost");
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+static void put_request(loadgen_conn_t *conn, int op, long key, size_t vlen) {
+    server_header_t hdr = {0};
+    char *p = conn->out + conn->outlen;
+    hdr.op = op;
+    hdr.klen = htonl(KEY_LEN);
+    hdr.vlen = htonl(vlen);
+    memcpy(p, &hdr, sizeof(hdr));
+    make_key(p + sizeof(hdr), key);
+    conn->outlen += sizeof(hdr) + KEY_LEN;
+    if (op == SERVER_OP_SET) {
+        make_val(conn->out + conn->outlen, key, vlen);
+        conn->outlen += vlen;
+    }
+}
+
+static void read_frame(loadgen_conn_t *conn, server_header_t *hdr) {
+    read_all(conn->fd, (char *)hdr, sizeof(server_header_t));
+    hdr->klen = ntohl(hdr->klen);
+    hdr->vlen = ntohl(hdr->vlen);
+    if (hdr->klen + hdr->vlen > SERVER_BUFFER_SIZE)
+        fatal("Oversized response frame");
+    read_all(conn->fd, conn->in, hdr->klen + hdr->vlen);
+}
+
+static void read_response(loadgen_conn_t *conn, int op, long key) {
+    const loadgen_opts_t *opts = conn->opts;
+    server_header_t hdr;
+    char prev[KEY_LEN];
+    int count = 0;
+    read_frame(conn, &hdr);
+    if (op != SERVER_OP_SCAN) {
+        if (hdr.op != op || hdr.status == SERVER_ERROR)
+            conn->errors++;
+        else if (hdr.status == SERVER_NOT_FOUND)
+            conn->misses++;
+        else if (op == SERVER_OP_GET &&
+                 check_val(conn->in, key, hdr.vlen, opts->vsize) != 0)
+            conn->errors++;
+        return;
+    }
+    // scans answer with records in key order and a closing frame
+    for (; hdr.status == SERVER_OK; read_frame(conn, &hdr), count++) {
+        if (hdr.klen != KEY_LEN || (count > 0 && memcmp(prev, conn->in,
+                                                        KEY_LEN) >= 0) ||
+            check_val(conn->in + KEY_LEN, atol(conn->in + 3), hdr.vlen,
+                      opts->vsize) != 0)
+            conn->errors++;
+        if (hdr.klen == KEY_LEN)
+            memcpy(prev, conn->in, KEY_LEN);
+    }
+    if (hdr.op != SERVER_OP_SCAN || hdr.status != SERVER_END ||
+        count > SCAN_RECORDS)
+        conn->errors++;
+}
+
+static void run_batch(loadgen_conn_t *conn, const int *ops, const long *keys,
+                      int count) {
+    int i;
+    conn->outlen = 0;
+    for (i = 0; i < count; i++)
+        put_request(conn, ops[i], keys[i],
+                    ops[i] == SERVER_OP_SET    ? conn->opts->vsize
+                    : ops[i] == SERVER_OP_SCAN ? SCAN_RECORDS
+                                               : 0);
+    write_all(conn->fd, conn->out, conn->outlen);
+    for (i = 0; i < count; i++)
+        read_response(conn, ops[i], keys[i]);
+}
+
+static void *conn_thread(void *arg) {
+    loadgen_conn_t *conn = arg;
+    const loadgen_opts_t *opts = conn->opts;
+    int *ops, i, n, pct;
+    long *keys, key, done;
+    unsigned long start;
+    if ((ops = malloc(opts->depth * sizeof(int))) == NULL ||
+        (keys = malloc(opts->depth * sizeof(long))) == NULL)
+        fatal("Failed to allocate batch");
+
+    // every connection preloads its share of the key space
+    for (key = conn->id, n = 0; opts->preload && key < opts->keys;
+         key += opts->conns) {
+        ops[n] = SERVER_OP_SET;
+        keys[n++] = key;
+        if (n == opts->depth || key + opts->conns >= opts->keys) {
+            run_batch(conn, ops, keys, n);
+            n = 0;
+        }
+    }
+    pthread_barrier_wait(conn->barrier);
+
+    for (done = 0; done < opts->ops; done += n) {
+        n = opts->ops - done < opts->depth ? opts->ops - done : opts->depth;
+        for (i = 0; i < n; i++) {
+            pct = rng_next(&conn->rng) % 100;
+            keys[i] = rng_next(&conn->rng) % opts->keys;
+            if (pct < opts->scan_pct)
+                ops[i] = SERVER_OP_SCAN;
+            else if (pct < opts->scan_pct + opts->read_pct)
+                ops[i] = SERVER_OP_GET;
+            else
+                ops[i] = SERVER_OP_SET;
+        }
+        start = now_ns();
+        run_batch(conn, ops, keys, n);
+        conn->lat[conn->batches++] = now_ns() - start;
+    }
+    conn->done = done;
+    free(keys);
+    free(ops);
+    return NULL;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -H HOST      server address (default 127.0.0.1)\n"
+            "  -p PORT      server port (default 7379)\n"
+            "  -u PATH      connect to a Unix socket instead of TCP\n"
+            "  -c CONNS     number of connections (default 4)\n"
+            "  -n OPS       operations per connection (default 100000)\n"
+            "  -d DEPTH     requests pipelined per round trip (default 16)\n"
+            "  -k KEYS      number of keys (default 100000)\n"
+            "  -r PERCENT   GET percentage (default 90)\n"
+            "  -S PERCENT   SCAN percentage (default 0)\n"
+            "  -v BYTES     value size (default 32)\n"
+            "  -s SEED      random seed (default 1)\n"
+            "  -x           skip preloading the keys\n",
+            name);
+}
+
+int main(int argc, char **argv) {
+    loadgen_opts_t opts = {
+        .host = "127.0.0.1",
+        .port = "7379",
+        .unix_path = NULL,
+        .conns = 4,
+        .ops = 100000,
+        .depth = 16,
+        .keys = 100000,
+        .read_pct = 90,
+        .scan_pct = 0,
+        .vsize = 32,
+        .seed = 1,
+        .preload = 1,
+    };
+    pthread_barrier_t barrier;
+    loadgen_conn_t *conns;
+    pthread_t *threads;
+    unsigned long start, total, *lat;
+    long i, j, nlat = 0, ops = 0, misses = 0, errors = 0;
+    double secs;
+    int opt;
+
+    program_name = "memdb-loadgen";
+    debug_flags = 0;
+
+    while ((opt = getopt(argc, argv, "H:p:u:c:n:d:k:r:S:v:s:xh")) != -1) {
+        switch (opt) {
+        case 'H':
+            opts.host = optarg;
+            break;
+        case 'p':
+            opts.port = optarg;
+            break;
+        case 'u':
+            opts.unix_path = optarg;
+            break;
+        case 'c':
+            opts.conns = atoi(optarg);
+            break;
+        case 'n':
+            opts.ops = atol(optarg);
+            break;
+        case 'd':
+            opts.depth = atoi(optarg);
+            break;
+        case 'k':
+            opts.keys = atol(optarg);
+            break;
+        case 'r':
+            opts.read_pct = atoi(optarg);
+            break;
+        case 'S':
+            opts.scan_pct = atoi(optarg);
+            break;
+        case 'v':
+            opts.vsize = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            opts.seed = strtoul(optarg, NULL, 0);
+            break;
+        case 'x':
+            opts.preload = 0;
+            break;
+        default:
+            usage(argv[0]);
+            return opt != 'h';
+        }
+    }
+    if (opts.conns <= 0 || opts.ops < 0 || opts.depth <= 0 ||
+        opts.keys <= 0 || opts.read_pct + opts.scan_pct > 100 ||
+        opts.vsize + KEY_LEN + sizeof(server_header_t) > SERVER_BUFFER_SIZE) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if ((conns = calloc(opts.conns, sizeof(loadgen_conn_t))) == NULL ||
+        (threads = malloc(opts.conns * sizeof(pthread_t))) == NULL)
+        fatal("Failed to allocate connections");
+    pthread_barrier_init(&barrier, NULL, opts.conns + 1);
+    for (i = 0; i < opts.conns; i++) {
+        conns[i].opts = &opts;
+        conns[i].barrier = &barrier;
+        conns[i].id = i;
+        conns[i].fd = connect_server(&opts);
+        conns[i].rng = opts.seed + i;
+        conns[i].out = malloc(opts.depth * (sizeof(server_header_t) +
+                                            KEY_LEN + opts.vsize));
+        conns[i].in = malloc(SERVER_BUFFER_SIZE);
+        conns[i].lat = malloc((opts.ops / opts.depth + 1) *
+                              sizeof(unsigned long));
+        if (conns[i].out == NULL || conns[i].in == NULL ||
+            conns[i].lat == NULL)
+            fatal("Failed to allocate connection buffers");
+        if (pthread_create(&threads[i], NULL, conn_thread, &conns[i]) != 0)
+            fatal("Failed to start connection thread");
+    }
+    pthread_barrier_wait(&barrier);
+    start = now_ns();
+    for (i = 0; i < opts.conns; i++)
+        pthread_join(threads[i], NULL);
+    total = now_ns() - start;
+
+    for (i = 0; i < opts.conns; i++)
+        nlat += conns[i].batches;
+    if ((lat = malloc((nlat + 1) * sizeof(unsigned long))) == NULL)
+        fatal("Failed to allocate latency samples");
+    for (i = 0, nlat = 0; i < opts.conns; i++) {
+        for (j = 0; j < conns[i].batches; j++)
+            lat[nlat++] = conns[i].lat[j];
+        ops += conns[i].done;
+        misses += conns[i].misses;
+        errors += conns[i].errors;
+        close(conns[i].fd);
+        free(conns[i].out);
+        free(conns[i].in);
+        free(conns[i].lat);
+    }
+    qsort(lat, nlat, sizeof(unsigned long), compare_lat);
+    secs = total / 1e9;
+    printf("{\"transport\":\"%s\",\"conns\":%d,\"depth\":%d,\"keys\":%ld,"
+           "\"read_pct\":%d,\"scan_pct\":%d,\"vsize\":%zu,\"ops\":%ld,"
+           "\"secs\":%.6f,\"ops_per_sec\":%.0f,\"misses\":%ld,"
+           "\"errors\":%ld,\"rtt_p50_ns\":%lu,\"rtt_p99_ns\":%lu,"
+           "\"rtt_p999_ns\":%lu}\n",
+           opts.unix_path != NULL ? "unix" : "tcp", opts.conns, opts.depth,
+           opts.keys, opts.read_pct, opts.scan_pct, opts.vsize, ops, secs,
+           secs > 0 ? ops / secs : 0.0, misses, errors,
+           nlat ? lat[nlat / 2] : 0, nlat ? lat[nlat * 99 / 100] : 0,
+           nlat ? lat[nlat * 999 / 1000] : 0);
+
+    pthread_barrier_destroy(&barrier);
+    free(lat);
+    free(threads);
+    free(conns);
+    return errors != 0;
+}
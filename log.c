@@ -1,4 +1,7 @@
 
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
 #include <time.h>
 #include <syslog.h>
 #include <errno.h>
@@ -23,9 +26,68 @@ int output_log_syslog = 1; // debug log
 time_t error_log_throttle_period = 1200;
 unsigned long error_log_errors_per_period = 200;
 
+#define RECORD_DEBUG 0
+#define RECORD_INFO 1
+#define RECORD_ERROR 2
+#define RECORD_ACCESS 3
+#define RECORD_NOTICE 4
+
+// a log call waiting in a ring buffer for the logging thread
+typedef struct {
+    int type;
+    const char *prefix;
+    const char *file;
+    const char *function;
+    unsigned long line;
+    time_t when;
+    int err;
+    char msg[LOG_RECORD_SIZE];
+} log_record_t;
+
+// single producer, single consumer ring of a thread, the positions live on
+// their own cache lines so writer and logging thread do not share them
+typedef struct log_ring_ {
+    unsigned long head __attribute__((aligned(64)));
+    unsigned long tail __attribute__((aligned(64)));
+    unsigned long dropped;
+    int closed;
+    struct log_ring_ *next;
+    log_record_t records[LOG_RING_RECORDS];
+} log_ring_t;
+
+// protects the ring list and the logging thread state
+static pthread_mutex_t log_rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static log_ring_t *log_rings;
+static pthread_key_t log_ring_key;
+static pthread_once_t log_ring_once = PTHREAD_ONCE_INIT;
+static __thread log_ring_t *log_ring;
+
+static pthread_t log_thread;
+static int log_alive;
+static int log_running;
+static time_t log_clock;
+static unsigned long log_dropped_freed, log_dropped_reported;
+// callers between the log_running check and publishing their record
+static unsigned long log_writers;
+
+static void log_notice(const char *fmt, ...)
+    __attribute__((format(printf, 1, 2)));
+
+// the logging thread keeps a coarse clock, callers never read the time
+static time_t log_time(void) {
+    if (__atomic_load_n(&log_running, __ATOMIC_ACQUIRE))
+        return __atomic_load_n(&log_clock, __ATOMIC_RELAXED);
+    return time(NULL);
+}
+
+// shared by all threads, updated without a lock so a request thread never
+// waits to log
+static time_t throttle_start;
+static unsigned long throttle_counter, throttle_prevented;
+
 int error_log_limit(int reset) {
-    static time_t start = 0;
-    static unsigned long counter = 0, prevented = 0;
+    time_t start, now;
+    unsigned long counter, prevented;
 
     // do not throttle if the period is 0
     if (error_log_throttle_period == 0)
@@ -35,63 +97,349 @@ int error_log_limit(int reset) {
     if (error_log_errors_per_period == 0)
         return 1;
 
-    time_t now = time(NULL);
-    if (!start)
+    now = log_time();
+    start = 0;
+    __atomic_compare_exchange_n(&throttle_start, &start, now, 0,
+                                __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    if (start == 0)
         start = now;
 
     if (reset) {
-        if (prevented) {
-            log_date(stderr);
-            fprintf(stderr, "%s: Resetting logging for process '%s' (prevented "
-                            "%lu logs in the last %ld seconds).\n",
-                    program_name, program_name, prevented, now - start);
-        }
-
+        __atomic_store_n(&throttle_start, now, __ATOMIC_RELAXED);
+        __atomic_store_n(&throttle_counter, 0, __ATOMIC_RELAXED);
+        prevented = __atomic_exchange_n(&throttle_prevented, 0,
+                                        __ATOMIC_RELAXED);
+        if (prevented)
+            log_notice("Resetting logging for process '%s' (prevented %lu "
+                       "logs in the last %ld seconds).",
+                       program_name, prevented, now - start);
+        start = now;
+    } else if (now - start > error_log_throttle_period &&
+               __atomic_compare_exchange_n(&throttle_start, &start, now, 0,
+                                           __ATOMIC_RELAXED,
+                                           __ATOMIC_RELAXED)) {
+        // only the thread that moved the start restarts the period
+        __atomic_store_n(&throttle_counter, 0, __ATOMIC_RELAXED);
+        prevented = __atomic_exchange_n(&throttle_prevented, 0,
+                                        __ATOMIC_RELAXED);
+        if (prevented)
+            log_notice("Resuming logging from process '%s' (prevented %lu "
+                       "logs in the last %ld seconds).",
+                       program_name, prevented, error_log_throttle_period);
         start = now;
-        counter = 0;
-        prevented = 0;
     }
 
     // detect if we log too much
-    counter++;
-
-    if (now - start > error_log_throttle_period) {
-        if (prevented) {
-            log_date(stderr);
-            fprintf(stderr, "%s: Resuming logging from process '%s' (prevented "
-                            "%lu logs in the last %ld seconds).\n",
-                    program_name, program_name, prevented,
-                    error_log_throttle_period);
-        }
+    counter = __atomic_add_fetch(&throttle_counter, 1, __ATOMIC_RELAXED);
+    if (counter <= error_log_errors_per_period)
+        return 0;
 
-        // restart the period accounting
-        start = now;
-        counter = 1;
-        prevented = 0;
+    if (__atomic_fetch_add(&throttle_prevented, 1, __ATOMIC_RELAXED) == 0)
+        log_notice("Too many logs (%lu logs in %ld seconds, threshold is set "
+                   "to %lu logs in %ld seconds). Preventing more logs from "
+                   "process '%s' for %ld seconds.",
+                   counter, now - start, error_log_errors_per_period,
+                   error_log_throttle_period, program_name,
+                   start + error_log_throttle_period - now);
+
+    // prevent logging this error
+    return 1;
+}
+
+static void ring_release(void *arg) {
+    log_ring_t *ring = arg, **prev;
+
+    pthread_mutex_lock(&log_rings_mutex);
+    if (log_alive) {
+        // the logging thread writes out what is left and frees it
+        ring->closed = 1;
+    } else {
+        for (prev = &log_rings; *prev != ring; prev = &(*prev)->next)
+            ;
+        *prev = ring->next;
+        log_dropped_freed += ring->dropped;
+        free(ring);
+    }
+    pthread_mutex_unlock(&log_rings_mutex);
+}
+
+static void ring_key_create(void) {
+    pthread_key_create(&log_ring_key, ring_release);
+}
+
+static log_ring_t *ring_register(void) {
+    log_ring_t *ring;
+
+    pthread_once(&log_ring_once, ring_key_create);
+    if (posix_memalign((void **)&ring, 64, sizeof(log_ring_t)) != 0)
+        return NULL;
+    memset(ring, 0, sizeof(log_ring_t));
 
-        // log this error
+    pthread_mutex_lock(&log_rings_mutex);
+    ring->next = log_rings;
+    log_rings = ring;
+    pthread_mutex_unlock(&log_rings_mutex);
+
+    pthread_setspecific(log_ring_key, ring);
+    log_ring = ring;
+    return ring;
+}
+
+// returns 0 if the record was queued or dropped, -1 to log synchronously
+static int log_enqueue(int type, const char *prefix, const char *file,
+                       const char *function, unsigned long line, int err,
+                       const char *fmt, va_list args) {
+    log_ring_t *ring;
+    log_record_t *rec;
+    unsigned long tail;
+
+    // the logging thread waits for writers past this check before its
+    // final drain, both sides use sequentially consistent ordering
+    __atomic_add_fetch(&log_writers, 1, __ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&log_running, __ATOMIC_SEQ_CST) ||
+        ((ring = log_ring) == NULL && (ring = ring_register()) == NULL)) {
+        __atomic_sub_fetch(&log_writers, 1, __ATOMIC_RELEASE);
+        return -1;
+    }
+
+    // never wait for the logging thread, drop the record instead
+    tail = ring->tail;
+    if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) ==
+        LOG_RING_RECORDS) {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&log_writers, 1, __ATOMIC_RELEASE);
         return 0;
     }
 
-    if (counter > error_log_errors_per_period) {
-        if (!prevented) {
-            log_date(stderr);
-            fprintf(stderr, "%s: Too many logs (%lu logs in %ld seconds, "
-                            "threshold is set to %lu logs in %ld seconds). "
-                            "Preventing more logs from process '%s' for %ld "
-                            "seconds.\n",
-                    program_name, counter, now - start,
-                    error_log_errors_per_period, error_log_throttle_period,
-                    program_name, start + error_log_throttle_period - now);
+    rec = &ring->records[tail & (LOG_RING_RECORDS - 1)];
+    rec->type = type;
+    rec->prefix = prefix;
+    rec->file = file;
+    rec->function = function;
+    rec->line = line;
+    rec->when = __atomic_load_n(&log_clock, __ATOMIC_RELAXED);
+    rec->err = err;
+    vsnprintf(rec->msg, sizeof(rec->msg), fmt, args);
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    __atomic_sub_fetch(&log_writers, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// throttling notices, never throttled themselves
+static void log_notice(const char *fmt, ...) {
+    va_list args;
+    int queued;
+
+    va_start(args, fmt);
+    queued = !log_enqueue(RECORD_NOTICE, NULL, NULL, NULL, 0, 0, fmt, args);
+    va_end(args);
+    if (queued)
+        return;
+
+    flockfile(stderr);
+    log_date(stderr);
+    fprintf(stderr, "%s: ", program_name);
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    fprintf(stderr, "\n");
+    funlockfile(stderr);
+}
+
+static const char *record_date(time_t when) {
+    static char date[64];
+    static time_t cached = -1;
+    struct tm tmbuf;
+
+    // records arrive in bursts within the same second
+    if (when != cached) {
+        date[0] = '\0';
+        if (localtime_r(&when, &tmbuf) != NULL)
+            strftime(date, sizeof(date), "%y-%m-%d %H:%M:%S", &tmbuf);
+        cached = when;
+    }
+    return date;
+}
+
+static void record_write(const log_record_t *rec) {
+    const char *date = record_date(rec->when);
+    char buf[200];
+
+    switch (rec->type) {
+    case RECORD_DEBUG:
+        fprintf(stdout, "%s: DEBUG (%s:%s:%04lu): %s: %s\n", date, rec->file,
+                rec->function, rec->line, program_name, rec->msg);
+        if (output_log_syslog)
+            syslog(LOG_ERR, "%s", rec->msg);
+        break;
+    case RECORD_INFO:
+        if (debug_flags)
+            fprintf(stderr, "%s: INFO (%s:%s:%04lu): %s: %s\n", date,
+                    rec->file, rec->function, rec->line, program_name,
+                    rec->msg);
+        else
+            fprintf(stderr, "%s: INFO: %s: %s\n", date, program_name,
+                    rec->msg);
+        if (error_log_syslog)
+            syslog(LOG_INFO, "%s", rec->msg);
+        break;
+    case RECORD_ERROR:
+        if (debug_flags)
+            fprintf(stderr, "%s: %s (%s:%s:%04lu): %s: %s", date, rec->prefix,
+                    rec->file, rec->function, rec->line, program_name,
+                    rec->msg);
+        else
+            fprintf(stderr, "%s: %s: %s: %s", date, rec->prefix, program_name,
+                    rec->msg);
+        if (rec->err)
+            fprintf(stderr, " (errno %d, %s)\n", rec->err,
+                    strerror_r(rec->err, buf, sizeof(buf)));
+        else
+            fprintf(stderr, "\n");
+        if (error_log_syslog)
+            syslog(LOG_ERR, "%s", rec->msg);
+        break;
+    case RECORD_NOTICE:
+        fprintf(stderr, "%s: %s: %s\n", date, program_name, rec->msg);
+        break;
+    case RECORD_ACCESS:
+        if (stdaccess)
+            fprintf(stdaccess, "%s: %s\n", date, rec->msg);
+        if (access_log_syslog)
+            syslog(LOG_INFO, "%s", rec->msg);
+        break;
+    }
+}
+
+static long ring_drain(log_ring_t *ring) {
+    unsigned long head = ring->head;
+    unsigned long tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    long count = 0;
+
+    for (; head != tail; head++, count++) {
+        record_write(&ring->records[head & (LOG_RING_RECORDS - 1)]);
+        // hand the slot back right away, the writer may be waiting for room
+        __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    }
+    return count;
+}
+
+// free the rings of threads that exited, only called by the thread that
+// drains the rings
+static void ring_sweep(void) {
+    log_ring_t **prev, *ring;
+
+    pthread_mutex_lock(&log_rings_mutex);
+    for (prev = &log_rings; (ring = *prev) != NULL;) {
+        if (!ring->closed) {
+            prev = &ring->next;
+            continue;
         }
+        ring_drain(ring);
+        log_dropped_freed += ring->dropped;
+        *prev = ring->next;
+        free(ring);
+    }
+    pthread_mutex_unlock(&log_rings_mutex);
+}
 
-        prevented++;
+unsigned long log_dropped(void) {
+    unsigned long dropped;
+    log_ring_t *ring;
 
-        // prevent logging this error
-        return 1;
+    pthread_mutex_lock(&log_rings_mutex);
+    dropped = log_dropped_freed;
+    for (ring = log_rings; ring != NULL; ring = ring->next)
+        dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&log_rings_mutex);
+    return dropped;
+}
+
+static long log_drain(void) {
+    unsigned long dropped;
+    log_ring_t *ring;
+    long count = 0;
+
+    // rings are only added at the head and only freed by this thread
+    pthread_mutex_lock(&log_rings_mutex);
+    ring = log_rings;
+    pthread_mutex_unlock(&log_rings_mutex);
+    for (; ring != NULL; ring = ring->next)
+        count += ring_drain(ring);
+
+    dropped = log_dropped();
+    if (dropped != log_dropped_reported) {
+        fprintf(stderr, "%s: %s: Dropped %lu log records, the log buffers "
+                        "were full.\n",
+                record_date(log_time()), program_name,
+                dropped - log_dropped_reported);
+        log_dropped_reported = dropped;
+        count++;
     }
 
-    return 0;
+    // one flush per batch instead of one per record
+    if (count) {
+        fflush(stdout);
+        fflush(stderr);
+        if (stdaccess)
+            fflush(stdaccess);
+    }
+    return count;
+}
+
+static void *log_main(void *arg) {
+    struct timespec period = {0, LOG_ASYNC_PERIOD * 1000000L};
+    (void)arg;
+
+    while (__atomic_load_n(&log_running, __ATOMIC_ACQUIRE)) {
+        __atomic_store_n(&log_clock, time(NULL), __ATOMIC_RELAXED);
+        if (log_drain() == 0)
+            nanosleep(&period, NULL);
+        ring_sweep();
+    }
+
+    // callers went back to synchronous logging, write out the rest once
+    // the ones that saw the thread running published their records
+    while (__atomic_load_n(&log_writers, __ATOMIC_SEQ_CST) != 0)
+        sched_yield();
+    log_drain();
+    ring_sweep();
+    return NULL;
+}
+
+int log_async_start(void) {
+    int retval = 0;
+
+    pthread_mutex_lock(&log_rings_mutex);
+    if (!log_alive) {
+        __atomic_store_n(&log_clock, time(NULL), __ATOMIC_RELAXED);
+        __atomic_store_n(&log_running, 1, __ATOMIC_RELEASE);
+        if (pthread_create(&log_thread, NULL, log_main, NULL) != 0) {
+            __atomic_store_n(&log_running, 0, __ATOMIC_RELEASE);
+            retval = -1;
+        } else
+            log_alive = 1;
+    }
+    pthread_mutex_unlock(&log_rings_mutex);
+
+    if (retval)
+        error("Failed to start the logging thread");
+    return retval;
+}
+
+void log_async_stop(void) {
+    if (!__atomic_exchange_n(&log_running, 0, __ATOMIC_SEQ_CST))
+        return;
+    pthread_join(log_thread, NULL);
+
+    pthread_mutex_lock(&log_rings_mutex);
+    log_alive = 0;
+    pthread_mutex_unlock(&log_rings_mutex);
+
+    // rings of threads that exited while the logging thread stopped
+    ring_sweep();
+    fflush(stdout);
+    fflush(stderr);
 }
 
 void log_date(FILE *out) {
@@ -113,7 +461,21 @@ void log_date(FILE *out) {
 void debug_int(const char *file, const char *function, const unsigned long line,
                const char *fmt, ...) {
     va_list args;
+    int queued;
+
+    // checked here to keep a single branch at the call site
+    if (silent)
+        return;
+
+    va_start(args, fmt);
+    queued = !log_enqueue(RECORD_DEBUG, "DEBUG", file, function, line, 0, fmt,
+                          args);
+    va_end(args);
+    if (queued)
+        return;
 
+    // keep the lines of concurrent threads apart
+    flockfile(stdout);
     log_date(stdout);
     va_start(args, fmt);
     fprintf(stdout, "DEBUG (%s:%s:%04lu): %s: ", file, function, line,
@@ -122,6 +484,7 @@ void debug_int(const char *file, const char *function, const unsigned long line,
     va_end(args);
     fprintf(stdout, "\n");
     fflush(stdout);
+    funlockfile(stdout);
 
     if (output_log_syslog) {
         va_start(args, fmt);
@@ -133,11 +496,20 @@ void debug_int(const char *file, const char *function, const unsigned long line,
 void info_int(const char *file, const char *function, const unsigned long line,
               const char *fmt, ...) {
     va_list args;
+    int queued;
 
     // prevent logging too much
     if (error_log_limit(0))
         return;
 
+    va_start(args, fmt);
+    queued = !log_enqueue(RECORD_INFO, "INFO", file, function, line, 0, fmt,
+                          args);
+    va_end(args);
+    if (queued)
+        return;
+
+    flockfile(stderr);
     log_date(stderr);
 
     va_start(args, fmt);
@@ -150,6 +522,7 @@ void info_int(const char *file, const char *function, const unsigned long line,
     va_end(args);
 
     fprintf(stderr, "\n");
+    funlockfile(stderr);
 
     if (error_log_syslog) {
         va_start(args, fmt);
@@ -161,11 +534,22 @@ void info_int(const char *file, const char *function, const unsigned long line,
 void error_int(const char *prefix, const char *file, const char *function,
                const unsigned long line, const char *fmt, ...) {
     va_list args;
+    int queued;
 
     // prevent logging too much
     if (error_log_limit(0))
         return;
 
+    va_start(args, fmt);
+    queued = !log_enqueue(RECORD_ERROR, prefix, file, function, line, errno,
+                          fmt, args);
+    va_end(args);
+    if (queued) {
+        errno = 0;
+        return;
+    }
+
+    flockfile(stderr);
     log_date(stderr);
 
     va_start(args, fmt);
@@ -184,6 +568,7 @@ void error_int(const char *prefix, const char *file, const char *function,
         errno = 0;
     } else
         fprintf(stderr, "\n");
+    funlockfile(stderr);
 
     if (error_log_syslog) {
         va_start(args, fmt);
@@ -196,6 +581,10 @@ void fatal_int(const char *file, const char *function, const unsigned long line,
                const char *fmt, ...) {
     va_list args;
 
+    // write out what was logged before, the process is about to exit
+    log_async_stop();
+
+    flockfile(stderr);
     log_date(stderr);
 
     va_start(args, fmt);
@@ -209,6 +598,7 @@ void fatal_int(const char *file, const char *function, const unsigned long line,
 
     perror(" # ");
     fprintf(stderr, "\n");
+    funlockfile(stderr);
 
     if (error_log_syslog) {
         va_start(args, fmt);
@@ -221,8 +611,16 @@ void fatal_int(const char *file, const char *function, const unsigned long line,
 
 void log_access(const char *fmt, ...) {
     va_list args;
+    int queued;
+
+    va_start(args, fmt);
+    queued = !log_enqueue(RECORD_ACCESS, NULL, NULL, NULL, 0, 0, fmt, args);
+    va_end(args);
+    if (queued)
+        return;
 
     if (stdaccess) {
+        flockfile(stdaccess);
         log_date(stdaccess);
 
         va_start(args, fmt);
@@ -230,6 +628,7 @@ void log_access(const char *fmt, ...) {
         va_end(args);
         fprintf(stdaccess, "\n");
         fflush(stdaccess);
+        funlockfile(stdaccess);
     }
 
     if (access_log_syslog) {
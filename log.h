@@ -45,10 +45,39 @@
 #define D_CONFIG 0x00000200
 #define D_WORKERQUEUE 0x00000400
 #define D_SCHEDULER 0x00000800
+#define D_STORAGE 0x00001000
+#define D_BPTREE 0x00002000
 #define D_TESTS 0X80000000
 
 
+#ifndef DEBUG
 #define DEBUG D_SCHEDULER | D_AVLTREE | D_BITREE | D_CONFIG | D_FLEX
+#endif
+
+/*
+    Compile time log level, set through the log_level meson option. Log
+    calls above this level are compiled out completely.
+*/
+#define LOG_LEVEL_FATAL 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_DEBUG 3
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+/*
+    Asynchronous logging. Every thread gets a ring of LOG_RING_RECORDS
+    records holding messages of up to LOG_RECORD_SIZE bytes, longer
+    messages are truncated. The logging thread drains the rings every
+    LOG_ASYNC_PERIOD milliseconds when it finds them empty. The throttle
+    counters are atomic and its notices go through the rings too, so a
+    caller never takes a lock or writes to a stream.
+*/
+#define LOG_RECORD_SIZE 256
+#define LOG_RING_RECORDS 256
+#define LOG_ASYNC_PERIOD 10
 
 extern unsigned long long debug_flags;
 extern const char *program_name;
@@ -71,16 +100,47 @@ extern int error_log_limit(int reset);
         error_log_limit(1);                                                    \
     } while (0)
 
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
 #define debug(type, args...)                                                   \
     do {                                                                       \
-        if (unlikely(!silent && (debug_flags & type)))                         \
+        if (unlikely(debug_flags & (type)))                                    \
             debug_int(__FILENAME__, __FUNCTION__, __LINE__, ##args);           \
     } while (0)
+#else
+#define debug(type, args...)                                                   \
+    do {                                                                       \
+        if (0)                                                                 \
+            debug_int(__FILENAME__, __FUNCTION__, __LINE__, ##args);           \
+    } while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
 #define info(args...) info_int(__FILE__, __FUNCTION__, __LINE__, ##args)
 #define infoerr(args...)                                                       \
     error_int("INFO", __FILENAME__, __FUNCTION__, __LINE__, ##args)
+#else
+#define info(args...)                                                          \
+    do {                                                                       \
+        if (0)                                                                 \
+            info_int(__FILE__, __FUNCTION__, __LINE__, ##args);                \
+    } while (0)
+#define infoerr(args...)                                                       \
+    do {                                                                       \
+        if (0)                                                                 \
+            error_int("INFO", __FILENAME__, __FUNCTION__, __LINE__, ##args);   \
+    } while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
 #define error(args...)                                                         \
     error_int("ERROR", __FILENAME__, __FUNCTION__, __LINE__, ##args)
+#else
+#define error(args...)                                                         \
+    do {                                                                       \
+        if (0)                                                                 \
+            error_int("ERROR", __FILENAME__, __FUNCTION__, __LINE__, ##args);  \
+    } while (0)
+#endif
 #define fatal(args...) fatal_int(__FILENAME__, __FUNCTION__, __LINE__, ##args)
 
 extern void log_date(FILE *out);
@@ -96,4 +156,22 @@ extern void fatal_int(const char *file, const char *function,
     __attribute__((noreturn));
 extern void log_access(const char *fmt, ...);
 
+/*
+    Hand formatting and I/O of all logs but fatal ones to a background
+    thread. Callers only format the message into their own ring buffer, a
+    full buffer drops the record instead of blocking. Returns 0 if
+    successful, -1 if the thread could not be started.
+*/
+extern int log_async_start(void);
+
+/*
+    Write out everything still buffered and go back to synchronous logging
+*/
+extern void log_async_stop(void);
+
+/*
+    Number of records dropped because a ring buffer was full
+*/
+extern unsigned long log_dropped(void);
+
 #endif
@@ -1,60 +1,185 @@
 #include <stdlib.h>
 #include <stdio.h>
-#include <malloc.h>
+#include <signal.h>
 #include <string.h>
+#include <unistd.h>
 
-#include "avl.h"
 #include "log.h"
+#include "memdb.h"
+#include "server.h"
+#include "workqueue.h"
 
-struct key_value_t {
-	char key[200];
-	char val[200];
-};
-
-struct key_value_t key1 = {
-	.key = "ip",
-	.val = "192.168.1.22",
-};
-
-struct key_value_t key2 = {
-	.key = "ms_ip",
-	.val = "192.168.1.253",
-};
-
-struct key_value_t key3 = {
-	.key = "radio_ip",
-	.val = "192.168.2.22",
-};
+static server_t *server;
+static memdb_t *db;
+static const char *snapshot_path;
 
+static void handle_signal(int sig)
+{
+	(void)sig;
+	if (server != NULL)
+		server_stop(server);
+}
 
-int compare_keys(const void *k1, const void *k2)
+static void snapshot_job(void *arg)
 {
-	struct key_value_t *x1, *x2;
-	x1 = (struct key_value_t*)k1;
-	x2 = (struct key_value_t*)k2;
-	return strcmp(x1->key, x2->key);
+	(void)arg;
+	if (memdb_snapshot_write(db, snapshot_path) != 0)
+		error("Failed to write snapshot %s", snapshot_path);
+	else
+		debug(D_SCHEDULER, "Wrote snapshot %s", snapshot_path);
 }
 
-void populate_db(avl_tree_t *tree)
+static void usage(const char *name)
 {
-	avl_insert(tree, (void*)&key1);
-	avl_insert(tree, (void*)&key2);
-	avl_insert(tree, (void*)&key3);
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -H HOST      TCP address to listen on (default 127.0.0.1)\n"
+		"  -p PORT      TCP port (default 7379)\n"
+		"  -T           do not listen on TCP\n"
+		"  -u PATH      Unix socket to listen on\n"
+		"  -e ENGINE    avl or bptree (default avl)\n"
+		"  -l PATH      write-ahead log\n"
+		"  -g USEC      group commit window of the log (default 0)\n"
+		"  -b BYTES     connection buffer size, also the largest request\n"
+		"               (default %d)\n"
+		"  -q BUFFERS   output buffers a connection may queue (default %d)\n"
+		"  -w WORKERS   worker threads running writes and background jobs\n"
+		"               (default 0, writes run on the event loop)\n"
+		"  -P           pin the workers to CPUs\n"
+		"  -S PATH      snapshot to start from, rewritten in the\n"
+		"               background to cut the log short\n"
+		"  -I SECS      snapshot interval (default 60)\n"
+		"  -a           log from a background thread\n"
+		"  -D FLAGS     debug flags\n",
+		name, SERVER_BUFFER_SIZE, SERVER_CONN_BUFFERS);
 }
 
-int main()
+int main(int argc, char **argv)
 {
-	avl_tree_t *tree = avl_init(compare_keys, free); 
-	struct key_value_t *search = malloc(sizeof(struct key_value_t));
-	strcpy(search->key, "ip");
+	memdb_config_t db_config = { .engine = MEMDB_ENGINE_AVL };
+	server_config_t config = { .host = "127.0.0.1", .port = 7379 };
+	workqueue_config_t wq_config = { .workers = 0 };
+	workqueue_stats_t stats;
+	workqueue_t *wq = NULL;
+	struct sigaction sa;
+	server_t *srv;
+	long interval = 60;
+	int opt, retval, offload, async = 0;
+
+	program_name = "memdb";
+	debug_flags = 0;
 
-	populate_db(tree);
+	while ((opt = getopt(argc, argv, "H:p:Tu:e:l:g:b:q:w:PS:I:aD:h")) != -1) {
+		switch (opt) {
+		case 'H':
+			config.host = optarg;
+			break;
+		case 'p':
+			config.port = atoi(optarg);
+			break;
+		case 'T':
+			config.host = NULL;
+			break;
+		case 'u':
+			config.unix_path = optarg;
+			break;
+		case 'e':
+			if (!strcmp(optarg, "bptree"))
+				db_config.engine = MEMDB_ENGINE_BPTREE;
+			else if (!strcmp(optarg, "avl"))
+				db_config.engine = MEMDB_ENGINE_AVL;
+			else {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'l':
+			db_config.wal = optarg;
+			break;
+		case 'g':
+			db_config.wal_delay = atol(optarg);
+			break;
+		case 'b':
+			config.buffer_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'q':
+			config.conn_buffers = atoi(optarg);
+			break;
+		case 'w':
+			wq_config.workers = atoi(optarg);
+			break;
+		case 'P':
+			wq_config.pin = 1;
+			break;
+		case 'S':
+			snapshot_path = optarg;
+			db_config.snapshot = optarg;
+			break;
+		case 'I':
+			interval = atol(optarg);
+			break;
+		case 'a':
+			async = 1;
+			break;
+		case 'D':
+			debug_flags = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return opt != 'h';
+		}
+	}
+
+	if (snapshot_path != NULL && interval <= 0) {
+		usage(argv[0]);
+		return 1;
+	}
 
-	int result = avl_lookup(tree, (void **)&search);
-	if (!result) {
-		printf("result found!\n");
-		printf("%s\n", search->val);
+	if (async && log_async_start() != 0)
+		fatal("Failed to start logging");
+	if ((db = memdb_init(&db_config)) == NULL)
+		fatal("Failed to open database");
+	if (wq_config.workers > 0 || snapshot_path != NULL) {
+		// background snapshots alone do not move writes off the loop
+		offload = wq_config.workers > 0;
+		if (!offload)
+			wq_config.workers = 1;
+		if ((wq = workqueue_init(&wq_config)) == NULL)
+			fatal("Failed to start workers");
+		if (offload)
+			config.workqueue = wq;
+		if (snapshot_path != NULL &&
+		    workqueue_every(wq, interval * 1000, snapshot_job, NULL) != 0)
+			fatal("Failed to schedule snapshots");
 	}
+	if ((server = server_init(db, &config)) == NULL)
+		fatal("Failed to start server");
 
-	bitree_destroy(tree);
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handle_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	if (config.host != NULL)
+		info("Serving %ld keys on %s:%d", memdb_size(db), config.host,
+		     server_port(server));
+	if (config.unix_path != NULL)
+		info("Serving %ld keys on %s", memdb_size(db),
+		     config.unix_path);
+	retval = server_run(server);
+
+	srv = server;
+	server = NULL;
+	server_destroy(srv);
+	if (wq != NULL) {
+		workqueue_stats(wq, &stats);
+		info("Workers ran %lu jobs, %lu stolen, %lu rejected, "
+		     "average wait %lu ns, longest wait %lu ns",
+		     stats.executed, stats.stolen, stats.rejected,
+		     stats.wait_avg, stats.wait_max);
+		workqueue_destroy(wq);
+	}
+	memdb_destroy(db);
+	log_async_stop();
+	return retval != 0;
 }
@@ -0,0 +1,436 @@
+/** @file memdb.c
+ *  @brief Functions for the key/value database.
+ *
+ *  This file contains the functions to control a key/value database with
+ *  an optional write-ahead log
+ *
+ *  @author Bram Vlerick (bram.vlerick@ucast.be)
+ *  @bug
+ *  * None at the moment
+ */
+
+#include <unistd.h>
+
+#include "memdb.h"
+
+static record_t *find(memdb_t *db, const char *key, size_t klen) {
+    record_t probe, *rec = &probe;
+    int retval;
+    record_probe(&probe, key, klen);
+    if (db->bptree != NULL)
+        retval = bptree_lookup(db->bptree, (void **)&rec);
+    else
+        retval = avl_lookup(db->tree, (void **)&rec);
+    return retval == 0 ? rec : NULL;
+}
+
+static int tree_insert(memdb_t *db, record_t *rec) {
+    if (db->bptree != NULL)
+        return bptree_insert(db->bptree, rec);
+    return avl_insert(db->tree, rec);
+}
+
+static int tree_remove(memdb_t *db, record_t *rec) {
+    if (db->bptree != NULL)
+        return bptree_remove(db->bptree, rec);
+    return avl_remove(db->tree, rec);
+}
+
+// a snapshot being written may still read the record, keep it until then
+static void retire(memdb_t *db, record_t *rec) {
+    record_t **retired;
+    long size;
+    if (db->view == NULL) {
+        record_free(db->arena, rec);
+        return;
+    }
+    if (db->retired_count == db->retired_size) {
+        size = db->retired_size ? db->retired_size * 2 : 64;
+        if ((retired = realloc(db->retired, size * sizeof(record_t *))) ==
+            NULL) {
+            // leaking beats freeing a record the snapshot may still read
+            error("Failed to retire record");
+            return;
+        }
+        db->retired = retired;
+        db->retired_size = size;
+    }
+    db->retired[db->retired_count++] = rec;
+    return;
+}
+
+static int apply_set(memdb_t *db, record_t *rec, const char *key,
+                     size_t klen, const char *val, size_t vlen) {
+    record_t *old = rec;
+    // while a snapshot is written records are not changed in place
+    if (rec != NULL && db->view == NULL)
+        return record_set_val(db->arena, rec, val, vlen);
+    if ((rec = record_new(db->arena, key, klen, val, vlen)) == NULL)
+        return -1;
+    if ((old != NULL ? avl_replace(db->tree, rec) : tree_insert(db, rec)) !=
+        0) {
+        record_free(db->arena, rec);
+        return -1;
+    }
+    if (old != NULL)
+        retire(db, old);
+    return 0;
+}
+
+static int apply_del(memdb_t *db, record_t *rec) {
+    if (tree_remove(db, rec) != 0)
+        return -1;
+    retire(db, rec);
+    return 0;
+}
+
+static int replay(int op, const char *key, size_t klen, const char *val,
+                  size_t vlen, void *arg) {
+    memdb_t *db = arg;
+    record_t *rec = find(db, key, klen);
+    if (op == WAL_REMOVE)
+        return rec != NULL ? apply_del(db, rec) : 0;
+    return apply_set(db, rec, key, klen, val, vlen);
+}
+
+static int load_record(memdb_t *db, snapshot_t *snap, long pos,
+                       record_t **rec) {
+    const char *key, *val;
+    size_t klen, vlen;
+    if (snapshot_entry(snap, pos, &key, &klen, &val, &vlen) != 0 ||
+        (*rec = record_new(db->arena, key, klen, val, vlen)) == NULL)
+        return -1;
+    return 0;
+}
+
+// on failure the caller destroys the arena and every record loaded so far
+static int load_snapshot(memdb_t *db, const char *path) {
+    snapshot_t *snap;
+    record_t **recs, *rec;
+    long i, count;
+    int retval = 0;
+    if (access(path, F_OK) != 0)
+        return 0;
+    if ((snap = snapshot_open(path)) == NULL)
+        return -1;
+    count = snapshot_count(snap);
+    if (db->bptree != NULL) {
+        for (i = 0; i < count && retval == 0; i++)
+            if ((retval = load_record(db, snap, i, &rec)) == 0)
+                retval = bptree_insert(db->bptree, rec);
+        snapshot_close(snap);
+        debug(D_STORAGE, "Loaded %ld keys from snapshot %s", count, path);
+        return retval != 0 ? -1 : 0;
+    }
+    // the snapshot is sorted, so the tree is built in a single pass
+    if ((recs = malloc((count + 1) * sizeof(record_t *))) == NULL) {
+        error("Failed to allocate snapshot records");
+        snapshot_close(snap);
+        return -1;
+    }
+    for (i = 0; i < count && retval == 0; i++)
+        retval = load_record(db, snap, i, &recs[i]);
+    if (retval == 0)
+        retval = avl_bulk_load(db->tree, (void **)recs, count);
+    free(recs);
+    snapshot_close(snap);
+    debug(D_STORAGE, "Loaded %ld keys from snapshot %s", count, path);
+    return retval != 0 ? -1 : 0;
+}
+
+memdb_t *memdb_init(const memdb_config_t *config) {
+    avl_key_t key = {.mode = AVL_KEY_STRING, .bytes = record_key};
+    memdb_t *db;
+    if ((db = calloc(1, sizeof(memdb_t))) == NULL) {
+        error("Failed to allocate database");
+        return NULL;
+    }
+    pthread_rwlock_init(&db->lock, NULL);
+    pthread_mutex_init(&db->snapshot_lock, NULL);
+    if ((db->arena = record_arena_init()) == NULL) {
+        memdb_destroy(db);
+        return NULL;
+    }
+    if (config != NULL && config->engine == MEMDB_ENGINE_BPTREE)
+        db->bptree = bptree_init_key(record_compare, &key, NULL);
+    else
+        db->tree = avl_init_key(record_compare, &key, NULL);
+    if (db->tree == NULL && db->bptree == NULL) {
+        memdb_destroy(db);
+        return NULL;
+    }
+    if (config != NULL && config->snapshot != NULL &&
+        ((db->snapshot = strdup(config->snapshot)) == NULL ||
+         load_snapshot(db, config->snapshot) != 0)) {
+        error("Failed to load snapshot %s", config->snapshot);
+        memdb_destroy(db);
+        return NULL;
+    }
+    if (config != NULL && config->wal != NULL &&
+        (db->wal = wal_open(config->wal, config->wal_delay, replay, db)) ==
+            NULL) {
+        memdb_destroy(db);
+        return NULL;
+    }
+    debug(D_STORAGE, "Initialised database with %ld keys", memdb_size(db));
+    return db;
+}
+
+void memdb_destroy(memdb_t *db) {
+    if (!db) {
+        debug(D_STORAGE, "Database pointer cannot be NULL");
+        return;
+    }
+    debug(D_STORAGE, "Destroying database");
+    if (db->wal != NULL)
+        wal_close(db->wal);
+    if (db->tree != NULL)
+        avl_destroy(db->tree);
+    if (db->bptree != NULL)
+        bptree_destroy(db->bptree);
+    if (db->arena != NULL)
+        record_arena_destroy(db->arena);
+    pthread_rwlock_destroy(&db->lock);
+    pthread_mutex_destroy(&db->snapshot_lock);
+    free(db->retired);
+    free(db->snapshot);
+    memset(db, 0, sizeof(memdb_t));
+    free(db);
+    return;
+}
+
+int memdb_set(memdb_t *db, const char *key, size_t klen, const char *val,
+              size_t vlen) {
+    record_t *rec;
+    long seq = 0;
+    int retval;
+    pthread_rwlock_wrlock(&db->lock);
+    rec = find(db, key, klen);
+    // log before applying so the log order is the apply order
+    if (db->wal != NULL &&
+        (seq = wal_append(db->wal, rec != NULL ? WAL_REPLACE : WAL_INSERT, key,
+                          klen, val, vlen)) < 0) {
+        pthread_rwlock_unlock(&db->lock);
+        return -1;
+    }
+    retval = apply_set(db, rec, key, klen, val, vlen);
+    pthread_rwlock_unlock(&db->lock);
+    // wait for durability outside the lock so commits can be grouped
+    if (retval == 0 && db->wal != NULL)
+        retval = wal_sync(db->wal, seq);
+    return retval;
+}
+
+int memdb_del(memdb_t *db, const char *key, size_t klen) {
+    record_t *rec;
+    long seq = 0;
+    int retval;
+    pthread_rwlock_wrlock(&db->lock);
+    if ((rec = find(db, key, klen)) == NULL) {
+        pthread_rwlock_unlock(&db->lock);
+        return -1;
+    }
+    if (db->wal != NULL &&
+        (seq = wal_append(db->wal, WAL_REMOVE, key, klen, NULL, 0)) < 0) {
+        pthread_rwlock_unlock(&db->lock);
+        return -1;
+    }
+    retval = apply_del(db, rec);
+    pthread_rwlock_unlock(&db->lock);
+    if (retval == 0 && db->wal != NULL)
+        retval = wal_sync(db->wal, seq);
+    return retval;
+}
+
+long memdb_get(memdb_t *db, const char *key, size_t klen, char *buf,
+               size_t size) {
+    record_t *rec;
+    long len = -1;
+    pthread_rwlock_rdlock(&db->lock);
+    if ((rec = find(db, key, klen)) != NULL) {
+        len = record_str_len(&rec->val);
+        if (size > 0)
+            memcpy(buf, record_str_data(&rec->val),
+                   (size_t)len < size ? (size_t)len : size);
+    }
+    pthread_rwlock_unlock(&db->lock);
+    return len;
+}
+
+/** @brief Definition of a scan in progress */
+typedef struct {
+    int (*callback)(const char *key, size_t klen, const char *val,
+                    size_t vlen, void *arg);
+    void *arg;
+} scan_t;
+
+static int scan_record(void *data, void *arg) {
+    record_t *rec = data;
+    scan_t *scan = arg;
+    return scan->callback(record_str_data(&rec->key),
+                          record_str_len(&rec->key),
+                          record_str_data(&rec->val),
+                          record_str_len(&rec->val), scan->arg);
+}
+
+long memdb_scan(memdb_t *db, const char *lo, size_t lolen, const char *hi,
+                size_t hilen,
+                int (*callback)(const char *key, size_t klen, const char *val,
+                                size_t vlen, void *arg),
+                void *arg) {
+    scan_t scan = {callback, arg};
+    record_t lo_probe, hi_probe;
+    record_t *lo_rec = NULL, *hi_rec = NULL;
+    long visited;
+    if (lo != NULL) {
+        record_probe(&lo_probe, lo, lolen);
+        lo_rec = &lo_probe;
+    }
+    if (hi != NULL) {
+        record_probe(&hi_probe, hi, hilen);
+        hi_rec = &hi_probe;
+    }
+    pthread_rwlock_rdlock(&db->lock);
+    if (db->bptree != NULL)
+        visited = bptree_range(db->bptree, lo_rec, hi_rec, scan_record, &scan);
+    else
+        visited = avl_range(db->tree, lo_rec, hi_rec, scan_record, &scan);
+    pthread_rwlock_unlock(&db->lock);
+    return visited;
+}
+
+/** @brief Definition of a snapshot copy in progress */
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t cap;
+    long count;
+} copy_t;
+
+static int copy_record(void *data, void *arg) {
+    record_t *rec = data;
+    copy_t *copy = arg;
+    snapshot_record_t hdr;
+    size_t need, cap;
+    char *buf;
+    hdr.klen = record_str_len(&rec->key);
+    hdr.vlen = record_str_len(&rec->val);
+    need = sizeof(snapshot_record_t) + hdr.klen + hdr.vlen;
+    if (copy->len + need > copy->cap) {
+        for (cap = copy->cap ? copy->cap : 4096; cap < copy->len + need;
+             cap *= 2)
+            ;
+        if ((buf = realloc(copy->buf, cap)) == NULL) {
+            error("Failed to grow snapshot copy");
+            return -1;
+        }
+        copy->buf = buf;
+        copy->cap = cap;
+    }
+    buf = copy->buf + copy->len;
+    memcpy(buf, &hdr, sizeof(snapshot_record_t));
+    memcpy(buf + sizeof(snapshot_record_t), record_str_data(&rec->key),
+           hdr.klen);
+    memcpy(buf + sizeof(snapshot_record_t) + hdr.klen,
+           record_str_data(&rec->val), hdr.vlen);
+    copy->len += need;
+    copy->count++;
+    return 0;
+}
+
+static int write_copy(snapshot_writer_t *writer, const copy_t *copy) {
+    snapshot_record_t hdr;
+    const char *buf;
+    size_t off;
+    for (off = 0; off < copy->len;
+         off += sizeof(snapshot_record_t) + hdr.klen + hdr.vlen) {
+        memcpy(&hdr, copy->buf + off, sizeof(snapshot_record_t));
+        buf = copy->buf + off + sizeof(snapshot_record_t);
+        if (snapshot_append(writer, buf, hdr.klen, buf + hdr.klen,
+                            hdr.vlen) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+// the B+tree has no snapshots, the data is copied with writers held up
+static int snapshot_copy(memdb_t *db, snapshot_writer_t *writer,
+                         int *checkpoint) {
+    copy_t copy = {NULL, 0, 0, 0};
+    long visited;
+    int retval;
+    pthread_rwlock_rdlock(&db->lock);
+    // sized up front so the copy rarely has to grow with writers waiting
+    copy.cap = record_arena_bytes(db->arena) +
+               memdb_size(db) * sizeof(snapshot_record_t);
+    if ((copy.buf = malloc(copy.cap)) == NULL)
+        copy.cap = 0;
+    visited = bptree_range(db->bptree, NULL, NULL, copy_record, &copy);
+    // writers append under the write lock, so the log splits right here
+    if (visited == copy.count && *checkpoint && wal_rotate(db->wal) < 0)
+        *checkpoint = 0;
+    pthread_rwlock_unlock(&db->lock);
+    // a failed copy stops the scan before the record is counted, the file
+    // is written without holding up writers
+    retval = visited == copy.count ? write_copy(writer, &copy) : -1;
+    free(copy.buf);
+    return retval;
+}
+
+static int append_record(void *data, void *arg) {
+    record_t *rec = data;
+    return snapshot_append(arg, record_str_data(&rec->key),
+                           record_str_len(&rec->key),
+                           record_str_data(&rec->val),
+                           record_str_len(&rec->val));
+}
+
+// the avl engine writes from a copy-on-write snapshot of the tree, writers
+// only wait while it is taken and released
+static int snapshot_view(memdb_t *db, snapshot_writer_t *writer,
+                         int *checkpoint) {
+    long visited, i;
+    pthread_rwlock_wrlock(&db->lock);
+    if ((db->view = avl_snapshot(db->tree)) == NULL) {
+        pthread_rwlock_unlock(&db->lock);
+        return -1;
+    }
+    // writers append under the write lock, so the log splits right here
+    if (*checkpoint && wal_rotate(db->wal) < 0)
+        *checkpoint = 0;
+    pthread_rwlock_unlock(&db->lock);
+    // the failing record is counted, the writer only counts what it wrote
+    visited = avl_snapshot_range(db->view, NULL, NULL, append_record, writer);
+    pthread_rwlock_wrlock(&db->lock);
+    avl_snapshot_release(db->view);
+    db->view = NULL;
+    for (i = 0; i < db->retired_count; i++)
+        record_free(db->arena, db->retired[i]);
+    db->retired_count = 0;
+    pthread_rwlock_unlock(&db->lock);
+    return visited == writer->count ? 0 : -1;
+}
+
+int memdb_snapshot_write(memdb_t *db, const char *path) {
+    snapshot_writer_t *writer;
+    int checkpoint, retval;
+    // a second writer would checkpoint the log under the first one
+    pthread_mutex_lock(&db->snapshot_lock);
+    if ((writer = snapshot_create(path)) == NULL) {
+        pthread_mutex_unlock(&db->snapshot_lock);
+        return -1;
+    }
+    // only the snapshot loaded at startup can stand in for the log
+    checkpoint = db->wal != NULL && db->snapshot != NULL &&
+                 strcmp(path, db->snapshot) == 0;
+    if (db->bptree != NULL)
+        retval = snapshot_copy(db, writer, &checkpoint);
+    else
+        retval = snapshot_view(db, writer, &checkpoint);
+    if (retval != 0)
+        snapshot_abort(writer);
+    else if ((retval = snapshot_commit(writer)) == 0 && checkpoint)
+        retval = wal_checkpoint(db->wal);
+    pthread_mutex_unlock(&db->snapshot_lock);
+    return retval;
+}
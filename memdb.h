@@ -0,0 +1,185 @@
+/** @file memdb.h
+ *  @brief Functions prototypes for the key/value database.
+ *
+ *  This file contains the prototypes and macros to control a key/value
+ *  database of records kept in an avl tree. With a write-ahead log
+ *  configured every change is logged before it is applied and the
+ *  database is rebuilt from the log when it is opened again. With a
+ *  snapshot configured as well, the database starts from the snapshot and
+ *  only replays the log written after it.
+ *
+ *  @author Bram Vlerick (bram.vlerick@ucast.be)
+ *  @bug
+ *  * None at the moment
+ */
+
+#ifndef _MEMDB_H_
+#define _MEMDB_H_
+
+#include <pthread.h>
+
+#include "avl.h"
+#include "bptree.h"
+#include "log.h"
+#include "record.h"
+#include "snapshot.h"
+#include "wal.h"
+
+#define MEMDB_ENGINE_AVL 0
+#define MEMDB_ENGINE_BPTREE 1
+
+/** @brief Definition of the database configuration
+ *
+ *  This structure contains the database settings, a zeroed configuration
+ *  gives a purely in-memory database
+ *
+ */
+typedef struct {
+    /**< Tree engine, MEMDB_ENGINE_AVL or MEMDB_ENGINE_BPTREE */
+    int engine;
+    /**< Path of the write-ahead log, NULL to run without a log */
+    const char *wal;
+    /**< Group commit window of the log in microseconds */
+    long wal_delay;
+    /**< Path of the snapshot to start from and checkpoint the log with, NULL
+     * for none */
+    const char *snapshot;
+} memdb_config_t;
+
+/** @brief Definition of the database
+ *
+ *  This structure contains all database data
+ *
+ */
+typedef struct {
+    /**< Records ordered by key, avl engine */
+    avl_tree_t *tree;
+    /**< Records ordered by key, B+tree engine */
+    bptree_t *bptree;
+    /**< Record storage */
+    record_arena_t *arena;
+    /**< Write-ahead log, NULL if not configured */
+    wal_t *wal;
+    /**< Path of the snapshot checkpointing the log, NULL if not configured */
+    char *snapshot;
+    /**< Database lock */
+    pthread_rwlock_t lock;
+    /**< Serializes snapshot writes */
+    pthread_mutex_t snapshot_lock;
+    /**< Tree snapshot being written, avl engine, NULL if none */
+    avl_snapshot_t *view;
+    /**< Replaced and removed records the snapshot may still read */
+    record_t **retired;
+    /**< Number of retired records */
+    long retired_count;
+    /**< Size of the retired array */
+    long retired_size;
+} memdb_t;
+
+/** @brief Initialise the database
+ *
+ *  This function initialises a database, loads the snapshot if one is
+ *  configured and exists, and replays the write-ahead log on top of it
+ *
+ *  @param config Database configuration, NULL for defaults
+ *
+ *  @return Pointer to the database, NULL if failed
+ */
+memdb_t *memdb_init(const memdb_config_t *config);
+
+/** @brief Destroy the database
+ *
+ *  Sync the write-ahead log and release all records
+ *
+ *  @param db Pointer to the database
+ */
+void memdb_destroy(memdb_t *db);
+
+/** @brief Set the value of a key
+ *
+ *  This function inserts the key or replaces its value. With a log
+ *  configured it returns once the change is durable.
+ *
+ *  @param db Pointer to the database
+ *  @param key Key bytes
+ *  @param klen Key length
+ *  @param val Value bytes
+ *  @param vlen Value length
+ *
+ *  @return 0 if successful, -1 if failed
+ */
+int memdb_set(memdb_t *db, const char *key, size_t klen, const char *val,
+              size_t vlen);
+
+/** @brief Remove a key
+ *
+ *  With a log configured this function returns once the removal is
+ *  durable
+ *
+ *  @param db Pointer to the database
+ *  @param key Key bytes
+ *  @param klen Key length
+ *
+ *  @return 0 if successful, -1 if failed or not found
+ */
+int memdb_del(memdb_t *db, const char *key, size_t klen);
+
+/** @brief Retrieve the value of a key
+ *
+ *  This function copies up to size bytes of the value into buf
+ *
+ *  @param db Pointer to the database
+ *  @param key Key bytes
+ *  @param klen Key length
+ *  @param buf Value buffer, can be NULL if size is 0
+ *  @param size Size of the value buffer
+ *
+ *  @return Length of the value, -1 if not found
+ */
+long memdb_get(memdb_t *db, const char *key, size_t klen, char *buf,
+               size_t size);
+
+/** @brief Scan a range of keys
+ *
+ *  This function calls callback in key order for every record between lo
+ *  and hi inclusive, until the callback returns non zero. Writers are
+ *  blocked while it runs.
+ *
+ *  @param db Pointer to the database
+ *  @param lo Lower bound, NULL for the first record
+ *  @param lolen Length of the lower bound
+ *  @param hi Upper bound, NULL for the last record
+ *  @param hilen Length of the upper bound
+ *  @param callback Callback function
+ *  @param arg Argument passed to the callback
+ *
+ *  @return Number of records visited, -1 if failed
+ */
+long memdb_scan(memdb_t *db, const char *lo, size_t lolen, const char *hi,
+                size_t hilen,
+                int (*callback)(const char *key, size_t klen, const char *val,
+                                size_t vlen, void *arg),
+                void *arg);
+
+/** @brief Write a snapshot of the database
+ *
+ *  This function writes all keys in order to a snapshot file that can be
+ *  opened with snapshot_open. The avl engine writes from a copy-on-write
+ *  snapshot of the tree and keeps the records replaced or removed in the
+ *  meantime until it is done, the B+tree engine copies the data first.
+ *  Either way writers are not blocked while the file is written. Calls
+ *  are serialized. When path is the configured snapshot, the log written
+ *  before the snapshot is removed once the snapshot is durable.
+ *
+ *  @param db Pointer to the database
+ *  @param path Path of the snapshot file
+ *
+ *  @return 0 if successful, -1 if failed
+ */
+int memdb_snapshot_write(memdb_t *db, const char *path);
+
+/**< Macro to retrieve the number of keys in the database */
+#define memdb_size(db)                                                         \
+    ((db)->bptree != NULL ? bptree_size((db)->bptree) : avl_size((db)->tree))
+
+#endif
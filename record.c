@@ -0,0 +1,253 @@
+/** @file record.c
+ *  @brief Functions for the key/value records.
+ *
+ *  This file contains the functions to control compact key/value records
+ *
+ *  @author Bram Vlerick (bram.vlerick@ucast.be)
+ *  @bug
+ *  * None at the moment
+ */
+
+#include "record.h"
+#include "hashtable.h"
+
+static int size_class(size_t len, size_t *size) {
+    size_t steps;
+    int bits, shift;
+    if (len < RECORD_CLASS_MIN)
+        len = RECORD_CLASS_MIN;
+    // four classes per power of two keep the rounding under a quarter
+    bits = 63 - __builtin_clzl(len - 1);
+    shift = bits - 2;
+    steps = ((len - 1) >> shift) + 1;
+    *size = steps << shift;
+    return (bits - 3) * 4 + steps - 8;
+}
+
+static char *large_alloc(record_arena_t *arena, size_t len) {
+    record_chunk_t *chunk;
+    if ((chunk = malloc(sizeof(record_chunk_t) + len)) == NULL) {
+        error("Failed to allocate large string");
+        return NULL;
+    }
+    chunk->size = len;
+    chunk->used = len;
+    chunk->prev = NULL;
+    chunk->next = arena->large;
+    if (arena->large != NULL)
+        arena->large->prev = chunk;
+    arena->large = chunk;
+    arena->bytes += len;
+    return chunk->bytes;
+}
+
+static void large_free(record_arena_t *arena, char *bytes) {
+    record_chunk_t *chunk =
+        (record_chunk_t *)(bytes - offsetof(record_chunk_t, bytes));
+    if (chunk->prev != NULL)
+        chunk->prev->next = chunk->next;
+    else
+        arena->large = chunk->next;
+    if (chunk->next != NULL)
+        chunk->next->prev = chunk->prev;
+    arena->bytes -= chunk->size;
+    free(chunk);
+    return;
+}
+
+static char *arena_alloc(record_arena_t *arena, size_t len) {
+    record_chunk_t *chunk = arena->chunks;
+    char *bytes;
+    size_t size;
+    int class;
+    if (len > RECORD_LARGE)
+        return large_alloc(arena, len);
+    class = size_class(len, &size);
+    if ((bytes = arena->free[class]) != NULL) {
+        memcpy(&arena->free[class], bytes, sizeof(char *));
+        arena->wasted -= size;
+        return bytes;
+    }
+    if (chunk == NULL || chunk->size - chunk->used < size) {
+        debug(D_MEMORY, "Allocating string chunk of %d bytes",
+              RECORD_CHUNK_SIZE);
+        if ((chunk = malloc(sizeof(record_chunk_t) + RECORD_CHUNK_SIZE)) ==
+            NULL) {
+            error("Failed to allocate string chunk");
+            return NULL;
+        }
+        chunk->size = RECORD_CHUNK_SIZE;
+        chunk->used = 0;
+        chunk->prev = NULL;
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+        arena->bytes += RECORD_CHUNK_SIZE;
+    }
+    chunk->used += size;
+    return chunk->bytes + chunk->used - size;
+}
+
+static void arena_free(record_arena_t *arena, char *bytes, size_t len) {
+    size_t size;
+    int class;
+    if (len > RECORD_LARGE) {
+        large_free(arena, bytes);
+        return;
+    }
+    class = size_class(len, &size);
+    memcpy(bytes, &arena->free[class], sizeof(char *));
+    arena->free[class] = bytes;
+    arena->wasted += size;
+    return;
+}
+
+static int str_set(record_arena_t *arena, record_str_t *str, const char *buf,
+                   size_t len) {
+    char *bytes;
+    if (len > 0xffffffffUL) {
+        error("String too long");
+        return -1;
+    }
+    if (len <= RECORD_INLINE) {
+        memset(str, 0, sizeof(record_str_t));
+        str->len = len;
+        memcpy((char *)str + offsetof(record_str_t, prefix), buf, len);
+        return 0;
+    }
+    if ((bytes = arena_alloc(arena, len)) == NULL)
+        return -1;
+    memcpy(bytes, buf, len);
+    str->len = len;
+    memcpy(str->prefix, buf, sizeof(str->prefix));
+    str->ptr = bytes;
+    return 0;
+}
+
+static void str_release(record_arena_t *arena, record_str_t *str) {
+    if (str->len > RECORD_INLINE)
+        arena_free(arena, (char *)str->ptr, str->len);
+    return;
+}
+
+record_arena_t *record_arena_init(void) {
+    record_arena_t *arena;
+    if ((arena = malloc(sizeof(record_arena_t))) == NULL) {
+        error("Failed to allocate arena");
+        return NULL;
+    }
+    if ((arena->records = slab_init(sizeof(record_t), RECORD_SLAB_RECORDS)) ==
+        NULL) {
+        free(arena);
+        return NULL;
+    }
+    arena->chunks = NULL;
+    arena->large = NULL;
+    memset(arena->free, 0, sizeof(arena->free));
+    arena->bytes = 0;
+    arena->wasted = 0;
+    debug(D_MEMORY, "Record arena initialised");
+    return arena;
+}
+
+void record_arena_destroy(record_arena_t *arena) {
+    record_chunk_t *chunk, *next;
+    if (!arena) {
+        debug(D_MEMORY, "Arena pointer cannot be NULL");
+        return;
+    }
+    debug(D_MEMORY, "Destroying record arena");
+    for (chunk = arena->chunks; chunk != NULL; chunk = next) {
+        next = chunk->next;
+        free(chunk);
+    }
+    for (chunk = arena->large; chunk != NULL; chunk = next) {
+        next = chunk->next;
+        free(chunk);
+    }
+    slab_destroy(arena->records);
+    memset(arena, 0, sizeof(record_arena_t));
+    free(arena);
+    return;
+}
+
+record_t *record_new(record_arena_t *arena, const char *key, size_t klen,
+                     const char *val, size_t vlen) {
+    record_t *rec;
+    if ((rec = slab_alloc(arena->records)) == NULL) {
+        error("Failed to allocate record");
+        return NULL;
+    }
+    if (str_set(arena, &rec->key, key, klen) != 0) {
+        slab_free(arena->records, rec);
+        return NULL;
+    }
+    if (str_set(arena, &rec->val, val, vlen) != 0) {
+        str_release(arena, &rec->key);
+        slab_free(arena->records, rec);
+        return NULL;
+    }
+    return rec;
+}
+
+int record_set_val(record_arena_t *arena, record_t *rec, const char *val,
+                   size_t vlen) {
+    record_str_t str;
+    if (str_set(arena, &str, val, vlen) != 0)
+        return -1;
+    str_release(arena, &rec->val);
+    rec->val = str;
+    return 0;
+}
+
+void record_free(record_arena_t *arena, record_t *rec) {
+    str_release(arena, &rec->key);
+    str_release(arena, &rec->val);
+    slab_free(arena->records, rec);
+    return;
+}
+
+void record_probe(record_t *probe, const char *key, size_t klen) {
+    memset(probe, 0, sizeof(record_t));
+    probe->key.len = klen;
+    if (klen <= RECORD_INLINE) {
+        memcpy((char *)&probe->key + offsetof(record_str_t, prefix), key,
+               klen);
+    } else {
+        memcpy(probe->key.prefix, key, sizeof(probe->key.prefix));
+        probe->key.ptr = key;
+    }
+    return;
+}
+
+int record_compare(const void *rec1, const void *rec2) {
+    const record_str_t *k1 = &((const record_t *)rec1)->key;
+    const record_str_t *k2 = &((const record_t *)rec2)->key;
+    unsigned int len = k1->len < k2->len ? k1->len : k2->len;
+    int cmpval;
+    // the inline prefix settles most comparisons without following ptr
+    cmpval = memcmp(k1->prefix, k2->prefix, len < 4 ? len : 4);
+    if (cmpval == 0 && len > 4)
+        cmpval = memcmp(record_str_data(k1) + 4, record_str_data(k2) + 4,
+                        len - 4);
+    if (cmpval != 0)
+        return cmpval;
+    return (k1->len > k2->len) - (k1->len < k2->len);
+}
+
+const char *record_key(const void *rec, size_t *len) {
+    const record_str_t *key = &((const record_t *)rec)->key;
+    *len = key->len;
+    return record_str_data(key);
+}
+
+unsigned long record_hash(const void *rec) {
+    const record_str_t *key = &((const record_t *)rec)->key;
+    return hashtable_hash_bytes(record_str_data(key), key->len);
+}
+
+int record_match_prefix(const void *prefix, const void *rec) {
+    const record_str_t *p = &((const record_t *)prefix)->key;
+    const record_str_t *k = &((const record_t *)rec)->key;
+    return k->len >= p->len &&
+           memcmp(record_str_data(p), record_str_data(k), p->len) == 0;
+}
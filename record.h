@@ -0,0 +1,238 @@
+/** @file record.h
+ *  @brief Functions prototypes for the key/value records.
+ *
+ *  This file contains the prototypes and macros to control compact key/value
+ *  records. Keys and values are length prefixed strings of 16 bytes: strings
+ *  of up to 12 bytes are stored inline, longer strings keep their first 4
+ *  bytes inline and the rest out of line in a shared byte arena. Out of line
+ *  strings are rounded up to a size class and released strings go on a free
+ *  list per class for the next string of that class, strings larger than
+ *  RECORD_LARGE get an allocation of their own. Records themselves are
+ *  allocated from a slab owned by the same arena.
+ *
+ *  @author Bram Vlerick (bram.vlerick@ucast.be)
+ *  @bug
+ *  * None at the moment
+ */
+
+#ifndef _RECORD_H_
+#define _RECORD_H_
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "slab.h"
+
+/**< Longest string stored inline */
+#define RECORD_INLINE 12
+
+/**< Size of a single arena chunk for out of line strings */
+#define RECORD_CHUNK_SIZE 65536
+
+/**< Longest string carved out of a chunk */
+#define RECORD_LARGE (RECORD_CHUNK_SIZE / 4)
+
+/**< Smallest size class */
+#define RECORD_CLASS_MIN 16
+
+/**< Number of size classes, four per power of two up to RECORD_LARGE */
+#define RECORD_CLASSES 41
+
+/**< Number of records allocated at once */
+#define RECORD_SLAB_RECORDS 2048
+
+/** @brief Definition of a record string
+ *
+ *  This structure holds a length prefixed string. The inline bytes start at
+ *  prefix and run on into rest, out of line strings keep a copy of their
+ *  first bytes in prefix so most comparisons never follow ptr.
+ *
+ */
+typedef struct {
+    /**< String length */
+    unsigned int len;
+    /**< First bytes of the string */
+    char prefix[4];
+    union {
+        /**< Remaining bytes of an inline string */
+        char rest[RECORD_INLINE - 4];
+        /**< Out of line string */
+        const char *ptr;
+    };
+} record_str_t;
+
+/** @brief Definition of a record
+ *
+ *  This structure contains a key/value pair
+ *
+ */
+typedef struct {
+    /**< Record key */
+    record_str_t key;
+    /**< Record value */
+    record_str_t val;
+} record_t;
+
+/** @brief Definition of an arena chunk
+ *
+ *  This structure is the header of a block of out of line string bytes
+ *
+ */
+typedef struct record_chunk_ {
+    /**< Next (older) chunk */
+    struct record_chunk_ *next;
+    /**< Previous (newer) chunk, only kept for large strings */
+    struct record_chunk_ *prev;
+    /**< Chunk size */
+    size_t size;
+    /**< Number of used bytes */
+    size_t used;
+    /**< String bytes */
+    char bytes[];
+} record_chunk_t;
+
+/** @brief Definition of the record arena
+ *
+ *  This structure contains all storage of a set of records
+ *
+ */
+typedef struct {
+    /**< Record allocator */
+    slab_t *records;
+    /**< List of string chunks, newest first */
+    record_chunk_t *chunks;
+    /**< List of large strings, newest first */
+    record_chunk_t *large;
+    /**< Released strings per size class, linked through their first bytes */
+    char *free[RECORD_CLASSES];
+    /**< Number of bytes allocated for strings */
+    size_t bytes;
+    /**< Number of string bytes on the free lists */
+    size_t wasted;
+} record_arena_t;
+
+/** @brief Initialise a record arena
+ *
+ *  @return Pointer to the arena, NULL if failed
+ */
+record_arena_t *record_arena_init(void);
+
+/** @brief Destroy a record arena
+ *
+ *  Release all records and strings of the arena at once
+ *
+ *  @param arena Pointer to the arena
+ */
+void record_arena_destroy(record_arena_t *arena);
+
+/** @brief Create a record
+ *
+ *  Copy a key and a value into a new record
+ *
+ *  @param arena Pointer to the arena
+ *  @param key Key bytes
+ *  @param klen Key length
+ *  @param val Value bytes
+ *  @param vlen Value length
+ *
+ *  @return Pointer to the record, NULL if failed
+ */
+record_t *record_new(record_arena_t *arena, const char *key, size_t klen,
+                     const char *val, size_t vlen);
+
+/** @brief Replace the value of a record
+ *
+ *  @param arena Pointer to the arena
+ *  @param rec Pointer to the record
+ *  @param val Value bytes
+ *  @param vlen Value length
+ *
+ *  @return 0 if successful, -1 if failed
+ */
+int record_set_val(record_arena_t *arena, record_t *rec, const char *val,
+                   size_t vlen);
+
+/** @brief Free a record
+ *
+ *  Return the record to the arena. Out of line string bytes go back on the
+ *  free list of their size class, large strings are freed.
+ *
+ *  @param arena Pointer to the arena
+ *  @param rec Pointer to the record
+ */
+void record_free(record_arena_t *arena, record_t *rec);
+
+/** @brief Initialise a lookup probe
+ *
+ *  Set up a record on the caller's stack that can be used as reference
+ *  data for lookups. The key bytes are not copied and have to outlive the
+ *  probe.
+ *
+ *  @param probe Pointer to the probe record
+ *  @param key Key bytes
+ *  @param klen Key length
+ */
+void record_probe(record_t *probe, const char *key, size_t klen);
+
+/** @brief Compare the keys of two records
+ *
+ *  Compare callback for trees holding records, keys sort bytewise
+ *
+ *  @param rec1 Pointer to the first record
+ *  @param rec2 Pointer to the second record
+ *
+ *  @return <0, 0 or >0 like memcmp
+ */
+int record_compare(const void *rec1, const void *rec2);
+
+/** @brief Retrieve the key bytes of a record
+ *
+ *  Key accessor for trees holding records in string key mode
+ *
+ *  @param rec Pointer to the record
+ *  @param len Set to the key length
+ *
+ *  @return Pointer to the key bytes
+ */
+const char *record_key(const void *rec, size_t *len);
+
+/** @brief Hash the key of a record
+ *
+ *  Hash callback for hash tables and indexes holding records
+ *
+ *  @param rec Pointer to the record
+ *
+ *  @return The hash value
+ */
+unsigned long record_hash(const void *rec);
+
+/** @brief Check if a record key starts with a prefix
+ *
+ *  Match callback for prefix scans over records
+ *
+ *  @param prefix Pointer to a record holding the prefix as key
+ *  @param rec Pointer to the record
+ *
+ *  @return Non zero if the key starts with the prefix
+ */
+int record_match_prefix(const void *prefix, const void *rec);
+
+/**< Macro to retrieve the bytes of a record string */
+#define record_str_data(str)                                                   \
+    ((str)->len <= RECORD_INLINE                                               \
+         ? (const char *)(str) + offsetof(record_str_t, prefix)                \
+         : (str)->ptr)
+
+/**< Macro to retrieve the length of a record string */
+#define record_str_len(str) ((str)->len)
+
+/**< Macro to retrieve the string bytes released and not yet reused */
+#define record_arena_wasted(arena) ((arena)->wasted)
+
+/**< Macro to retrieve the memory used by an arena */
+#define record_arena_bytes(arena)                                              \
+    (slab_bytes((arena)->records) + (arena)->bytes)
+
+#endif
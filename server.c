@@ -0,0 +1,667 @@
+/** @file server.c
+ *  @brief Functions for the network server.
+ *
+ *  This file contains the functions to serve a database over TCP and Unix
+ *  sockets from a single epoll event loop
+ *
+ *  @author Bram Vlerick (bram.vlerick@ucast.be)
+ *  @bug
+ *  * Without a worker queue durable writes block the event loop until the log
+ *    is synced
+ */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "server.h"
+
+/** @brief Definition of a scan in progress */
+typedef struct {
+    server_t *srv;
+    server_conn_t *conn;
+    long left;
+    int failed;
+} scan_ctx_t;
+
+static server_buf_t *buf_alloc(server_t *srv) {
+    server_buf_t *buf;
+    if ((buf = slab_alloc(srv->buffers)) == NULL) {
+        error("Failed to allocate connection buffer");
+        return NULL;
+    }
+    buf->next = NULL;
+    buf->start = 0;
+    buf->end = 0;
+    return buf;
+}
+
+static server_buf_t *conn_space(server_t *srv, server_conn_t *conn,
+                                size_t len) {
+    server_buf_t *buf = conn->tail;
+    if (len > srv->config.buffer_size)
+        return NULL;
+    if (buf != NULL && srv->config.buffer_size - buf->end >= len)
+        return buf;
+    if ((buf = buf_alloc(srv)) == NULL)
+        return NULL;
+    if (conn->tail != NULL)
+        conn->tail->next = buf;
+    else
+        conn->out = buf;
+    conn->tail = buf;
+    conn->queued++;
+    return buf;
+}
+
+static void put_header(char *p, int op, int status, size_t klen,
+                       size_t vlen) {
+    server_header_t hdr;
+    hdr.op = op;
+    hdr.status = status;
+    hdr.reserved = 0;
+    hdr.klen = htonl(klen);
+    hdr.vlen = htonl(vlen);
+    memcpy(p, &hdr, sizeof(server_header_t));
+    return;
+}
+
+static int conn_frame(server_t *srv, server_conn_t *conn, int op, int status,
+                      const char *key, size_t klen, const char *val,
+                      size_t vlen) {
+    size_t len = sizeof(server_header_t) + klen + vlen;
+    server_buf_t *buf;
+    char *p;
+    if ((buf = conn_space(srv, conn, len)) == NULL)
+        return -1;
+    p = buf->data + buf->end;
+    put_header(p, op, status, klen, vlen);
+    p += sizeof(server_header_t);
+    if (klen > 0)
+        memcpy(p, key, klen);
+    if (vlen > 0)
+        memcpy(p + klen, val, vlen);
+    buf->end += len;
+    return 0;
+}
+
+static int do_get(server_t *srv, server_conn_t *conn, const char *key,
+                  size_t klen) {
+    size_t hlen = sizeof(server_header_t), room;
+    server_buf_t *buf;
+    long len;
+    if ((buf = conn_space(srv, conn, hlen)) == NULL)
+        return -1;
+    room = srv->config.buffer_size - buf->end - hlen;
+    len = memdb_get(srv->db, key, klen, buf->data + buf->end + hlen, room);
+    if (len > (long)room) {
+        // retry once in an empty buffer, the value may change in between
+        if ((buf = conn_space(srv, conn, srv->config.buffer_size)) == NULL)
+            return conn_frame(srv, conn, SERVER_OP_GET, SERVER_ERROR, NULL, 0,
+                              NULL, 0);
+        room = srv->config.buffer_size - hlen;
+        len = memdb_get(srv->db, key, klen, buf->data + hlen, room);
+        if (len > (long)room)
+            return conn_frame(srv, conn, SERVER_OP_GET, SERVER_ERROR, NULL, 0,
+                              NULL, 0);
+    }
+    if (len < 0)
+        return conn_frame(srv, conn, SERVER_OP_GET, SERVER_NOT_FOUND, NULL, 0,
+                          NULL, 0);
+    put_header(buf->data + buf->end, SERVER_OP_GET, SERVER_OK, 0, len);
+    buf->end += hlen + len;
+    return 0;
+}
+
+static int scan_frame(const char *key, size_t klen, const char *val,
+                      size_t vlen, void *arg) {
+    scan_ctx_t *ctx = arg;
+    if (conn_frame(ctx->srv, ctx->conn, SERVER_OP_SCAN, SERVER_OK, key, klen,
+                   val, vlen) != 0) {
+        ctx->failed = 1;
+        return -1;
+    }
+    return --ctx->left == 0;
+}
+
+static int do_scan(server_t *srv, server_conn_t *conn, const char *key,
+                   size_t klen, long limit) {
+    scan_ctx_t ctx = {srv, conn, limit, 0};
+    if (limit == 0 || limit > srv->config.scan_limit)
+        ctx.left = srv->config.scan_limit;
+    if (memdb_scan(srv->db, key, klen, NULL, 0, scan_frame, &ctx) < 0)
+        ctx.failed = 1;
+    return conn_frame(srv, conn, SERVER_OP_SCAN,
+                      ctx.failed ? SERVER_ERROR : SERVER_END, NULL, 0, NULL,
+                      0);
+}
+
+static int do_write(memdb_t *db, const server_header_t *hdr,
+                    const char *key, const char *val) {
+    if (hdr->op == SERVER_OP_SET)
+        return memdb_set(db, key, hdr->klen, val, hdr->vlen) == 0
+                   ? SERVER_OK
+                   : SERVER_ERROR;
+    return memdb_del(db, key, hdr->klen) == 0 ? SERVER_OK : SERVER_NOT_FOUND;
+}
+
+static void write_job(void *arg) {
+    server_conn_t *conn = arg;
+    server_t *srv = conn->srv;
+    const char *key = conn->in->data + conn->in->start + sizeof(server_header_t);
+    uint64_t one = 1;
+    ssize_t n;
+    conn->status = do_write(srv->db, &conn->req, key, key + conn->req.klen);
+    pthread_mutex_lock(&srv->done_lock);
+    conn->done = srv->done;
+    srv->done = conn;
+    pthread_mutex_unlock(&srv->done_lock);
+    n = write(srv->wake_fd, &one, sizeof(one));
+    (void)n;
+    return;
+}
+
+static int handle(server_t *srv, server_conn_t *conn,
+                  const server_header_t *hdr, const char *key,
+                  const char *val) {
+    int status;
+    debug(D_SOCKETS, "Request %d on fd %d", hdr->op, conn->fd);
+    switch (hdr->op) {
+    case SERVER_OP_GET:
+        return do_get(srv, conn, key, hdr->klen);
+    case SERVER_OP_SET:
+    case SERVER_OP_DEL:
+        if (srv->config.workqueue != NULL) {
+            // the request stays in the input buffer until the write is done
+            conn->req = *hdr;
+            conn->busy = 1;
+            if (workqueue_submit(srv->config.workqueue, write_job, conn) == 0) {
+                srv->inflight++;
+                return 1;
+            }
+            conn->busy = 0;
+        }
+        status = do_write(srv->db, hdr, key, val);
+        break;
+    case SERVER_OP_SCAN:
+        return do_scan(srv, conn, key, hdr->klen, hdr->vlen);
+    default:
+        status = SERVER_ERROR;
+    }
+    return conn_frame(srv, conn, hdr->op, status, NULL, 0, NULL, 0);
+}
+
+static int conn_process(server_t *srv, server_conn_t *conn) {
+    server_buf_t *in = conn->in;
+    server_header_t hdr;
+    size_t len;
+    const char *p;
+    int retval;
+    while (in->end - in->start >= sizeof(server_header_t) && !conn->busy &&
+           conn->queued < srv->config.conn_buffers) {
+        p = in->data + in->start;
+        memcpy(&hdr, p, sizeof(server_header_t));
+        hdr.klen = ntohl(hdr.klen);
+        hdr.vlen = ntohl(hdr.vlen);
+        // the record limit of a scan travels in vlen without any bytes
+        len = sizeof(server_header_t) + (size_t)hdr.klen +
+              (hdr.op != SERVER_OP_SCAN ? hdr.vlen : 0);
+        if (len > srv->config.buffer_size) {
+            error("Frame of %zu bytes on fd %d exceeds the buffer size", len,
+                  conn->fd);
+            return -1;
+        }
+        if (in->end - in->start < len)
+            break;
+        p += sizeof(server_header_t);
+        if ((retval = handle(srv, conn, &hdr, p, p + hdr.klen)) < 0)
+            return -1;
+        if (retval > 0)
+            return 0;
+        in->start += len;
+    }
+    if (in->start == in->end) {
+        // idle connections hand their input buffer back to the pool
+        slab_free(srv->buffers, in);
+        conn->in = NULL;
+    }
+    return 0;
+}
+
+static int conn_read(server_t *srv, server_conn_t *conn) {
+    server_buf_t *in;
+    ssize_t n;
+    if (conn->in != NULL && conn_process(srv, conn) != 0)
+        return -1;
+    while (!conn->closing && !conn->busy &&
+           conn->queued < srv->config.conn_buffers) {
+        if (conn->in == NULL && (conn->in = buf_alloc(srv)) == NULL)
+            return -1;
+        in = conn->in;
+        if (in->start > 0) {
+            memmove(in->data, in->data + in->start, in->end - in->start);
+            in->end -= in->start;
+            in->start = 0;
+        }
+        n = read(conn->fd, in->data + in->end,
+                 srv->config.buffer_size - in->end);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            debug(D_SOCKETS, "Read on fd %d failed: %s", conn->fd,
+                  strerror(errno));
+            return -1;
+        }
+        if (n == 0) {
+            debug(D_SOCKETS, "Connection on fd %d closed by peer", conn->fd);
+            conn->closing = 1;
+            break;
+        }
+        in->end += n;
+        if (conn_process(srv, conn) != 0)
+            return -1;
+    }
+    if (conn->in != NULL && conn->in->start == conn->in->end) {
+        slab_free(srv->buffers, conn->in);
+        conn->in = NULL;
+    }
+    return !conn->closing && !conn->busy &&
+           conn->queued >= srv->config.conn_buffers;
+}
+
+static int conn_flush(server_t *srv, server_conn_t *conn) {
+    struct iovec iov[SERVER_IOV_MAX];
+    struct msghdr msg;
+    server_buf_t *buf;
+    ssize_t n;
+    int count;
+    while (conn->out != NULL) {
+        // gather every queued buffer so pipelined responses leave together
+        for (buf = conn->out, count = 0; buf != NULL && count < SERVER_IOV_MAX;
+             buf = buf->next, count++) {
+            iov[count].iov_base = buf->data + buf->start;
+            iov[count].iov_len = buf->end - buf->start;
+        }
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        if ((n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL)) < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            debug(D_SOCKETS, "Write on fd %d failed: %s", conn->fd,
+                  strerror(errno));
+            return -1;
+        }
+        while (conn->out != NULL &&
+               (size_t)n >= conn->out->end - conn->out->start) {
+            buf = conn->out;
+            n -= buf->end - buf->start;
+            conn->out = buf->next;
+            slab_free(srv->buffers, buf);
+            conn->queued--;
+        }
+        if (conn->out == NULL)
+            conn->tail = NULL;
+        else
+            conn->out->start += n;
+    }
+    return 0;
+}
+
+static void conn_close(server_t *srv, server_conn_t *conn) {
+    server_buf_t *buf, *next;
+    debug(D_SOCKETS, "Closing connection on fd %d", conn->fd);
+    epoll_ctl(srv->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    for (buf = conn->out; buf != NULL; buf = next) {
+        next = buf->next;
+        slab_free(srv->buffers, buf);
+    }
+    if (conn->in != NULL)
+        slab_free(srv->buffers, conn->in);
+    if (conn->prev != NULL)
+        conn->prev->next = conn->next;
+    else
+        srv->conn_list = conn->next;
+    if (conn->next != NULL)
+        conn->next->prev = conn->prev;
+    srv->conns--;
+    free(conn);
+    return;
+}
+
+static int conn_update(server_t *srv, server_conn_t *conn) {
+    struct epoll_event ev;
+    uint32_t events = 0;
+    if (!conn->closing && !conn->busy &&
+        conn->queued < srv->config.conn_buffers)
+        events |= EPOLLIN;
+    if (conn->out != NULL)
+        events |= EPOLLOUT;
+    if (events == 0 && !conn->busy)
+        return -1;
+    if (events == conn->events)
+        return 0;
+    ev.events = events;
+    ev.data.ptr = conn;
+    if (epoll_ctl(srv->epfd, EPOLL_CTL_MOD, conn->fd, &ev) != 0) {
+        error("Failed to update events of fd %d", conn->fd);
+        return -1;
+    }
+    conn->events = events;
+    return 0;
+}
+
+static void conn_event(server_t *srv, server_conn_t *conn, uint32_t events) {
+    int retval = 0, more;
+    if (events & EPOLLOUT)
+        retval = conn_flush(srv, conn);
+    more = (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) ||
+           (conn->in != NULL && !conn->busy);
+    // buffered requests get no new event, keep serving while output drains
+    while (retval == 0 && more &&
+           conn->queued < srv->config.conn_buffers) {
+        if ((more = conn_read(srv, conn)) < 0)
+            retval = -1;
+        else
+            retval = conn_flush(srv, conn);
+    }
+    if (retval == 0 && conn->busy && (events & (EPOLLHUP | EPOLLERR)))
+        retval = -1;
+    if (retval == 0 && conn_update(srv, conn) == 0)
+        return;
+    if (!conn->busy) {
+        conn_close(srv, conn);
+        return;
+    }
+    // the worker still uses the input buffer, close once the write is done
+    epoll_ctl(srv->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    conn->dead = 1;
+    return;
+}
+
+static void complete_writes(server_t *srv) {
+    server_conn_t *conn, *next;
+    pthread_mutex_lock(&srv->done_lock);
+    conn = srv->done;
+    srv->done = NULL;
+    pthread_mutex_unlock(&srv->done_lock);
+    for (; conn != NULL; conn = next) {
+        next = conn->done;
+        srv->inflight--;
+        conn->busy = 0;
+        if (conn->dead) {
+            conn_close(srv, conn);
+            continue;
+        }
+        conn->in->start += sizeof(server_header_t) + conn->req.klen +
+                           conn->req.vlen;
+        if (conn_frame(srv, conn, conn->req.op, conn->status, NULL, 0, NULL,
+                       0) != 0) {
+            conn_close(srv, conn);
+            continue;
+        }
+        // send the response and carry on with the requests behind it
+        conn_event(srv, conn, EPOLLOUT);
+    }
+    return;
+}
+
+static void accept_conns(server_t *srv, int lfd) {
+    struct epoll_event ev;
+    server_conn_t *conn;
+    int fd, one = 1;
+    while ((fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >=
+           0) {
+        if (lfd == srv->tcp_fd)
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if ((conn = calloc(1, sizeof(server_conn_t))) == NULL) {
+            error("Failed to allocate connection");
+            close(fd);
+            continue;
+        }
+        conn->srv = srv;
+        conn->fd = fd;
+        conn->events = EPOLLIN;
+        ev.events = EPOLLIN;
+        ev.data.ptr = conn;
+        if (epoll_ctl(srv->epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            error("Failed to register fd %d", fd);
+            close(fd);
+            free(conn);
+            continue;
+        }
+        conn->next = srv->conn_list;
+        if (srv->conn_list != NULL)
+            srv->conn_list->prev = conn;
+        srv->conn_list = conn;
+        srv->conns++;
+        debug(D_SOCKETS, "Accepted connection on fd %d", fd);
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        error("Failed to accept connection: %s", strerror(errno));
+    return;
+}
+
+static int listen_tcp(server_t *srv) {
+    struct addrinfo hints, *res, *ai;
+    struct sockaddr_storage addr;
+    socklen_t alen = sizeof(addr);
+    char port[16];
+    int fd = -1, one = 1, retval;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    snprintf(port, sizeof(port), "%d", srv->config.port);
+    if ((retval = getaddrinfo(srv->config.host, port, &hints, &res)) != 0) {
+        error("Failed to resolve %s: %s", srv->config.host,
+              gai_strerror(retval));
+        return -1;
+    }
+    for (ai = res; ai != NULL; ai = ai->ai_next) {
+        if ((fd = socket(ai->ai_family,
+                         ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                         ai->ai_protocol)) < 0)
+            continue;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+            listen(fd, SOMAXCONN) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0) {
+        error("Failed to listen on %s:%d", srv->config.host, srv->config.port);
+        return -1;
+    }
+    getsockname(fd, (struct sockaddr *)&addr, &alen);
+    if (addr.ss_family == AF_INET6)
+        srv->port = ntohs(((struct sockaddr_in6 *)&addr)->sin6_port);
+    else
+        srv->port = ntohs(((struct sockaddr_in *)&addr)->sin_port);
+    srv->tcp_fd = fd;
+    debug(D_SOCKETS, "Listening on %s:%d", srv->config.host, srv->port);
+    return 0;
+}
+
+static int listen_unix(server_t *srv) {
+    struct sockaddr_un addr;
+    int fd;
+    if (strlen(srv->config.unix_path) >= sizeof(addr.sun_path)) {
+        error("Socket path %s too long", srv->config.unix_path);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, srv->config.unix_path);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                     0)) < 0) {
+        error("Failed to create socket: %s", strerror(errno));
+        return -1;
+    }
+    // a stale socket of an earlier run would make bind fail
+    unlink(srv->config.unix_path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(fd, SOMAXCONN) != 0) {
+        error("Failed to listen on %s: %s", srv->config.unix_path,
+              strerror(errno));
+        close(fd);
+        return -1;
+    }
+    srv->unix_fd = fd;
+    debug(D_SOCKETS, "Listening on %s", srv->config.unix_path);
+    return 0;
+}
+
+static int watch(server_t *srv, int *fd) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = fd;
+    if (epoll_ctl(srv->epfd, EPOLL_CTL_ADD, *fd, &ev) != 0) {
+        error("Failed to register fd %d", *fd);
+        return -1;
+    }
+    return 0;
+}
+
+server_t *server_init(memdb_t *db, const server_config_t *config) {
+    server_t *srv;
+    if (!db || !config) {
+        debug(D_SOCKETS, "Database and configuration cannot be NULL");
+        return NULL;
+    }
+    if (config->host == NULL && config->unix_path == NULL) {
+        error("No TCP address or Unix socket to listen on");
+        return NULL;
+    }
+    if ((srv = calloc(1, sizeof(server_t))) == NULL) {
+        error("Failed to allocate server");
+        return NULL;
+    }
+    srv->db = db;
+    srv->config = *config;
+    if (srv->config.buffer_size == 0)
+        srv->config.buffer_size = SERVER_BUFFER_SIZE;
+    if (srv->config.conn_buffers <= 0)
+        srv->config.conn_buffers = SERVER_CONN_BUFFERS;
+    if (srv->config.scan_limit <= 0)
+        srv->config.scan_limit = SERVER_SCAN_LIMIT;
+    srv->epfd = srv->tcp_fd = srv->unix_fd = srv->wake_fd = -1;
+    pthread_mutex_init(&srv->done_lock, NULL);
+    if (srv->config.buffer_size <= sizeof(server_header_t)) {
+        error("Buffer size %zu too small", srv->config.buffer_size);
+        server_destroy(srv);
+        return NULL;
+    }
+    if ((srv->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+        (srv->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        error("Failed to create event loop: %s", strerror(errno));
+        server_destroy(srv);
+        return NULL;
+    }
+    if ((srv->buffers =
+             slab_init(sizeof(server_buf_t) + srv->config.buffer_size,
+                       SERVER_SLAB_BUFFERS)) == NULL ||
+        (srv->config.host != NULL &&
+         (listen_tcp(srv) != 0 || watch(srv, &srv->tcp_fd) != 0)) ||
+        (srv->config.unix_path != NULL &&
+         (listen_unix(srv) != 0 || watch(srv, &srv->unix_fd) != 0)) ||
+        watch(srv, &srv->wake_fd) != 0) {
+        server_destroy(srv);
+        return NULL;
+    }
+    debug(D_SOCKETS, "Initialised server");
+    return srv;
+}
+
+void server_destroy(server_t *srv) {
+    if (!srv) {
+        debug(D_SOCKETS, "Server pointer cannot be NULL");
+        return;
+    }
+    debug(D_SOCKETS, "Destroying server");
+    while (srv->conn_list != NULL)
+        conn_close(srv, srv->conn_list);
+    if (srv->tcp_fd >= 0)
+        close(srv->tcp_fd);
+    if (srv->unix_fd >= 0) {
+        close(srv->unix_fd);
+        unlink(srv->config.unix_path);
+    }
+    if (srv->wake_fd >= 0)
+        close(srv->wake_fd);
+    if (srv->epfd >= 0)
+        close(srv->epfd);
+    if (srv->buffers != NULL)
+        slab_destroy(srv->buffers);
+    pthread_mutex_destroy(&srv->done_lock);
+    memset(srv, 0, sizeof(server_t));
+    free(srv);
+    return;
+}
+
+int server_run(server_t *srv) {
+    struct epoll_event events[SERVER_EVENTS];
+    uint64_t count;
+    int n, i, woken;
+    if (!srv) {
+        debug(D_SOCKETS, "Server pointer cannot be NULL");
+        debug(D_SOCKETS, "Allocate server first");
+        return -1;
+    }
+    debug(D_SOCKETS, "Running event loop");
+    // after server_stop keep going until no worker touches a connection
+    while (!srv->stop || srv->inflight > 0) {
+        if ((n = epoll_wait(srv->epfd, events, SERVER_EVENTS, -1)) < 0) {
+            if (errno == EINTR)
+                continue;
+            error("Failed to wait for events: %s", strerror(errno));
+            return -1;
+        }
+        for (i = 0, woken = 0; i < n; i++) {
+            if (events[i].data.ptr == &srv->wake_fd) {
+                if (read(srv->wake_fd, &count, sizeof(count)) < 0)
+                    debug(D_SOCKETS, "Spurious wake up");
+                woken = 1;
+            } else if (events[i].data.ptr == &srv->tcp_fd) {
+                accept_conns(srv, srv->tcp_fd);
+            } else if (events[i].data.ptr == &srv->unix_fd) {
+                accept_conns(srv, srv->unix_fd);
+            } else {
+                conn_event(srv, events[i].data.ptr, events[i].events);
+            }
+        }
+        // completions may close connections, the batch must not see them
+        if (woken)
+            complete_writes(srv);
+    }
+    while (srv->conn_list != NULL)
+        conn_close(srv, srv->conn_list);
+    debug(D_SOCKETS, "Event loop stopped");
+    return 0;
+}
+
+void server_stop(server_t *srv) {
+    uint64_t one = 1;
+    ssize_t n;
+    srv->stop = 1;
+    // the counter only overflows after 2^64 - 1 wake ups, ignore the result
+    n = write(srv->wake_fd, &one, sizeof(one));
+    (void)n;
+    return;
+}
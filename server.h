@@ -0,0 +1,241 @@
+/** @file server.h
+ *  @brief Functions prototypes for the network server.
+ *
+ *  This file contains the prototypes, macros and wire format of the
+ *  event driven server that exposes a database over TCP and Unix sockets.
+ *
+ *  Every request and response is a frame made of a 12 byte header followed
+ *  by klen key bytes and vlen value bytes, lengths in network byte order.
+ *  Clients may pipeline any number of requests, responses come back in
+ *  request order. A SCAN request carries the first key and uses vlen as the
+ *  maximum number of records, it is answered with one frame per record and
+ *  a closing frame with status SERVER_END. With a worker queue configured
+ *  writes run on the workers, so durable writes of different connections
+ *  share log syncs while the event loop keeps serving reads.
+ *
+ *  @author Bram Vlerick (bram.vlerick@ucast.be)
+ *  @bug
+ *  * None at the moment
+ */
+
+#ifndef _SERVER_H_
+#define _SERVER_H_
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "log.h"
+#include "memdb.h"
+#include "slab.h"
+#include "workqueue.h"
+
+#define SERVER_OP_GET 1
+#define SERVER_OP_SET 2
+#define SERVER_OP_DEL 3
+#define SERVER_OP_SCAN 4
+
+#define SERVER_OK 0
+#define SERVER_NOT_FOUND 1
+#define SERVER_ERROR 2
+#define SERVER_END 3
+
+/**< Default size of a connection buffer, also the largest frame */
+#define SERVER_BUFFER_SIZE 65536
+
+/**< Default number of output buffers a connection may queue */
+#define SERVER_CONN_BUFFERS 64
+
+/**< Default maximum number of records returned by a scan */
+#define SERVER_SCAN_LIMIT 1000
+
+/**< Number of buffers allocated at once */
+#define SERVER_SLAB_BUFFERS 64
+
+/**< Maximum number of buffers gathered by a single write */
+#define SERVER_IOV_MAX 64
+
+/**< Maximum number of events handled per epoll_wait */
+#define SERVER_EVENTS 256
+
+/** @brief Definition of a frame header
+ *
+ *  This structure is the wire header of requests and responses
+ *
+ */
+typedef struct {
+    /**< Operation, one of SERVER_OP_* */
+    uint8_t op;
+    /**< Response status, one of SERVER_OK .. SERVER_END, 0 in requests */
+    uint8_t status;
+    /**< Reserved, must be 0 */
+    uint16_t reserved;
+    /**< Key length */
+    uint32_t klen;
+    /**< Value length, record limit of a scan request */
+    uint32_t vlen;
+} server_header_t;
+
+/** @brief Definition of the server configuration
+ *
+ *  This structure contains the server settings, zeroed sizes select the
+ *  defaults
+ *
+ */
+typedef struct {
+    /**< Address to listen on for TCP, NULL to disable TCP */
+    const char *host;
+    /**< TCP port, 0 for an ephemeral port */
+    int port;
+    /**< Path of the Unix socket, NULL to disable the Unix socket */
+    const char *unix_path;
+    /**< Size of a connection buffer, also the largest frame */
+    size_t buffer_size;
+    /**< Number of output buffers a connection may queue before it is no
+     * longer read from */
+    int conn_buffers;
+    /**< Maximum number of records returned by a scan */
+    int scan_limit;
+    /**< Pool that runs writes, NULL to run them on the event loop */
+    workqueue_t *workqueue;
+} server_config_t;
+
+/** @brief Definition of a connection buffer
+ *
+ *  This structure is the header of a pooled buffer, data runs from start
+ *  to end
+ *
+ */
+typedef struct server_buf_ {
+    /**< Next buffer of the chain */
+    struct server_buf_ *next;
+    /**< Offset of the first unconsumed byte */
+    size_t start;
+    /**< Offset past the last byte */
+    size_t end;
+    /**< Buffer bytes */
+    char data[];
+} server_buf_t;
+
+/** @brief Definition of a connection
+ *
+ *  This structure contains the state of a single client connection
+ *
+ */
+typedef struct server_conn_ {
+    /**< Server the connection belongs to */
+    struct server_ *srv;
+    /**< Previous connection of the server list */
+    struct server_conn_ *prev;
+    /**< Next connection of the server list */
+    struct server_conn_ *next;
+    /**< Socket */
+    int fd;
+    /**< Input buffer, NULL while idle */
+    server_buf_t *in;
+    /**< First output buffer */
+    server_buf_t *out;
+    /**< Last output buffer */
+    server_buf_t *tail;
+    /**< Number of queued output buffers */
+    int queued;
+    /**< Registered epoll events */
+    uint32_t events;
+    /**< Close once the output is flushed */
+    int closing;
+    /**< Write running on a worker, input is not parsed until it completes */
+    int busy;
+    /**< Close once the running write completes */
+    int dead;
+    /**< Request of the running write */
+    server_header_t req;
+    /**< Response status of the running write */
+    int status;
+    /**< Next connection with a completed write */
+    struct server_conn_ *done;
+} server_conn_t;
+
+/** @brief Definition of the server
+ *
+ *  This structure contains all server data
+ *
+ */
+typedef struct server_ {
+    /**< Database served */
+    memdb_t *db;
+    /**< Settings, sizes resolved */
+    server_config_t config;
+    /**< Epoll instance */
+    int epfd;
+    /**< TCP listening socket, -1 if disabled */
+    int tcp_fd;
+    /**< Unix listening socket, -1 if disabled */
+    int unix_fd;
+    /**< Eventfd used to wake the loop for server_stop and completed
+     * writes */
+    int wake_fd;
+    /**< Bound TCP port */
+    int port;
+    /**< Buffer pool shared by all connections */
+    slab_t *buffers;
+    /**< List of open connections */
+    server_conn_t *conn_list;
+    /**< Number of open connections */
+    long conns;
+    /**< Number of writes running on workers */
+    long inflight;
+    /**< Lock protecting the completed writes */
+    pthread_mutex_t done_lock;
+    /**< Connections with a completed write */
+    server_conn_t *done;
+    /**< Set by server_stop */
+    volatile int stop;
+} server_t;
+
+/** @brief Initialise the server
+ *
+ *  This function opens the listening sockets, it does not accept
+ *  connections until server_run is called
+ *
+ *  @param db Pointer to the database to serve
+ *  @param config Server configuration
+ *
+ *  @return Pointer to the server, NULL if failed
+ */
+server_t *server_init(memdb_t *db, const server_config_t *config);
+
+/** @brief Destroy the server
+ *
+ *  Close the listening sockets and remove the Unix socket. The server must
+ *  not be running.
+ *
+ *  @param srv Pointer to the server
+ */
+void server_destroy(server_t *srv);
+
+/** @brief Run the event loop
+ *
+ *  This function serves connections until server_stop is called, open
+ *  connections are closed when it returns once running writes completed
+ *
+ *  @param srv Pointer to the server
+ *
+ *  @return 0 if successful, -1 if failed
+ */
+int server_run(server_t *srv);
+
+/** @brief Stop the event loop
+ *
+ *  Make server_run return, safe to call from other threads and signal
+ *  handlers
+ *
+ *  @param srv Pointer to the server
+ */
+void server_stop(server_t *srv);
+
+/**< Macro to retrieve the bound TCP port */
+#define server_port(srv) ((srv)->port)
+
+/**< Macro to retrieve the number of open connections */
+#define server_conns(srv) ((srv)->conns)
+
+#endif
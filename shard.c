@@ -0,0 +1,173 @@
+/** @file shard.c
+ *  @brief Functions for the sharded database.
+ *
+ *  This file contains the functions to control a database that hash
+ *  partitions its keys over a number of independent avl trees
+ *
+ *  @author Bram Vlerick (bram.vlerick@ucast.be)
+ *  @bug
+ *  * None at the moment
+ */
+
+#include "shard.h"
+
+static shard_t *pick(shard_db_t *db, const void *data) {
+    unsigned long hash = db->hash(data) * 0x9e3779b97f4a7c15UL;
+    return &db->shards[(hash >> 32) % db->count];
+}
+
+static int cursor_less(shard_db_t *db, avl_cursor_t *c1, avl_cursor_t *c2) {
+    return db->compare(avl_cursor_data(c1), avl_cursor_data(c2)) < 0;
+}
+
+static void heap_down(shard_db_t *db, avl_cursor_t **heap, int count,
+                      int pos) {
+    avl_cursor_t *tmp;
+    int child;
+    while ((child = 2 * pos + 1) < count) {
+        if (child + 1 < count && cursor_less(db, heap[child + 1], heap[child]))
+            child++;
+        if (!cursor_less(db, heap[child], heap[pos]))
+            break;
+        tmp = heap[pos];
+        heap[pos] = heap[child];
+        heap[child] = tmp;
+        pos = child;
+    }
+    return;
+}
+
+shard_db_t *shard_init(int count,
+                       int (*compare)(const void *key1, const void *key2),
+                       unsigned long (*hash)(const void *data),
+                       void (*destroy)(void *data)) {
+    shard_db_t *db;
+    int i;
+    if (count <= 0) {
+        error("Invalid shard count");
+        return NULL;
+    }
+    if ((db = malloc(sizeof(shard_db_t))) == NULL) {
+        error("Failed to allocate database");
+        return NULL;
+    }
+    if (posix_memalign((void **)&db->shards, SHARD_CACHE_LINE,
+                       count * sizeof(shard_t)) != 0) {
+        error("Failed to allocate shards");
+        free(db);
+        return NULL;
+    }
+    db->count = count;
+    db->compare = compare;
+    db->hash = hash;
+    for (i = 0; i < count; i++) {
+        if ((db->shards[i].tree = avl_init(compare, destroy)) == NULL) {
+            db->count = i;
+            shard_destroy(db);
+            return NULL;
+        }
+        pthread_rwlock_init(&db->shards[i].lock, NULL);
+    }
+    debug(D_AVLTREE, "Initialised %d shards", count);
+    return db;
+}
+
+void shard_destroy(shard_db_t *db) {
+    int i;
+    if (!db) {
+        debug(D_AVLTREE, "Database pointer cannot be NULL");
+        return;
+    }
+    debug(D_AVLTREE, "Destroying %d shards", db->count);
+    for (i = 0; i < db->count; i++) {
+        avl_destroy(db->shards[i].tree);
+        pthread_rwlock_destroy(&db->shards[i].lock);
+    }
+    free(db->shards);
+    memset(db, 0, sizeof(shard_db_t));
+    free(db);
+    return;
+}
+
+int shard_insert(shard_db_t *db, const void *data) {
+    shard_t *shard = pick(db, data);
+    int retval;
+    pthread_rwlock_wrlock(&shard->lock);
+    retval = avl_insert(shard->tree, data);
+    pthread_rwlock_unlock(&shard->lock);
+    return retval;
+}
+
+int shard_remove(shard_db_t *db, const void *data) {
+    shard_t *shard = pick(db, data);
+    int retval;
+    pthread_rwlock_wrlock(&shard->lock);
+    retval = avl_remove(shard->tree, data);
+    pthread_rwlock_unlock(&shard->lock);
+    return retval;
+}
+
+int shard_lookup(shard_db_t *db, void **data) {
+    shard_t *shard = pick(db, *data);
+    int retval;
+    pthread_rwlock_rdlock(&shard->lock);
+    retval = avl_lookup(shard->tree, data);
+    pthread_rwlock_unlock(&shard->lock);
+    return retval;
+}
+
+long shard_range(shard_db_t *db, const void *lo, const void *hi,
+                 int (*callback)(void *data, void *arg), void *arg) {
+    avl_cursor_t *cursors, **heap;
+    long visited = 0;
+    int i, retval, count = 0;
+    debug(D_AVLTREE, "Performing merged range scan");
+    if ((cursors = malloc(db->count * sizeof(avl_cursor_t))) == NULL ||
+        (heap = malloc(db->count * sizeof(avl_cursor_t *))) == NULL) {
+        error("Failed to allocate cursors");
+        free(cursors);
+        return -1;
+    }
+
+    // lock in shard order, writers only ever hold a single shard lock
+    for (i = 0; i < db->count; i++) {
+        pthread_rwlock_rdlock(&db->shards[i].lock);
+        avl_cursor_init(&cursors[i], db->shards[i].tree);
+        if (lo != NULL)
+            retval = avl_cursor_seek(&cursors[i], lo);
+        else
+            retval = avl_cursor_first(&cursors[i]);
+        if (retval == 0)
+            heap[count++] = &cursors[i];
+    }
+    for (i = count / 2 - 1; i >= 0; i--)
+        heap_down(db, heap, count, i);
+
+    while (count > 0) {
+        if (hi != NULL && db->compare(avl_cursor_data(heap[0]), hi) > 0)
+            break;
+        visited++;
+        if (callback(avl_cursor_data(heap[0]), arg) != 0)
+            break;
+        if (avl_cursor_next(heap[0]) != 0)
+            heap[0] = heap[--count];
+        heap_down(db, heap, count, 0);
+    }
+
+    for (i = 0; i < db->count; i++)
+        pthread_rwlock_unlock(&db->shards[i].lock);
+    free(heap);
+    free(cursors);
+    return visited;
+}
+
+long shard_size(shard_db_t *db) {
+    long size = 0;
+    int i;
+    for (i = 0; i < db->count; i++) {
+        pthread_rwlock_rdlock(&db->shards[i].lock);
+        size += avl_size(db->shards[i].tree);
+        pthread_rwlock_unlock(&db->shards[i].lock);
+    }
+    return size;
+}
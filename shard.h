@@ -0,0 +1,128 @@
+/** @file shard.h
+ *  @brief Functions prototypes for the sharded database.
+ *
+ *  This file contains the prototypes and macros to control a database that
+ *  hash partitions its keys over a number of independent avl trees. Every
+ *  shard has its own lock, so writers to different shards run in parallel.
+ *
+ *  @author Bram Vlerick (bram.vlerick@ucast.be)
+ *  @bug
+ *  * None at the moment
+ */
+
+#ifndef _SHARD_H_
+#define _SHARD_H_
+
+#include <pthread.h>
+
+#include "avl.h"
+#include "log.h"
+
+/**< Cache line size the shard headers are aligned to */
+#define SHARD_CACHE_LINE 64
+
+/** @brief Definition of a single shard
+ *
+ *  This structure is the header of a single shard. It is aligned to a
+ *  cache line so that the locks of neighbouring shards never share one.
+ *
+ */
+typedef struct {
+    /**< Shard lock */
+    pthread_rwlock_t lock;
+    /**< Shard tree */
+    avl_tree_t *tree;
+} __attribute__((aligned(SHARD_CACHE_LINE))) shard_t;
+
+/** @brief Definition of the sharded database
+ *
+ *  This structure contains all sharded database data
+ *
+ */
+typedef struct {
+    /**< Number of shards */
+    int count;
+    /**< Compare callback function */
+    int (*compare)(const void *key1, const void *key2);
+    /**< Hash callback function */
+    unsigned long (*hash)(const void *data);
+    /**< Shard array */
+    shard_t *shards;
+} shard_db_t;
+
+/** @brief Initialise the sharded database
+ *
+ *  This function initialises a database of count shards. Data that
+ *  compares equal has to hash to the same value.
+ *
+ *  @param count Number of shards
+ *  @param compare Data compare callback
+ *  @param hash Data hash callback
+ *  @param destroy Destroy data callback
+ *
+ *  @return Pointer to the database, NULL if failed
+ */
+shard_db_t *shard_init(int count,
+                       int (*compare)(const void *key1, const void *key2),
+                       unsigned long (*hash)(const void *data),
+                       void (*destroy)(void *data));
+
+/** @brief Destroy the sharded database
+ *
+ *  @param db Pointer to the database
+ */
+void shard_destroy(shard_db_t *db);
+
+/** @brief Insert data into the database
+ *
+ *  @param db Pointer to the database
+ *  @param data Void pointer to the data that will be inserted
+ *
+ *  @return 0 if successful, 1 if the data already exists, -1 if failed
+ */
+int shard_insert(shard_db_t *db, const void *data);
+
+/** @brief Remove data from the database
+ *
+ *  @param db Pointer to the database
+ *  @param data Reference data that has to be removed
+ *
+ *  @return 0 if successful, -1 if failed
+ */
+int shard_remove(shard_db_t *db, const void *data);
+
+/** @brief Lookup data in the database
+ *
+ *  @param db Pointer to the database
+ *  @param data Pointer to a data reference, set to the found data
+ *
+ *  @return 0 if successful, -1 if failed
+ */
+int shard_lookup(shard_db_t *db, void **data);
+
+/** @brief Call a callback for every entry in a range
+ *
+ *  Walk all entries between lo and hi (both inclusive) of all shards in
+ *  order, merging the shards on the fly. All shards are read locked for
+ *  the duration of the walk.
+ *
+ *  @param db Pointer to the database
+ *  @param lo Lower bound reference data, NULL for no lower bound
+ *  @param hi Upper bound reference data, NULL for no upper bound
+ *  @param callback Callback called for every entry
+ *  @param arg Argument passed to the callback
+ *
+ *  @return Number of visited entries, -1 if failed
+ */
+long shard_range(shard_db_t *db, const void *lo, const void *hi,
+                 int (*callback)(void *data, void *arg), void *arg);
+
+/** @brief Get the number of entries
+ *
+ *  @param db Pointer to the database
+ *
+ *  @return Number of entries over all shards
+ */
+long shard_size(shard_db_t *db);
+
+#endif
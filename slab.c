@@ -0,0 +1,110 @@
+/** @file slab.c
+ *  @brief Functions for the slab allocator.
+ *
+ *  This file contains the functions to control a fixed size object
+ *  allocator
+ *
+ *  @author Bram Vlerick (bram.vlerick@ucast.be)
+ *  @bug
+ *  * None at the moment
+ */
+
+#include "slab.h"
+
+#define SLAB_ALIGN 16
+
+slab_t *slab_init(size_t obj_size, size_t per_slab) {
+    slab_t *slab;
+    if (obj_size < sizeof(void *) || per_slab == 0) {
+        error("Invalid slab object size");
+        return NULL;
+    }
+    if ((slab = malloc(sizeof(slab_t))) == NULL) {
+        error("Failed to allocate slab");
+        return NULL;
+    }
+    slab->obj_size = (obj_size + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1);
+    slab->per_slab = per_slab;
+    slab->chunks = NULL;
+    slab->freelist = NULL;
+    slab->count = 0;
+    slab->nchunks = 0;
+    debug(D_MEMORY, "Slab initialised");
+    return slab;
+}
+
+void slab_destroy(slab_t *slab) {
+    slab_chunk_t *chunk, *next;
+    if (!slab) {
+        debug(D_MEMORY, "Slab pointer cannot be NULL");
+        return;
+    }
+    debug(D_MEMORY, "Releasing %ld slabs", slab->nchunks);
+    for (chunk = slab->chunks; chunk != NULL; chunk = next) {
+        next = chunk->next;
+        free(chunk);
+    }
+    memset(slab, 0, sizeof(slab_t));
+    free(slab);
+    return;
+}
+
+void *slab_alloc(slab_t *slab) {
+    slab_chunk_t *chunk;
+    void *obj;
+    if (slab->freelist != NULL) {
+        obj = slab->freelist;
+        slab->freelist = *(void **)obj;
+        slab->count++;
+        return obj;
+    }
+    chunk = slab->chunks;
+    if (chunk == NULL || chunk->used == slab->per_slab) {
+        debug(D_MEMORY, "Allocating new slab");
+        if ((chunk = malloc(sizeof(slab_chunk_t) +
+                            slab->per_slab * slab->obj_size)) == NULL) {
+            error("Failed to allocate slab");
+            return NULL;
+        }
+        chunk->used = 0;
+        chunk->next = slab->chunks;
+        slab->chunks = chunk;
+        slab->nchunks++;
+    }
+    obj = chunk->objs + chunk->used * slab->obj_size;
+    chunk->used++;
+    slab->count++;
+    return obj;
+}
+
+void slab_free(slab_t *slab, void *obj) {
+    *(void **)obj = slab->freelist;
+    slab->freelist = obj;
+    slab->count--;
+    return;
+}
+
+void slab_walk(slab_t *slab, void (*callback)(void *obj, void *arg),
+               void *arg) {
+    slab_chunk_t *chunk;
+    size_t i;
+    for (chunk = slab->chunks; chunk != NULL; chunk = chunk->next) {
+        for (i = 0; i < chunk->used; i++)
+            callback(chunk->objs + i * slab->obj_size, arg);
+    }
+    return;
+}
+
+void *slab_next(slab_t *slab, slab_hand_t *hand) {
+    if (slab->chunks == NULL)
+        return NULL;
+    if (hand->chunk == NULL || hand->index == hand->chunk->used) {
+        // slabs are only released with the allocator, the hand stays valid
+        if (hand->chunk == NULL || hand->chunk->next == NULL)
+            hand->chunk = slab->chunks;
+        else
+            hand->chunk = hand->chunk->next;
+        hand->index = 0;
+    }
+    return hand->chunk->objs + hand->index++ * slab->obj_size;
+}
@@ -0,0 +1,149 @@
+/** @file slab.h
+ *  @brief Functions prototypes for the slab allocator.
+ *
+ *  This file contains the prototypes and macros to control a fixed size
+ *  object allocator. Objects are carved out of large slabs so that they are
+ *  packed contiguously in memory, freed objects are kept on a freelist for
+ *  reuse and the whole allocator is released one slab at a time.
+ *
+ *  @author Bram Vlerick (bram.vlerick@ucast.be)
+ *  @bug
+ *  * None at the moment
+ */
+
+#ifndef _SLAB_H_
+#define _SLAB_H_
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+
+/** @brief Definition of a single slab
+ *
+ *  This structure is the header of one contiguous block of objects
+ *
+ */
+typedef struct slab_chunk_ {
+    /**< Next (older) slab */
+    struct slab_chunk_ *next;
+    /**< Number of objects carved out of this slab */
+    size_t used;
+    /**< Object storage */
+    char objs[] __attribute__((aligned(16)));
+} slab_chunk_t;
+
+/** @brief Definition of a slab hand
+ *
+ *  This structure holds a position for walking the objects round robin
+ *
+ */
+typedef struct {
+    /**< Slab of the position, NULL before the first step */
+    slab_chunk_t *chunk;
+    /**< Index of the next object in the slab */
+    size_t index;
+} slab_hand_t;
+
+/** @brief Definition of the slab allocator
+ *
+ *  This structure contains all slab allocator data
+ *
+ */
+typedef struct {
+    /**< Size of a single object, rounded up to the alignment */
+    size_t obj_size;
+    /**< Number of objects per slab */
+    size_t per_slab;
+    /**< List of slabs, newest first */
+    slab_chunk_t *chunks;
+    /**< List of freed objects */
+    void *freelist;
+    /**< Number of live objects */
+    long count;
+    /**< Number of allocated slabs */
+    long nchunks;
+} slab_t;
+
+/** @brief Initialise a slab allocator
+ *
+ *  This function initialises an allocator for objects of a given size
+ *
+ *  @param obj_size Size of a single object
+ *  @param per_slab Number of objects in a single slab
+ *
+ *  @return Pointer to the allocator, NULL if failed
+ */
+slab_t *slab_init(size_t obj_size, size_t per_slab);
+
+/** @brief Destroy a slab allocator
+ *
+ *  This function releases all slabs at once, live objects included
+ *
+ *  @param slab Pointer to the slab allocator
+ */
+void slab_destroy(slab_t *slab);
+
+/** @brief Allocate an object
+ *
+ *  Take an object from the freelist, or carve a new one from the current
+ *  slab. The object memory is not cleared.
+ *
+ *  @param slab Pointer to the slab allocator
+ *
+ *  @return Pointer to the object, NULL if failed
+ */
+void *slab_alloc(slab_t *slab);
+
+/** @brief Free an object
+ *
+ *  Put an object back on the freelist. The first pointer sized word of the
+ *  object is overwritten by the freelist link.
+ *
+ *  @param slab Pointer to the slab allocator
+ *  @param obj Pointer to the object
+ */
+void slab_free(slab_t *slab, void *obj);
+
+/** @brief Walk all objects
+ *
+ *  Call a callback for every object ever carved out of the allocator in
+ *  memory order, freed objects included. The caller has to be able to tell
+ *  live and freed objects apart.
+ *
+ *  @param slab Pointer to the slab allocator
+ *  @param callback Callback called for every object
+ *  @param arg Argument passed to the callback
+ */
+void slab_walk(slab_t *slab, void (*callback)(void *obj, void *arg),
+               void *arg);
+
+/** @brief Step a hand to the next object
+ *
+ *  Return the object under the hand and move the hand on. After the last
+ *  object the hand wraps around to the first one. Like slab_walk, freed
+ *  objects are returned too.
+ *
+ *  @param slab Pointer to the slab allocator
+ *  @param hand Pointer to the hand, zeroed to start at the first object
+ *
+ *  @return Pointer to the object, NULL if nothing was ever allocated
+ */
+void *slab_next(slab_t *slab, slab_hand_t *hand);
+
+/**< Macro to retrieve the number of live objects */
+#define slab_count(slab) ((slab)->count)
+
+/**< Macro to retrieve the number of objects ever carved out */
+#define slab_capacity(slab)                                                    \
+    ((slab)->chunks != NULL                                                    \
+         ? ((slab)->nchunks - 1) * (long)(slab)->per_slab +                    \
+               (long)(slab)->chunks->used                                      \
+         : 0)
+
+/**< Macro to retrieve the number of bytes held by the allocator */
+#define slab_bytes(slab)                                                      \
+    ((slab)->nchunks *                                                         \
+     (sizeof(slab_chunk_t) + (slab)->per_slab * (slab)->obj_size))
+
+#endif
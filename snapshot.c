@@ -0,0 +1,343 @@
+/** @file snapshot.c
+ *  @brief Functions for the snapshot files.
+ *
+ *  This file contains the functions to write sorted snapshot files and to
+ *  serve lookups and range scans from a read-only mapping of one
+ *
+ *  @author Bram Vlerick (bram.vlerick@ucast.be)
+ *  @bug
+ *  * Snapshots are stored in host byte order
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "key.h"
+#include "snapshot.h"
+#include "wal.h"
+
+static int key_cmp(const char *key1, size_t len1, const char *key2,
+                   size_t len2) {
+    int cmpval = memcmp(key1, key2, len1 < len2 ? len1 : len2);
+    if (cmpval != 0)
+        return cmpval;
+    return (len1 > len2) - (len1 < len2);
+}
+
+static void writer_free(snapshot_writer_t *writer) {
+    if (writer->file != NULL)
+        fclose(writer->file);
+    free(writer->index);
+    free(writer->tmp);
+    free(writer->path);
+    memset(writer, 0, sizeof(snapshot_writer_t));
+    free(writer);
+    return;
+}
+
+snapshot_writer_t *snapshot_create(const char *path) {
+    snapshot_header_t hdr;
+    snapshot_writer_t *writer;
+    int fd;
+    if (!path) {
+        debug(D_STORAGE, "Path cannot be NULL");
+        return NULL;
+    }
+    if ((writer = calloc(1, sizeof(snapshot_writer_t))) == NULL) {
+        error("Failed to allocate snapshot writer");
+        return NULL;
+    }
+    if ((writer->path = strdup(path)) == NULL ||
+        (writer->tmp = malloc(strlen(path) + sizeof(".XXXXXX"))) == NULL) {
+        error("Failed to allocate snapshot path");
+        writer_free(writer);
+        return NULL;
+    }
+    // a name of its own, so writers of the same path never share the file
+    sprintf(writer->tmp, "%s.XXXXXX", path);
+    if ((fd = mkstemp(writer->tmp)) < 0) {
+        error("Failed to create snapshot %s", writer->tmp);
+        writer_free(writer);
+        return NULL;
+    }
+    if ((writer->file = fdopen(fd, "w")) == NULL)
+        close(fd);
+    // the header is rewritten with the final counts on commit
+    memset(&hdr, 0, sizeof(snapshot_header_t));
+    if (writer->file == NULL ||
+        fwrite(&hdr, sizeof(snapshot_header_t), 1, writer->file) != 1) {
+        error("Failed to create snapshot %s", writer->tmp);
+        snapshot_abort(writer);
+        return NULL;
+    }
+    writer->offset = sizeof(snapshot_header_t);
+    debug(D_STORAGE, "Writing snapshot %s", path);
+    return writer;
+}
+
+int snapshot_append(snapshot_writer_t *writer, const char *key, size_t klen,
+                    const char *val, size_t vlen) {
+    snapshot_entry_t *index;
+    snapshot_record_t rec;
+    uint64_t prefix = key_prefix(key, klen);
+    long cap;
+    if (klen > UINT32_MAX || vlen > UINT32_MAX) {
+        error("Snapshot record too large");
+        return -1;
+    }
+    if (writer->count > 0 && writer->index[writer->count - 1].prefix > prefix) {
+        error("Snapshot records out of order");
+        return -1;
+    }
+    if (writer->count == writer->cap) {
+        cap = writer->cap ? 2 * writer->cap : 1024;
+        if ((index = realloc(writer->index, cap * sizeof(snapshot_entry_t))) ==
+            NULL) {
+            error("Failed to grow snapshot index");
+            return -1;
+        }
+        writer->index = index;
+        writer->cap = cap;
+    }
+    rec.klen = klen;
+    rec.vlen = vlen;
+    if (fwrite(&rec, sizeof(snapshot_record_t), 1, writer->file) != 1 ||
+        fwrite(key, 1, klen, writer->file) != klen ||
+        fwrite(val, 1, vlen, writer->file) != vlen) {
+        error("Failed to write snapshot record");
+        return -1;
+    }
+    writer->index[writer->count].prefix = prefix;
+    writer->index[writer->count].offset = writer->offset;
+    writer->count++;
+    writer->offset += sizeof(snapshot_record_t) + klen + vlen;
+    return 0;
+}
+
+int snapshot_commit(snapshot_writer_t *writer) {
+    static const char pad[sizeof(uint64_t)];
+    snapshot_header_t hdr;
+    size_t padding;
+    int retval;
+    // align the index so it can be used in place from the mapping
+    padding = -writer->offset % sizeof(uint64_t);
+    memset(&hdr, 0, sizeof(snapshot_header_t));
+    memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic));
+    hdr.version = SNAPSHOT_VERSION;
+    hdr.count = writer->count;
+    hdr.index = writer->offset + padding;
+    hdr.size = hdr.index + writer->count * sizeof(snapshot_entry_t);
+    hdr.crc = wal_crc32(0, &hdr, sizeof(snapshot_header_t));
+    if (fwrite(pad, 1, padding, writer->file) != padding ||
+        (writer->count > 0 &&
+         fwrite(writer->index, sizeof(snapshot_entry_t), writer->count,
+                writer->file) != (size_t)writer->count) ||
+        fseek(writer->file, 0, SEEK_SET) != 0 ||
+        fwrite(&hdr, sizeof(snapshot_header_t), 1, writer->file) != 1 ||
+        fflush(writer->file) != 0 || fsync(fileno(writer->file)) != 0) {
+        error("Failed to write snapshot %s", writer->tmp);
+        snapshot_abort(writer);
+        return -1;
+    }
+    if (rename(writer->tmp, writer->path) != 0) {
+        error("Failed to rename snapshot to %s", writer->path);
+        snapshot_abort(writer);
+        return -1;
+    }
+    debug(D_STORAGE, "Wrote snapshot %s with %ld records", writer->path,
+          writer->count);
+    retval = wal_sync_dir(writer->path);
+    writer_free(writer);
+    return retval;
+}
+
+void snapshot_abort(snapshot_writer_t *writer) {
+    if (!writer) {
+        debug(D_STORAGE, "Writer pointer cannot be NULL");
+        return;
+    }
+    debug(D_STORAGE, "Abandoning snapshot %s", writer->tmp);
+    if (writer->file != NULL) {
+        fclose(writer->file);
+        writer->file = NULL;
+    }
+    unlink(writer->tmp);
+    writer_free(writer);
+    return;
+}
+
+snapshot_t *snapshot_open(const char *path) {
+    snapshot_header_t hdr;
+    snapshot_t *snap;
+    struct stat st;
+    uint32_t crc;
+    void *map;
+    int fd;
+    if (!path) {
+        debug(D_STORAGE, "Path cannot be NULL");
+        return NULL;
+    }
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0 || fstat(fd, &st) != 0) {
+        error("Failed to open snapshot %s", path);
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+    if ((size_t)st.st_size < sizeof(snapshot_header_t)) {
+        error("Snapshot %s is truncated", path);
+        close(fd);
+        return NULL;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        error("Failed to map snapshot %s", path);
+        return NULL;
+    }
+
+    memcpy(&hdr, map, sizeof(snapshot_header_t));
+    crc = hdr.crc;
+    hdr.crc = 0;
+    if (memcmp(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.version != SNAPSHOT_VERSION ||
+        wal_crc32(0, &hdr, sizeof(snapshot_header_t)) != crc ||
+        hdr.size != (uint64_t)st.st_size ||
+        hdr.index < sizeof(snapshot_header_t) || hdr.index > hdr.size ||
+        hdr.index % sizeof(uint64_t) != 0 ||
+        hdr.count != (hdr.size - hdr.index) / sizeof(snapshot_entry_t) ||
+        (hdr.size - hdr.index) % sizeof(snapshot_entry_t) != 0) {
+        error("Snapshot %s is corrupt", path);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    if ((snap = malloc(sizeof(snapshot_t))) == NULL) {
+        error("Failed to allocate snapshot");
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    // lookups jump around the file, do not read ahead
+    madvise(map, st.st_size, MADV_RANDOM);
+    snap->map = map;
+    snap->size = st.st_size;
+    snap->count = hdr.count;
+    snap->index = (const snapshot_entry_t *)((const char *)map + hdr.index);
+    debug(D_STORAGE, "Opened snapshot %s with %ld records", path,
+          snap->count);
+    return snap;
+}
+
+void snapshot_close(snapshot_t *snap) {
+    if (!snap) {
+        debug(D_STORAGE, "Snapshot pointer cannot be NULL");
+        return;
+    }
+    debug(D_STORAGE, "Closing snapshot");
+    munmap((void *)snap->map, snap->size);
+    memset(snap, 0, sizeof(snapshot_t));
+    free(snap);
+    return;
+}
+
+int snapshot_entry(snapshot_t *snap, long pos, const char **key,
+                   size_t *klen, const char **val, size_t *vlen) {
+    uint64_t off, end = (const char *)snap->index - snap->map;
+    snapshot_record_t rec;
+    if (pos < 0 || pos >= snap->count)
+        return -1;
+    off = snap->index[pos].offset;
+    if (off < sizeof(snapshot_header_t) ||
+        off > end - sizeof(snapshot_record_t)) {
+        error("Snapshot record %ld is corrupt", pos);
+        return -1;
+    }
+    memcpy(&rec, snap->map + off, sizeof(snapshot_record_t));
+    off += sizeof(snapshot_record_t);
+    if ((uint64_t)rec.klen + rec.vlen > end - off) {
+        error("Snapshot record %ld is corrupt", pos);
+        return -1;
+    }
+    *key = snap->map + off;
+    *klen = rec.klen;
+    if (val != NULL)
+        *val = snap->map + off + rec.klen;
+    if (vlen != NULL)
+        *vlen = rec.vlen;
+    return 0;
+}
+
+long snapshot_seek(snapshot_t *snap, const char *key, size_t klen,
+                   int *found) {
+    uint64_t prefix = key_prefix(key, klen);
+    long lo = 0, hi = snap->count, mid;
+    const char *k;
+    size_t kl;
+    int cmpval;
+    *found = 0;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        // only equal prefixes need the record itself
+        if (snap->index[mid].prefix != prefix) {
+            cmpval = snap->index[mid].prefix < prefix ? -1 : 1;
+        } else {
+            if (snapshot_entry(snap, mid, &k, &kl, NULL, NULL) != 0)
+                return -1;
+            cmpval = key_cmp(k, kl, key, klen);
+        }
+        if (cmpval < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < snap->count && snap->index[lo].prefix == prefix) {
+        if (snapshot_entry(snap, lo, &k, &kl, NULL, NULL) != 0)
+            return -1;
+        *found = key_cmp(k, kl, key, klen) == 0;
+    }
+    return lo;
+}
+
+int snapshot_lookup(snapshot_t *snap, const char *key, size_t klen,
+                    const char **val, size_t *vlen) {
+    const char *k;
+    size_t kl;
+    long pos;
+    int found;
+    if (!snap) {
+        debug(D_STORAGE, "Snapshot pointer cannot be NULL");
+        return -1;
+    }
+    if ((pos = snapshot_seek(snap, key, klen, &found)) < 0 || !found)
+        return -1;
+    return snapshot_entry(snap, pos, &k, &kl, val, vlen);
+}
+
+long snapshot_range(snapshot_t *snap, const char *lo, size_t lolen,
+                    const char *hi, size_t hilen,
+                    int (*callback)(const char *key, size_t klen,
+                                    const char *val, size_t vlen, void *arg),
+                    void *arg) {
+    const char *key, *val;
+    size_t klen, vlen;
+    long pos = 0, visited = 0;
+    int found;
+    if (!snap) {
+        debug(D_STORAGE, "Snapshot pointer cannot be NULL");
+        return -1;
+    }
+    debug(D_STORAGE, "Performing snapshot range scan");
+    if (lo != NULL && (pos = snapshot_seek(snap, lo, lolen, &found)) < 0)
+        return -1;
+    for (; pos < snap->count; pos++) {
+        if (snapshot_entry(snap, pos, &key, &klen, &val, &vlen) != 0)
+            return -1;
+        if (hi != NULL && key_cmp(key, klen, hi, hilen) > 0)
+            break;
+        visited++;
+        if (callback(key, klen, val, vlen, arg) != 0)
+            break;
+    }
+    return visited;
+}
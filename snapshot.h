@@ -0,0 +1,244 @@
+/** @file snapshot.h
+ *  @brief Functions prototypes for the snapshot files.
+ *
+ *  This file contains the prototypes and macros to write and read sorted
+ *  snapshot files. A snapshot is a header, a block of length prefixed
+ *  key/value records in key order and an index block with the offset and
+ *  key prefix of every record. All offsets are relative to the start of the
+ *  file, so a snapshot is served straight from a read-only mapping: opening
+ *  one only checks the header and pages fault in as lookups touch them.
+ *
+ *  @author Bram Vlerick (bram.vlerick@ucast.be)
+ *  @bug
+ *  * Snapshots are stored in host byte order
+ */
+
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+
+/**< Snapshot file magic */
+#define SNAPSHOT_MAGIC "MEMDBSNP"
+
+/**< Snapshot format version */
+#define SNAPSHOT_VERSION 1
+
+/** @brief Definition of the snapshot header
+ *
+ *  This structure is stored at the start of a snapshot file
+ *
+ */
+typedef struct {
+    /**< File magic */
+    char magic[8];
+    /**< Format version */
+    uint32_t version;
+    /**< CRC32 of the header with this field set to 0 */
+    uint32_t crc;
+    /**< Number of records */
+    uint64_t count;
+    /**< Offset of the index block */
+    uint64_t index;
+    /**< File size */
+    uint64_t size;
+} snapshot_header_t;
+
+/** @brief Definition of a snapshot index entry
+ *
+ *  The key prefix settles most comparisons of a binary search without
+ *  touching the record
+ *
+ */
+typedef struct {
+    /**< First 8 key bytes, big endian and zero padded */
+    uint64_t prefix;
+    /**< Offset of the record */
+    uint64_t offset;
+} snapshot_entry_t;
+
+/** @brief Definition of a snapshot record header
+ *
+ *  This structure precedes the key and value bytes of every record
+ *
+ */
+typedef struct {
+    /**< Key length */
+    uint32_t klen;
+    /**< Value length */
+    uint32_t vlen;
+} snapshot_record_t;
+
+/** @brief Definition of a snapshot writer
+ *
+ *  This structure contains the state of a snapshot being written
+ *
+ */
+typedef struct {
+    /**< Final path */
+    char *path;
+    /**< Temporary path the snapshot is written to */
+    char *tmp;
+    /**< Temporary file */
+    FILE *file;
+    /**< Index entries written so far */
+    snapshot_entry_t *index;
+    /**< Number of index entries */
+    long count;
+    /**< Size of the index array */
+    long cap;
+    /**< Current file offset */
+    uint64_t offset;
+} snapshot_writer_t;
+
+/** @brief Definition of an open snapshot
+ *
+ *  This structure contains a read-only view of a mapped snapshot
+ *
+ */
+typedef struct {
+    /**< File mapping */
+    const char *map;
+    /**< Mapping size */
+    size_t size;
+    /**< Number of records */
+    long count;
+    /**< Index block */
+    const snapshot_entry_t *index;
+} snapshot_t;
+
+/** @brief Start writing a snapshot
+ *
+ *  The snapshot is written to a uniquely named temporary file next to path
+ *  and only replaces path when it is committed
+ *
+ *  @param path Path of the snapshot file
+ *
+ *  @return Pointer to the writer, NULL if failed
+ */
+snapshot_writer_t *snapshot_create(const char *path);
+
+/** @brief Add a record to a snapshot
+ *
+ *  Records have to be added in ascending bytewise key order
+ *
+ *  @param writer Pointer to the writer
+ *  @param key Key bytes
+ *  @param klen Key length
+ *  @param val Value bytes
+ *  @param vlen Value length
+ *
+ *  @return 0 if successful, -1 if failed
+ */
+int snapshot_append(snapshot_writer_t *writer, const char *key, size_t klen,
+                    const char *val, size_t vlen);
+
+/** @brief Finish writing a snapshot
+ *
+ *  This function writes the index and header, syncs the file and renames
+ *  it into place. The writer is released.
+ *
+ *  @param writer Pointer to the writer
+ *
+ *  @return 0 if successful, -1 if failed
+ */
+int snapshot_commit(snapshot_writer_t *writer);
+
+/** @brief Abandon a snapshot
+ *
+ *  Remove the temporary file and release the writer
+ *
+ *  @param writer Pointer to the writer
+ */
+void snapshot_abort(snapshot_writer_t *writer);
+
+/** @brief Open a snapshot
+ *
+ *  This function maps the snapshot read-only and checks its header. Records
+ *  are not read until they are looked up.
+ *
+ *  @param path Path of the snapshot file
+ *
+ *  @return Pointer to the snapshot, NULL if failed
+ */
+snapshot_t *snapshot_open(const char *path);
+
+/** @brief Close a snapshot
+ *
+ *  @param snap Pointer to the snapshot
+ */
+void snapshot_close(snapshot_t *snap);
+
+/** @brief Retrieve a record by position
+ *
+ *  @param snap Pointer to the snapshot
+ *  @param pos Record position, 0 to count - 1
+ *  @param key Set to the key bytes
+ *  @param klen Set to the key length
+ *  @param val Set to the value bytes, can be NULL
+ *  @param vlen Set to the value length, can be NULL
+ *
+ *  @return 0 if successful, -1 if failed
+ */
+int snapshot_entry(snapshot_t *snap, long pos, const char **key,
+                   size_t *klen, const char **val, size_t *vlen);
+
+/** @brief Find the position of a key
+ *
+ *  @param snap Pointer to the snapshot
+ *  @param key Key bytes
+ *  @param klen Key length
+ *  @param found Set to 1 if the key is present, 0 otherwise
+ *
+ *  @return Position of the first record not below key, count if none, -1
+ *  if failed
+ */
+long snapshot_seek(snapshot_t *snap, const char *key, size_t klen,
+                   int *found);
+
+/** @brief Look up a key
+ *
+ *  The value points into the mapping and stays valid until the snapshot
+ *  is closed
+ *
+ *  @param snap Pointer to the snapshot
+ *  @param key Key bytes
+ *  @param klen Key length
+ *  @param val Set to the value bytes
+ *  @param vlen Set to the value length
+ *
+ *  @return 0 if successful, -1 if not found
+ */
+int snapshot_lookup(snapshot_t *snap, const char *key, size_t klen,
+                    const char **val, size_t *vlen);
+
+/** @brief Scan a range of keys
+ *
+ *  This function calls callback in key order for every record between lo
+ *  and hi inclusive, until the callback returns non zero
+ *
+ *  @param snap Pointer to the snapshot
+ *  @param lo Lower bound, NULL for the first record
+ *  @param lolen Length of the lower bound
+ *  @param hi Upper bound, NULL for the last record
+ *  @param hilen Length of the upper bound
+ *  @param callback Callback function
+ *  @param arg Argument passed to the callback
+ *
+ *  @return Number of records visited, -1 if failed
+ */
+long snapshot_range(snapshot_t *snap, const char *lo, size_t lolen,
+                    const char *hi, size_t hilen,
+                    int (*callback)(const char *key, size_t klen,
+                                    const char *val, size_t vlen, void *arg),
+                    void *arg);
+
+/**< Macro to retrieve the number of records in a snapshot */
+#define snapshot_count(snap) ((snap)->count)
+
+#endif
@@ -0,0 +1,177 @@
+/** @file stats.c
+ *  @brief Functions for the statistics counters.
+ *
+ *  This file contains the functions to keep striped operation counters and
+ *  log bucket latency histograms
+ *
+ *  @author Bram Vlerick (bram.vlerick@ucast.be)
+ *  @bug
+ *  * None at the moment
+ */
+
+#include "stats.h"
+
+/**< Stripe handed to the next thread that records something */
+static int next_stripe;
+
+/**< Stripe of the calling thread, -1 until it records something */
+static __thread int own = -1;
+
+/**< Number of sampling decisions taken by the calling thread */
+static __thread unsigned int samples;
+
+static inline char *stripe_of(stats_t *stats, int stripe) {
+    return stats->stripes + stripe * stats->stripe_size;
+}
+
+static inline char *own_stripe(stats_t *stats) {
+    if (own < 0)
+        own = __atomic_fetch_add(&next_stripe, 1, __ATOMIC_RELAXED) %
+              STATS_STRIPES;
+    return stripe_of(stats, own);
+}
+
+static inline stats_hist_t *hist_of(stats_t *stats, char *stripe, int hist) {
+    return (stats_hist_t *)(stripe + stats->counters * sizeof(unsigned long)) +
+           hist;
+}
+
+static int bucket(unsigned long value) {
+    int shift;
+    if (value >> STATS_VALUE_BITS)
+        value = (1UL << STATS_VALUE_BITS) - 1;
+    if (value < STATS_SUB_BUCKETS)
+        return value;
+    // the top STATS_SUB_BITS + 1 bits of the value pick the bucket
+    shift = 63 - __builtin_clzl(value) - STATS_SUB_BITS;
+    return ((shift + 1) << STATS_SUB_BITS) +
+           ((value >> shift) & (STATS_SUB_BUCKETS - 1));
+}
+
+static unsigned long bucket_top(int b) {
+    unsigned long sub;
+    int shift;
+    if (b < STATS_SUB_BUCKETS)
+        return b;
+    shift = (b >> STATS_SUB_BITS) - 1;
+    sub = STATS_SUB_BUCKETS | (b & (STATS_SUB_BUCKETS - 1));
+    return ((sub + 1) << shift) - 1;
+}
+
+stats_t *stats_init(int counters, int hists) {
+    stats_t *stats;
+    size_t size;
+    if ((stats = malloc(sizeof(stats_t))) == NULL) {
+        error("Failed to allocate statistics");
+        return NULL;
+    }
+    size = counters * sizeof(unsigned long) + hists * sizeof(stats_hist_t);
+    stats->counters = counters;
+    stats->hists = hists;
+    stats->stripe_size =
+        (size + STATS_CACHE_LINE - 1) & ~(size_t)(STATS_CACHE_LINE - 1);
+    if (posix_memalign((void **)&stats->stripes, STATS_CACHE_LINE,
+                       STATS_STRIPES * stats->stripe_size) != 0) {
+        error("Failed to allocate statistics stripes");
+        free(stats);
+        return NULL;
+    }
+    memset(stats->stripes, 0, STATS_STRIPES * stats->stripe_size);
+    return stats;
+}
+
+void stats_destroy(stats_t *stats) {
+    if (!stats) {
+        debug(D_MEMORY, "Statistics pointer cannot be NULL");
+        return;
+    }
+    free(stats->stripes);
+    free(stats);
+    return;
+}
+
+void stats_add(stats_t *stats, int counter, unsigned long n) {
+    unsigned long *counters = (unsigned long *)own_stripe(stats);
+    // relaxed, the stripe is shared only once there are more threads than
+    // stripes
+    __atomic_fetch_add(&counters[counter], n, __ATOMIC_RELAXED);
+    return;
+}
+
+void stats_record(stats_t *stats, int hist, unsigned long value) {
+    stats_hist_t *h = hist_of(stats, own_stripe(stats), hist);
+    unsigned long max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, value, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->buckets[bucket(value)], 1, __ATOMIC_RELAXED);
+    while (value > max &&
+           !__atomic_compare_exchange_n(&h->max, &max, value, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    return;
+}
+
+int stats_sample(void) {
+    return (++samples & (STATS_SAMPLE - 1)) == 0;
+}
+
+unsigned long stats_counter(stats_t *stats, int counter) {
+    unsigned long total = 0;
+    int i;
+    for (i = 0; i < STATS_STRIPES; i++)
+        total += __atomic_load_n(
+            &((unsigned long *)stripe_of(stats, i))[counter], __ATOMIC_RELAXED);
+    return total;
+}
+
+void stats_hist(stats_t *stats, int hist, stats_hist_t *out) {
+    stats_hist_t *h;
+    unsigned long max;
+    int i, b;
+    memset(out, 0, sizeof(stats_hist_t));
+    for (i = 0; i < STATS_STRIPES; i++) {
+        h = hist_of(stats, stripe_of(stats, i), hist);
+        out->count += __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+        out->sum += __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+        if ((max = __atomic_load_n(&h->max, __ATOMIC_RELAXED)) > out->max)
+            out->max = max;
+        for (b = 0; b < STATS_BUCKETS; b++)
+            out->buckets[b] +=
+                __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+    }
+    return;
+}
+
+unsigned long stats_percentile(const stats_hist_t *hist, double pct) {
+    unsigned long total = 0, rank, seen = 0;
+    int b;
+    // count the buckets, a concurrent read can leave count slightly off
+    for (b = 0; b < STATS_BUCKETS; b++)
+        total += hist->buckets[b];
+    if (total == 0)
+        return 0;
+    rank = (unsigned long)(pct / 100.0 * total + 0.5);
+    if (rank == 0)
+        rank = 1;
+    for (b = 0; b < STATS_BUCKETS; b++) {
+        seen += hist->buckets[b];
+        if (seen >= rank)
+            break;
+    }
+    if (b == STATS_BUCKETS || bucket_top(b) > hist->max)
+        return hist->max;
+    return bucket_top(b);
+}
+
+void stats_summary(stats_t *stats, int hist, stats_summary_t *out) {
+    stats_hist_t h;
+    stats_hist(stats, hist, &h);
+    out->count = h.count;
+    out->mean = h.count != 0 ? h.sum / h.count : 0;
+    out->p50 = stats_percentile(&h, 50.0);
+    out->p90 = stats_percentile(&h, 90.0);
+    out->p99 = stats_percentile(&h, 99.0);
+    out->p999 = stats_percentile(&h, 99.9);
+    out->max = h.max;
+    return;
+}
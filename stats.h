@@ -0,0 +1,190 @@
+/** @file stats.h
+ *  @brief Functions prototypes for the statistics counters.
+ *
+ *  This file contains the prototypes and macros to keep operation counters
+ *  and latency histograms. Every thread updates its own stripe of counters
+ *  so collection adds no contention, readers add the stripes up. Histograms
+ *  use log buckets split in STATS_SUB_BUCKETS linear sub buckets, like HDR
+ *  histograms, so a bucket is at most 1/STATS_SUB_BUCKETS of its value wide.
+ *
+ *  @author Bram Vlerick (bram.vlerick@ucast.be)
+ *  @bug
+ *  * None at the moment
+ */
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+
+/**< Number of counter stripes, threads beyond it share stripes */
+#define STATS_STRIPES 16
+
+/**< Number of linear sub buckets per power of two, log2 */
+#define STATS_SUB_BITS 3
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+
+/**< Number of value bits the buckets cover, larger values are clamped */
+#define STATS_VALUE_BITS 40
+
+/**< Number of histogram buckets */
+#define STATS_BUCKETS                                                          \
+    ((STATS_VALUE_BITS - STATS_SUB_BITS + 1) * STATS_SUB_BUCKETS)
+
+/**< One in this many timed operations is recorded, a power of two */
+#define STATS_SAMPLE 8
+
+/**< Alignment of a stripe, stripes never share a cache line */
+#define STATS_CACHE_LINE 64
+
+/** @brief Definition of a histogram
+ *
+ *  This structure contains the buckets of a single histogram
+ *
+ */
+typedef struct {
+    /**< Number of recorded values */
+    unsigned long count;
+    /**< Sum of the recorded values */
+    unsigned long sum;
+    /**< Largest recorded value */
+    unsigned long max;
+    /**< Number of values per bucket */
+    unsigned long buckets[STATS_BUCKETS];
+} stats_hist_t;
+
+/** @brief Definition of a histogram summary
+ *
+ *  This structure contains the usual percentiles of a histogram
+ *
+ */
+typedef struct {
+    /**< Number of recorded values */
+    unsigned long count;
+    /**< Average value */
+    unsigned long mean;
+    /**< Median */
+    unsigned long p50;
+    /**< 90th percentile */
+    unsigned long p90;
+    /**< 99th percentile */
+    unsigned long p99;
+    /**< 99.9th percentile */
+    unsigned long p999;
+    /**< Largest value */
+    unsigned long max;
+} stats_summary_t;
+
+/** @brief Definition of a statistics set
+ *
+ *  This structure contains a fixed number of counters and histograms,
+ *  replicated in every stripe
+ *
+ */
+typedef struct {
+    /**< Number of counters */
+    int counters;
+    /**< Number of histograms */
+    int hists;
+    /**< Size of a stripe in bytes */
+    size_t stripe_size;
+    /**< Stripes, counters first and histograms after them */
+    char *stripes;
+} stats_t;
+
+/** @brief Initialise a statistics set
+ *
+ *  @param counters Number of counters
+ *  @param hists Number of histograms
+ *
+ *  @return Pointer to the statistics set, NULL if failed
+ */
+stats_t *stats_init(int counters, int hists);
+
+/** @brief Destroy a statistics set
+ *
+ *  @param stats Pointer to the statistics set
+ */
+void stats_destroy(stats_t *stats);
+
+/** @brief Add to a counter
+ *
+ *  @param stats Pointer to the statistics set
+ *  @param counter Counter index
+ *  @param n Amount to add
+ */
+void stats_add(stats_t *stats, int counter, unsigned long n);
+
+/** @brief Record a value in a histogram
+ *
+ *  @param stats Pointer to the statistics set
+ *  @param hist Histogram index
+ *  @param value Value to record
+ */
+void stats_record(stats_t *stats, int hist, unsigned long value);
+
+/** @brief Decide whether to time an operation
+ *
+ *  Reading the clock twice costs about as much as a short operation, so
+ *  callers time one in STATS_SAMPLE operations of every thread
+ *
+ *  @return Non zero if the operation should be timed
+ */
+int stats_sample(void);
+
+/** @brief Read a counter
+ *
+ *  Add up the counter over all stripes
+ *
+ *  @param stats Pointer to the statistics set
+ *  @param counter Counter index
+ *
+ *  @return Counter value
+ */
+unsigned long stats_counter(stats_t *stats, int counter);
+
+/** @brief Read a histogram
+ *
+ *  Add up the histogram over all stripes. Values recorded while it runs
+ *  may be partly included.
+ *
+ *  @param stats Pointer to the statistics set
+ *  @param hist Histogram index
+ *  @param out Filled with the histogram
+ */
+void stats_hist(stats_t *stats, int hist, stats_hist_t *out);
+
+/** @brief Retrieve a percentile of a histogram
+ *
+ *  @param hist Pointer to the histogram
+ *  @param pct Percentile between 0 and 100
+ *
+ *  @return Upper bound of the bucket holding the percentile, clamped to
+ *  the largest value
+ */
+unsigned long stats_percentile(const stats_hist_t *hist, double pct);
+
+/** @brief Summarise a histogram
+ *
+ *  @param stats Pointer to the statistics set
+ *  @param hist Histogram index
+ *  @param out Filled with the summary
+ */
+void stats_summary(stats_t *stats, int hist, stats_summary_t *out);
+
+/** @brief Read the monotonic clock
+ *
+ *  @return Time in nanoseconds
+ */
+static inline unsigned long stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+#endif
@@ -0,0 +1,408 @@
+/** @file wal.c
+ *  @brief Functions for the write-ahead log.
+ *
+ *  This file contains the functions to control an append only log with
+ *  checksummed records and group commit
+ *
+ *  @author Bram Vlerick (bram.vlerick@ucast.be)
+ *  @bug
+ *  * Records are stored in host byte order
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "wal.h"
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void) {
+    uint32_t crc;
+    int i, j;
+    for (i = 0; i < 256; i++) {
+        crc = i;
+        for (j = 0; j < 8; j++)
+            crc = crc & 1 ? (crc >> 1) ^ 0xedb88320U : crc >> 1;
+        crc_table[i] = crc;
+    }
+    return;
+}
+
+static uint32_t record_crc(const wal_header_t *hdr, const char *key,
+                           const char *val) {
+    uint32_t crc;
+    crc = wal_crc32(0, &hdr->op, sizeof(wal_header_t) - sizeof(hdr->crc));
+    crc = wal_crc32(crc, key, hdr->klen);
+    return wal_crc32(crc, val, hdr->vlen);
+}
+
+static int write_all(int fd, const char *buf, size_t len, off_t off) {
+    ssize_t n;
+    while (len > 0) {
+        if ((n = pwrite(fd, buf, len, off)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+        off += n;
+    }
+    return 0;
+}
+
+static off_t replay_log(int fd, off_t size,
+                        int (*replay)(int op, const char *key, size_t klen,
+                                      const char *val, size_t vlen, void *arg),
+                        void *arg) {
+    wal_header_t hdr;
+    const char *map = NULL, *key;
+    off_t off = 0;
+    long count = 0;
+    if (size > 0 && (map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0)) ==
+                        MAP_FAILED) {
+        error("Failed to map log");
+        return -1;
+    }
+    while (size - off >= (off_t)sizeof(wal_header_t)) {
+        memcpy(&hdr, map + off, sizeof(wal_header_t));
+        if ((uint64_t)hdr.klen + hdr.vlen >
+            (uint64_t)(size - off) - sizeof(wal_header_t))
+            break;
+        key = map + off + sizeof(wal_header_t);
+        if (hdr.op < WAL_INSERT || hdr.op > WAL_REPLACE ||
+            record_crc(&hdr, key, key + hdr.klen) != hdr.crc)
+            break;
+        if (replay != NULL &&
+            replay(hdr.op, key, hdr.klen, key + hdr.klen, hdr.vlen, arg) != 0) {
+            error("Failed to replay log record at offset %lld",
+                  (long long)off);
+            munmap((void *)map, size);
+            return -1;
+        }
+        off += sizeof(wal_header_t) + hdr.klen + hdr.vlen;
+        count++;
+    }
+    if (map != NULL)
+        munmap((void *)map, size);
+
+    if (off < size) {
+        error("Truncating torn log tail of %lld bytes at offset %lld",
+              (long long)(size - off), (long long)off);
+        if (ftruncate(fd, off) != 0 || fdatasync(fd) != 0) {
+            error("Failed to truncate log");
+            return -1;
+        }
+    }
+    debug(D_STORAGE, "Replayed %ld log records", count);
+    return off;
+}
+
+static int replay_old(wal_t *wal,
+                      int (*replay)(int op, const char *key, size_t klen,
+                                    const char *val, size_t vlen, void *arg),
+                      void *arg) {
+    struct stat st;
+    int fd, retval = 0;
+    if ((fd = open(wal->old, O_RDWR | O_CLOEXEC)) < 0)
+        return errno == ENOENT ? 0 : -1;
+    // a snapshot did not get to cover it, it comes before the current log
+    info("Replaying log %s left by an unfinished snapshot", wal->old);
+    if (fstat(fd, &st) != 0 || replay_log(fd, st.st_size, replay, arg) < 0)
+        retval = -1;
+    close(fd);
+    wal->rotated = retval == 0;
+    return retval;
+}
+
+static void wal_free(wal_t *wal) {
+    free(wal->path);
+    free(wal->old);
+    free(wal->buf);
+    free(wal->spare);
+    memset(wal, 0, sizeof(wal_t));
+    free(wal);
+    return;
+}
+
+uint32_t wal_crc32(uint32_t crc, const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    pthread_once(&crc_once, crc_init);
+    crc = ~crc;
+    while (len--)
+        crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+int wal_sync_dir(const char *path) {
+    char *copy;
+    int fd, retval = 0;
+    if ((copy = strdup(path)) == NULL) {
+        error("Failed to allocate path");
+        return -1;
+    }
+    if ((fd = open(dirname(copy), O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0 ||
+        fsync(fd) != 0) {
+        error("Failed to sync directory of %s", path);
+        retval = -1;
+    }
+    if (fd >= 0)
+        close(fd);
+    free(copy);
+    return retval;
+}
+
+wal_t *wal_open(const char *path, long delay,
+                int (*replay)(int op, const char *key, size_t klen,
+                              const char *val, size_t vlen, void *arg),
+                void *arg) {
+    struct stat st;
+    wal_t *wal;
+    if (!path) {
+        debug(D_STORAGE, "Path cannot be NULL");
+        return NULL;
+    }
+    if ((wal = calloc(1, sizeof(wal_t))) == NULL) {
+        error("Failed to allocate log");
+        return NULL;
+    }
+    if ((wal->path = strdup(path)) == NULL ||
+        (wal->old = malloc(strlen(path) + sizeof(".old"))) == NULL) {
+        error("Failed to allocate log path");
+        wal_free(wal);
+        return NULL;
+    }
+    sprintf(wal->old, "%s.old", path);
+    if (replay_old(wal, replay, arg) != 0 ||
+        (wal->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0) {
+        error("Failed to open log %s", path);
+        wal_free(wal);
+        return NULL;
+    }
+    wal->cap = wal->spare_cap = WAL_BUFFER_SIZE;
+    if (fstat(wal->fd, &st) != 0 ||
+        (wal->size = replay_log(wal->fd, st.st_size, replay, arg)) < 0 ||
+        (st.st_size == 0 && wal_sync_dir(path) != 0) ||
+        (wal->buf = malloc(wal->cap)) == NULL ||
+        (wal->spare = malloc(wal->spare_cap)) == NULL) {
+        error("Failed to open log %s", path);
+        close(wal->fd);
+        wal_free(wal);
+        return NULL;
+    }
+    wal->delay = delay;
+    pthread_mutex_init(&wal->lock, NULL);
+    pthread_cond_init(&wal->flushed, NULL);
+    debug(D_STORAGE, "Opened log %s at %lld bytes", path,
+          (long long)wal->size);
+    return wal;
+}
+
+int wal_close(wal_t *wal) {
+    int retval = 0;
+    if (!wal) {
+        debug(D_STORAGE, "Log pointer cannot be NULL");
+        return -1;
+    }
+    debug(D_STORAGE, "Closing log");
+    if (wal->appended > 0)
+        retval = wal_sync(wal, wal->appended);
+    if (close(wal->fd) != 0) {
+        error("Failed to close log");
+        retval = -1;
+    }
+    pthread_mutex_destroy(&wal->lock);
+    pthread_cond_destroy(&wal->flushed);
+    wal_free(wal);
+    return retval;
+}
+
+long wal_append(wal_t *wal, int op, const char *key, size_t klen,
+                const char *val, size_t vlen) {
+    wal_header_t hdr;
+    size_t need = sizeof(wal_header_t) + klen + vlen, cap;
+    char *buf;
+    long seq;
+    if (!wal) {
+        debug(D_STORAGE, "Log pointer cannot be NULL");
+        return -1;
+    }
+    if (klen > UINT32_MAX || vlen > UINT32_MAX) {
+        error("Log record too large");
+        return -1;
+    }
+    hdr.op = op;
+    hdr.klen = klen;
+    hdr.vlen = vlen;
+    hdr.crc = record_crc(&hdr, key, val);
+
+    pthread_mutex_lock(&wal->lock);
+    if (wal->failed) {
+        pthread_mutex_unlock(&wal->lock);
+        error("Log failed earlier, refusing record");
+        return -1;
+    }
+    if (wal->len + need > wal->cap) {
+        for (cap = wal->cap; cap < wal->len + need; cap *= 2)
+            ;
+        if ((buf = realloc(wal->buf, cap)) == NULL) {
+            pthread_mutex_unlock(&wal->lock);
+            error("Failed to grow log buffer");
+            return -1;
+        }
+        wal->buf = buf;
+        wal->cap = cap;
+    }
+    buf = wal->buf + wal->len;
+    memcpy(buf, &hdr, sizeof(wal_header_t));
+    memcpy(buf + sizeof(wal_header_t), key, klen);
+    if (vlen > 0)
+        memcpy(buf + sizeof(wal_header_t) + klen, val, vlen);
+    wal->len += need;
+    seq = ++wal->appended;
+    pthread_mutex_unlock(&wal->lock);
+    return seq;
+}
+
+int wal_sync(wal_t *wal, long seq) {
+    struct timespec delay;
+    unsigned long target;
+    size_t len, cap;
+    off_t off;
+    char *buf;
+    int retval;
+    if (!wal || seq < 0) {
+        debug(D_STORAGE, "Invalid log or sequence number");
+        return -1;
+    }
+    pthread_mutex_lock(&wal->lock);
+    while (wal->synced < (unsigned long)seq && !wal->failed) {
+        if (wal->flushing) {
+            pthread_cond_wait(&wal->flushed, &wal->lock);
+            continue;
+        }
+        wal->flushing = 1;
+        if (wal->delay > 0) {
+            // give other writers the window to join this commit
+            pthread_mutex_unlock(&wal->lock);
+            delay.tv_sec = wal->delay / 1000000;
+            delay.tv_nsec = (wal->delay % 1000000) * 1000;
+            nanosleep(&delay, NULL);
+            pthread_mutex_lock(&wal->lock);
+        }
+        buf = wal->buf;
+        cap = wal->cap;
+        len = wal->len;
+        off = wal->size;
+        target = wal->appended;
+        wal->buf = wal->spare;
+        wal->cap = wal->spare_cap;
+        wal->len = 0;
+        wal->spare = buf;
+        wal->spare_cap = cap;
+        pthread_mutex_unlock(&wal->lock);
+
+        retval = write_all(wal->fd, buf, len, off);
+        if (retval == 0)
+            retval = fdatasync(wal->fd);
+
+        pthread_mutex_lock(&wal->lock);
+        wal->flushing = 0;
+        if (retval == 0) {
+            debug(D_STORAGE, "Committed %zu bytes up to record %lu", len,
+                  target);
+            wal->size = off + len;
+            wal->synced = target;
+        } else {
+            error("Failed to write log");
+            wal->failed = 1;
+        }
+        pthread_cond_broadcast(&wal->flushed);
+    }
+    retval = wal->synced >= (unsigned long)seq ? 0 : -1;
+    pthread_mutex_unlock(&wal->lock);
+    return retval;
+}
+
+int wal_rotate(wal_t *wal) {
+    int fd = -1, retval = 0;
+    if (!wal) {
+        debug(D_STORAGE, "Log pointer cannot be NULL");
+        return -1;
+    }
+    pthread_mutex_lock(&wal->lock);
+    // records a snapshot never covered have to stay in front of the new ones
+    if (wal->rotated) {
+        pthread_mutex_unlock(&wal->lock);
+        return 1;
+    }
+    while (wal->flushing)
+        pthread_cond_wait(&wal->flushed, &wal->lock);
+    if (wal->failed ||
+        (wal->len > 0 &&
+         write_all(wal->fd, wal->buf, wal->len, wal->size) != 0) ||
+        fdatasync(wal->fd) != 0) {
+        error("Failed to write log");
+        wal->failed = 1;
+        retval = -1;
+    } else {
+        wal->size += wal->len;
+        wal->len = 0;
+        wal->synced = wal->appended;
+        pthread_cond_broadcast(&wal->flushed);
+    }
+    if (retval == 0 && rename(wal->path, wal->old) != 0) {
+        error("Failed to rename log to %s", wal->old);
+        retval = -1;
+    }
+    if (retval == 0 &&
+        ((fd = open(wal->path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,
+                    0644)) < 0 ||
+         wal_sync_dir(wal->path) != 0)) {
+        error("Failed to start log %s", wal->path);
+        if (fd >= 0) {
+            close(fd);
+            unlink(wal->path);
+        }
+        // keep appending to the old file under its own name
+        if (rename(wal->old, wal->path) != 0)
+            wal->failed = 1;
+        retval = -1;
+    }
+    if (retval == 0) {
+        close(wal->fd);
+        wal->fd = fd;
+        wal->size = 0;
+        wal->rotated = 1;
+        debug(D_STORAGE, "Started log %s", wal->path);
+    }
+    pthread_mutex_unlock(&wal->lock);
+    return retval;
+}
+
+int wal_checkpoint(wal_t *wal) {
+    int retval = 0;
+    if (!wal) {
+        debug(D_STORAGE, "Log pointer cannot be NULL");
+        return -1;
+    }
+    pthread_mutex_lock(&wal->lock);
+    if (wal->rotated) {
+        if (unlink(wal->old) != 0 || wal_sync_dir(wal->old) != 0) {
+            error("Failed to remove log %s", wal->old);
+            retval = -1;
+        } else {
+            debug(D_STORAGE, "Removed log %s", wal->old);
+            wal->rotated = 0;
+        }
+    }
+    pthread_mutex_unlock(&wal->lock);
+    return retval;
+}
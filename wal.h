@@ -0,0 +1,203 @@
+/** @file wal.h
+ *  @brief Functions prototypes for the write-ahead log.
+ *
+ *  This file contains the prototypes and macros to control an append only
+ *  log of insert, remove and replace operations. Every record carries a
+ *  CRC32 checksum, a torn tail left behind by a crash is cut off when the
+ *  log is opened. Writers append to a memory buffer and then wait for it to
+ *  become durable, one writer flushes and syncs the buffer on behalf of all
+ *  writers that are waiting (group commit). A snapshot checkpoints the log
+ *  by setting the file aside when it captures the data and removing it once
+ *  the snapshot is durable.
+ *
+ *  @author Bram Vlerick (bram.vlerick@ucast.be)
+ *  @bug
+ *  * Records are stored in host byte order
+ */
+
+#ifndef _WAL_H_
+#define _WAL_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "log.h"
+
+#define WAL_INSERT 1
+#define WAL_REMOVE 2
+#define WAL_REPLACE 3
+
+/**< Initial size of the append buffer */
+#define WAL_BUFFER_SIZE 65536
+
+/** @brief Definition of a log record header
+ *
+ *  This structure precedes the key and value bytes of every record
+ *
+ */
+typedef struct {
+    /**< CRC32 of the rest of the header, the key and the value */
+    uint32_t crc;
+    /**< Operation */
+    uint32_t op;
+    /**< Key length */
+    uint32_t klen;
+    /**< Value length */
+    uint32_t vlen;
+} wal_header_t;
+
+/** @brief Definition of the write-ahead log
+ *
+ *  This structure contains all write-ahead log data
+ *
+ */
+typedef struct {
+    /**< Log file descriptor */
+    int fd;
+    /**< Path of the log */
+    char *path;
+    /**< Path the log is set aside under by wal_rotate */
+    char *old;
+    /**< Non zero while a set aside log waits for wal_checkpoint */
+    int rotated;
+    /**< Group commit window in microseconds */
+    long delay;
+    /**< Lock protecting the buffers and counters */
+    pthread_mutex_t lock;
+    /**< Signalled when a flush completes */
+    pthread_cond_t flushed;
+    /**< Records appended but not yet written */
+    char *buf;
+    /**< Number of bytes in buf */
+    size_t len;
+    /**< Size of buf */
+    size_t cap;
+    /**< Buffer being written by the flushing writer */
+    char *spare;
+    /**< Size of spare */
+    size_t spare_cap;
+    /**< Sequence number of the last appended record */
+    unsigned long appended;
+    /**< Sequence number of the last durable record */
+    unsigned long synced;
+    /**< Non zero while a writer is flushing */
+    int flushing;
+    /**< Non zero after a failed write, the log refuses further records */
+    int failed;
+    /**< Size of the log file */
+    off_t size;
+} wal_t;
+
+/** @brief Open a write-ahead log
+ *
+ *  This function opens or creates the log at path and replays every intact
+ *  record through the replay callback, oldest first. A log left set aside
+ *  by wal_rotate is replayed before it. A torn or corrupt tail is truncated.
+ *  New records are appended after the last intact one.
+ *
+ *  @param path Path of the log file
+ *  @param delay Group commit window in microseconds, 0 syncs right away
+ *  @param replay Replay callback, can be NULL
+ *  @param arg Argument passed to the replay callback
+ *
+ *  @return Pointer to the log, NULL if failed
+ */
+wal_t *wal_open(const char *path, long delay,
+                int (*replay)(int op, const char *key, size_t klen,
+                              const char *val, size_t vlen, void *arg),
+                void *arg);
+
+/** @brief Close a write-ahead log
+ *
+ *  Flush and sync outstanding records and close the log
+ *
+ *  @param wal Pointer to the log
+ *
+ *  @return 0 if successful, -1 if failed
+ */
+int wal_close(wal_t *wal);
+
+/** @brief Append a record
+ *
+ *  This function appends a record to the memory buffer. The record is not
+ *  durable until wal_sync returns for its sequence number.
+ *
+ *  @param wal Pointer to the log
+ *  @param op Operation, WAL_INSERT, WAL_REMOVE or WAL_REPLACE
+ *  @param key Key bytes
+ *  @param klen Key length
+ *  @param val Value bytes, NULL for WAL_REMOVE
+ *  @param vlen Value length
+ *
+ *  @return Sequence number of the record, -1 if failed
+ */
+long wal_append(wal_t *wal, int op, const char *key, size_t klen,
+                const char *val, size_t vlen);
+
+/** @brief Wait for a record to become durable
+ *
+ *  This function returns once the record with sequence number seq and all
+ *  records before it are written and synced. The first waiting writer
+ *  waits for the group commit window, then writes the buffer of all
+ *  writers and syncs it once.
+ *
+ *  @param wal Pointer to the log
+ *  @param seq Sequence number returned by wal_append
+ *
+ *  @return 0 if successful, -1 if failed
+ */
+int wal_sync(wal_t *wal, long seq);
+
+/** @brief Set the log aside for a checkpoint
+ *
+ *  This function syncs every appended record and renames the log to path
+ *  with ".old" appended, new records go to a new file at path. Call it
+ *  while no records are appended, at the point a snapshot captures the
+ *  data. If an earlier log is still set aside the log is left as is, it
+ *  then holds records from before and after the snapshot, which is safe to
+ *  replay on top of it.
+ *
+ *  @param wal Pointer to the log
+ *
+ *  @return 0 if successful, 1 if an earlier log is still set aside, -1 if
+ *  failed
+ */
+int wal_rotate(wal_t *wal);
+
+/** @brief Remove the log set aside by wal_rotate
+ *
+ *  Call once the snapshot that captured the data is durable
+ *
+ *  @param wal Pointer to the log
+ *
+ *  @return 0 if successful, -1 if failed
+ */
+int wal_checkpoint(wal_t *wal);
+
+/** @brief Compute a CRC32 checksum
+ *
+ *  @param crc Checksum of the preceding bytes, 0 to start
+ *  @param buf Bytes to checksum
+ *  @param len Number of bytes
+ *
+ *  @return The updated checksum
+ */
+uint32_t wal_crc32(uint32_t crc, const void *buf, size_t len);
+
+/** @brief Sync the directory holding a file
+ *
+ *  Make the directory entry of a newly created or renamed file durable
+ *
+ *  @param path Path of the file
+ *
+ *  @return 0 if successful, -1 if failed
+ */
+int wal_sync_dir(const char *path);
+
+/**< Macro to retrieve the size of the log file */
+#define wal_size(wal) ((wal)->size)
+
+#endif
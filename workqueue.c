@@ -0,0 +1,392 @@
+/** @file workqueue.c
+ *  @brief Functions for the worker queue.
+ *
+ *  This file contains the functions to control a pool of worker threads
+ *  with per worker lock-free queues, work stealing and periodic jobs
+ *
+ *  @author Bram Vlerick (bram.vlerick@ucast.be)
+ *  @bug
+ *  * None at the moment
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "workqueue.h"
+
+/**< Worker running on the current thread, NULL outside the pools */
+static __thread workqueue_worker_t *self;
+
+static inline unsigned long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static int queue_push(workqueue_worker_t *worker, const workqueue_job_t *job) {
+    workqueue_slot_t *slot;
+    unsigned long pos, seq;
+    long diff;
+    pos = __atomic_load_n(&worker->tail, __ATOMIC_RELAXED);
+    for (;;) {
+        slot = &worker->slots[pos & worker->mask];
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        diff = (long)(seq - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&worker->tail, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            return -1;
+        } else {
+            pos = __atomic_load_n(&worker->tail, __ATOMIC_RELAXED);
+        }
+    }
+    slot->job = *job;
+    // publish the job, a consumer waits for seq to reach pos + 1
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static int queue_pop(workqueue_worker_t *worker, workqueue_job_t *job) {
+    workqueue_slot_t *slot;
+    unsigned long pos, seq;
+    long diff;
+    pos = __atomic_load_n(&worker->head, __ATOMIC_RELAXED);
+    for (;;) {
+        slot = &worker->slots[pos & worker->mask];
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        diff = (long)(seq - (pos + 1));
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&worker->head, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            return -1;
+        } else {
+            pos = __atomic_load_n(&worker->head, __ATOMIC_RELAXED);
+        }
+    }
+    *job = slot->job;
+    // hand the slot back to producers for the next lap
+    __atomic_store_n(&slot->seq, pos + worker->mask + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static int take(workqueue_t *wq, workqueue_worker_t *worker,
+                workqueue_job_t *job) {
+    int i;
+    if (queue_pop(worker, job) == 0)
+        return 0;
+    for (i = 1; i < wq->count; i++) {
+        if (queue_pop(&wq->workers[(worker->id + i) % wq->count], job) == 0) {
+            __atomic_store_n(&worker->stolen, worker->stolen + 1,
+                             __ATOMIC_RELAXED);
+            debug(D_WORKERQUEUE, "Worker %d stole a job from worker %d",
+                  worker->id, (worker->id + i) % wq->count);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static void run(workqueue_worker_t *worker, const workqueue_job_t *job) {
+    unsigned long wait = now_ns() - job->queued;
+    __atomic_store_n(&worker->wait_ns, worker->wait_ns + wait,
+                     __ATOMIC_RELAXED);
+    if (wait > worker->wait_max)
+        __atomic_store_n(&worker->wait_max, wait, __ATOMIC_RELAXED);
+    job->fn(job->arg);
+    __atomic_store_n(&worker->executed, worker->executed + 1,
+                     __ATOMIC_RELAXED);
+    return;
+}
+
+static void *worker_main(void *arg) {
+    workqueue_worker_t *worker = arg;
+    workqueue_t *wq = worker->wq;
+    workqueue_job_t job;
+    self = worker;
+    debug(D_WORKERQUEUE, "Worker %d started on cpu %d", worker->id,
+          worker->cpu);
+    for (;;) {
+        if (take(wq, worker, &job) == 0) {
+            __atomic_sub_fetch(&wq->pending, 1, __ATOMIC_SEQ_CST);
+            run(worker, &job);
+            continue;
+        }
+        pthread_mutex_lock(&wq->lock);
+        // idle is raised before pending is read, a submitter that misses
+        // the sleeper has made pending non zero before reading idle
+        __atomic_add_fetch(&wq->idle, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&wq->pending, __ATOMIC_SEQ_CST) == 0 &&
+               !wq->stop)
+            pthread_cond_wait(&wq->work, &wq->lock);
+        __atomic_sub_fetch(&wq->idle, 1, __ATOMIC_SEQ_CST);
+        if (wq->stop && __atomic_load_n(&wq->pending, __ATOMIC_SEQ_CST) == 0) {
+            pthread_mutex_unlock(&wq->lock);
+            break;
+        }
+        pthread_mutex_unlock(&wq->lock);
+    }
+    debug(D_WORKERQUEUE, "Worker %d stopped", worker->id);
+    return NULL;
+}
+
+static void periodic_run(void *arg) {
+    workqueue_periodic_t *periodic = arg;
+    periodic->fn(periodic->arg);
+    __atomic_store_n(&periodic->busy, 0, __ATOMIC_RELEASE);
+    return;
+}
+
+static void *scheduler_main(void *arg) {
+    workqueue_t *wq = arg;
+    workqueue_periodic_t *periodic;
+    unsigned long now, due;
+    struct timespec ts;
+    pthread_mutex_lock(&wq->lock);
+    while (!wq->stop) {
+        now = now_ns();
+        due = 0;
+        for (periodic = wq->periodic; periodic != NULL;
+             periodic = periodic->next) {
+            if (periodic->due <= now) {
+                periodic->due = now + periodic->interval * 1000000UL;
+                if (__atomic_load_n(&periodic->busy, __ATOMIC_ACQUIRE)) {
+                    debug(D_SCHEDULER, "Periodic job still running, skipped");
+                } else {
+                    periodic->busy = 1;
+                    // submitting signals the workers, drop the lock first
+                    pthread_mutex_unlock(&wq->lock);
+                    if (workqueue_submit(wq, periodic_run, periodic) != 0)
+                        __atomic_store_n(&periodic->busy, 0,
+                                         __ATOMIC_RELEASE);
+                    pthread_mutex_lock(&wq->lock);
+                }
+            }
+            if (due == 0 || periodic->due < due)
+                due = periodic->due;
+        }
+        if (due == 0) {
+            pthread_cond_wait(&wq->timer, &wq->lock);
+        } else {
+            ts.tv_sec = due / 1000000000UL;
+            ts.tv_nsec = due % 1000000000UL;
+            pthread_cond_timedwait(&wq->timer, &wq->lock, &ts);
+        }
+    }
+    pthread_mutex_unlock(&wq->lock);
+    debug(D_SCHEDULER, "Scheduler stopped");
+    return NULL;
+}
+
+static int start_worker(workqueue_worker_t *worker,
+                        const workqueue_config_t *config, long cpus) {
+    cpu_set_t set;
+    worker->cpu = -1;
+    if (pthread_create(&worker->thread, NULL, worker_main, worker) != 0) {
+        error("Failed to start worker %d", worker->id);
+        return -1;
+    }
+    if (config != NULL && config->pin) {
+        worker->cpu =
+            config->cpus != NULL ? config->cpus[worker->id] : worker->id % cpus;
+        CPU_ZERO(&set);
+        CPU_SET(worker->cpu, &set);
+        if (pthread_setaffinity_np(worker->thread, sizeof(set), &set) != 0) {
+            error("Failed to pin worker %d to cpu %d", worker->id,
+                  worker->cpu);
+            worker->cpu = -1;
+        }
+    }
+    return 0;
+}
+
+static void release(workqueue_t *wq) {
+    workqueue_periodic_t *periodic, *next;
+    int i;
+    for (i = 0; i < wq->count; i++)
+        free(wq->workers[i].slots);
+    for (periodic = wq->periodic; periodic != NULL; periodic = next) {
+        next = periodic->next;
+        free(periodic);
+    }
+    pthread_cond_destroy(&wq->timer);
+    pthread_cond_destroy(&wq->work);
+    pthread_mutex_destroy(&wq->lock);
+    free(wq->workers);
+    memset(wq, 0, sizeof(workqueue_t));
+    free(wq);
+    return;
+}
+
+static void stop(workqueue_t *wq, int workers) {
+    int i;
+    pthread_mutex_lock(&wq->lock);
+    wq->stop = 1;
+    pthread_cond_broadcast(&wq->work);
+    pthread_cond_broadcast(&wq->timer);
+    pthread_mutex_unlock(&wq->lock);
+    if (wq->scheduling)
+        pthread_join(wq->scheduler, NULL);
+    for (i = 0; i < workers; i++)
+        pthread_join(wq->workers[i].thread, NULL);
+    return;
+}
+
+workqueue_t *workqueue_init(const workqueue_config_t *config) {
+    workqueue_worker_t *worker;
+    pthread_condattr_t attr;
+    workqueue_t *wq;
+    size_t size = WORKQUEUE_QUEUE_SIZE;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned long i;
+    int count, started;
+    if (cpus <= 0)
+        cpus = 1;
+    count = config != NULL && config->workers > 0 ? config->workers : cpus;
+    if (config != NULL && config->queue_size > 0)
+        size = config->queue_size;
+    for (i = 1; i < size; i <<= 1)
+        ;
+    size = i;
+    if ((wq = calloc(1, sizeof(workqueue_t))) == NULL) {
+        error("Failed to allocate worker queue");
+        return NULL;
+    }
+    if (posix_memalign((void **)&wq->workers, WORKQUEUE_CACHE_LINE,
+                       count * sizeof(workqueue_worker_t)) != 0) {
+        error("Failed to allocate workers");
+        free(wq);
+        return NULL;
+    }
+    memset(wq->workers, 0, count * sizeof(workqueue_worker_t));
+    pthread_mutex_init(&wq->lock, NULL);
+    pthread_cond_init(&wq->work, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&wq->timer, &attr);
+    pthread_condattr_destroy(&attr);
+    for (wq->count = 0; wq->count < count; wq->count++) {
+        worker = &wq->workers[wq->count];
+        worker->id = wq->count;
+        worker->wq = wq;
+        worker->mask = size - 1;
+        if ((worker->slots = malloc(size * sizeof(workqueue_slot_t))) ==
+            NULL) {
+            error("Failed to allocate worker queue");
+            release(wq);
+            return NULL;
+        }
+        for (i = 0; i < size; i++)
+            worker->slots[i].seq = i;
+    }
+    for (started = 0; started < count; started++)
+        if (start_worker(&wq->workers[started], config, cpus) != 0)
+            break;
+    if (started == count &&
+        pthread_create(&wq->scheduler, NULL, scheduler_main, wq) == 0)
+        wq->scheduling = 1;
+    if (!wq->scheduling) {
+        stop(wq, started);
+        release(wq);
+        return NULL;
+    }
+    debug(D_WORKERQUEUE, "Initialised %d workers with %zu slots each", count,
+          size);
+    return wq;
+}
+
+void workqueue_destroy(workqueue_t *wq) {
+    if (!wq) {
+        debug(D_WORKERQUEUE, "Worker queue pointer cannot be NULL");
+        return;
+    }
+    debug(D_WORKERQUEUE, "Destroying worker queue");
+    stop(wq, wq->count);
+    release(wq);
+    return;
+}
+
+int workqueue_submit(workqueue_t *wq, void (*fn)(void *arg), void *arg) {
+    workqueue_job_t job = {fn, arg, now_ns()};
+    unsigned long first;
+    int i;
+    if (self != NULL && self >= wq->workers && self < wq->workers + wq->count)
+        first = self->id;
+    else
+        first = __atomic_fetch_add(&wq->next, 1, __ATOMIC_RELAXED);
+    // count the job before it can be taken so pending never goes negative
+    __atomic_add_fetch(&wq->pending, 1, __ATOMIC_SEQ_CST);
+    for (i = 0; i < wq->count; i++)
+        if (queue_push(&wq->workers[(first + i) % wq->count], &job) == 0)
+            break;
+    if (i == wq->count) {
+        __atomic_sub_fetch(&wq->pending, 1, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&wq->rejected, 1, __ATOMIC_RELAXED);
+        debug(D_WORKERQUEUE, "Every worker queue is full");
+        return -1;
+    }
+    if (__atomic_load_n(&wq->idle, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&wq->lock);
+        pthread_cond_signal(&wq->work);
+        pthread_mutex_unlock(&wq->lock);
+    }
+    return 0;
+}
+
+int workqueue_every(workqueue_t *wq, long interval, void (*fn)(void *arg),
+                    void *arg) {
+    workqueue_periodic_t *periodic;
+    if (interval <= 0) {
+        error("Invalid interval %ld", interval);
+        return -1;
+    }
+    if ((periodic = calloc(1, sizeof(workqueue_periodic_t))) == NULL) {
+        error("Failed to allocate periodic job");
+        return -1;
+    }
+    periodic->fn = fn;
+    periodic->arg = arg;
+    periodic->interval = interval;
+    periodic->due = now_ns() + interval * 1000000UL;
+    pthread_mutex_lock(&wq->lock);
+    periodic->next = wq->periodic;
+    wq->periodic = periodic;
+    pthread_cond_signal(&wq->timer);
+    pthread_mutex_unlock(&wq->lock);
+    debug(D_SCHEDULER, "Scheduled periodic job every %ld ms", interval);
+    return 0;
+}
+
+void workqueue_stats(workqueue_t *wq, workqueue_stats_t *stats) {
+    workqueue_worker_t *worker;
+    unsigned long wait_ns = 0, max;
+    long depth;
+    int i;
+    memset(stats, 0, sizeof(workqueue_stats_t));
+    stats->rejected = __atomic_load_n(&wq->rejected, __ATOMIC_RELAXED);
+    for (i = 0; i < wq->count; i++) {
+        worker = &wq->workers[i];
+        stats->executed += __atomic_load_n(&worker->executed, __ATOMIC_RELAXED);
+        stats->stolen += __atomic_load_n(&worker->stolen, __ATOMIC_RELAXED);
+        wait_ns += __atomic_load_n(&worker->wait_ns, __ATOMIC_RELAXED);
+        max = __atomic_load_n(&worker->wait_max, __ATOMIC_RELAXED);
+        if (max > stats->wait_max)
+            stats->wait_max = max;
+        // a racing push and pop can make the difference briefly negative
+        if ((depth = workqueue_depth(wq, i)) > 0) {
+            stats->depth += depth;
+            if (depth > stats->depth_max)
+                stats->depth_max = depth;
+        }
+    }
+    stats->wait_avg = stats->executed ? wait_ns / stats->executed : 0;
+    return;
+}
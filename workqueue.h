@@ -0,0 +1,248 @@
+/** @file workqueue.h
+ *  @brief Functions prototypes for the worker queue.
+ *
+ *  This file contains the prototypes and macros to control a fixed size
+ *  pool of worker threads. Every worker owns a bounded lock-free queue,
+ *  jobs submitted from outside the pool are spread round robin over the
+ *  queues and idle workers steal from the queues of busy ones. A scheduler
+ *  thread submits periodic background jobs such as snapshots.
+ *
+ *  @author Bram Vlerick (bram.vlerick@ucast.be)
+ *  @bug
+ *  * None at the moment
+ */
+
+#ifndef _WORKQUEUE_H_
+#define _WORKQUEUE_H_
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+
+/**< Default number of jobs a single worker queue can hold */
+#define WORKQUEUE_QUEUE_SIZE 1024
+
+/**< Size of a cache line, queue positions live on their own line */
+#define WORKQUEUE_CACHE_LINE 64
+
+/** @brief Definition of a job
+ *
+ *  This structure contains a function to run on a worker
+ *
+ */
+typedef struct {
+    /**< Job function */
+    void (*fn)(void *arg);
+    /**< Argument passed to the job function */
+    void *arg;
+    /**< Submit time in nanoseconds */
+    unsigned long queued;
+} workqueue_job_t;
+
+/** @brief Definition of a queue slot
+ *
+ *  This structure is a single cell of a worker queue, seq tells producers
+ *  and consumers whose turn it is
+ *
+ */
+typedef struct {
+    /**< Sequence number of the cell */
+    unsigned long seq;
+    /**< Queued job */
+    workqueue_job_t job;
+} workqueue_slot_t;
+
+/** @brief Definition of a worker
+ *
+ *  This structure contains a worker thread, its queue and its counters.
+ *  The counters are only written by the worker itself.
+ *
+ */
+typedef struct {
+    /**< Position of the next job to take */
+    unsigned long head __attribute__((aligned(WORKQUEUE_CACHE_LINE)));
+    /**< Position of the next free slot */
+    unsigned long tail __attribute__((aligned(WORKQUEUE_CACHE_LINE)));
+    /**< Queue slots */
+    workqueue_slot_t *slots __attribute__((aligned(WORKQUEUE_CACHE_LINE)));
+    /**< Number of slots minus one */
+    unsigned long mask;
+    /**< Pool the worker belongs to */
+    struct workqueue_ *wq;
+    /**< Worker thread */
+    pthread_t thread;
+    /**< Worker index */
+    int id;
+    /**< CPU the worker is pinned to, -1 if not pinned */
+    int cpu;
+    /**< Number of jobs run */
+    unsigned long executed;
+    /**< Number of jobs taken from other queues */
+    unsigned long stolen;
+    /**< Total time jobs waited in a queue in nanoseconds */
+    unsigned long wait_ns;
+    /**< Longest time a job waited in a queue in nanoseconds */
+    unsigned long wait_max;
+} workqueue_worker_t;
+
+/** @brief Definition of a periodic job
+ *
+ *  This structure contains a job the scheduler submits at a fixed interval
+ *
+ */
+typedef struct workqueue_periodic_ {
+    /**< Next periodic job */
+    struct workqueue_periodic_ *next;
+    /**< Job function */
+    void (*fn)(void *arg);
+    /**< Argument passed to the job function */
+    void *arg;
+    /**< Interval in milliseconds */
+    long interval;
+    /**< Next due time in nanoseconds */
+    unsigned long due;
+    /**< Set while the job is queued or running */
+    int busy;
+} workqueue_periodic_t;
+
+/** @brief Definition of the worker queue configuration
+ *
+ *  This structure contains the pool settings, zeroed fields select the
+ *  defaults
+ *
+ */
+typedef struct {
+    /**< Number of workers, 0 for one per online CPU */
+    int workers;
+    /**< Number of jobs a single worker queue can hold, rounded up to a
+     * power of two */
+    size_t queue_size;
+    /**< Pin every worker to a CPU */
+    int pin;
+    /**< CPU of every worker when pinning, NULL to use worker i on CPU i */
+    const int *cpus;
+} workqueue_config_t;
+
+/** @brief Definition of the worker queue statistics
+ *
+ *  This structure contains a snapshot of the pool counters
+ *
+ */
+typedef struct {
+    /**< Number of jobs run */
+    unsigned long executed;
+    /**< Number of jobs taken from other queues */
+    unsigned long stolen;
+    /**< Number of jobs refused because every queue was full */
+    unsigned long rejected;
+    /**< Number of jobs queued right now */
+    long depth;
+    /**< Deepest single worker queue right now */
+    long depth_max;
+    /**< Average time jobs waited in a queue in nanoseconds */
+    unsigned long wait_avg;
+    /**< Longest time a job waited in a queue in nanoseconds */
+    unsigned long wait_max;
+} workqueue_stats_t;
+
+/** @brief Definition of the worker queue
+ *
+ *  This structure contains all worker queue data
+ *
+ */
+typedef struct workqueue_ {
+    /**< Workers */
+    workqueue_worker_t *workers;
+    /**< Number of workers */
+    int count;
+    /**< Number of jobs queued and not yet taken */
+    long pending;
+    /**< Next queue for jobs submitted from outside the pool */
+    unsigned long next;
+    /**< Number of jobs refused because every queue was full */
+    unsigned long rejected;
+    /**< Lock protecting the sleep state and the periodic jobs */
+    pthread_mutex_t lock;
+    /**< Signalled when jobs are submitted */
+    pthread_cond_t work;
+    /**< Number of sleeping workers */
+    int idle;
+    /**< Set when the pool is destroyed */
+    int stop;
+    /**< Scheduler thread */
+    pthread_t scheduler;
+    /**< Set once the scheduler thread runs */
+    int scheduling;
+    /**< Signalled when periodic jobs change */
+    pthread_cond_t timer;
+    /**< Periodic jobs */
+    workqueue_periodic_t *periodic;
+} workqueue_t;
+
+/** @brief Initialise a worker queue
+ *
+ *  This function starts the workers and the scheduler
+ *
+ *  @param config Pool configuration, NULL for defaults
+ *
+ *  @return Pointer to the worker queue, NULL if failed
+ */
+workqueue_t *workqueue_init(const workqueue_config_t *config);
+
+/** @brief Destroy a worker queue
+ *
+ *  Stop the scheduler, run every job still queued and join the workers
+ *
+ *  @param wq Pointer to the worker queue
+ */
+void workqueue_destroy(workqueue_t *wq);
+
+/** @brief Submit a job
+ *
+ *  Jobs submitted by a worker go to its own queue, other jobs are spread
+ *  round robin. A full queue passes the job on to the next one.
+ *
+ *  @param wq Pointer to the worker queue
+ *  @param fn Job function
+ *  @param arg Argument passed to the job function
+ *
+ *  @return 0 if successful, -1 if every queue is full
+ */
+int workqueue_submit(workqueue_t *wq, void (*fn)(void *arg), void *arg);
+
+/** @brief Run a job periodically
+ *
+ *  The scheduler submits the job every interval milliseconds, a run is
+ *  skipped while the previous one is still queued or running
+ *
+ *  @param wq Pointer to the worker queue
+ *  @param interval Interval in milliseconds
+ *  @param fn Job function
+ *  @param arg Argument passed to the job function
+ *
+ *  @return 0 if successful, -1 if failed
+ */
+int workqueue_every(workqueue_t *wq, long interval, void (*fn)(void *arg),
+                    void *arg);
+
+/** @brief Retrieve the pool statistics
+ *
+ *  The counters are read without stopping the workers and are not an
+ *  atomic snapshot of the whole pool
+ *
+ *  @param wq Pointer to the worker queue
+ *  @param stats Filled with the statistics
+ */
+void workqueue_stats(workqueue_t *wq, workqueue_stats_t *stats);
+
+/**< Macro to retrieve the number of workers */
+#define workqueue_workers(wq) ((wq)->count)
+
+/**< Macro to retrieve the number of jobs queued on a worker */
+#define workqueue_depth(wq, i)                                                 \
+    ((long)(__atomic_load_n(&(wq)->workers[i].tail, __ATOMIC_RELAXED) -        \
+            __atomic_load_n(&(wq)->workers[i].head, __ATOMIC_RELAXED)))
+
+#endif